@@ -1,6 +1,9 @@
 //! Wrappers for BIOS disk routines
 
+use core::alloc::Layout;
+use alloc::vec;
 use alloc::vec::Vec;
+use boot_args::{ModuleTable, MODULE_TABLE_SIGNATURE};
 use crate::real_mode::{invoke_realmode_interrupt, RegisterState};
 
 /// The packet used to request a disk read from the BIOS
@@ -19,34 +22,96 @@ struct DiskAddressPacket {
 /// so this can't be too large.
 const SECTOR_BUFFER_SIZE: u32 = 8;
 
-pub fn read_kernel(boot_disk_id: u8, bootloader_size: u32) -> Option<Vec<u8>> {
+/// Reads the module table in the sector after the bootloader. Returns the table and the first
+/// sector of the kernel.
+pub fn read_module_table(boot_disk_id: u8, bootloader_size: u32) -> Option<(ModuleTable, u32)> {
 	// Get the sector count of the boot disk. We cast to u32, because we don't have enough memory
 	// to load more sectors than that anyway
 	let disk_sector_count = get_disk_sector_count(boot_disk_id)? as u32;
 
     // Dividing the size by 512 while rounding up gives us the bootloader sector count
     let bootloader_sector_count = (bootloader_size + 511) / 512;
-    // We assume that the rest of the sectors on disk are kernel sectors
-    let kernel_sector_count = disk_sector_count - bootloader_sector_count;
-    
+
+    let mut table_sector = [0u8; 512];
+    read_sectors(boot_disk_id, bootloader_sector_count, &mut table_sector, None)?;
+    let table = unsafe {
+        core::ptr::read_unaligned(table_sector.as_ptr() as *const ModuleTable)
+    };
+    if table.signature != MODULE_TABLE_SIGNATURE {
+        serial::println!("Module table signature mismatch");
+        return None;
+    }
+
+    // Make sure both modules are on the disk
+    let kernel_sector = bootloader_sector_count + 1;
+    let module_sector_count = sectors_for(table.kernel_size)
+        .checked_add(sectors_for(table.fs_image_size))?;
+    if kernel_sector.checked_add(module_sector_count)? > disk_sector_count {
+        serial::println!("Modules extend beyond the end of the disk");
+        return None;
+    }
+
+    Some((table, kernel_sector))
+}
+
+/// Reads the kernel image described by `table`, which starts at sector `kernel_sector`
+pub fn read_kernel(boot_disk_id: u8, table: &ModuleTable, kernel_sector: u32) -> Option<Vec<u8>> {
+    let mut kernel_image = vec![0u8; table.kernel_size as usize];
+    read_sectors(boot_disk_id, kernel_sector, &mut kernel_image, Some("Loading kernel from disk"))?;
+
+    serial::println!("Read kernel image: {} bytes, at {:#x?}", kernel_image.len(), kernel_image.as_ptr());
+    Some(kernel_image)
+}
+
+/// Reads the filesystem image described by `table`, which follows the kernel that starts at sector
+/// `kernel_sector`, into page aligned memory which is never freed, so the kernel can keep using it
+pub fn read_fs_image(boot_disk_id: u8, table: &ModuleTable, kernel_sector: u32)
+    -> Option<&'static [u8]> {
+    let layout = Layout::from_size_align(table.fs_image_size.max(1) as usize, 4096).ok()?;
+    let fs_image = unsafe {
+        let ptr = alloc::alloc::alloc(layout);
+        if ptr.is_null() {
+            return None;
+        }
+        core::slice::from_raw_parts_mut(ptr, table.fs_image_size as usize)
+    };
+
+    let fs_image_sector = kernel_sector + sectors_for(table.kernel_size);
+    read_sectors(boot_disk_id, fs_image_sector, fs_image, Some("Loading filesystem from disk"))?;
+
+    serial::println!("Read filesystem image: {} bytes, at {:#x?}", fs_image.len(), fs_image.as_ptr());
+    Some(fs_image)
+}
+
+/// Returns the number of sectors `size` bytes take
+fn sectors_for(size: u32) -> u32 {
+    (size + 511) / 512
+}
+
+/// Reads `out.len()` bytes from the disk, starting at sector `first_sector`. If `message` is given,
+/// it is printed along with a progress indicator.
+fn read_sectors(boot_disk_id: u8, first_sector: u32, out: &mut [u8], message: Option<&str>)
+    -> Option<()> {
+    let sector_count = sectors_for(out.len() as u32);
+
     // Local stack buffer which is under the 64K limit that the BIOS can read to
     let mut sector_buffer = [0u8; 512*SECTOR_BUFFER_SIZE as usize];
 
-	let mut kernel_image: Vec<u8> = Vec::with_capacity((kernel_sector_count * 512) as usize);
-
-    let indicator_step = (kernel_sector_count / SECTOR_BUFFER_SIZE) / 10;
+    let indicator_step = ((sector_count / SECTOR_BUFFER_SIZE) / 10).max(1);
     let mut indicator_idx = 0;
-    crate::screen::print("Loading kernel from disk");
-	// Read each kernel sector
-    for sector_off in (0..kernel_sector_count).step_by(SECTOR_BUFFER_SIZE as usize) {
+    if let Some(message) = message {
+        crate::screen::print(message);
+    }
+	// Read each sector
+    for sector_off in (0..sector_count).step_by(SECTOR_BUFFER_SIZE as usize) {
         indicator_idx += 1;
-        if indicator_idx % indicator_step == 0 {
+        if message.is_some() && indicator_idx % indicator_step == 0 {
             crate::screen::print(".");
         }
 
-        // We either read `SECTOR_BUFFER_SIZE` sectors, or if we are at the end of the image, the
+        // We either read `SECTOR_BUFFER_SIZE` sectors, or if we are at the end of the range, the
         // remaining sectors
-        let sectors_to_read = core::cmp::min(SECTOR_BUFFER_SIZE, kernel_sector_count - sector_off);
+        let sectors_to_read = core::cmp::min(SECTOR_BUFFER_SIZE, sector_count - sector_off);
         
         let mut disk_address_packet = DiskAddressPacket {
             struct_size: 0x10,
@@ -54,7 +119,7 @@ pub fn read_kernel(boot_disk_id: u8, bootloader_size: u32) -> Option<Vec<u8>> {
             sector_read_count: sectors_to_read as u16,
             memory_buffer_offset: &mut sector_buffer as *mut _ as u16,
             memory_buffer_segment: 0,
-            start_sector_offset: (bootloader_sector_count + sector_off) as u64
+            start_sector_offset: (first_sector + sector_off) as u64
         };
     
         let mut register_context = RegisterState {
@@ -73,13 +138,16 @@ pub fn read_kernel(boot_disk_id: u8, bootloader_size: u32) -> Option<Vec<u8>> {
             return None;
         }
 
-        // Append the read sectors to the kernel image
-		kernel_image.extend(&sector_buffer[..sectors_to_read as usize * 512]);
+        // Copy the read sectors, the last sector might only be partially used
+        let out_offset = sector_off as usize * 512;
+        let num_bytes = core::cmp::min(sectors_to_read as usize * 512, out.len() - out_offset);
+		out[out_offset..out_offset + num_bytes].copy_from_slice(&sector_buffer[..num_bytes]);
 	}
-    crate::screen::print("\n");
-    
-    serial::println!("Read kernel image: {} bytes, at {:#x?}", kernel_image.len(), kernel_image.as_ptr());
-    Some(kernel_image)
+    if message.is_some() {
+        crate::screen::print("\n");
+    }
+
+    Some(())
 }
 
 /// The result of a int 13h/ah=48h BIOS call
@@ -12,33 +12,64 @@ mod real_mode;
 mod memory_manager;
 mod screen;
 mod disk;
+mod multiboot;
 
 use core::convert::TryInto;
 use serial::println;
 use elf_parser::ElfParser;
-use page_tables::{PageDirectory, VirtAddr, PhysAddr};
+use page_tables::{PageDirectory, VirtAddr, PhysAddr, PhysMem};
+use multiboot::MultibootInfo;
 use boot_args::{BootArgs, KERNEL_STACK_SIZE, KERNEL_STACK_BASE_VADDR, LAST_PAGE_TABLE_VADDR,
     KERNEL_ALLOCATIONS_BASE_VADDR};
 
-/// Rust bootloader entry point
+/// Rust bootloader entry point. Called by stage0 with the id of the boot disk, or by the Multiboot
+/// shim with the physical address of the Multiboot information structure in `multiboot_info`
+/// (which is zero when called by stage0). In both cases `bootloader_size` includes the boot sector.
 #[no_mangle]
-pub extern fn entry(boot_disk_id: u8, bootloader_size: u32) -> ! {
+pub extern fn entry(boot_disk_id: u8, bootloader_size: u32, multiboot_info: u32) -> ! {
     // Initialize serial ports for logging
     serial::init();
 
     println!(" === Bootloader running!");
 
+    // We have a flat memory mapping, so a physical address is also the virtual address
+    let multiboot_info = if multiboot_info != 0 {
+        Some(unsafe { &*(multiboot_info as *const MultibootInfo) })
+    } else {
+        None
+    };
+
+    // The Multiboot information is in memory we don't reserve, so it is read before anything is
+    // allocated
+    let boot_modules = multiboot_info.map(|info| {
+        multiboot::get_boot_modules(info)
+            .expect("The Multiboot loader must pass the kernel and the filesystem image as modules")
+    });
+
     // Initialize the memory manager which handles physical allocations
-    memory_manager::init(bootloader_size);
+    memory_manager::init(bootloader_size, multiboot_info);
 
     // Clear the screen and display a message, because if the kernel is big this might take a couple
     // seconds
     screen::reset();
     screen::print("Welcome to the bootloader!\n");
 
-    // Load and map the kernel
-    let (kernel_entry, kernel_stack, new_cr3, last_page_table_paddr) =
-        setup_kernel(boot_disk_id, bootloader_size);
+    // Map the kernel and find the filesystem image, which the kernel maps itself
+    let ((kernel_entry, kernel_stack, new_cr3, last_page_table_paddr), fs_image) =
+        match boot_modules {
+            Some(boot_modules) => {
+                // The Multiboot loader already loaded both, and page aligned the modules
+                assert!((boot_modules.fs_image.as_ptr() as u32 & 0xfff) == 0);
+                let kernel = setup_kernel(boot_modules.kernel);
+
+                // The kernel ELF is not needed once it is mapped
+                memory_manager::PHYS_MEM.lock().as_mut().unwrap().release_phys_mem(
+                    PhysAddr(boot_modules.kernel.as_ptr() as u32), boot_modules.kernel.len());
+
+                (kernel, boot_modules.fs_image)
+            },
+            None => load_from_disk(boot_disk_id, bootloader_size),
+        };
 
     // Grab the lock of physical memory and serial ports so we can transfer them to the kernel
     let mut pmem = memory_manager::PHYS_MEM.lock();
@@ -48,7 +79,9 @@ pub extern fn entry(boot_disk_id: u8, bootloader_size: u32) -> ! {
     let boot_args = BootArgs {
         free_memory: core::mem::replace(&mut *pmem, None).unwrap().0,
         serial_port: core::mem::replace(&mut *serial, None).unwrap(),
-        last_page_table_paddr
+        last_page_table_paddr,
+        fs_image_paddr: PhysAddr(fs_image.as_ptr() as u32),
+        fs_image_size: fs_image.len() as u32,
     };
 
     // Release the locks because we will never return from the kernel so they would not be released
@@ -68,11 +101,19 @@ pub extern fn entry(boot_disk_id: u8, bootloader_size: u32) -> ! {
     }
 }
 
-/// Reads the kernel from disk and maps it into memory. Also maps kernel stack and 1MiB identity.
-/// Returns (kernel entry vaddr, kernel stack vaddr, new cr3, last page table vaddr)
-fn setup_kernel(boot_disk_id: u8, bootloader_size: u32) -> (u32, u32, u32, PhysAddr) {
+/// Reads the kernel from disk and maps it into memory, and then reads the filesystem image from
+/// disk. Returns the results of `setup_kernel` and the filesystem image.
+fn load_from_disk(boot_disk_id: u8, bootloader_size: u32)
+    -> ((u32, u32, u32, PhysAddr), &'static [u8]) {
+    // Find the kernel and the filesystem image on the disk
+    let (module_table, kernel_sector) = disk::read_module_table(boot_disk_id, bootloader_size)
+        .unwrap_or_else(|| {
+            screen::print_with_attributes("Failed to read the module table from disk.", 0xf4);
+            panic!("Failed to read the module table from disk.");
+        });
+
     // Read the kernel from disk
-    let kernel_image = disk::read_kernel(boot_disk_id, bootloader_size);
+    let kernel_image = disk::read_kernel(boot_disk_id, &module_table, kernel_sector);
     if kernel_image.is_none() { 
         screen::print_with_attributes("Failed to read kernel from disk.", 0xf4);
         panic!("Failed to read kernel from disk.");
@@ -80,8 +121,24 @@ fn setup_kernel(boot_disk_id: u8, bootloader_size: u32) -> (u32, u32, u32, PhysA
     let kernel_image = kernel_image.unwrap();
     screen::print(&alloc::format!("Read {} bytes from disk!", kernel_image.len()));
 
+    // The kernel image is freed before the filesystem image is read
+    let kernel = setup_kernel(&kernel_image);
+    core::mem::drop(kernel_image);
+
+    let fs_image = disk::read_fs_image(boot_disk_id, &module_table, kernel_sector)
+        .unwrap_or_else(|| {
+            screen::print_with_attributes("Failed to read the filesystem image from disk.", 0xf4);
+            panic!("Failed to read the filesystem image from disk.");
+        });
+
+    (kernel, fs_image)
+}
+
+/// Maps the kernel ELF `kernel_image` into memory. Also maps kernel stack and 1MiB identity.
+/// Returns (kernel entry vaddr, kernel stack vaddr, new cr3, last page table vaddr)
+fn setup_kernel(kernel_image: &[u8]) -> (u32, u32, u32, PhysAddr) {
     // Parse the ELF of the kernel
-    let kernel_elf = ElfParser::parse(&kernel_image);
+    let kernel_elf = ElfParser::parse(kernel_image);
     if kernel_elf.is_none() {
         screen::print_with_attributes("Failed to parse kernel ELF.", 0xf4);
         panic!("Failed to parse kernel ELF.");
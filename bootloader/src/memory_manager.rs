@@ -1,6 +1,7 @@
 //! Responisble for physical memory management in the bootloader
 
 use crate::real_mode::{invoke_realmode_interrupt, RegisterState};
+use crate::multiboot::{self, MultibootInfo};
 
 use core::convert::TryInto;
 use range_set::{RangeSet, InclusiveRange};
@@ -109,21 +110,8 @@ struct E820RangeDescriptor {
 	mem_type: u32
 }
 
-/// Initialize the physical memory manager. Builds a memory map of available and reserved memory.
-/// 
-/// We get the memory map from the E820 BIOS call and store in a `RangeSet`. We also mark out own
-/// bootloader code and stack, and some BIOS structures as reserved memory.
-pub fn init(bootloader_size: u32) {
-    let mut pmem = PHYS_MEM.lock();
-    assert!(pmem.is_none(), "The memory manager should only be initialized once");
-
-	// This the map of available memory we are building
-    let mut available_memory = RangeSet::new();
-    // This is the set of reserved ranges. We save the reserved ranges in a `RangeSet` instead of
-    // just removing the reserved ranges from the `memory_map` because a reserved range which
-    // overlaps a "free" range might appear before the free range in the E820 list.
-    let mut reserved_ranges = RangeSet::new();
-
+/// Builds the memory map using the E820 BIOS call
+fn read_e820_memory_map(available_memory: &mut RangeSet, reserved_ranges: &mut RangeSet) {
     // An opaque value used by the BIOS to report the next entry every time we call it. The initial
     // value is zero
     let mut continuation_value = 0;
@@ -144,30 +132,70 @@ pub fn init(bootloader_size: u32) {
         
         // Save the continuation value for the next E820 call
         continuation_value = register_context.ebx;
-        
-        // We can only use ranges which start inside the 32-bit address limit
-        if result_descriptor.base_addr <= core::u32::MAX as u64 {
-            // If the range extends beyond the address limit, we trim it
-            let range_end = core::cmp::min(result_descriptor.base_addr + result_descriptor.length - 1,
-                core::u32::MAX as u64) as u32;
-
-            let new_range = InclusiveRange {
-                start: result_descriptor.base_addr as u32,
-                end: range_end
-            };
-            // A memory type of 1 is memory that we are free to use. Any other type is reserved
-            if result_descriptor.mem_type == 1 {
-                available_memory.insert(new_range);
-            } else {
-                reserved_ranges.insert(new_range);
-            }
-        }
+
+        add_memory_range(available_memory, reserved_ranges, result_descriptor.base_addr,
+            result_descriptor.length, result_descriptor.mem_type);
 
         // If CF is set or the continuation is zero, this is the last range
         if register_context.eflags&0x1 == 1 || register_context.ebx == 0 {
             break;
         }
     }
+}
+
+/// Adds the memory range at `base_addr` of size `length` to `available_memory` if `mem_type` is 1
+/// (memory we are free to use), or to `reserved_ranges` otherwise. The part of the range beyond
+/// the 32-bit address limit is ignored.
+fn add_memory_range(available_memory: &mut RangeSet, reserved_ranges: &mut RangeSet, base_addr: u64,
+    length: u64, mem_type: u32) {
+    // We can only use ranges which start inside the 32-bit address limit
+    if length == 0 || base_addr > core::u32::MAX as u64 {
+        return;
+    }
+
+    // If the range extends beyond the address limit, we trim it
+    let range_end = core::cmp::min(base_addr + length - 1, core::u32::MAX as u64) as u32;
+
+    let new_range = InclusiveRange {
+        start: base_addr as u32,
+        end: range_end
+    };
+    if mem_type == 1 {
+        available_memory.insert(new_range);
+    } else {
+        reserved_ranges.insert(new_range);
+    }
+}
+
+/// Initialize the physical memory manager. Builds a memory map of available and reserved memory.
+/// 
+/// We get the memory map from the E820 BIOS call, or from `multiboot_info` if a Multiboot loader
+/// started us, and store it in a `RangeSet`. We also mark out own bootloader code and stack, some
+/// BIOS structures and the Multiboot modules as reserved memory.
+pub fn init(bootloader_size: u32, multiboot_info: Option<&MultibootInfo>) {
+    let mut pmem = PHYS_MEM.lock();
+    assert!(pmem.is_none(), "The memory manager should only be initialized once");
+
+	// This the map of available memory we are building
+    let mut available_memory = RangeSet::new();
+    // This is the set of reserved ranges. We save the reserved ranges in a `RangeSet` instead of
+    // just removing the reserved ranges from the `memory_map` because a reserved range which
+    // overlaps a "free" range might appear before the free range in the E820 list.
+    let mut reserved_ranges = RangeSet::new();
+
+    if let Some(info) = multiboot_info {
+        // The Multiboot loader already made the E820 calls for us
+        multiboot::for_each_memory_range(info, |base_addr, length, mem_type| {
+            add_memory_range(&mut available_memory, &mut reserved_ranges, base_addr, length,
+                mem_type);
+        });
+
+        // The modules are in memory the map reports as available
+        multiboot::for_each_module_range(info, |range| reserved_ranges.insert(range));
+    } else {
+        read_e820_memory_map(&mut available_memory, &mut reserved_ranges);
+    }
+
     // Subtract all reserved ranges from the memory map, this is to guard against some BIOSes which
     // have overlapping free and reserved ranges
     available_memory.subtract(&reserved_ranges);
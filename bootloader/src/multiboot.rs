@@ -0,0 +1,107 @@
+//! Reading the information a Multiboot loader (e.g. QEMU's `-kernel` option) passes to the
+//! Multiboot shim, which replaces the BIOS memory map and disk reads when booting without stage0
+
+use range_set::InclusiveRange;
+
+/// The flag in `MultibootInfo::flags` which is set if the module fields are valid
+const INFO_FLAG_MODULES: u32 = 1 << 3;
+/// The flag in `MultibootInfo::flags` which is set if the memory map fields are valid
+const INFO_FLAG_MEMORY_MAP: u32 = 1 << 6;
+
+/// The Multiboot information structure, up to the memory map fields
+#[repr(C)]
+pub struct MultibootInfo {
+    flags: u32,
+    mem_lower: u32,
+    mem_upper: u32,
+    boot_device: u32,
+    cmdline: u32,
+    mods_count: u32,
+    mods_addr: u32,
+    syms: [u32; 4],
+    mmap_length: u32,
+    mmap_addr: u32,
+}
+
+/// An entry of the module list
+#[repr(C)]
+struct MultibootModule {
+    mod_start: u32,
+    /// The address right after the module
+    mod_end: u32,
+    cmdline: u32,
+    _reserved: u32,
+}
+
+/// An entry of the memory map. `size` is the size of the rest of the entry, so entries can be
+/// larger than this structure.
+#[repr(C, packed)]
+struct MultibootMemoryRange {
+    size: u32,
+    base_addr: u64,
+    length: u64,
+    mem_type: u32,
+}
+
+/// The modules the bootloader needs, which the Multiboot loader loaded in memory
+#[derive(Clone, Copy)]
+pub struct BootModules {
+    /// The kernel ELF, the first module
+    pub kernel: &'static [u8],
+    /// The filesystem image, the second module
+    pub fs_image: &'static [u8],
+}
+
+/// Returns the modules list of `info`
+fn get_modules(info: &MultibootInfo) -> &'static [MultibootModule] {
+    if (info.flags & INFO_FLAG_MODULES) == 0 {
+        return &[];
+    }
+
+    // We have a flat memory mapping, so a physical address is also the virtual address
+    unsafe {
+        core::slice::from_raw_parts(info.mods_addr as *const MultibootModule,
+            info.mods_count as usize)
+    }
+}
+
+/// Returns the kernel and the filesystem image from the modules of `info`, or `None` if they are
+/// missing
+pub fn get_boot_modules(info: &MultibootInfo) -> Option<BootModules> {
+    let modules = get_modules(info);
+    let get_module = |module: &MultibootModule| {
+        let size = module.mod_end.checked_sub(module.mod_start)?;
+        Some(unsafe { core::slice::from_raw_parts(module.mod_start as *const u8, size as usize) })
+    };
+
+    Some(BootModules {
+        kernel: get_module(modules.get(0)?)?,
+        fs_image: get_module(modules.get(1)?)?,
+    })
+}
+
+/// Calls `callback` with the inclusive range of every module of `info`, which the Multiboot loader
+/// placed in otherwise available memory
+pub fn for_each_module_range(info: &MultibootInfo, mut callback: impl FnMut(InclusiveRange)) {
+    for module in get_modules(info) {
+        if module.mod_end > module.mod_start {
+            callback(InclusiveRange { start: module.mod_start, end: module.mod_end - 1 });
+        }
+    }
+}
+
+/// Calls `callback` with the base address, the length and the type of every range of the memory
+/// map of `info`. The types are the same as the types of the E820 BIOS call.
+pub fn for_each_memory_range(info: &MultibootInfo, mut callback: impl FnMut(u64, u64, u32)) {
+    assert!((info.flags & INFO_FLAG_MEMORY_MAP) != 0, "The Multiboot loader gave no memory map");
+
+    let mut entry_addr = info.mmap_addr;
+    let mmap_end = info.mmap_addr + info.mmap_length;
+    while entry_addr < mmap_end {
+        let entry = unsafe { core::ptr::read_unaligned(entry_addr as *const MultibootMemoryRange) };
+        callback(entry.base_addr, entry.length, entry.mem_type);
+
+        // The size field itself is not included in the size
+        entry_addr += entry.size + 4;
+    }
+}
@@ -0,0 +1,82 @@
+; Multiboot entry shim, which lets a Multiboot loader (e.g. QEMU's -kernel option) start the Rust
+; bootloader instead of the boot sector. The loader places this image at MULTIBOOT_LOAD_ADDR (above
+; 1MiB, because it places its information structure and the modules right after the image), and the
+; shim copies the Rust bootloader to the address it is linked at and calls its entry point with the
+; Multiboot information. The kernel ELF and the filesystem image are passed as the first and second
+; modules, so nothing is read from disk.
+[org MULTIBOOT_LOAD_ADDR]
+[bits 32]
+
+MULTIBOOT_HEADER_MAGIC equ 0x1BADB002
+; Page-align the modules, provide a memory map, and load the image using the addresses in the header
+MULTIBOOT_HEADER_FLAGS equ (1 << 0) | (1 << 1) | (1 << 16)
+; The value a Multiboot loader passes in eax
+MULTIBOOT_LOADER_MAGIC equ 0x2BADB002
+
+align 4
+multiboot_header:
+	dd MULTIBOOT_HEADER_MAGIC
+	dd MULTIBOOT_HEADER_FLAGS
+	dd -(MULTIBOOT_HEADER_MAGIC + MULTIBOOT_HEADER_FLAGS)	; Checksum
+	dd multiboot_header		; Header address
+	dd $$					; Load address
+	dd IMAGE_END			; Load end address
+	dd IMAGE_END			; BSS end address
+	dd multiboot_entry		; Entry address
+
+; The loader jumps here in protected mode, with paging and interrupts disabled, eax holding the
+; loader magic and ebx holding the physical address of the Multiboot information structure
+multiboot_entry:
+	cli
+	cld
+
+	; Halt if we weren't started by a Multiboot loader
+	cmp eax, MULTIBOOT_LOADER_MAGIC
+	jne halt
+
+	; The GDT of the loader might not be valid anymore, so we load our own flat-map GDT, which is
+	; the same one stage0 uses
+	lgdt [GDT_DESCRIPTOR]
+	jmp CODE_SEG:reload_segments
+
+reload_segments:
+	mov ax, DATA_SEG
+	mov ds, ax
+	mov ss, ax
+	mov es, ax
+	mov fs, ax
+	mov gs, ax
+
+	; Setup the same stack stage0 uses
+	mov ebp, 0x7c00
+	mov esp, ebp
+
+	; Copy the Rust bootloader to its base address
+	mov esi, rust_bootloader
+	mov edi, BOOTLOADER_BASE_ADDR
+	mov ecx, RUST_BOOTLOADER_SIZE
+	rep movsb
+
+	; Push the Multiboot information argument
+	push ebx
+	; Push the size argument. The bootloader reserves its memory from the start of the boot sector,
+	; so we count the boot sector it replaces.
+	push dword RUST_BOOTLOADER_SIZE + 512
+	; Push the boot drive id argument, which is unused
+	push dword 0
+	; Jump to the Rust bootloader's entry point (Defined using -D when assembling)
+	call BOOTLOADER_ENTRY_POINT
+
+halt:
+	cli
+	hlt
+	jmp halt
+
+%include "gdt.asm"
+
+align 16
+rust_bootloader:
+INCBIN "../../../build/bootloader.flat"
+RUST_BOOTLOADER_SIZE equ ($ - rust_bootloader)
+
+IMAGE_END:
@@ -71,6 +71,9 @@ protected_mode_landing_point:
 	mov esp, ebp
 	
 
+	; Push the Multiboot information argument, which is zero as we weren't started by a Multiboot
+	; loader
+	push dword 0
 	; Push the size argument
 	push dword BOOTLOADER_SIZE
 	; Push the boot drive id argument
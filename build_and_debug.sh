@@ -2,4 +2,5 @@
 
 cargo run kernel_debug
 
-qemu-system-i386 -serial stdio -drive format=raw,file=build/explore_os.img -s -S
+qemu-system-i386 -serial stdio -drive format=raw,file=build/explore_os.img,index=0 \
+	-drive format=raw,file=build/swap.img,index=1 -s -S
@@ -11,21 +11,52 @@ const SUPER_BLOCK_SIZE: usize = 1024;
 const SUPER_BLOCK_MAGIC_SIGNATURE: u16 = 0xEF53;
 /// The number of direct pointers in an inode
 const INODE_DIRECT_PTR_COUNT: usize = 12;
+/// The largest supported block size
+const MAX_BLOCK_SIZE: usize = 4096;
+/// The value of the signature field of a valid extent tree node header
+const EXTENT_HEADER_MAGIC: u16 = 0xF30A;
+/// The deepest extent tree ext4 creates, the root in the inode is at this depth at most
+const MAX_EXTENT_TREE_DEPTH: u16 = 5;
+/// Extents longer than this are uninitialized: their blocks are allocated but read as zeros, and
+/// their length is the difference
+const MAX_INITIALIZED_EXTENT_LENGTH: u16 = 32768;
 /// The inode number of the root directory
 pub const ROOT_INODE: u32 = 2;
 
 /// Bitmask of required features the implementation supports
 const SUPPORTED_REQUIRED_FEATURES_MASK: u32 = 
-    RequiredFeatureFlags::DirectoryEntriesContainTypeField as u32;
-/// Bitmask of features required for writing the implemention supports
+    RequiredFeatureFlags::DirectoryEntriesContainTypeField as u32 |
+    RequiredFeatureFlags::Extents as u32 | RequiredFeatureFlags::FlexibleBlockGroups as u32;
+/// Bitmask of features required for writing the implemention supports. The ext4 features only
+/// change structures we don't read (or only read as much as is needed for reading), so they are
+/// supported as long as we don't write
 const SUPPORTED_WRITING_FEATURES_MASK: u32 = 
-    WritingFeatureFlags::SparseSuperblocksAndGroupDescriptorTables | WritingFeatureFlags::FileSize64Bit;
+    WritingFeatureFlags::SparseSuperblocksAndGroupDescriptorTables as u32 |
+    WritingFeatureFlags::FileSize64Bit as u32 | WritingFeatureFlags::HugeFiles as u32 |
+    WritingFeatureFlags::GroupDescriptorChecksums as u32 |
+    WritingFeatureFlags::LargeDirectories as u32 | WritingFeatureFlags::ExtraInodeSize as u32 |
+    WritingFeatureFlags::MetadataChecksums as u32;
 
 /// An address in disk, as a multiple of the block size
-#[derive(Clone, Copy, Debug)]
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
 #[repr(transparent)]
 pub struct BlockAddr(u32);
 
+/// The contents of every hole: blocks which are not allocated (a zero pointer) read as zeros
+static ZERO_BLOCK: [u8; MAX_BLOCK_SIZE] = [0; MAX_BLOCK_SIZE];
+
+/// A run of consecutive blocks of a file, which are either physically contiguous on the disk or all
+/// holes
+#[derive(Clone, Copy, Debug, PartialEq, Eq)]
+pub struct BlockRange {
+    /// The index in the file of the first block of the run
+    pub first_block: u32,
+    /// The address of the first block of the run, or `None` if the run is a hole
+    pub first_addr: Option<BlockAddr>,
+    /// The number of blocks in the run
+    pub count: u32,
+}
+
 /// The structure of the super-block, containing all the metadata about the filesystem
 #[derive(Clone, Copy, Debug)]
 #[repr(C, packed)]
@@ -138,6 +169,10 @@ enum RequiredFeatureFlags {
     DirectoryEntriesContainTypeField = 0x2,
     JournalReplaying = 0x4,
     JournalDevice = 0x8,
+    /// (ext4) Inodes may map their blocks with an extent tree instead of block pointers
+    Extents = 0x40,
+    /// (ext4) The bitmaps and inode tables of block groups may be placed in other block groups
+    FlexibleBlockGroups = 0x200,
 }
 bitor_flags!(RequiredFeatureFlags, u32);
 
@@ -146,6 +181,16 @@ enum WritingFeatureFlags {
     SparseSuperblocksAndGroupDescriptorTables = 0x1,
     FileSize64Bit = 0x2,
     DirectoryContentsBinarySearchTree = 0x4,
+    /// (ext4) The block count of inodes may be in units of blocks instead of sectors
+    HugeFiles = 0x8,
+    /// (ext4) Block group descriptors have checksums
+    GroupDescriptorChecksums = 0x10,
+    /// (ext4) Directories may have more than 65000 subdirectories
+    LargeDirectories = 0x20,
+    /// (ext4) Inodes larger than 128 bytes have extra fields
+    ExtraInodeSize = 0x40,
+    /// (ext4) Metadata blocks have checksums
+    MetadataChecksums = 0x400,
 }
 bitor_flags!(WritingFeatureFlags, u32);
 
@@ -296,6 +341,9 @@ pub enum InodeFlags {
     BTreeOrHashIndexedDirectory = 0x1000,
     AFSDirectory = 0x2000,
     Ext3JournalData = 0x4000,
+    /// (ext4) The inode maps its blocks with an extent tree, whose root is stored in place of the
+    /// block pointers
+    Extents = 0x80000,
 }
 bitor_flags!(InodeFlags, u32);
 
@@ -353,6 +401,8 @@ pub struct Ext2Parser<'a> {
     inodes_per_block_group: u32,
     /// Number of block groups
     block_group_count: u32,
+    /// Size of an inode in the inode table in bytes
+    inode_size: usize,
     /// The number of pointers that fit in a pointer block
     num_ptrs_per_block: usize,
 }
@@ -389,8 +439,10 @@ impl<'a> Ext2Parser<'a> {
             &*(bytes[extended_fields_offset..].as_ptr() as *const SuperBlockExtension)
         };
 
-        // Fail if the filesystem uses a non-standard inode structure
-        if super_block_extension.inode_size != core::mem::size_of::<Inode>() as u16 {
+        // Larger inodes (e.g. the 256-byte inodes of ext4) start with the standard inode structure,
+        // and we ignore their extra fields
+        let inode_size = super_block_extension.inode_size as usize;
+        if inode_size < core::mem::size_of::<Inode>() || !inode_size.is_power_of_two() {
             return None;
         }
 
@@ -413,6 +465,9 @@ impl<'a> Ext2Parser<'a> {
 
         // The block_size_exponent is log2(block_size) - 10, therefore block_size is 1024<<(exp)
         let block_size = 1024usize.checked_shl(super_block.block_size_exponent)?;
+        if block_size > MAX_BLOCK_SIZE {
+            return None;
+        }
 
         // The block group count could either be calculated using the block count and number of
         // blocks in a block group, or using the inode count and the number of inodes in a block
@@ -421,7 +476,7 @@ impl<'a> Ext2Parser<'a> {
         let block_group_count = 
             div_ceil(super_block.block_count, super_block.num_blocks_in_block_group)?;
         let block_group_count_alt = 
-            div_ceil(super_block.inode_count, super_block.num_blocks_in_block_group)?;
+            div_ceil(super_block.inode_count, super_block.num_inodes_in_block_group)?;
         if block_group_count != block_group_count_alt {
             return None;
         }
@@ -450,6 +505,7 @@ impl<'a> Ext2Parser<'a> {
             blocks_per_block_group: super_block.num_blocks_in_block_group,
             inodes_per_block_group: super_block.num_inodes_in_block_group,
             block_group_count,
+            inode_size,
             num_ptrs_per_block: block_size / core::mem::size_of::<BlockAddr>()
         })
     }
@@ -642,52 +698,39 @@ impl<'a> Ext2Parser<'a> {
     /// Reads the file with inode number `inode` into `out_buffer` starting at the specified offset.
     /// The amount of bytes read is returned, and it is limited by the size of `out_buffer`
     pub fn get_contents_with_offset(&self, inode: u32, out_buffer: &mut [u8], offset: usize) -> usize {
-        if out_buffer.is_empty() {
+        let file_size = self.get_inode(inode).size_low as usize; // TODO: 64bit size
+        if offset >= file_size {
             return 0;
         }
 
-        // FIXME: Don't iterate from the start every time...
-
-        let inode_metadata = self.get_inode(inode);
-        let file_size = inode_metadata.size_low as usize; // TODO: 64bit size
+        let read_size = out_buffer.len().min(file_size - offset);
+        let out_buffer = &mut out_buffer[..read_size];
+        if out_buffer.is_empty() {
+            return 0;
+        }
 
-        // total_read tracks the number of bytes we read into the buffer, and data_offset tracks the
-        // number of bytes we went over from the start of the file
+        // Only the blocks from the one containing the offset are visited, and each run of
+        // contiguous blocks is copied at once
+        let first_block = (offset / self.block_size) as u32;
         let mut total_read = 0;
-        let mut data_offset = 0;
-        self.for_each_data_block(inode, &mut |data_block| {
-            // The last block may be less than the normal size if the block size does not divide the
-            // file size
-            let block_length = data_block.len().min(file_size - data_offset);
-
-            // We check if part of this block is after the requested offset
-            if offset < data_offset + block_length {
-                // We might need to read from the middle of the first block we read
-                let block_offset = if offset > data_offset {
-                    offset - data_offset
-                } else {
-                    0
-                };
-
-                
-                // The amount of bytes we need to read is the minimum between the number of bytes
-                // in the block we are interested in, and the space left in the out buffer
-                let left_in_block = block_length - block_offset;
-                let size_left = left_in_block.min(out_buffer.len() - total_read);
-
-                out_buffer[total_read..total_read+size_left].copy_from_slice(&data_block[..size_left]);
-                total_read += size_left;
-
-                // If we reached the end of the out buffer, we can finish
-                if total_read == out_buffer.len() {
-                    return IterationDecision::Break;
-                }
+        self.for_each_block_range(inode, first_block, &mut |range| {
+            // The first run might start before the offset
+            let range_offset = range.first_block as usize * self.block_size;
+            let skip = offset + total_read - range_offset;
+            let range_size = range.count as usize * self.block_size;
+            let size = (range_size - skip).min(out_buffer.len() - total_read);
+
+            let out = &mut out_buffer[total_read..total_read + size];
+            match range.first_addr {
+                Some(addr) => {
+                    let data_offset = addr.0 as usize * self.block_size + skip;
+                    out.copy_from_slice(&self.raw_bytes[data_offset..data_offset + size]);
+                },
+                None => out.fill(0),
             }
+            total_read += size;
 
-            data_offset += self.block_size;
-
-            // If we reached the end of the logical file there is no need to continue
-            if data_offset >= file_size {
+            if total_read == out_buffer.len() {
                 IterationDecision::Break
             } else {
                 IterationDecision::Continue
@@ -697,21 +740,77 @@ impl<'a> Ext2Parser<'a> {
         total_read
     }
 
-    /// Calls the `callback` for each block allocated to inode whose number is `inode`. The callback
-    /// will be called with a byte slice of the block's content
+    /// Calls the `callback` for each block of the inode whose number is `inode`, up to the size of
+    /// the inode. The callback will be called with a byte slice of the block's content, which is
+    /// a shared zero block for holes
     pub fn for_each_data_block<F>(&self, inode: u32, callback: &mut F)
         where F: FnMut(&'a [u8]) -> IterationDecision {
+        self.for_each_block_range(inode, 0, &mut |range| {
+            for i in 0..range.count {
+                let block = match range.first_addr {
+                    Some(addr) => self.get_block(BlockAddr(addr.0 + i)),
+                    None => &ZERO_BLOCK[..self.block_size],
+                };
+                if callback(block) == IterationDecision::Break {
+                    return IterationDecision::Break;
+                }
+            }
+
+            IterationDecision::Continue
+        });
+    }
+
+    /// Calls the `callback` for each run of blocks of the inode whose number is `inode`, starting
+    /// from the block at index `first_block` in the file up to the size of the inode. Each run is
+    /// either physically contiguous or a hole. Pointer blocks are only read if they point to blocks
+    /// in that range, and holes don't read the disk at all.
+    pub fn for_each_block_range<F>(&self, inode: u32, first_block: u32, callback: &mut F)
+        where F: FnMut(BlockRange) -> IterationDecision {
         let inode_metadata = self.get_inode(inode);
+        let end_block = div_ceil(inode_metadata.size_low, self.block_size as u32).unwrap();
+        if first_block >= end_block {
+            return;
+        }
 
-        for i in 0..INODE_DIRECT_PTR_COUNT {
-            if callback(self.get_block(inode_metadata.direct_pointers[i])) == IterationDecision::Break {
-                return;
+        let mut coalescer = RangeCoalescer::new(first_block as u64, end_block as u64);
+
+        // An inode without allocated blocks is a single hole, so there are no pointers to walk
+        if inode_metadata.disk_sector_count == 0 {
+            coalescer.push(first_block as u64, None, (end_block - first_block) as u64, callback);
+            coalescer.finish(callback);
+            return;
+        }
+
+        if (inode_metadata.flags & InodeFlags::Extents as u32) != 0 {
+            let mut block = first_block as u64;
+            let decision = self.walk_extent_node(self.get_extent_tree_root(inode_metadata),
+                MAX_EXTENT_TREE_DEPTH, &mut block, &mut coalescer, callback);
+
+            // The blocks after the last extent are a hole
+            if decision == IterationDecision::Continue {
+                coalescer.push(block, None, end_block as u64 - block, callback);
+            }
+            coalescer.finish(callback);
+            return;
+        }
+
+        let direct_pointers = inode_metadata.direct_pointers;
+        let indirect_pointers = [
+            (inode_metadata.singly_indirect_pointer, 1),
+            (inode_metadata.doubly_indirect_pointer, 2),
+            (inode_metadata.triply_indirect_pointer, 3),
+        ];
+
+        let mut block = 0;
+        let pointers = direct_pointers.iter().map(|&ptr| (ptr, 0)).chain(indirect_pointers);
+        for (ptr, depth) in pointers {
+            if self.walk_pointer(ptr, depth, &mut block, &mut coalescer, callback)
+                == IterationDecision::Break {
+                break;
             }
         }
 
-        self.for_each_indirect_block(inode_metadata.singly_indirect_pointer, callback);
-        self.for_each_doubly_indirect_block(inode_metadata.doubly_indirect_pointer, callback);
-        self.for_each_triply_indirect_block(inode_metadata.triply_indirect_pointer, callback);
+        coalescer.finish(callback);
     }
 
     /// Returns a reference to the inode metadata structure of the inode whose number is `inode`
@@ -728,7 +827,7 @@ impl<'a> Ext2Parser<'a> {
         let inode_table_block_addr = 
             self.block_group_descriptor_table[block_group].inode_table_start_addr.0 as usize;
         let inode_offset = 
-            (inode_table_block_addr * self.block_size) + (inode_index * core::mem::size_of::<Inode>());
+            (inode_table_block_addr * self.block_size) + (inode_index * self.inode_size);
         
         unsafe { 
             &*(self.raw_bytes[inode_offset..].as_ptr() as *const Inode)
@@ -741,6 +840,16 @@ impl<'a> Ext2Parser<'a> {
         &self.raw_bytes[offset..offset+self.block_size]
     }
 
+    /// Returns a byte slice of the data of the block at the 48-bit address `(high << 32) | low`, or
+    /// `None` if it is not inside the file system
+    fn get_block_checked(&self, high: u16, low: u32) -> Option<&'a [u8]> {
+        if high != 0 {
+            return None;
+        }
+        let offset = (low as usize).checked_mul(self.block_size)?;
+        self.raw_bytes.get(offset..offset.checked_add(self.block_size)?)
+    }
+
     // Returns a slice of the pointers inside the block at address `block`
     fn get_ptrs_block(&self, block: BlockAddr) -> &'a [BlockAddr] {
         unsafe { 
@@ -751,48 +860,254 @@ impl<'a> Ext2Parser<'a> {
         }
     }
 
-    /// Calls the `callback` for each block pointed to by the pointers in the pointer block `block`.
-    /// The callback will be called with a byte slice of the block's content
-    fn for_each_indirect_block<F>(&self, block: BlockAddr, callback: &mut F)
-        where F: FnMut(&'a [u8]) -> IterationDecision {
-        let ptrs = self.get_ptrs_block(block);
-        for &direct_ptr in ptrs {
-            if direct_ptr.0 == 0 {
-                return;
-            }
+    /// Passes the blocks under the pointer `ptr` to `coalescer`. `ptr` points to a data block if
+    /// `depth` is zero, and to a block of pointers `depth` levels above the data blocks otherwise.
+    /// `block` is the index in the file of the first block under the pointer, and is advanced past
+    /// them. Pointers whose blocks are all outside the range of `coalescer` aren't read. Returns
+    /// `Break` when the end of the range is reached or the callback breaks.
+    fn walk_pointer<F>(&self, ptr: BlockAddr, depth: u32, block: &mut u64,
+        coalescer: &mut RangeCoalescer, callback: &mut F) -> IterationDecision
+        where F: FnMut(BlockRange) -> IterationDecision {
+        if *block >= coalescer.end_block {
+            return IterationDecision::Break;
+        }
+
+        let span = (self.num_ptrs_per_block as u64).pow(depth);
+        let next_block = *block + span;
+        if next_block <= coalescer.first_block {
+            *block = next_block;
+            return IterationDecision::Continue;
+        }
+
+        if ptr.0 == 0 {
+            // Every block under a zero pointer is a hole
+            let start = (*block).max(coalescer.first_block);
+            let end = next_block.min(coalescer.end_block);
+            *block = next_block;
+            return coalescer.push(start, None, end - start, callback);
+        }
+
+        if depth == 0 {
+            *block = next_block;
+            return coalescer.push(next_block - 1, Some(ptr), 1, callback);
+        }
 
-            if callback(self.get_block(direct_ptr)) == IterationDecision::Break {
-                return;
+        for &child in self.get_ptrs_block(ptr) {
+            if self.walk_pointer(child, depth - 1, block, coalescer, callback)
+                == IterationDecision::Break {
+                return IterationDecision::Break;
             }
         }
+
+        IterationDecision::Continue
     }
 
-    /// Calls the `callback` for each block eventually pointed to by the pointers in the indirect
-    /// pointers block `block`. The callback will be called with a byte slice of the block's content
-    fn for_each_doubly_indirect_block<F>(&self, block: BlockAddr, callback: &mut F)
-        where F: FnMut(&'a [u8]) -> IterationDecision {
-        let ptrs = self.get_ptrs_block(block);
+    /// Returns the bytes of the root node of the extent tree of an inode which is mapped by extents
+    fn get_extent_tree_root(&self, inode: &'a Inode) -> &'a [u8] {
+        // The root takes the place of the block pointers
+        let pointers_size = core::mem::size_of::<BlockAddr>() * (INODE_DIRECT_PTR_COUNT + 3);
+        unsafe {
+            core::slice::from_raw_parts(core::ptr::addr_of!(inode.direct_pointers) as *const u8,
+                pointers_size)
+        }
+    }
+
+    /// Passes the blocks mapped by the extent tree node `node` to `coalescer`, starting from
+    /// the block at index `block`, which is advanced past them. The gaps between extents are holes.
+    /// The first extent which maps `block` is found with a binary search in each level, so only the
+    /// nodes along that path and the nodes after it are read. `max_depth` is the maximal depth of
+    /// the node. Returns `Break` when the end of the range is reached, the callback breaks, or the
+    /// tree is corrupt or maps blocks we can't address (above 32 bits), so the blocks from there on
+    /// are not passed.
+    fn walk_extent_node<F>(&self, node: &'a [u8], max_depth: u16, block: &mut u64,
+        coalescer: &mut RangeCoalescer, callback: &mut F) -> IterationDecision
+        where F: FnMut(BlockRange) -> IterationDecision {
+        let entries_offset = core::mem::size_of::<ExtentHeader>();
+        if node.len() < entries_offset {
+            return IterationDecision::Break;
+        }
+
+        let header = unsafe { &*(node.as_ptr() as *const ExtentHeader) };
+        let entry_count = header.entry_count as usize;
+        if header.magic != EXTENT_HEADER_MAGIC || header.depth > max_depth
+            || entries_offset + entry_count * core::mem::size_of::<Extent>() > node.len() {
+            return IterationDecision::Break;
+        }
 
-        for &ptr in ptrs {
-            if ptr.0 == 0 {
-                return;
+        if header.depth > 0 {
+            let indices = unsafe {
+                core::slice::from_raw_parts(node[entries_offset..].as_ptr() as *const ExtentIndex,
+                    entry_count)
+            };
+
+            // The subtree of an index maps the blocks from its first block up to the first block of
+            // the next index, so the walk starts at the last index which starts at or before `block`
+            let first_index = indices.partition_point(|index| index.first_block as u64 <= *block)
+                .saturating_sub(1);
+            for index in &indices[first_index..] {
+                let child = match self.get_block_checked(index.leaf_high, index.leaf_low) {
+                    Some(child) => child,
+                    None => return IterationDecision::Break,
+                };
+                if self.walk_extent_node(child, header.depth - 1, block, coalescer, callback)
+                    == IterationDecision::Break {
+                    return IterationDecision::Break;
+                }
             }
-            self.for_each_indirect_block(ptr, callback);
+
+            return IterationDecision::Continue;
         }
+
+        let extents = unsafe {
+            core::slice::from_raw_parts(node[entries_offset..].as_ptr() as *const Extent,
+                entry_count)
+        };
+
+        let first_extent = extents.partition_point(|extent| extent.first_block as u64 <= *block)
+            .saturating_sub(1);
+        for extent in &extents[first_extent..] {
+            let (length, initialized) = if extent.length > MAX_INITIALIZED_EXTENT_LENGTH {
+                (extent.length - MAX_INITIALIZED_EXTENT_LENGTH, false)
+            } else {
+                (extent.length, true)
+            };
+
+            let extent_start = extent.first_block as u64;
+            let extent_end = extent_start + length as u64;
+            if extent_end <= *block {
+                continue;
+            }
+
+            // The blocks before the extent are a hole
+            if extent_start > *block {
+                let hole_end = extent_start.min(coalescer.end_block);
+                let decision = coalescer.push(*block, None, hole_end - *block, callback);
+                *block = hole_end;
+                if decision == IterationDecision::Break {
+                    return IterationDecision::Break;
+                }
+            }
+
+            let addr = match extent.start_low.checked_add((*block - extent_start) as u32) {
+                Some(addr) if extent.start_high == 0 => BlockAddr(addr),
+                _ => return IterationDecision::Break,
+            };
+            let end = extent_end.min(coalescer.end_block);
+            let decision = coalescer.push(*block, Some(addr).filter(|_| initialized), end - *block,
+                callback);
+            *block = end;
+            if decision == IterationDecision::Break {
+                return IterationDecision::Break;
+            }
+        }
+
+        IterationDecision::Continue
     }
+}
 
-    /// Calls the `callback` for each block eventually pointed to by the pointers in the doubly
-    /// indirect pointers block `block`. The callback will be called with a byte slice of the
-    /// block's content
-    fn for_each_triply_indirect_block<F>(&self, block: BlockAddr, callback: &mut F)
-        where F: FnMut(&'a [u8]) -> IterationDecision {
-        let ptrs = self.get_ptrs_block(block);
+/// The header of an extent tree node, which is followed by `entry_count` extents in a leaf, or
+/// `entry_count` indices of lower nodes otherwise. The root node is stored in the inode, and the
+/// rest of the nodes take a block each.
+#[derive(Clone, Copy, Debug)]
+#[repr(C, packed)]
+struct ExtentHeader {
+    /// Must be `EXTENT_HEADER_MAGIC`
+    magic: u16,
+    /// Number of valid entries following the header
+    entry_count: u16,
+    /// Number of entries which fit in the node
+    max_entry_count: u16,
+    /// Depth of the node in the tree, zero for leaves
+    depth: u16,
+    /// Generation of the tree, unused
+    generation: u32,
+}
+
+/// An index in an extent tree node, pointing to the node mapping the blocks from `first_block`
+#[derive(Clone, Copy, Debug)]
+#[repr(C, packed)]
+struct ExtentIndex {
+    /// The index in the file of the first block the lower node maps
+    first_block: u32,
+    /// Low 32 bits of the address of the lower node
+    leaf_low: u32,
+    /// High 16 bits of the address of the lower node
+    leaf_high: u16,
+    _unused: u16,
+}
+
+/// A leaf entry of an extent tree, mapping a run of blocks of the file to a run of contiguous
+/// blocks on the disk
+#[derive(Clone, Copy, Debug)]
+#[repr(C, packed)]
+struct Extent {
+    /// The index in the file of the first block of the extent
+    first_block: u32,
+    /// Number of blocks in the extent, see `MAX_INITIALIZED_EXTENT_LENGTH`
+    length: u16,
+    /// High 16 bits of the address of the first block of the extent
+    start_high: u16,
+    /// Low 32 bits of the address of the first block of the extent
+    start_low: u32,
+}
+
+/// Merges the blocks of a file, passed in order, into runs of physically contiguous blocks or holes
+struct RangeCoalescer {
+    /// The index of the first block which is passed
+    first_block: u64,
+    /// The index of the block after the last block which is passed
+    end_block: u64,
+    /// The run which is being extended
+    run: Option<BlockRange>,
+    /// Whether the callback asked to stop
+    stopped: bool,
+}
 
-        for &ptr in ptrs {
-            if ptr.0 == 0 {
-                return;
+impl RangeCoalescer {
+    fn new(first_block: u64, end_block: u64) -> Self {
+        Self { first_block, end_block, run: None, stopped: false }
+    }
+
+    /// Adds `count` blocks starting at the block at index `block`, which are contiguous from the
+    /// address `addr` or holes if it is `None`. Calls `callback` with the previous run if the
+    /// blocks don't extend it. Returns `Break` if the callback did, or if the blocks reach the end
+    /// of the range.
+    fn push<F>(&mut self, block: u64, addr: Option<BlockAddr>, count: u64, callback: &mut F)
+        -> IterationDecision
+        where F: FnMut(BlockRange) -> IterationDecision {
+        let extends_run = match (self.run.as_ref(), addr) {
+            (Some(run), None) => run.first_addr.is_none(),
+            (Some(run), Some(addr)) => {
+                matches!(run.first_addr, Some(run_addr) if run_addr.0 as u64 + run.count as u64
+                    == addr.0 as u64)
+            },
+            (None, _) => false,
+        };
+
+        if extends_run {
+            self.run.as_mut().unwrap().count += count as u32;
+        } else {
+            let new_run = BlockRange { first_block: block as u32, first_addr: addr, count: count as u32 };
+            if let Some(run) = self.run.replace(new_run) {
+                if callback(run) == IterationDecision::Break {
+                    self.stopped = true;
+                    return IterationDecision::Break;
+                }
             }
-            self.for_each_doubly_indirect_block(ptr, callback);
+        }
+
+        if block + count >= self.end_block {
+            IterationDecision::Break
+        } else {
+            IterationDecision::Continue
+        }
+    }
+
+    /// Calls `callback` with the last run, unless the callback asked to stop
+    fn finish<F>(self, callback: &mut F)
+        where F: FnMut(BlockRange) -> IterationDecision {
+        if let (Some(run), false) = (self.run, self.stopped) {
+            callback(run);
         }
     }
 }
@@ -816,6 +1131,152 @@ mod tests {
 
     use crate::*;
     extern crate std;
+    use std::vec::Vec;
+
+    #[test]
+    fn coalesces_ranges() {
+        let mut ranges = Vec::new();
+        let mut callback = |range| {
+            ranges.push(range);
+            IterationDecision::Continue
+        };
+
+        let mut coalescer = RangeCoalescer::new(0, 8);
+        coalescer.push(0, Some(BlockAddr(10)), 1, &mut callback);
+        coalescer.push(1, Some(BlockAddr(11)), 1, &mut callback);
+        coalescer.push(2, None, 2, &mut callback);
+        coalescer.push(4, None, 1, &mut callback);
+        coalescer.push(5, Some(BlockAddr(20)), 1, &mut callback);
+        assert!(coalescer.push(6, Some(BlockAddr(30)), 2, &mut callback) == IterationDecision::Break);
+        coalescer.finish(&mut callback);
+
+        assert_eq!(ranges, [
+            BlockRange { first_block: 0, first_addr: Some(BlockAddr(10)), count: 2 },
+            BlockRange { first_block: 2, first_addr: None, count: 3 },
+            BlockRange { first_block: 5, first_addr: Some(BlockAddr(20)), count: 1 },
+            BlockRange { first_block: 6, first_addr: Some(BlockAddr(30)), count: 2 },
+        ]);
+    }
+
+    /// Returns a parser over `raw_bytes` with 1KiB blocks, without a valid super block
+    fn parser_over(raw_bytes: &[u8]) -> Ext2Parser {
+        static ZEROS: [u8; 1024] = [0; 1024];
+        unsafe {
+            Ext2Parser {
+                raw_bytes,
+                super_block: &*(ZEROS.as_ptr() as *const SuperBlock),
+                super_block_extension: &*(ZEROS.as_ptr() as *const SuperBlockExtension),
+                block_group_descriptor_table: &[],
+                block_size: 1024,
+                inode_count: 0,
+                block_count: (raw_bytes.len() / 1024) as u32,
+                blocks_per_block_group: 8192,
+                inodes_per_block_group: 0,
+                block_group_count: 1,
+                inode_size: 128,
+                num_ptrs_per_block: 256,
+            }
+        }
+    }
+
+    /// Writes an extent tree node header of a node with `entry_count` entries at `node`
+    fn write_extent_header(node: &mut [u8], entry_count: u16, depth: u16) {
+        node[0..2].copy_from_slice(&EXTENT_HEADER_MAGIC.to_le_bytes());
+        node[2..4].copy_from_slice(&entry_count.to_le_bytes());
+        node[4..6].copy_from_slice(&4u16.to_le_bytes());
+        node[6..8].copy_from_slice(&depth.to_le_bytes());
+    }
+
+    /// Writes the `idx`th entry of an extent tree node at `node`: an index of the lower node at
+    /// `addr` if `length` is zero, or else an extent of `length` blocks starting at `addr`
+    fn write_extent_entry(node: &mut [u8], idx: usize, first_block: u32, addr: u32, length: u16) {
+        let entry = &mut node[12 + idx * 12..][..12];
+        entry[0..4].copy_from_slice(&first_block.to_le_bytes());
+        if length == 0 {
+            // An index
+            entry[4..8].copy_from_slice(&addr.to_le_bytes());
+        } else {
+            entry[4..6].copy_from_slice(&length.to_le_bytes());
+            entry[8..12].copy_from_slice(&addr.to_le_bytes());
+        }
+    }
+
+    /// Returns the ranges the extent tree whose root is `root` maps from block `first_block` to
+    /// `end_block`, as `for_each_block_range` would pass them
+    fn walk_extents(parser: &Ext2Parser, root: &[u8], first_block: u64, end_block: u64)
+        -> Vec<BlockRange> {
+        let mut ranges = Vec::new();
+        let mut callback = |range| {
+            ranges.push(range);
+            IterationDecision::Continue
+        };
+
+        let mut coalescer = RangeCoalescer::new(first_block, end_block);
+        let mut block = first_block;
+        if parser.walk_extent_node(root, MAX_EXTENT_TREE_DEPTH, &mut block, &mut coalescer,
+            &mut callback) == IterationDecision::Continue {
+            coalescer.push(block, None, end_block - block, &mut callback);
+        }
+        coalescer.finish(&mut callback);
+        ranges
+    }
+
+    #[test]
+    fn maps_blocks_through_extent_tree() {
+        // The root has two indices, of the leaves in blocks 1 and 2
+        let mut disk = std::vec![0u8; 3 * 1024];
+        let mut root = [0u8; 60];
+        write_extent_header(&mut root, 2, 1);
+        write_extent_entry(&mut root, 0, 0, 1, 0);
+        write_extent_entry(&mut root, 1, 10, 2, 0);
+
+        write_extent_header(&mut disk[1024..2048], 2, 0);
+        write_extent_entry(&mut disk[1024..2048], 0, 0, 100, 2);
+        write_extent_entry(&mut disk[1024..2048], 1, 4, 102, 3);
+        write_extent_header(&mut disk[2048..], 1, 0);
+        // An uninitialized extent reads as a hole
+        write_extent_entry(&mut disk[2048..], 0, 10, 200, MAX_INITIALIZED_EXTENT_LENGTH + 2);
+
+        let parser = parser_over(&disk);
+        assert_eq!(walk_extents(&parser, &root, 0, 14), [
+            BlockRange { first_block: 0, first_addr: Some(BlockAddr(100)), count: 2 },
+            BlockRange { first_block: 2, first_addr: None, count: 2 },
+            BlockRange { first_block: 4, first_addr: Some(BlockAddr(102)), count: 3 },
+            BlockRange { first_block: 7, first_addr: None, count: 7 },
+        ]);
+
+        // Starting inside the second extent skips the first leaf's first extent
+        assert_eq!(walk_extents(&parser, &root, 5, 8), [
+            BlockRange { first_block: 5, first_addr: Some(BlockAddr(103)), count: 2 },
+            BlockRange { first_block: 7, first_addr: None, count: 1 },
+        ]);
+    }
+
+    #[test]
+    fn stops_at_corrupt_extent_tree() {
+        let mut disk = std::vec![0u8; 2 * 1024];
+        let mut root = [0u8; 60];
+        write_extent_header(&mut root, 2, 1);
+        write_extent_entry(&mut root, 0, 0, 1, 0);
+        // Points past the end of the disk
+        write_extent_entry(&mut root, 1, 10, 50, 0);
+
+        write_extent_header(&mut disk[1024..], 1, 0);
+        write_extent_entry(&mut disk[1024..], 0, 0, 100, 2);
+
+        // The blocks from the bad index on are not passed
+        let parser = parser_over(&disk);
+        assert_eq!(walk_extents(&parser, &root, 0, 14), [
+            BlockRange { first_block: 0, first_addr: Some(BlockAddr(100)), count: 2 },
+        ]);
+
+        // A leaf with a bad magic, and an extent above 32 bits
+        disk[1024] = 0;
+        assert_eq!(walk_extents(&parser_over(&disk), &root, 0, 14), []);
+        write_extent_header(&mut disk[1024..], 1, 0);
+        disk[1024 + 12 + 6] = 1;
+        assert_eq!(walk_extents(&parser_over(&disk), &root, 0, 14), []);
+    }
 
     #[test]
     fn it_works() {
@@ -0,0 +1,232 @@
+//! A small LZ77 compressor and decompressor for page-sized buffers, using a byte-oriented format
+//! similar to LZ4 blocks. The compressed data is a sequence of:
+//! - A token byte: the high nibble is the number of literals, the low nibble is the length of the
+//!   match minus `MIN_MATCH`. A nibble of 15 means more length bytes follow (each adds its value,
+//!   and a byte of 255 means another one follows)
+//! - The literal bytes
+//! - The offset of the match backwards from the current position as a little-endian u16, followed
+//!   by the extra match length bytes
+//!
+//! The last sequence only has literals, and ends the data.
+
+#![no_std]
+
+/// The shortest match that is encoded
+const MIN_MATCH: usize = 4;
+/// The maximum distance of a match backwards from the current position
+const MAX_OFFSET: usize = u16::MAX as usize;
+/// Number of bits in the hash of the next `MIN_MATCH` bytes
+pub const HASH_BITS: u32 = 12;
+/// Number of entries in the hash table used by `compress`
+pub const HASH_TABLE_SIZE: usize = 1 << HASH_BITS;
+
+/// Marks an empty hash table entry
+const NO_POSITION: u16 = u16::MAX;
+
+/// Compresses `input` into `output`, using `hash_table` as scratch space. Returns the compressed
+/// size, or None if the compressed data does not fit in `output` (i.e. the input is not
+/// compressible enough). The input must be smaller than 64KiB.
+pub fn compress(input: &[u8], output: &mut [u8], hash_table: &mut [u16; HASH_TABLE_SIZE])
+    -> Option<usize> {
+    assert!(input.len() < NO_POSITION as usize);
+    hash_table.fill(NO_POSITION);
+
+    let mut out_pos = 0;
+    let mut anchor = 0;
+    let mut pos = 0;
+    while pos + MIN_MATCH <= input.len() {
+        let sequence = read_u32(input, pos);
+        let hash = hash(sequence);
+        let candidate = hash_table[hash] as usize;
+        hash_table[hash] = pos as u16;
+
+        if candidate == NO_POSITION as usize || pos - candidate > MAX_OFFSET
+            || read_u32(input, candidate) != sequence {
+            pos += 1;
+            continue;
+        }
+
+        // Extend the match as far as it goes. The match may overlap the current position, which
+        // the decompressor handles by copying byte by byte
+        let mut match_len = MIN_MATCH;
+        while pos + match_len < input.len() && input[candidate + match_len] == input[pos + match_len] {
+            match_len += 1;
+        }
+
+        out_pos = write_sequence(output, out_pos, &input[anchor..pos],
+            Some(((pos - candidate) as u16, match_len)))?;
+        pos += match_len;
+        anchor = pos;
+    }
+
+    write_sequence(output, out_pos, &input[anchor..], None)
+}
+
+/// Decompresses `input` into `output`. Returns the decompressed size, or None if the compressed
+/// data is malformed or does not fit in `output`.
+pub fn decompress(input: &[u8], output: &mut [u8]) -> Option<usize> {
+    let mut in_pos = 0;
+    let mut out_pos = 0;
+    loop {
+        let token = *input.get(in_pos)?;
+        in_pos += 1;
+
+        let literals_len = read_length(input, &mut in_pos, (token >> 4) as usize)?;
+        let literals = input.get(in_pos..in_pos.checked_add(literals_len)?)?;
+        output.get_mut(out_pos..out_pos + literals_len)?.copy_from_slice(literals);
+        in_pos += literals_len;
+        out_pos += literals_len;
+
+        // The last sequence has no match
+        if in_pos == input.len() {
+            return Some(out_pos);
+        }
+
+        let offset = u16::from_le_bytes([*input.get(in_pos)?, *input.get(in_pos + 1)?]) as usize;
+        in_pos += 2;
+        let match_len = read_length(input, &mut in_pos, (token & 0xF) as usize)? + MIN_MATCH;
+
+        if offset == 0 || offset > out_pos || out_pos + match_len > output.len() {
+            return None;
+        }
+
+        // The match may overlap the bytes it produces, so it is copied byte by byte
+        for idx in out_pos..out_pos + match_len {
+            output[idx] = output[idx - offset];
+        }
+        out_pos += match_len;
+    }
+}
+
+/// Writes a sequence of `literals` followed by the match `(offset, length)` to `output` at
+/// `out_pos`. Returns the position after the sequence, or None if it does not fit.
+fn write_sequence(output: &mut [u8], mut out_pos: usize, literals: &[u8],
+    match_info: Option<(u16, usize)>) -> Option<usize> {
+    let match_len_code = match_info.map_or(0, |(_, match_len)| match_len - MIN_MATCH);
+
+    let token = (literals.len().min(15) << 4) as u8 | match_len_code.min(15) as u8;
+    *output.get_mut(out_pos)? = token;
+    out_pos += 1;
+
+    out_pos = write_length(output, out_pos, literals.len())?;
+    output.get_mut(out_pos..out_pos + literals.len())?.copy_from_slice(literals);
+    out_pos += literals.len();
+
+    if let Some((offset, _)) = match_info {
+        output.get_mut(out_pos..out_pos + 2)?.copy_from_slice(&offset.to_le_bytes());
+        out_pos += 2;
+        out_pos = write_length(output, out_pos, match_len_code)?;
+    }
+
+    Some(out_pos)
+}
+
+/// Writes the extra length bytes of a length whose nibble in the token is saturated
+fn write_length(output: &mut [u8], mut out_pos: usize, length: usize) -> Option<usize> {
+    if length < 15 {
+        return Some(out_pos);
+    }
+
+    let mut remaining = length - 15;
+    loop {
+        let byte = remaining.min(255);
+        *output.get_mut(out_pos)? = byte as u8;
+        out_pos += 1;
+        if byte < 255 {
+            return Some(out_pos);
+        }
+        remaining -= 255;
+    }
+}
+
+/// Reads a length whose token nibble is `nibble`, consuming any extra length bytes
+fn read_length(input: &[u8], in_pos: &mut usize, nibble: usize) -> Option<usize> {
+    let mut length = nibble;
+    if nibble == 15 {
+        loop {
+            let byte = *input.get(*in_pos)?;
+            *in_pos += 1;
+            length += byte as usize;
+            if byte != 255 {
+                break;
+            }
+        }
+    }
+
+    Some(length)
+}
+
+/// Reads 4 bytes at `pos` as a little-endian u32
+fn read_u32(buffer: &[u8], pos: usize) -> u32 {
+    u32::from_le_bytes(buffer[pos..pos + 4].try_into().unwrap())
+}
+
+/// Hashes 4 bytes into an index into the hash table (Knuth's multiplicative hash)
+fn hash(sequence: u32) -> usize {
+    (sequence.wrapping_mul(2654435761) >> (32 - HASH_BITS)) as usize
+}
+
+#[cfg(test)]
+mod tests {
+
+    use crate::{compress, decompress, HASH_TABLE_SIZE};
+
+    fn round_trip(input: &[u8]) -> Option<usize> {
+        let mut hash_table = [0u16; HASH_TABLE_SIZE];
+        let mut compressed = [0u8; 4096];
+        let compressed_len = compress(input, &mut compressed, &mut hash_table)?;
+
+        let mut decompressed = [0u8; 4096];
+        assert!(decompress(&compressed[..compressed_len], &mut decompressed) == Some(input.len()));
+        assert!(&decompressed[..input.len()] == input);
+        Some(compressed_len)
+    }
+
+    #[test]
+    fn repetitive_data() {
+        let mut page = [0u8; 4096];
+        for (idx, byte) in page.iter_mut().enumerate() {
+            *byte = b"hello world "[idx % 12];
+        }
+        assert!(round_trip(&page).unwrap() < 64);
+        assert!(round_trip(&[0u8; 4096]).unwrap() < 32);
+    }
+
+    #[test]
+    fn short_and_mixed_data() {
+        assert!(round_trip(&[]).is_some());
+        assert!(round_trip(b"abc").is_some());
+
+        let mut page = [0u8; 4096];
+        let mut state = 1u32;
+        for (idx, byte) in page.iter_mut().enumerate() {
+            state = state.wrapping_mul(1103515245).wrapping_add(12345);
+            // Runs of zeros between pseudo-random bytes
+            *byte = if (idx / 64) % 2 == 0 { (state >> 16) as u8 } else { 0 };
+        }
+        assert!(round_trip(&page).is_some());
+    }
+
+    #[test]
+    fn incompressible_data() {
+        let mut page = [0u8; 4096];
+        let mut state = 1u32;
+        for byte in page.iter_mut() {
+            state = state.wrapping_mul(1103515245).wrapping_add(12345);
+            *byte = (state >> 16) as u8;
+        }
+
+        let mut hash_table = [0u16; HASH_TABLE_SIZE];
+        let mut compressed = [0u8; 2048];
+        assert!(compress(&page, &mut compressed, &mut hash_table).is_none());
+    }
+
+    #[test]
+    fn malformed_data() {
+        let mut output = [0u8; 16];
+        // A match before the start of the output
+        assert!(decompress(&[0x10, b'a', 0x05, 0x00], &mut output).is_none());
+        // Literals past the end of the input
+        assert!(decompress(&[0x50, b'a'], &mut output).is_none());
+    }
+}
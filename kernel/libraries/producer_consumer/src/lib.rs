@@ -29,6 +29,16 @@ impl<T, const SIZE: usize> ProducerConsumer<T, SIZE>  {
         }
     }
 
+    /// Returns the number of items in the queue which were not consumed yet
+    pub fn len(&self) -> usize {
+        self.uncosumed_count.load(Ordering::Relaxed)
+    }
+
+    /// Returns true if there is no room for another item
+    pub fn is_full(&self) -> bool {
+        self.len() == SIZE
+    }
+
     pub fn produce(&self, val: T) -> Option<()> {
         if self.uncosumed_count.load(Ordering::Relaxed) == SIZE {
             return None
@@ -0,0 +1,224 @@
+//! Minimal ATA PIO driver for the drives on the primary IDE bus. Transfers are polled (the drive
+//! interrupts are disabled), so they can be issued with interrupts masked and locks held.
+
+use core::hint::spin_loop;
+
+/// Size of a sector in bytes
+pub const SECTOR_SIZE: usize = 512;
+/// The maximum number of sectors a single command can transfer
+pub const MAX_SECTORS_PER_COMMAND: usize = 256;
+
+/// I/O port of the data register of the primary bus
+const ATA_PRIMARY_DATA_PORT: u16 = 0x1F0;
+/// I/O port of the sector count register of the primary bus
+const ATA_PRIMARY_SECTOR_COUNT_PORT: u16 = 0x1F2;
+/// I/O port of the low byte of the LBA of the primary bus
+const ATA_PRIMARY_LBA_LOW_PORT: u16 = 0x1F3;
+/// I/O port of the middle byte of the LBA of the primary bus
+const ATA_PRIMARY_LBA_MID_PORT: u16 = 0x1F4;
+/// I/O port of the high byte of the LBA of the primary bus
+const ATA_PRIMARY_LBA_HIGH_PORT: u16 = 0x1F5;
+/// I/O port of the drive select register of the primary bus
+const ATA_PRIMARY_DRIVE_PORT: u16 = 0x1F6;
+/// I/O port for writing commands and reading the status register of the primary bus
+const ATA_PRIMARY_CMD_STATUS_PORT: u16 = 0x1F7;
+/// I/O port for writing the device control register and reading the alternate status register
+const ATA_PRIMARY_CONTROL_PORT: u16 = 0x3F6;
+
+/// ATA status mask for the error bit
+const ATA_STATUS_ERROR_MASK: u8 = 1 << 0;
+/// ATA status mask for the data request bit
+const ATA_STATUS_DATA_REQUEST_MASK: u8 = 1 << 3;
+/// ATA status mask for the drive fault bit
+const ATA_STATUS_DRIVE_FAULT_MASK: u8 = 1 << 5;
+/// ATA status mask for the busy bit
+const ATA_STATUS_BUSY_MASK: u8 = 1 << 7;
+
+/// Device control mask which stops the drives from raising interrupts
+const ATA_CONTROL_DISABLE_INTERRUPTS_MASK: u8 = 1 << 1;
+/// Drive select mask for LBA addressing (the other set bits are obsolete and always set)
+const ATA_DRIVE_SELECT_LBA: u8 = 0xE0;
+/// Drive select mask for the second drive on the bus
+const ATA_DRIVE_SELECT_SLAVE_MASK: u8 = 1 << 4;
+
+/// Timeout for the drive to become ready or to request data
+const ATA_TIMEOUT: usize = 0x1000000;
+
+/// Possible commands for an ATA drive
+#[repr(u8)]
+enum AtaCommand {
+	ReadSectors = 0x20,
+	WriteSectors = 0x30,
+	CacheFlush = 0xE7,
+	Identify = 0xEC,
+}
+
+/// A drive on the primary IDE bus
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum Drive {
+	#[allow(unused)]
+	Master,
+	Slave,
+}
+
+/// Returns the number of addressable sectors of `drive`, or None if there is no ATA drive there
+pub fn identify(drive: Drive) -> Option<u32> {
+	unsafe {
+		// We poll the drives, so they should not raise interrupts
+		cpu::out8(ATA_PRIMARY_CONTROL_PORT, ATA_CONTROL_DISABLE_INTERRUPTS_MASK);
+
+		select_drive(drive, 0);
+		cpu::out8(ATA_PRIMARY_SECTOR_COUNT_PORT, 0);
+		cpu::out8(ATA_PRIMARY_LBA_LOW_PORT, 0);
+		cpu::out8(ATA_PRIMARY_LBA_MID_PORT, 0);
+		cpu::out8(ATA_PRIMARY_LBA_HIGH_PORT, 0);
+		cpu::out8(ATA_PRIMARY_CMD_STATUS_PORT, AtaCommand::Identify as u8);
+
+		// A status of zero means there is no drive, and a floating bus reads as all ones
+		let status = cpu::in8(ATA_PRIMARY_CMD_STATUS_PORT);
+		if status == 0 || status == 0xFF {
+			return None;
+		}
+
+		wait_not_busy()?;
+
+		// ATAPI and SATA devices set the LBA registers to a signature instead of answering
+		if cpu::in8(ATA_PRIMARY_LBA_MID_PORT) != 0 || cpu::in8(ATA_PRIMARY_LBA_HIGH_PORT) != 0 {
+			return None;
+		}
+
+		wait_data_request()?;
+
+		let mut identify_data = [0u16; 256];
+		for word in identify_data.iter_mut() {
+			*word = cpu::in16(ATA_PRIMARY_DATA_PORT);
+		}
+
+		// Words 60 and 61 hold the number of sectors addressable with 28-bit LBA
+		Some((identify_data[60] as u32) | ((identify_data[61] as u32) << 16))
+	}
+}
+
+/// Reads `buffer.len() / SECTOR_SIZE` sectors starting at sector `lba` of `drive` into `buffer`.
+/// The length of `buffer` must be a multiple of the sector size.
+#[must_use]
+pub fn read_sectors(drive: Drive, lba: u32, buffer: &mut [u8]) -> Option<()> {
+	assert!(buffer.len() % SECTOR_SIZE == 0);
+
+	for (chunk_idx, chunk) in buffer.chunks_mut(MAX_SECTORS_PER_COMMAND * SECTOR_SIZE).enumerate() {
+		let chunk_lba = lba.checked_add((chunk_idx * MAX_SECTORS_PER_COMMAND) as u32)?;
+		unsafe {
+			issue_transfer(drive, chunk_lba, chunk.len() / SECTOR_SIZE, AtaCommand::ReadSectors)?;
+
+			for sector in chunk.chunks_mut(SECTOR_SIZE) {
+				wait_data_request()?;
+				for word in sector.chunks_mut(2) {
+					word.copy_from_slice(&cpu::in16(ATA_PRIMARY_DATA_PORT).to_le_bytes());
+				}
+			}
+		}
+	}
+
+	Some(())
+}
+
+/// Writes `buffer` to the sectors starting at sector `lba` of `drive`, and flushes the write cache
+/// of the drive. The length of `buffer` must be a multiple of the sector size.
+#[must_use]
+pub fn write_sectors(drive: Drive, lba: u32, buffer: &[u8]) -> Option<()> {
+	assert!(buffer.len() % SECTOR_SIZE == 0);
+
+	for (chunk_idx, chunk) in buffer.chunks(MAX_SECTORS_PER_COMMAND * SECTOR_SIZE).enumerate() {
+		let chunk_lba = lba.checked_add((chunk_idx * MAX_SECTORS_PER_COMMAND) as u32)?;
+		unsafe {
+			issue_transfer(drive, chunk_lba, chunk.len() / SECTOR_SIZE, AtaCommand::WriteSectors)?;
+
+			for sector in chunk.chunks(SECTOR_SIZE) {
+				wait_data_request()?;
+				for word in sector.chunks(2) {
+					cpu::out16(ATA_PRIMARY_DATA_PORT, u16::from_le_bytes([word[0], word[1]]));
+				}
+			}
+		}
+	}
+
+	let status = unsafe {
+		cpu::out8(ATA_PRIMARY_CMD_STATUS_PORT, AtaCommand::CacheFlush as u8);
+		wait_not_busy()?
+	};
+	if (status & (ATA_STATUS_ERROR_MASK | ATA_STATUS_DRIVE_FAULT_MASK)) != 0 {
+		return None;
+	}
+
+	Some(())
+}
+
+/// Selects `drive` and sends a read or write command of `sector_count` sectors starting at `lba`
+unsafe fn issue_transfer(drive: Drive, lba: u32, sector_count: usize, command: AtaCommand)
+	-> Option<()> {
+	// 28-bit LBA can't address anything above this, and a count of zero means 256 sectors
+	if sector_count == 0 || sector_count > MAX_SECTORS_PER_COMMAND
+		|| lba.checked_add(sector_count as u32)? > (1 << 28) {
+		return None;
+	}
+
+	wait_not_busy()?;
+	select_drive(drive, lba);
+	cpu::out8(ATA_PRIMARY_SECTOR_COUNT_PORT, sector_count as u8);
+	cpu::out8(ATA_PRIMARY_LBA_LOW_PORT, lba as u8);
+	cpu::out8(ATA_PRIMARY_LBA_MID_PORT, (lba >> 8) as u8);
+	cpu::out8(ATA_PRIMARY_LBA_HIGH_PORT, (lba >> 16) as u8);
+	cpu::out8(ATA_PRIMARY_CMD_STATUS_PORT, command as u8);
+
+	Some(())
+}
+
+/// Selects `drive`, with `lba` providing the top 4 bits of the LBA of the next command
+unsafe fn select_drive(drive: Drive, lba: u32) {
+	let mut select = ATA_DRIVE_SELECT_LBA | ((lba >> 24) & 0xF) as u8;
+	if drive == Drive::Slave {
+		select |= ATA_DRIVE_SELECT_SLAVE_MASK;
+	}
+	cpu::out8(ATA_PRIMARY_DRIVE_PORT, select);
+
+	// The drive needs 400ns to respond to the selection, which reading the alternate status
+	// register four times takes
+	for _ in 0..4 {
+		cpu::in8(ATA_PRIMARY_CONTROL_PORT);
+	}
+}
+
+/// Waits for the selected drive to clear its busy bit and returns its status. Returns None on
+/// timeout.
+unsafe fn wait_not_busy() -> Option<u8> {
+	let mut timeout = ATA_TIMEOUT;
+	loop {
+		let status = cpu::in8(ATA_PRIMARY_CMD_STATUS_PORT);
+		if (status & ATA_STATUS_BUSY_MASK) == 0 {
+			return Some(status);
+		}
+
+		timeout = timeout.checked_sub(1)?;
+		spin_loop();
+	}
+}
+
+/// Waits for the selected drive to request a sector transfer. Returns None on timeout or on an
+/// error.
+unsafe fn wait_data_request() -> Option<()> {
+	let mut timeout = ATA_TIMEOUT;
+	loop {
+		let status = cpu::in8(ATA_PRIMARY_CMD_STATUS_PORT);
+		if (status & ATA_STATUS_BUSY_MASK) == 0 {
+			if (status & (ATA_STATUS_ERROR_MASK | ATA_STATUS_DRIVE_FAULT_MASK)) != 0 {
+				return None;
+			}
+			if (status & ATA_STATUS_DATA_REQUEST_MASK) != 0 {
+				return Some(());
+			}
+		}
+
+		timeout = timeout.checked_sub(1)?;
+		spin_loop();
+	}
+}
@@ -0,0 +1,45 @@
+//! A common interface to the block devices, so their users don't depend on the driver
+
+use crate::{ata, virtio_blk};
+
+/// Size of a sector in bytes, which is the same for every block device
+pub const SECTOR_SIZE: usize = ata::SECTOR_SIZE;
+
+/// A block device
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum BlockDevice {
+	/// A drive on the primary IDE bus
+	Ata(ata::Drive),
+	/// A virtio block device, by its index
+	VirtioBlk(usize),
+}
+
+impl BlockDevice {
+	/// Returns the number of addressable sectors of the device, or None if there is no device there
+	pub fn sector_count(&self) -> Option<u32> {
+		match *self {
+			BlockDevice::Ata(drive) => ata::identify(drive),
+			BlockDevice::VirtioBlk(idx) => virtio_blk::sector_count(idx),
+		}
+	}
+
+	/// Reads `buffer.len() / SECTOR_SIZE` sectors starting at sector `lba` into `buffer`. The
+	/// length of `buffer` must be a multiple of the sector size.
+	#[must_use]
+	pub fn read_sectors(&self, lba: u32, buffer: &mut [u8]) -> Option<()> {
+		match *self {
+			BlockDevice::Ata(drive) => ata::read_sectors(drive, lba, buffer),
+			BlockDevice::VirtioBlk(idx) => virtio_blk::read_sectors(idx, lba, buffer),
+		}
+	}
+
+	/// Writes `buffer` to the sectors starting at sector `lba`. The length of `buffer` must be a
+	/// multiple of the sector size.
+	#[must_use]
+	pub fn write_sectors(&self, lba: u32, buffer: &[u8]) -> Option<()> {
+		match *self {
+			BlockDevice::Ata(drive) => ata::write_sectors(drive, lba, buffer),
+			BlockDevice::VirtioBlk(idx) => virtio_blk::write_sectors(idx, lba, buffer),
+		}
+	}
+}
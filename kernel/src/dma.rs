@@ -0,0 +1,219 @@
+//! Memory for DMA: buffers which are physically contiguous, so a device can be given a single
+//! physical address, and which are mapped in the kernel's DMA region so the driver can access them
+//! through the same memory, without copying. Small buffers (e.g. request headers) come from pools
+//! of fixed-size blocks carved out of whole pages, so they don't take up a page each.
+//!
+//! The page tables of the DMA region are created by `init`, before any address space is created,
+//! so every address space shares them and buffers are visible in all of them.
+
+use core::alloc::Layout;
+
+use lock_cell::LockCell;
+use page_tables::{PhysAddr, PhysMem, VirtAddr, PAGE_ENTRY_PRESENT, PAGE_ENTRY_WRITE};
+use range_set::{InclusiveRange, RangeSet};
+use crate::memory_manager::PHYS_MEM;
+
+/// The virtual address where DMA buffers are mapped
+const DMA_REGION_VADDR: u32 = 0xC9000000;
+/// The size of the virtual region of DMA buffers
+const DMA_REGION_SIZE: u32 = 0x1000000;
+
+/// The last physical address devices limited to 24-bit addresses (e.g. ISA DMA) can access
+const ISA_DMA_MAX_ADDR: u32 = 0xFFFFFF;
+
+/// The block sizes of the small buffer pools, each a power of two so blocks never cross a page
+const POOL_BLOCK_SIZES: [usize; 5] = [32, 64, 128, 256, 512];
+
+/// The free parts of the DMA region
+static FREE_VIRT_RANGES: LockCell<RangeSet> = LockCell::new(RangeSet::new());
+
+/// The free blocks of each small buffer pool. Each free block holds the virtual and physical
+/// addresses of the next free block, so the pools need no memory of their own.
+static POOLS: LockCell<[Option<DmaBlock>; POOL_BLOCK_SIZES.len()]> =
+	LockCell::new([None; POOL_BLOCK_SIZES.len()]);
+
+/// A physically contiguous buffer mapped in the DMA region, released when dropped. The buffer is
+/// zeroed when it is allocated.
+pub struct DmaBuffer {
+	vaddr: VirtAddr,
+	paddr: PhysAddr,
+	/// The size of the buffer, which is a whole number of pages
+	size: usize,
+}
+
+/// A block of a small buffer pool. Blocks must be returned with `release_block`.
+#[derive(Clone, Copy)]
+pub struct DmaBlock {
+	pub vaddr: VirtAddr,
+	pub paddr: PhysAddr,
+}
+
+/// Creates the page tables of the DMA region
+pub fn init() {
+	let mut pmem = PHYS_MEM.lock();
+	let (phys_mem, page_dir) = pmem.as_mut().unwrap();
+
+	// Writing an empty entry with `create` set creates the page table
+	for table_vaddr in (DMA_REGION_VADDR..DMA_REGION_VADDR + DMA_REGION_SIZE).step_by(0x400000) {
+		unsafe {
+			page_dir.map_raw(phys_mem, VirtAddr(table_vaddr), 0, true, true)
+				.expect("Failed to create the page tables of the DMA region");
+		}
+	}
+
+	FREE_VIRT_RANGES.lock().insert(InclusiveRange {
+		start: DMA_REGION_VADDR,
+		end: DMA_REGION_VADDR + (DMA_REGION_SIZE - 1),
+	});
+}
+
+impl DmaBuffer {
+	/// Allocates a buffer of at least `size` bytes, whose physical address is aligned to `align`
+	/// (and at least to a page). If `isa` is set, the whole buffer is below 16MiB, for devices
+	/// which can only address 24 bits.
+	pub fn allocate(size: usize, align: usize, isa: bool) -> Option<Self> {
+		let size = size.checked_add(4095)? & !0xFFF;
+		if size == 0 {
+			return None;
+		}
+		let layout = Layout::from_size_align(size, align.max(4096)).ok()?;
+
+		let vaddr = FREE_VIRT_RANGES.lock().allocate(size as u32, 4096)?;
+
+		let paddr = {
+			let mut pmem = PHYS_MEM.lock();
+			let (phys_mem, page_dir) = pmem.as_mut().unwrap();
+
+			let paddr = if isa {
+				phys_mem.allocate_phys_mem_below(layout, ISA_DMA_MAX_ADDR)
+			} else {
+				phys_mem.allocate_phys_mem(layout)
+			};
+
+			paddr.and_then(|paddr| {
+				for offset in (0..size as u32).step_by(4096) {
+					let raw_pte = PAGE_ENTRY_PRESENT | PAGE_ENTRY_WRITE | (paddr.0 + offset);
+					// The page tables of the region always exist
+					let mapped = unsafe {
+						page_dir.map_raw(phys_mem, VirtAddr(vaddr + offset), raw_pte, false, false)
+					};
+					if mapped.is_none() {
+						// Clear the entries which were already mapped, and release the frames
+						for mapped_offset in (0..offset).step_by(4096) {
+							unsafe {
+								page_dir.map_raw(phys_mem, VirtAddr(vaddr + mapped_offset), 0, true,
+									false).expect("Failed to unmap a DMA buffer");
+							}
+						}
+						phys_mem.release_phys_mem(paddr, size);
+						return None;
+					}
+				}
+				Some(paddr)
+			})
+		};
+
+		let paddr = match paddr {
+			Some(paddr) => paddr,
+			None => {
+				FREE_VIRT_RANGES.lock().insert(InclusiveRange {
+					start: vaddr,
+					end: vaddr + (size as u32 - 1),
+				});
+				return None;
+			}
+		};
+
+		unsafe { core::ptr::write_bytes(vaddr as *mut u8, 0, size); }
+
+		Some(DmaBuffer { vaddr: VirtAddr(vaddr), paddr, size })
+	}
+
+	pub fn vaddr(&self) -> VirtAddr {
+		self.vaddr
+	}
+
+	pub fn paddr(&self) -> PhysAddr {
+		self.paddr
+	}
+
+	/// Returns a pointer to the `T` at `offset` of the buffer
+	pub fn ptr_at<T>(&self, offset: usize) -> *mut T {
+		assert!(offset + core::mem::size_of::<T>() <= self.size);
+		(self.vaddr.0 as usize + offset) as *mut T
+	}
+
+	/// Returns the physical address of `offset` of the buffer
+	pub fn paddr_at(&self, offset: usize) -> PhysAddr {
+		assert!(offset < self.size);
+		PhysAddr(self.paddr.0 + offset as u32)
+	}
+}
+
+impl Drop for DmaBuffer {
+	fn drop(&mut self) {
+		{
+			let mut pmem = PHYS_MEM.lock();
+			let (phys_mem, page_dir) = pmem.as_mut().unwrap();
+
+			// The entries are cleared instead of unmapped, so the page tables of the region are
+			// never freed
+			for offset in (0..self.size as u32).step_by(4096) {
+				unsafe {
+					page_dir.map_raw(phys_mem, VirtAddr(self.vaddr.0 + offset), 0, true, false)
+						.expect("Failed to unmap a DMA buffer");
+				}
+			}
+			phys_mem.release_phys_mem(self.paddr, self.size);
+		}
+
+		FREE_VIRT_RANGES.lock().insert(InclusiveRange {
+			start: self.vaddr.0,
+			end: self.vaddr.0 + (self.size as u32 - 1),
+		});
+	}
+}
+
+/// Returns the index of the pool of the smallest block size which fits `size` bytes
+fn pool_index(size: usize) -> Option<usize> {
+	POOL_BLOCK_SIZES.iter().position(|&block_size| size <= block_size)
+}
+
+/// Allocates a zeroed block of at least `size` bytes from the small buffer pools. Blocks are
+/// aligned to their size, so they never cross a page. Pages added to a pool stay in it.
+pub fn allocate_block(size: usize) -> Option<DmaBlock> {
+	let pool = pool_index(size)?;
+	let block_size = POOL_BLOCK_SIZES[pool];
+
+	let mut pools = POOLS.lock();
+	if pools[pool].is_none() {
+		// Carve a new page into blocks, and link them into the free list
+		let page = DmaBuffer::allocate(4096, 4096, false)?;
+		for offset in (0..4096).step_by(block_size).rev() {
+			let block = DmaBlock {
+				vaddr: VirtAddr(page.vaddr().0 + offset as u32),
+				paddr: page.paddr_at(offset),
+			};
+			push_free_block(&mut pools[pool], block);
+		}
+		core::mem::forget(page);
+	}
+
+	let block = pools[pool].unwrap();
+	pools[pool] = unsafe { (block.vaddr.0 as *const Option<DmaBlock>).read() };
+	unsafe { core::ptr::write_bytes(block.vaddr.0 as *mut u8, 0, block_size); }
+	Some(block)
+}
+
+/// Returns `block`, which was allocated with `allocate_block(size)`, to its pool
+pub fn release_block(block: DmaBlock, size: usize) {
+	let pool = pool_index(size).expect("Released a DMA block of an invalid size");
+	push_free_block(&mut POOLS.lock()[pool], block);
+}
+
+/// Pushes `block` to the free list whose head is `head`
+fn push_free_block(head: &mut Option<DmaBlock>, block: DmaBlock) {
+	assert!(core::mem::size_of::<Option<DmaBlock>>() <= POOL_BLOCK_SIZES[0]);
+	unsafe { (block.vaddr.0 as *mut Option<DmaBlock>).write(*head); }
+	*head = Some(block);
+}
@@ -1,10 +1,101 @@
-use ext2_parser::Ext2Parser;
+use boot_args::BootArgs;
+use ext2_parser::{Ext2Parser, IterationDecision};
 use lock_cell::LockCell;
+use page_tables::{PhysAddr, VirtAddr};
 
-use crate::RAM_EXT2_FS;
+/// The virtual address where the filesystem image loaded by the bootloader is mapped
+const FS_IMAGE_VADDR: u32 = 0xCC000000;
+/// The size of the virtual region reserved for the filesystem image
+const FS_IMAGE_MAX_SIZE: u32 = 0x4000000;
 
 pub static EXT2_PARSER: LockCell<Option<Ext2Parser>> = LockCell::new(None);
 
-pub fn init() {
-	*EXT2_PARSER.lock() = Ext2Parser::parse(RAM_EXT2_FS);
-}
\ No newline at end of file
+/// Maps the filesystem image the bootloader loaded, and parses it
+pub fn init(boot_args: &BootArgs) {
+	let image_size = boot_args.fs_image_size;
+	assert!(image_size <= FS_IMAGE_MAX_SIZE, "Filesystem image is too large");
+
+	{
+		let mut pmem = crate::memory_manager::PHYS_MEM.lock();
+		let (phys_mem, page_dir) = pmem.as_mut().unwrap();
+
+		// The image is only ever read
+		for offset in (0..image_size).step_by(4096) {
+			page_dir.map_to_phys_page(phys_mem, VirtAddr(FS_IMAGE_VADDR + offset),
+				PhysAddr(boot_args.fs_image_paddr.0 + offset), false, false, false, true)
+				.expect("Failed to map the filesystem image");
+		}
+	}
+
+	let image = unsafe {
+		core::slice::from_raw_parts(FS_IMAGE_VADDR as *const u8, image_size as usize)
+	};
+	*EXT2_PARSER.lock() = Ext2Parser::parse(image);
+}
+
+/// Writes the absolute path of the directory `dir_inode` to `buf`, by walking up the `..` entries.
+/// Returns the length of the path, or `None` if `buf` is too small.
+pub fn get_directory_path(ext2_parser: &Ext2Parser, dir_inode: u32, buf: &mut [u8])
+	-> Option<usize> {
+	if dir_inode == ext2_parser::ROOT_INODE {
+		if buf.is_empty() {
+			return None;
+		} else {
+			buf[0] = b'/';
+			return Some(1);
+		}
+	}
+
+	let mut inode_walk = [0u32; 128];
+	let mut walk_index = 0;
+
+	inode_walk[0] = dir_inode;
+	while inode_walk[walk_index] != ext2_parser::ROOT_INODE {
+		assert!(walk_index + 1 < inode_walk.len());
+
+		ext2_parser.for_each_directory_entry(inode_walk[walk_index],
+			|entry_inode, entry_name, _| {
+				if entry_name == ".." {
+					inode_walk[walk_index + 1] = entry_inode;
+					IterationDecision::Break
+				} else {
+					IterationDecision::Continue
+				}
+			}
+		);
+
+		walk_index += 1;
+	}
+
+	// TODO: Calling for_each_directory_entry twice is bad, optimize this
+
+	let mut write_index = 0;
+	let mut success = true;
+	for i in (1..=walk_index).rev() {
+		ext2_parser.for_each_directory_entry(inode_walk[i],
+			|entry_inode, entry_name, _| {
+				if entry_inode == inode_walk[i-1] {
+					if write_index + entry_name.len() + 1 > buf.len() {
+						success = false;
+						return IterationDecision::Break;
+					}
+					
+					buf[write_index] = b'/';
+					write_index += 1;
+					buf[write_index..write_index + entry_name.len()].copy_from_slice(entry_name.as_bytes());
+					write_index += entry_name.len();
+
+					IterationDecision::Break
+				} else {
+					IterationDecision::Continue
+				}
+			}
+		);
+
+		if !success {
+			return None;
+		}
+	}
+
+	Some(write_index)
+}
@@ -0,0 +1,129 @@
+//! Synthetic input: injection of key events, so the shell and the TTY can be driven by a program
+//! (e.g. to benchmark them), and recording of the key events of the keyboard, so a real session
+//! can be replayed. Both are exposed as device files, which read and write `SyscallInputEvent`s.
+
+use core::sync::atomic::{AtomicU32, Ordering};
+
+use lock_cell::LockCell;
+use syscall_interface::{SyscallInputEvent, INPUT_EVENT_KEY_UP, INPUT_RECORD_START, INPUT_RECORD_STOP};
+use crate::keyboard::{self, KeyCode, KeyEvent, KeyEventType};
+
+/// The number of events the recorder can hold. Events past it are not recorded.
+const RECORDING_CAPACITY: usize = 4096;
+
+struct Recorder {
+	recording: bool,
+	events: [SyscallInputEvent; RECORDING_CAPACITY],
+	len: usize,
+}
+
+/// The recording of the key events of the keyboard. The lock masks interrupts, so the keyboard
+/// interrupt can't record while the recording is read.
+static RECORDER: LockCell<Recorder> = LockCell::new(Recorder {
+	recording: false,
+	events: [SyscallInputEvent { key_code: 0, flags: 0, ascii: 0, reserved: 0 }; RECORDING_CAPACITY],
+	len: 0,
+});
+
+/// Total number of injected events
+static INJECTED_EVENTS: AtomicU32 = AtomicU32::new(0);
+/// Total number of injected events which were dropped because the events queue was full
+static DROPPED_EVENTS: AtomicU32 = AtomicU32::new(0);
+
+/// Returns the total number of injected events and the number of them which were dropped
+#[allow(unused)]
+pub fn get_stats() -> (u32, u32) {
+	(INJECTED_EVENTS.load(Ordering::Relaxed), DROPPED_EVENTS.load(Ordering::Relaxed))
+}
+
+/// Adds `event`, an event of the keyboard, to the recording if recording is on
+pub fn record_event(event: &KeyEvent) {
+	let mut recorder = RECORDER.lock();
+	if !recorder.recording || recorder.len == RECORDING_CAPACITY {
+		return;
+	}
+
+	let idx = recorder.len;
+	recorder.events[idx] = SyscallInputEvent {
+		key_code: event.key_code as u8,
+		flags: if event.event_type == KeyEventType::KeyUp { INPUT_EVENT_KEY_UP } else { 0 },
+		ascii: event.as_ascii().unwrap_or(0),
+		reserved: 0,
+	};
+	recorder.len += 1;
+}
+
+/// Injects the events in `buf`, which holds a sequence of `SyscallInputEvent`s, into the keyboard
+/// events queue. Stops at the first invalid event or when the queue is full. Returns the number of
+/// bytes of the events which were injected.
+pub fn inject(buf: &[u8]) -> usize {
+	let event_size = core::mem::size_of::<SyscallInputEvent>();
+
+	// Interrupts are masked so the keyboard interrupt doesn't push events while we do
+	let unmask_interrupts = cpu::get_if();
+	if unmask_interrupts {
+		unsafe { cpu::cli(); }
+	}
+
+	let mut injected = 0;
+	for raw_event in buf.chunks_exact(event_size) {
+		let key_code = match KeyCode::from_u8(raw_event[0]) {
+			Some(key_code) => key_code,
+			None => break,
+		};
+		let event_type = if (raw_event[1] & INPUT_EVENT_KEY_UP) != 0 {
+			KeyEventType::KeyUp
+		} else {
+			KeyEventType::KeyDown
+		};
+
+		if !keyboard::inject_event(key_code, event_type) {
+			DROPPED_EVENTS.fetch_add(1, Ordering::Relaxed);
+			break;
+		}
+		injected += 1;
+	}
+
+	if unmask_interrupts {
+		unsafe { cpu::sti(); }
+	}
+
+	INJECTED_EVENTS.fetch_add(injected as u32, Ordering::Relaxed);
+	injected * event_size
+}
+
+/// Copies the recorded events starting at byte `offset` of the recording to `buf`. Only whole
+/// events are copied. Returns the number of bytes copied.
+pub fn read_recording(buf: &mut [u8], offset: usize) -> usize {
+	let event_size = core::mem::size_of::<SyscallInputEvent>();
+
+	let recorder = RECORDER.lock();
+	let first_event = (offset / event_size).min(recorder.len);
+	let event_count = (buf.len() / event_size).min(recorder.len - first_event);
+
+	let events = &recorder.events[first_event..first_event + event_count];
+	for (raw_event, event) in buf.chunks_exact_mut(event_size).zip(events.iter()) {
+		raw_event.copy_from_slice(&[event.key_code, event.flags, event.ascii, event.reserved]);
+	}
+
+	event_count * event_size
+}
+
+/// Handles a control command written to the recorder: `INPUT_RECORD_START` discards the recording
+/// and starts a new one, and `INPUT_RECORD_STOP` stops recording. Returns the number of bytes of
+/// `buf` which were handled.
+pub fn control_recording(buf: &[u8]) -> usize {
+	let mut recorder = RECORDER.lock();
+	for (idx, &command) in buf.iter().enumerate() {
+		match command {
+			INPUT_RECORD_START => {
+				recorder.recording = true;
+				recorder.len = 0;
+			},
+			INPUT_RECORD_STOP => recorder.recording = false,
+			_ => return idx,
+		}
+	}
+
+	buf.len()
+}
@@ -1,15 +1,26 @@
 //! Interrupts initialization and handling
 
+pub mod deferred;
 mod pic_8259a;
-mod pit_8254;
+pub mod pit_8254;
+pub mod stats;
 
-use core::arch::asm;
+use core::arch::global_asm;
+use core::sync::atomic::{AtomicUsize, Ordering};
 use cpu::PushADRegisterState;
 use exclusive_cell::ExclusiveCell;
 use crate::{gdt::KERNEL_CS_SELECTOR, syscall::Syscall};
 use serial::println;
 
 const IDT_ENTRIES: usize = 256;
+/// The size of each entry stub, which are laid out one after the other by vector number
+const INTERRUPT_STUB_SIZE: u32 = 16;
+/// The vector of the syscall interrupt
+const SYSCALL_VECTOR: u8 = 0x67;
+/// Bitmap of the exception vectors for which the CPU pushes an error code: #DF, #TS, #NP, #SS,
+/// #GP, #PF, #AC, #CP, #VC and #SX
+const ERROR_CODE_VECTORS: u32 = (1 << 8) | (1 << 10) | (1 << 11) | (1 << 12) | (1 << 13) |
+    (1 << 14) | (1 << 17) | (1 << 21) | (1 << 29) | (1 << 30);
 
 /// Struct to wrap IDT entries to so we can set the alignment to 8 bytes (best performance according
 /// to the Intel manual)
@@ -25,90 +36,25 @@ pub fn init() {
 
     assert!((idt.as_ptr() as usize) & 7 == 0);
 
-    // Setup the descriptors for exceptions
-    idt[0] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_0_handler as u32, 0, true,
-        DescriptorType::Interrupt);
-    idt[1] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_1_handler as u32, 0, true,
-        DescriptorType::Interrupt);
-    idt[2] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_2_handler as u32, 0, true,
-        DescriptorType::Interrupt);
-    idt[3] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_3_handler as u32, 3, true,
-        DescriptorType::Interrupt);
-    idt[4] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_4_handler as u32, 3, true,
-        DescriptorType::Interrupt);
-    idt[5] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_5_handler as u32, 0, true,
-        DescriptorType::Interrupt);
-    idt[6] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_6_handler as u32, 0, true,
-        DescriptorType::Interrupt);
-    idt[7] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_7_handler as u32, 0, true,
-        DescriptorType::Interrupt);
-    
+    // Every vector enters through its stub, which builds a `TrapFrame` and dispatches to the
+    // handler registered for the vector. Breakpoints, overflows and syscalls can be raised by
+    // user-mode, and syscalls are taken with interrupts unmasked.
     // TODO: Use a task gate for the double fault handler so we can handle kernel stack corruptino
-    idt[8] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_8_handler as u32, 0, true,
-        DescriptorType::Interrupt);
-
-    idt[9] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_9_handler as u32, 0, true,
-        DescriptorType::Interrupt);
-    idt[10] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_10_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[11] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_11_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[12] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_12_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[13] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_13_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[14] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_14_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[16] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_16_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[17] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_17_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[18] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_18_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[19] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_19_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[20] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_20_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[21] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_21_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    
-    // Setup the descriptor for the 8259A PICs
-    idt[32] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_32_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[33] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_33_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[34] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_34_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[35] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_35_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[36] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_36_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[37] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_37_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[38] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_38_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[39] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_39_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[40] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_40_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[41] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_41_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[42] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_42_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[43] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_43_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[44] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_44_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[45] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_45_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[46] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_46_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    idt[47] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_47_handler as u32, 0,
-        true, DescriptorType::Interrupt);
-    
-    // Setup the descriptor for syscalls
-    idt[0x67] = IDTEntry::new(KERNEL_CS_SELECTOR, interrupt_103_handler as u32, 3,
-        true, DescriptorType::Trap);
+    for (vector, entry) in idt.iter_mut().enumerate() {
+        let stub = interrupt_stubs as u32 + (vector as u32) * INTERRUPT_STUB_SIZE;
+        let (privilege, typ) = match vector as u8 {
+            3 | 4 => (3, DescriptorType::Interrupt),
+            SYSCALL_VECTOR => (3, DescriptorType::Trap),
+            _ => (0, DescriptorType::Interrupt),
+        };
+        *entry = IDTEntry::new(KERNEL_CS_SELECTOR, stub, privilege, true, typ);
+    }
+
+    register_handler(14, |frame| unsafe { crate::page_fault::handle_page_fault(frame) });
+    register_handler(SYSCALL_VECTOR, syscall_interrupt_handler);
+    register_handler(pic_8259a::PIC_IRQ_OFFSET, |_| unsafe { pit_8254::handle_interrupt() });
+    register_handler(pic_8259a::PIC_IRQ_OFFSET + 1, |_| crate::ps2::controller::handle_interrupt());
+    register_handler(pic_8259a::PIC_IRQ_OFFSET + 12, |_| crate::ps2::controller::handle_interrupt());
 
     // Load the IDT
     unsafe {
@@ -154,33 +100,118 @@ impl IDTEntry {
     }
 }
 
-/// General interrupt handler, each interrupt lands here after going through its specific gate
-unsafe extern "cdecl" fn interrupt_handler(interrupt_number: u32, error_code: u32, eip: u32) {
-    let interrupt_number = interrupt_number as u8;
-    
-    if (pic_8259a::PIC_IRQ_OFFSET..pic_8259a::PIC_IRQ_OFFSET + 16).contains(&interrupt_number) {
-        let irq = interrupt_number - pic_8259a::PIC_IRQ_OFFSET;
+/// The state of the interrupted code, as saved by the entry stubs. The same frame is built for
+/// every vector.
+#[derive(Debug)]
+#[repr(C)]
+pub struct TrapFrame {
+    pub registers: PushADRegisterState,
+    pub vector: u32,
+    /// The error code pushed by the CPU, or zero for vectors without one
+    pub error_code: u32,
+    pub eip: u32,
+    pub cs: u32,
+    pub eflags: u32,
+    /// Only valid if the interrupt happened in user-mode
+    pub user_esp: u32,
+    /// Only valid if the interrupt happened in user-mode
+    pub user_ss: u32,
+}
+
+/// A handler for an interrupt vector. The handler of an IRQ doesn't need to send the EOI.
+pub type InterruptHandler = fn(&mut TrapFrame);
+
+/// The address of the handler registered for each vector, zero if none is registered
+static HANDLERS: [AtomicUsize; IDT_ENTRIES] = {
+    const NO_HANDLER: AtomicUsize = AtomicUsize::new(0);
+    [NO_HANDLER; IDT_ENTRIES]
+};
+
+/// Registers `handler` as the handler of interrupts with the vector `vector`, replacing the
+/// handler which was registered for it. Returns the replaced handler.
+pub fn register_handler(vector: u8, handler: InterruptHandler) -> Option<InterruptHandler> {
+    let previous = HANDLERS[vector as usize].swap(handler as usize, Ordering::AcqRel);
+    get_handler_from_addr(previous)
+}
+
+/// Registers `handler` as the handler of the PIC IRQ `irq`, for devices whose IRQ is only known at
+/// runtime (e.g. PCI devices). Handlers are not chained, so if another handler is already
+/// registered for the IRQ it is kept and false is returned. Registering the same handler again
+/// succeeds.
+pub fn register_irq_handler(irq: u8, handler: InterruptHandler) -> bool {
+    assert!(irq < 16);
+    let vector = (pic_8259a::PIC_IRQ_OFFSET + irq) as usize;
+    match HANDLERS[vector].compare_exchange(0, handler as usize, Ordering::AcqRel,
+        Ordering::Acquire) {
+        Ok(_) => true,
+        Err(existing) => existing == handler as usize,
+    }
+}
+
+/// Removes the handler of interrupts with the vector `vector`. Returns the removed handler.
+#[allow(unused)]
+pub fn unregister_handler(vector: u8) -> Option<InterruptHandler> {
+    let previous = HANDLERS[vector as usize].swap(0, Ordering::AcqRel);
+    get_handler_from_addr(previous)
+}
+
+/// Converts an address stored in `HANDLERS` back to the handler
+fn get_handler_from_addr(addr: usize) -> Option<InterruptHandler> {
+    if addr == 0 {
+        None
+    } else {
+        // SAFETY: Only `InterruptHandler`s are stored in `HANDLERS`
+        Some(unsafe { core::mem::transmute::<usize, InterruptHandler>(addr) })
+    }
+}
+
+/// Called by the entry stubs with the frame of every interrupt. Calls the handler registered for
+/// the vector, and for IRQs also handles spurious IRQs, sends the EOI and runs the deferred work.
+/// Pending signals are delivered before returning to user-mode.
+unsafe extern "cdecl" fn dispatch_interrupt(frame: &mut TrapFrame) {
+    let start_cycles = cpu::serializing_rdtsc();
+    let vector = frame.vector as u8;
+    let handler = get_handler_from_addr(HANDLERS[vector as usize].load(Ordering::Acquire));
+    stats::record_raised(vector);
+
+    if (pic_8259a::PIC_IRQ_OFFSET..pic_8259a::PIC_IRQ_OFFSET + 16).contains(&vector) {
+        let irq = vector - pic_8259a::PIC_IRQ_OFFSET;
         if pic_8259a::handle_spurious_irq(irq) {
-            println!("WARNING: Spurious PIC IRQ {}!", irq);
-            return;
-        }
-        
-        if irq == 0 {
-            pit_8254::handle_interrupt();
-        } else if irq == 1 || irq == 12 {
-            crate::ps2::controller::handle_interrupt();
+            deferred::queue(deferred::WorkItem::SpuriousIRQ(irq));
         } else {
-            println!("PIC IRQ {}", irq);
+            // The handlers only acknowledge the device and queue the rest of the work, which runs
+            // after the EOI with interrupts unmasked
+            match handler {
+                Some(handler) => handler(frame),
+                None => deferred::queue(deferred::WorkItem::UnhandledIRQ(irq)),
+            }
+            
+            pic_8259a::send_eoi(irq);
         }
-        
-        pic_8259a::send_eoi(irq);
-        return;
+
+        // The time spent with interrupts masked, the deferred work is measured separately
+        stats::record_handled(vector, cpu::serializing_rdtsc() - start_cycles);
+        deferred::run_pending();
+    } else {
+        match handler {
+            Some(handler) => handler(frame),
+            None => unhandled_exception(frame),
+        }
+        stats::record_handled(vector, cpu::serializing_rdtsc() - start_cycles);
     }
-    
+
+    if (frame.cs & 3) == 3 {
+        crate::signal::deliver_pending(frame);
+    }
+}
+
+/// Handles an interrupt which has no handler
+fn unhandled_exception(frame: &TrapFrame) -> ! {
     // FIXME: This will dead-lock if the exception happened while the serial lock is held
-    println!("Handling interrupt {} with code={} eip={:#010x}", interrupt_number, error_code, eip);
+    println!("Handling interrupt {} with code={} eip={:#010x}", frame.vector, frame.error_code,
+        frame.eip);
 
-    match interrupt_number {
+    match frame.vector {
         0 => panic!("Divide Error Exception (#DE)"),
         1 => panic!("Debug Exception (#DB)"),
         2 => panic!("NMI Interrupt"),
@@ -195,287 +226,83 @@ unsafe extern "cdecl" fn interrupt_handler(interrupt_number: u32, error_code: u3
         11 => panic!("Segment Not Present (#NP)"),
         12 => panic!("Stack Fault Exception (#SS)"),
         13 => panic!("General Protection Exception (#GP)"),
-        14 => panic!("Page-Fault Exception (#PF) CR2={:#010x}", cpu::get_cr2()),
+        14 => panic!("Page Fault Exception (#PF)"),
         16 => panic!("x87 FPU Floating-Point Error (#MF) StatusRegister={:#0b}", cpu::get_x87_fpu_status()),
         17 => panic!("Alignment Check Exception (#AC)"),
         18 => panic!("Machine-Check Exception (#MC)"),
         19 => panic!("SIMD Floating-Point Exception (#XM)"),
         20 => panic!("Virtualization Exception (#VE)"),
         21 => panic!("Control Protection Exception (#CP)"),
-        _ => panic!("Unrecognized Interrupt {}", interrupt_number)
+        _ => panic!("Unrecognized Interrupt {}", frame.vector)
     }
 }
 
 /// Syscall interrupt handler, int 0x67 lands here
-unsafe extern "cdecl" fn syscall_interrupt_handler(esp: u32, eflags: u32, return_eip: u32,
-    register_state: &mut PushADRegisterState) {
-    // Syscall number in eax, args 1 to 3 are in ebx, ecx, edx
-    // crate::println!("Syscall {:?} eip={:#X} esp={:#X} eflags={:#b}", register_state, return_eip, esp, eflags);
+fn syscall_interrupt_handler(frame: &mut TrapFrame) {
+    // Syscall number in eax, args 1 to 6 are in ebx, ecx, edx, esi, edi, ebp
+    // crate::println!("Syscall {:?} eip={:#X} esp={:#X} eflags={:#b}", frame.registers, frame.eip, frame.user_esp, frame.eflags);
 
     // We need to save the register state, because if this is a fork we want to clone the correct
     // registers
-    let mut user_register_state = *register_state;
-    user_register_state.esp = esp;
-    crate::process::set_current_register_state(return_eip, eflags, user_register_state);
-
-    let syscall = Syscall::from_u32(register_state.eax).unwrap();
+    let mut user_register_state = frame.registers;
+    user_register_state.esp = frame.user_esp;
+    crate::process::set_current_register_state(frame.eip, frame.eflags, user_register_state);
 
-    // crate::println!("Syscall {:?}({:#X}, {:#X}, {:#X}) [from pid={} at {:#X}]", syscall,
-    //     register_state.ebx, register_state.ecx, register_state.edx,
-    //     crate::process::SCHEDULER_STATE.lock().current_process, return_eip);
-
-    let return_value = crate::syscall::handle_syscall(syscall, register_state.ebx, register_state.ecx, register_state.edx);
-    register_state.eax = return_value as u32;
-}
+    let syscall = frame.registers.eax;
 
-macro_rules! int_asm_no_err_code {
-    ($x:literal) => {
-        asm!("
-                push eax                // Save `cdecl` caller-saved registers on the stack
-                push ecx
-                push edx
-                mov eax, [esp + 12]     // Grab the return eip from the interrupt frame
-                push eax                // Push arg 3: the interrupt's return eip
-                push dword ptr 0        // Push arg 2: the fake error code
-                push dword ptr {int_no} // Push arg 1: the interrupt number
-                call {int_handler}      // Call the handler function
-                add esp, 12             // Pop the interrupt number, the error code, and the ret eip
-                pop edx                 // Restore caller-saved registers
-                pop ecx
-                pop eax
-                iretd                   // Return from the interrupt
-            ",
-            int_no = const $x,
-            int_handler = sym interrupt_handler,
-            options(noreturn)
-        );
-    }
-}
-
-macro_rules! int_asm_err_code {
-    ($x:literal) => {
-        asm!("
-                push eax                // Save `cdecl` caller-saved registers on the stack
-                push ecx
-                push edx
-                mov eax, [esp + 16]     // Grab the return eip from the interrupt frame
-                mov ecx, [esp + 12]     // Grab the interrupt error code
-                push eax                // Push arg 3: the interrupt's return eip
-                push ecx                // Push arg 2: the error code
-                push dword ptr {int_no} // Push arg 1: the interrupt number
-                call {int_handler}      // Call the handler function
-                add esp, 12             // Pop the interrupt number, the error code, and the ret eip
-                pop edx                 // Restore caller-saved registers
-                pop ecx
-                pop eax
-                iretd                   // Return from the interrupt
-            ",
-            int_no = const $x,
-            int_handler = sym interrupt_handler,
-            options(noreturn)
-        );
+    // Returning from a signal handler replaces the whole user state, including eax
+    if syscall == Syscall::SigReturn as u32 {
+        crate::signal::sigreturn(frame);
+        return;
     }
-}
-
-#[naked]
-unsafe extern fn interrupt_0_handler() -> ! {
-    int_asm_no_err_code!(0);
-}
-
-#[naked]
-unsafe extern fn interrupt_1_handler() -> ! {
-    int_asm_no_err_code!(1);
-}
-
-#[naked]
-unsafe extern fn interrupt_2_handler() -> ! {
-    int_asm_no_err_code!(2);
-}
-
-#[naked]
-unsafe extern fn interrupt_3_handler() -> ! {
-    int_asm_no_err_code!(3);
-}
-
-#[naked]
-unsafe extern fn interrupt_4_handler() -> ! {
-    int_asm_no_err_code!(4);
-}
-
-#[naked]
-unsafe extern fn interrupt_5_handler() -> ! {
-    int_asm_no_err_code!(5);
-}
-
-#[naked]
-unsafe extern fn interrupt_6_handler() -> ! {
-    int_asm_no_err_code!(6);
-}
-
-#[naked]
-unsafe extern fn interrupt_7_handler() -> ! {
-    int_asm_no_err_code!(7);
-}
-
-#[naked]
-unsafe extern fn interrupt_8_handler() -> ! {
-    int_asm_err_code!(8);
-}
-
-#[naked]
-unsafe extern fn interrupt_9_handler() -> ! {
-    int_asm_no_err_code!(9);
-}
 
-#[naked]
-unsafe extern fn interrupt_10_handler() -> ! {
-    int_asm_err_code!(10);
-}
-
-#[naked]
-unsafe extern fn interrupt_11_handler() -> ! {
-    int_asm_err_code!(11);
-}
-
-#[naked]
-unsafe extern fn interrupt_12_handler() -> ! {
-    int_asm_err_code!(12);
-}
-
-#[naked]
-unsafe extern fn interrupt_13_handler() -> ! {
-    int_asm_err_code!(13);
-}
-
-#[naked]
-unsafe extern fn interrupt_14_handler() -> ! {
-    int_asm_err_code!(14);
-}
-
-#[naked]
-unsafe extern fn interrupt_16_handler() -> ! {
-    int_asm_no_err_code!(16);
-}
-
-#[naked]
-unsafe extern fn interrupt_17_handler() -> ! {
-    int_asm_err_code!(17);
-}
-
-#[naked]
-unsafe extern fn interrupt_18_handler() -> ! {
-    int_asm_no_err_code!(18);
-}
-
-#[naked]
-unsafe extern fn interrupt_19_handler() -> ! {
-    int_asm_no_err_code!(19);
-}
-
-#[naked]
-unsafe extern fn interrupt_20_handler() -> ! {
-    int_asm_no_err_code!(20);
-}
-
-#[naked]
-unsafe extern fn interrupt_21_handler() -> ! {
-    int_asm_err_code!(21);
-}
-
-#[naked]
-unsafe extern fn interrupt_32_handler() -> ! {
-    int_asm_no_err_code!(32);
-}
-
-#[naked]
-unsafe extern fn interrupt_33_handler() -> ! {
-    int_asm_no_err_code!(33);
-}
-
-#[naked]
-unsafe extern fn interrupt_34_handler() -> ! {
-    int_asm_no_err_code!(34);
-}
-
-#[naked]
-unsafe extern fn interrupt_35_handler() -> ! {
-    int_asm_no_err_code!(35);
-}
-
-#[naked]
-unsafe extern fn interrupt_36_handler() -> ! {
-    int_asm_no_err_code!(36);
-}
-
-#[naked]
-unsafe extern fn interrupt_37_handler() -> ! {
-    int_asm_no_err_code!(37);
-}
-
-#[naked]
-unsafe extern fn interrupt_38_handler() -> ! {
-    int_asm_no_err_code!(38);
-}
-
-#[naked]
-unsafe extern fn interrupt_39_handler() -> ! {
-    int_asm_no_err_code!(39);
-}
-
-#[naked]
-unsafe extern fn interrupt_40_handler() -> ! {
-    int_asm_no_err_code!(40);
-}
-
-#[naked]
-unsafe extern fn interrupt_41_handler() -> ! {
-    int_asm_no_err_code!(41);
-}
-
-#[naked]
-unsafe extern fn interrupt_42_handler() -> ! {
-    int_asm_no_err_code!(42);
-}
-
-#[naked]
-unsafe extern fn interrupt_43_handler() -> ! {
-    int_asm_no_err_code!(43);
-}
-
-#[naked]
-unsafe extern fn interrupt_44_handler() -> ! {
-    int_asm_no_err_code!(44);
-}
-
-#[naked]
-unsafe extern fn interrupt_45_handler() -> ! {
-    int_asm_no_err_code!(45);
-}
-
-#[naked]
-unsafe extern fn interrupt_46_handler() -> ! {
-    int_asm_no_err_code!(46);
-}
-
-#[naked]
-unsafe extern fn interrupt_47_handler() -> ! {
-    int_asm_no_err_code!(47);
-}
-
-#[naked]
-unsafe extern fn interrupt_103_handler() -> ! {
-    asm!("
-            pushad
-            push esp                  // Function argument: the pushad register state
-            push dword ptr [esp + 36] // Function argument: the return eip
-            push dword ptr [esp + 48] // Function argument: the user eflags
-            push dword ptr [esp + 56] // Function argument: the user esp
-            call {int_handler}        // Call the handler function
-            add esp, 16               // Pop the arguments
-            popad
-            iretd                     // Return from the interrupt
-        ",
-        int_handler = sym syscall_interrupt_handler,
-        options(noreturn)
-    );
-}
\ No newline at end of file
+    // crate::println!("Syscall {:?}({:#X}, {:#X}, {:#X}) [from pid={} at {:#X}]", syscall,
+    //     frame.registers.ebx, frame.registers.ecx, frame.registers.edx,
+    //     crate::process::SCHEDULER_STATE.lock().current_process, frame.eip);
+
+    let registers = &frame.registers;
+    let args = [registers.ebx, registers.ecx, registers.edx, registers.esi, registers.edi,
+        registers.ebp];
+    let return_value = crate::syscall::handle_syscall(syscall, args);
+    frame.registers.eax = return_value as u32;
+}
+
+extern "C" {
+    /// The entry stubs of all the vectors, `INTERRUPT_STUB_SIZE` bytes each. Not a real function.
+    fn interrupt_stubs();
+}
+
+// The entry stub of each vector pushes a fake error code if the CPU doesn't push one, pushes the
+// vector number, and jumps to the common entry which saves the registers and calls
+// `dispatch_interrupt` with the resulting `TrapFrame`
+global_asm!("
+        .global interrupt_stubs
+        .p2align 4
+        interrupt_stubs:
+        .set interrupt_vector, 0
+        .rept 256
+            .p2align 4
+            .if interrupt_vector < 32
+                .if (({error_code_vectors} >> interrupt_vector) & 1) == 0
+                    push 0              // Push the fake error code
+                .endif
+            .else
+                push 0                  // Push the fake error code
+            .endif
+            push interrupt_vector       // Push the vector number
+            jmp 2f
+            .set interrupt_vector, interrupt_vector + 1
+        .endr
+
+    2:
+        pushad                          // Save the general purpose registers
+        push esp                        // Function argument: the trap frame
+        call {dispatch}                 // Call the dispatcher
+        add esp, 4                      // Pop the argument
+        popad                           // Restore the (possibly modified) registers
+        add esp, 8                      // Pop the vector number and the error code
+        iretd                           // Return from the interrupt
+    ",
+    error_code_vectors = const ERROR_CODE_VECTORS,
+    dispatch = sym dispatch_interrupt,
+);
@@ -0,0 +1,141 @@
+//! Deferred interrupt work. The IRQ handlers (the top halves) only acknowledge their device and
+//! queue a work item, and the work itself (the bottom half) runs after the EOI with interrupts
+//! unmasked, before the interrupt returns to the code it interrupted.
+
+use core::fmt::{self, Write};
+use core::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, Ordering};
+
+use lock_cell::LockCell;
+use serial::println;
+
+/// The number of work items which can wait to run
+const WORK_QUEUE_CAPACITY: usize = 128;
+
+/// Work queued by an IRQ handler
+#[derive(Clone, Copy, Debug)]
+pub enum WorkItem {
+	/// A PIT interrupt happened
+	TimerTick,
+	/// A message was read from the PS/2 controller, along with the status register it was read with
+	PS2Message { status: u8, message: u8 },
+	/// The PIC raised a spurious IRQ
+	SpuriousIRQ(u8),
+	/// An IRQ without a handler happened
+	UnhandledIRQ(u8),
+	/// A virtio block device completed requests
+	BlockCompletion,
+}
+
+/// A ring of work items waiting to run, oldest first
+struct WorkQueue {
+	items: [WorkItem; WORK_QUEUE_CAPACITY],
+	head: usize,
+	len: usize,
+}
+
+/// The queued work items. The lock masks interrupts, so an IRQ handler can't queue while the
+/// bottom half takes an item.
+static WORK_QUEUE: LockCell<WorkQueue> = LockCell::new(WorkQueue {
+	items: [WorkItem::TimerTick; WORK_QUEUE_CAPACITY],
+	head: 0,
+	len: 0,
+});
+
+/// Whether an interrupt is running the queued work, in which case interrupts which nest in it only
+/// queue their work
+static RUNNING: AtomicBool = AtomicBool::new(false);
+
+/// Number of work items which ran
+static ITEMS_RUN: AtomicU32 = AtomicU32::new(0);
+/// Number of work items which were dropped because the queue was full
+static ITEMS_DROPPED: AtomicU32 = AtomicU32::new(0);
+/// Total number of cycles spent running work items
+static WORK_CYCLES: AtomicU64 = AtomicU64::new(0);
+/// Largest number of cycles a single work item ran for
+static MAX_WORK_CYCLES: AtomicU64 = AtomicU64::new(0);
+
+/// Queues `item` to run after the current interrupt is acknowledged. Must be called with interrupts
+/// masked.
+pub fn queue(item: WorkItem) {
+	let mut queue = WORK_QUEUE.lock();
+	if queue.len == WORK_QUEUE_CAPACITY {
+		ITEMS_DROPPED.fetch_add(1, Ordering::Relaxed);
+		return;
+	}
+
+	let idx = (queue.head + queue.len) % WORK_QUEUE_CAPACITY;
+	queue.items[idx] = item;
+	queue.len += 1;
+}
+
+/// Removes the oldest queued work item
+fn take() -> Option<WorkItem> {
+	let mut queue = WORK_QUEUE.lock();
+	if queue.len == 0 {
+		return None;
+	}
+
+	let item = queue.items[queue.head];
+	queue.head = (queue.head + 1) % WORK_QUEUE_CAPACITY;
+	queue.len -= 1;
+	Some(item)
+}
+
+/// Runs the queued work items with interrupts unmasked, until none are left. Must be called at the
+/// end of an IRQ handler, after the EOI. Only the outermost interrupt runs the work, so work items
+/// never nest and run in the order they were queued. Returns with interrupts masked.
+pub fn run_pending() {
+	if RUNNING.swap(true, Ordering::Acquire) {
+		return;
+	}
+
+	loop {
+		// The queue is checked with interrupts masked, so no item can be queued after we saw the
+		// queue empty and before we stop running
+		unsafe { cpu::cli(); }
+		let item = match take() {
+			Some(item) => item,
+			None => break,
+		};
+		unsafe { cpu::sti(); }
+
+		let start_cycles = cpu::serializing_rdtsc();
+		run(item);
+		let cycles = cpu::serializing_rdtsc() - start_cycles;
+
+		ITEMS_RUN.fetch_add(1, Ordering::Relaxed);
+		WORK_CYCLES.fetch_add(cycles, Ordering::Relaxed);
+		MAX_WORK_CYCLES.fetch_max(cycles, Ordering::Relaxed);
+	}
+
+	RUNNING.store(false, Ordering::Release);
+}
+
+/// Runs the bottom half of a work item
+fn run(item: WorkItem) {
+	match item {
+		WorkItem::TimerTick => {
+			super::pit_8254::handle_deferred_tick();
+			crate::ps2::controller::handle_timer_tick();
+			crate::ksm::handle_timer_tick();
+			crate::reaper::handle_timer_tick();
+			crate::page_fault::handle_timer_tick();
+		},
+		WorkItem::PS2Message { status, message } => {
+			crate::ps2::controller::handle_message(status, message);
+		},
+		WorkItem::SpuriousIRQ(irq) => println!("WARNING: Spurious PIC IRQ {}!", irq),
+		WorkItem::UnhandledIRQ(irq) => println!("PIC IRQ {}", irq),
+		WorkItem::BlockCompletion => crate::virtio_blk::handle_completions(),
+	}
+}
+
+/// Writes the counters of the deferred work
+pub fn write_stats(out: &mut impl Write) -> fmt::Result {
+	let items_run = ITEMS_RUN.load(Ordering::Relaxed);
+	let work_cycles = WORK_CYCLES.load(Ordering::Relaxed);
+	writeln!(out, "Deferred work: {} items run ({} dropped), {} cycles total, {} average, {} max",
+		items_run, ITEMS_DROPPED.load(Ordering::Relaxed), work_cycles,
+		work_cycles.checked_div(items_run as u64).unwrap_or(0),
+		MAX_WORK_CYCLES.load(Ordering::Relaxed))
+}
@@ -41,12 +41,34 @@ pub fn init() {
 
 pub static CURRENT_UNIX_TIME: AtomicU32 = AtomicU32::new(0);
 static ONLINE_TIME: ExclusiveCell<f64> = ExclusiveCell::new(0.0);
+/// The number of PIT interrupts since the PIT was initialized
+static TICKS: AtomicU32 = AtomicU32::new(0);
 
-// Handles an interrupt from the PIT (should only be called when an interrupt happens)
+/// Returns the number of PIT interrupts since the PIT was initialized. Wraps around.
+pub fn get_ticks() -> u32 {
+	TICKS.load(Ordering::Relaxed)
+}
+
+/// Returns the number of PIT interrupts which take at least `ms` milliseconds
+pub fn ms_to_ticks(ms: u32) -> u32 {
+	let ticks = (ms as f64) * REAL_FREQ_HZ / 1000f64;
+	let whole_ticks = ticks as u32;
+	if (whole_ticks as f64) < ticks { whole_ticks + 1 } else { whole_ticks }
+}
+
+// Handles an interrupt from the PIT (should only be called when an interrupt happens). The time is
+// updated by the deferred work it queues.
 pub unsafe fn handle_interrupt() {
+	TICKS.fetch_add(1, Ordering::Relaxed);
+	super::deferred::queue(super::deferred::WorkItem::TimerTick);
+}
+
+/// Updates the time following a PIT interrupt. Must only be called from the deferred work of the
+/// PIT interrupt.
+pub fn handle_deferred_tick() {
 	let mut online_time = ONLINE_TIME.acquire();
 	*online_time += 1f64/REAL_FREQ_HZ;
 
 	let boot_time = crate::time::BOOT_UNIX_TIME.load(Ordering::Relaxed);
 	CURRENT_UNIX_TIME.store(boot_time + (*online_time as u32), Ordering::Relaxed);
-}
\ No newline at end of file
+}
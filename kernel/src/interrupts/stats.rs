@@ -0,0 +1,93 @@
+//! Per-vector interrupt statistics, collected by the common interrupt path: how many times each
+//! vector was raised, and how many cycles its handler took
+
+use core::fmt::{self, Write};
+use core::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+
+use super::{pic_8259a::PIC_IRQ_OFFSET, IDT_ENTRIES, SYSCALL_VECTOR};
+
+/// The counters of a single vector
+struct VectorStats {
+	/// Number of times the vector was raised
+	count: AtomicU32,
+	/// Total cycles its handler took, for the handlers which returned
+	total_cycles: AtomicU64,
+	/// Largest number of cycles a single call of its handler took
+	max_cycles: AtomicU64,
+}
+
+static STATS: [VectorStats; IDT_ENTRIES] = {
+	const NO_STATS: VectorStats = VectorStats {
+		count: AtomicU32::new(0),
+		total_cycles: AtomicU64::new(0),
+		max_cycles: AtomicU64::new(0),
+	};
+	[NO_STATS; IDT_ENTRIES]
+};
+
+/// Counts an interrupt with the vector `vector`. Called when the interrupt is raised, as some
+/// handlers (e.g. of an `exit` syscall) never return.
+#[inline]
+pub fn record_raised(vector: u8) {
+	STATS[vector as usize].count.fetch_add(1, Ordering::Relaxed);
+}
+
+/// Records that the handler of an interrupt with the vector `vector` returned after `cycles` cycles
+#[inline]
+pub fn record_handled(vector: u8, cycles: u64) {
+	let stats = &STATS[vector as usize];
+	stats.total_cycles.fetch_add(cycles, Ordering::Relaxed);
+	stats.max_cycles.fetch_max(cycles, Ordering::Relaxed);
+}
+
+/// Returns a short description of the vector `vector`
+fn vector_name(vector: u8) -> &'static str {
+	const EXCEPTION_NAMES: [&str; 22] = ["#DE divide error", "#DB debug", "NMI", "#BP breakpoint",
+		"#OF overflow", "#BR bound range", "#UD invalid opcode", "#NM device not available",
+		"#DF double fault", "coprocessor segment overrun", "#TS invalid TSS",
+		"#NP segment not present", "#SS stack fault", "#GP general protection", "#PF page fault",
+		"reserved", "#MF x87 floating-point", "#AC alignment check", "#MC machine check",
+		"#XM SIMD floating-point", "#VE virtualization", "#CP control protection"];
+
+	if let Some(name) = EXCEPTION_NAMES.get(vector as usize) {
+		return name;
+	}
+
+	match vector {
+		SYSCALL_VECTOR => "syscall",
+		_ if vector == PIC_IRQ_OFFSET => "IRQ 0 (PIT)",
+		_ if vector == PIC_IRQ_OFFSET + 1 => "IRQ 1 (PS/2 keyboard)",
+		_ if vector == PIC_IRQ_OFFSET + 7 => "IRQ 7 (spurious)",
+		_ if vector == PIC_IRQ_OFFSET + 12 => "IRQ 12 (PS/2 mouse)",
+		_ if vector == PIC_IRQ_OFFSET + 15 => "IRQ 15 (spurious)",
+		_ if (PIC_IRQ_OFFSET..PIC_IRQ_OFFSET + 16).contains(&vector) => "IRQ",
+		_ => "",
+	}
+}
+
+/// Writes a table of the counters of every vector which was raised, followed by the counters of the
+/// deferred interrupt work. For IRQs, the cycles are of the handler and the EOI, without the
+/// deferred work.
+pub fn write_stats(out: &mut impl Write) -> fmt::Result {
+	writeln!(out, "vector      count  avg cycles  max cycles  name")?;
+	for (vector, stats) in STATS.iter().enumerate() {
+		let count = stats.count.load(Ordering::Relaxed);
+		if count == 0 {
+			continue;
+		}
+
+		let total_cycles = stats.total_cycles.load(Ordering::Relaxed);
+		writeln!(out, "{:>6} {:>10} {:>11} {:>11}  {}", vector, count, total_cycles / count as u64,
+			stats.max_cycles.load(Ordering::Relaxed), vector_name(vector as u8))?;
+	}
+
+	super::deferred::write_stats(out)
+}
+
+/// Prints the counters of every vector which was raised to the serial port
+#[allow(unused)]
+pub fn dump_stats() {
+	let mut text = alloc::string::String::new();
+	write_stats(&mut text).unwrap();
+	serial::print!("{}", text);
+}
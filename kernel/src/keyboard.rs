@@ -1,8 +1,11 @@
 //! General keyboard definitions and methods
 
+mod layouts;
+
+use core::sync::atomic::{AtomicUsize, Ordering};
 use exclusive_cell::ExclusiveCell;
 use producer_consumer::ProducerConsumer;
-use crate::println;
+use crate::{input, println, signal};
 
 // The order of keys is generally from top to bottom, left to right, first the main keys, then the
 // action keys, then arrows, and then the numpad and finally multimedia keys.
@@ -140,31 +143,17 @@ pub enum KeyCode {
 }
 
 impl KeyCode {
-	/// Whether or not the key is in the numpad area
-	fn is_in_numpad(&self) -> bool {
-		matches!(self, 
-			KeyCode::KeyNumpad0 | KeyCode::KeyNumpad1 | KeyCode::KeyNumpad2 | KeyCode::KeyNumpad3 |
-			KeyCode::KeyNumpad4 | KeyCode::KeyNumpad5 | KeyCode::KeyNumpad6 | KeyCode::KeyNumpad7 |
-			KeyCode::KeyNumpad8 | KeyCode::KeyNumpad9 | KeyCode::KeyNumberLock |
-			KeyCode::KeyNumpadSlash | KeyCode::KeyNumpadAsterisk | KeyCode::KeyNumpadMinus |
-			KeyCode::KeyNumpadPlus | KeyCode::KeyNumpadEnter | KeyCode::KeyNumpadPeriod
-		)
-	}
-
-	/// Whether or not this is a letter key
-	fn is_letter(&self) -> bool {
-		matches!(self,
-			KeyCode::KeyA | KeyCode::KeyB | KeyCode::KeyC | KeyCode::KeyD | KeyCode::KeyE |
-			KeyCode::KeyF | KeyCode::KeyG | KeyCode::KeyH | KeyCode::KeyI | KeyCode::KeyJ |
-			KeyCode::KeyK | KeyCode::KeyL | KeyCode::KeyM | KeyCode::KeyN | KeyCode::KeyO |
-			KeyCode::KeyP | KeyCode::KeyQ | KeyCode::KeyR | KeyCode::KeyS | KeyCode::KeyT |
-			KeyCode::KeyU | KeyCode::KeyV | KeyCode::KeyW | KeyCode::KeyX | KeyCode::KeyY |
-			KeyCode::KeyZ
-		)
+	/// Returns the key code with the value `val`, if there is one
+	pub fn from_u8(val: u8) -> Option<Self> {
+		if val < KeyCode::Count as u8 {
+			unsafe { Some(core::mem::transmute(val)) }
+		} else {
+			None
+		}
 	}
 }
 
-#[derive(PartialEq)]
+#[derive(Clone, Copy, PartialEq)]
 pub enum KeyEventType {
 	KeyDown,
 	KeyUp,
@@ -184,189 +173,78 @@ pub struct KeyEvent {
 }
 
 impl KeyEvent {
-	/// Returns the ASCII representation of the pressed key, modifier keys are respected. `None` is
-	/// returned if the key press does not have an ASCII representation.
+	/// Returns the modifier state of the event, as an index into the tables of a layout
+	fn modifier_state(&self) -> usize {
+		let mut modifiers = 0;
+		if self.shift_down {
+			modifiers |= layouts::MODIFIER_SHIFT;
+		}
+		if self.caps_lock_enabled {
+			modifiers |= layouts::MODIFIER_CAPS_LOCK;
+		}
+		if self.number_lock_enabled {
+			modifiers |= layouts::MODIFIER_NUMBER_LOCK;
+		}
+		modifiers
+	}
+
+	/// Returns the ASCII representation of the pressed key in the active layout, modifier keys are
+	/// respected. `None` is returned if the key press does not have an ASCII representation.
 	pub fn as_ascii(&self) -> Option<u8> {
 		// If Control/Alt/Logo is down, this is not a normal text key.
 		if self.ctrl_down || self.alt_down || self.logo_down {
 			return None;
 		}
 
-		let ascii_code = if self.key_code.is_in_numpad() {
-			// If this is a numpad key, then the number lock has to be respected. If the number lock
-			// is not enabled, or if shift down (even if number lock is enabled), the numbers act as
-			// their action-counterpart, and not as text.
-			if !self.number_lock_enabled || self.shift_down {
-				match self.key_code {
-					KeyCode::KeyNumpadSlash => b'/',
-					KeyCode::KeyNumpadAsterisk => b'*',
-					KeyCode::KeyNumpadMinus => b'-',
-					KeyCode::KeyNumpadPlus => b'+',
-					KeyCode::KeyNumpadEnter => b'\n',
-					KeyCode::KeyNumpadPeriod => b'.',
-					_ => 0
-				}
-			} else {
-				match self.key_code {
-					KeyCode::KeyNumpad0 => b'0',
-					KeyCode::KeyNumpad1 => b'1',
-					KeyCode::KeyNumpad2 => b'2',
-					KeyCode::KeyNumpad3 => b'3',
-					KeyCode::KeyNumpad4 => b'4',
-					KeyCode::KeyNumpad5 => b'5',
-					KeyCode::KeyNumpad6 => b'6',
-					KeyCode::KeyNumpad7 => b'7',
-					KeyCode::KeyNumpad8 => b'8',
-					KeyCode::KeyNumpad9 => b'9',
-					KeyCode::KeyNumpadSlash => b'/',
-					KeyCode::KeyNumpadAsterisk => b'*',
-					KeyCode::KeyNumpadMinus => b'-',
-					KeyCode::KeyNumpadPlus => b'+',
-					KeyCode::KeyNumpadEnter => b'\n',
-					KeyCode::KeyNumpadPeriod => b'.',
-					_ => 0
-				}
-			}
-		} else if self.key_code.is_letter() {
-			// If this is a letter key, caps lock has to be respected. Shift and caps lock both
-			// switch from lower-case letters to upper-case letters, but if both caps lock is
-			// enabled and shift down the effect is canceled and the letters are lower-case.
-			if self.shift_down ^ self.caps_lock_enabled {
-				match self.key_code {
-					KeyCode::KeyA => b'A',
-					KeyCode::KeyB => b'B',
-					KeyCode::KeyC => b'C',
-					KeyCode::KeyD => b'D',
-					KeyCode::KeyE => b'E',
-					KeyCode::KeyF => b'F',
-					KeyCode::KeyG => b'G',
-					KeyCode::KeyH => b'H',
-					KeyCode::KeyI => b'I',
-					KeyCode::KeyJ => b'J',
-					KeyCode::KeyK => b'K',
-					KeyCode::KeyL => b'L',
-					KeyCode::KeyM => b'M',
-					KeyCode::KeyN => b'N',
-					KeyCode::KeyO => b'O',
-					KeyCode::KeyP => b'P',
-					KeyCode::KeyQ => b'Q',
-					KeyCode::KeyR => b'R',
-					KeyCode::KeyS => b'S',
-					KeyCode::KeyT => b'T',
-					KeyCode::KeyU => b'U',
-					KeyCode::KeyV => b'V',
-					KeyCode::KeyW => b'W',
-					KeyCode::KeyX => b'X',
-					KeyCode::KeyY => b'Y',
-					KeyCode::KeyZ => b'Z',
-					_ => 0
-				}
-			} else {
-				match self.key_code {
-					KeyCode::KeyA => b'a',
-					KeyCode::KeyB => b'b',
-					KeyCode::KeyC => b'c',
-					KeyCode::KeyD => b'd',
-					KeyCode::KeyE => b'e',
-					KeyCode::KeyF => b'f',
-					KeyCode::KeyG => b'g',
-					KeyCode::KeyH => b'h',
-					KeyCode::KeyI => b'i',
-					KeyCode::KeyJ => b'j',
-					KeyCode::KeyK => b'k',
-					KeyCode::KeyL => b'l',
-					KeyCode::KeyM => b'm',
-					KeyCode::KeyN => b'n',
-					KeyCode::KeyO => b'o',
-					KeyCode::KeyP => b'p',
-					KeyCode::KeyQ => b'q',
-					KeyCode::KeyR => b'r',
-					KeyCode::KeyS => b's',
-					KeyCode::KeyT => b't',
-					KeyCode::KeyU => b'u',
-					KeyCode::KeyV => b'v',
-					KeyCode::KeyW => b'w',
-					KeyCode::KeyX => b'x',
-					KeyCode::KeyY => b'y',
-					KeyCode::KeyZ => b'z',
-					_ => 0
-				}
-			}
-		} else {
-			// Keys have different meaning if the shift key is down
-			if self.shift_down {
-				match self.key_code {
-					KeyCode::KeyBackTick => b'~',
-					KeyCode::Key1 => b'!',
-					KeyCode::Key2 => b'@',
-					KeyCode::Key3 => b'#',
-					KeyCode::Key4 => b'$',
-					KeyCode::Key5 => b'%',
-					KeyCode::Key6 => b'^',
-					KeyCode::Key7 => b'&',
-					KeyCode::Key8 => b'*',
-					KeyCode::Key9 => b'(',
-					KeyCode::Key0 => b')',
-					KeyCode::KeyMinus => b'_',
-					KeyCode::KeyEquals => b'+',
-					KeyCode::KeyBackspace => 8, // TODO: Should I really do this?
-					KeyCode::KeyTab => b'\t',
-					KeyCode::KeyLeftSquareBracket => b'{',
-					KeyCode::KeyRightSquareBracket => b'}',
-					KeyCode::KeyEnter => b'\n',
-					KeyCode::KeySemicolon => b':',
-					KeyCode::KeyApostrophe => b'"',
-					KeyCode::KeyBackSlash => b'|',
-					KeyCode::KeyExtraBackSlash => b'|',
-					KeyCode::KeyComma => b'<',
-					KeyCode::KeyPeriod => b'>',
-					KeyCode::KeySlash => b'?',
-					KeyCode::KeySpace => b' ',
-					_ => 0
-				}
-			} else {
-				match self.key_code {
-					KeyCode::KeyBackTick => b'`',
-					KeyCode::Key1 => b'1',
-					KeyCode::Key2 => b'2',
-					KeyCode::Key3 => b'3',
-					KeyCode::Key4 => b'4',
-					KeyCode::Key5 => b'5',
-					KeyCode::Key6 => b'6',
-					KeyCode::Key7 => b'7',
-					KeyCode::Key8 => b'8',
-					KeyCode::Key9 => b'9',
-					KeyCode::Key0 => b'0',
-					KeyCode::KeyMinus => b'-',
-					KeyCode::KeyEquals => b'=',
-					KeyCode::KeyBackspace => 8, // TODO: Should I really do this?
-					KeyCode::KeyTab => b'\t',
-					KeyCode::KeyLeftSquareBracket => b'[',
-					KeyCode::KeyRightSquareBracket => b']',
-					KeyCode::KeyEnter => b'\n',
-					KeyCode::KeySemicolon => b';',
-					KeyCode::KeyApostrophe => b'\'',
-					KeyCode::KeyBackSlash => b'\\',
-					KeyCode::KeyExtraBackSlash => b'\\',
-					KeyCode::KeyComma => b',',
-					KeyCode::KeyPeriod => b'.',
-					KeyCode::KeySlash => b'/',
-					KeyCode::KeySpace => b' ',
-					_ => 0
-				}
-			}
-		};
+		let layout = layouts::LAYOUTS[ACTIVE_LAYOUT.load(Ordering::Relaxed)];
 
-		// We mark keys that are not representable in ASCII with a 0 (easier than writing Some(...)
-		// everywhere)
-		if ascii_code != 0 {
-			Some(ascii_code)
-		} else {
-			None
+		// Keys that are not representable in ASCII are marked with a 0 in the layout tables
+		match layout.ascii(self.key_code, self.modifier_state()) {
+			0 => None,
+			ascii_code => Some(ascii_code),
 		}
 	}
 }
 
+/// The index in `layouts::LAYOUTS` of the layout key events are translated with
+static ACTIVE_LAYOUT: AtomicUsize = AtomicUsize::new(0);
+
+/// Switches to the compiled-in keyboard layout called `name`. Returns false if there is no such
+/// layout.
+pub fn set_layout(name: &str) -> bool {
+	match layouts::LAYOUTS.iter().position(|layout| layout.name == name) {
+		Some(layout_idx) => {
+			ACTIVE_LAYOUT.store(layout_idx, Ordering::Relaxed);
+			true
+		},
+		None => false,
+	}
+}
+
+/// Copies the name of the active layout, followed by a newline, starting at byte `offset` of it to
+/// `buf`. Returns the number of bytes copied.
+pub fn read_layout(buf: &mut [u8], offset: usize) -> usize {
+	let name = layouts::LAYOUTS[ACTIVE_LAYOUT.load(Ordering::Relaxed)].name.as_bytes();
+	let mut copied = 0;
+	for (dst, &src) in buf.iter_mut().zip(name.iter().chain(b"\n").skip(offset)) {
+		*dst = src;
+		copied += 1;
+	}
+	copied
+}
+
+/// Handles a layout name written to the layout device, which may end with a newline. Returns the
+/// number of bytes of `buf` which were handled: all of them if the layout was switched, or 0 if
+/// there is no such layout.
+pub fn control_layout(buf: &[u8]) -> usize {
+	let name = core::str::from_utf8(buf).unwrap_or("");
+	if set_layout(name.strip_suffix('\n').unwrap_or(name)) {
+		buf.len()
+	} else {
+		0
+	}
+}
+
 struct KeyboardState {
 	/// The state of each key in the keyboard. `true` signifies that the key is currently pressed
 	key_state: [bool; KeyCode::Count as usize],
@@ -391,59 +269,64 @@ impl KeyboardState {
 /// The global keyboard state. Access should be exclusive: we do not expect to recieve two key
 /// events simultaneously
 static KEYBOARD_STATE: ExclusiveCell<KeyboardState> = ExclusiveCell::new(KeyboardState::new());
-pub static KEYBOARD_EVENTS_QUEUE: ProducerConsumer<KeyEvent, 20> = ProducerConsumer::new();
+/// The key events waiting to be read. Large enough to hold a burst of injected events.
+pub static KEYBOARD_EVENTS_QUEUE: ProducerConsumer<KeyEvent, 1024> = ProducerConsumer::new();
 
 /// Updates the keyboard state given that the key with code `key_code` was pressed down
 pub fn key_pressed_event(key_code: KeyCode) {
-	// Acquire exclusive access to the keyboard state
-	let mut keyboard_state = KEYBOARD_STATE.acquire();
+	let event = update_keyboard_state(key_code, KeyEventType::KeyDown);
+	input::record_event(&event);
 
-	// Save the key as currently pressed
-	keyboard_state.key_state[key_code as usize] = true;
-
-	// Toggle the relevant lock state if the lock key is pressed
-	if key_code == KeyCode::KeyCapsLock {
-		keyboard_state.caps_lock_enabled = !keyboard_state.caps_lock_enabled;
-	} else if key_code == KeyCode::KeyNumberLock {
-		keyboard_state.number_lock_enabled = !keyboard_state.number_lock_enabled;
-	} else if key_code == KeyCode::KeyScrollLock {
-		keyboard_state.scroll_lock_enabled = !keyboard_state.scroll_lock_enabled;
+	// Ctrl+C interrupts the foreground process instead of being read
+	if key_code == KeyCode::KeyC && event.ctrl_down {
+		signal::interrupt_foreground();
+		return;
 	}
 
-	// Calculate the modifier states by checking both left and right variants
-	let shift_down = keyboard_state.key_state[KeyCode::KeyLeftShift as usize]
-		|| keyboard_state.key_state[KeyCode::KeyRightShift as usize];
-	let ctrl_down = keyboard_state.key_state[KeyCode::KeyLeftControl as usize]
-		|| keyboard_state.key_state[KeyCode::KeyRightControl as usize];
-	let alt_down = keyboard_state.key_state[KeyCode::KeyLeftAlt as usize]
-		|| keyboard_state.key_state[KeyCode::KeyRightAlt as usize];
-	let logo_down = keyboard_state.key_state[KeyCode::KeyLeftLogo as usize]
-		|| keyboard_state.key_state[KeyCode::KeyRightLogo as usize];
+	produce_event(event);
+}
 
-	// Construct the KeyDown event
-	let event = KeyEvent {
-		key_code,
-		event_type: KeyEventType::KeyDown,
-		shift_down,
-		ctrl_down,
-		alt_down,
-		logo_down,
-		caps_lock_enabled: keyboard_state.caps_lock_enabled,
-		number_lock_enabled: keyboard_state.number_lock_enabled,
-	};
+/// Updates the keyboard state given that the key with code `key_code` was released
+pub fn key_released_event(key_code: KeyCode) {
+	let event = update_keyboard_state(key_code, KeyEventType::KeyUp);
+	input::record_event(&event);
+	produce_event(event);
+}
 
-	if KEYBOARD_EVENTS_QUEUE.produce(event).is_none() {
-		println!("Warning: dropping keyboard events because buffer ran out of space");
+/// Updates the keyboard state with a synthetic event of the key with code `key_code`, which is
+/// not recorded. Returns false if the event was dropped because the events queue is full. Must be
+/// called with interrupts masked, so it doesn't race with the keyboard interrupt.
+pub fn inject_event(key_code: KeyCode, event_type: KeyEventType) -> bool {
+	assert!(!cpu::get_if());
+
+	// The queue is checked first, so the keyboard state is only updated if the event goes through
+	if KEYBOARD_EVENTS_QUEUE.is_full() {
+		return false;
 	}
+
+	let event = update_keyboard_state(key_code, event_type);
+	KEYBOARD_EVENTS_QUEUE.produce(event).is_some()
 }
 
-/// Updates the keyboard state given that the key with code `key_code` was released
-pub fn key_released_event(key_code: KeyCode) {
-	// Acquire exclusive rights to the keyboard state
+/// Updates the keyboard state given that the key with code `key_code` was pressed down or released
+/// and returns the corresponding event
+fn update_keyboard_state(key_code: KeyCode, event_type: KeyEventType) -> KeyEvent {
+	// Acquire exclusive access to the keyboard state
 	let mut keyboard_state = KEYBOARD_STATE.acquire();
 
-	// Save the key as unpressed
-	keyboard_state.key_state[key_code as usize] = false;
+	// Save the key as currently pressed or unpressed
+	keyboard_state.key_state[key_code as usize] = event_type == KeyEventType::KeyDown;
+
+	// Toggle the relevant lock state if the lock key is pressed
+	if event_type == KeyEventType::KeyDown {
+		if key_code == KeyCode::KeyCapsLock {
+			keyboard_state.caps_lock_enabled = !keyboard_state.caps_lock_enabled;
+		} else if key_code == KeyCode::KeyNumberLock {
+			keyboard_state.number_lock_enabled = !keyboard_state.number_lock_enabled;
+		} else if key_code == KeyCode::KeyScrollLock {
+			keyboard_state.scroll_lock_enabled = !keyboard_state.scroll_lock_enabled;
+		}
+	}
 
 	// Calculate the modifier states by checking both left and right variants
 	let shift_down = keyboard_state.key_state[KeyCode::KeyLeftShift as usize]
@@ -455,19 +338,21 @@ pub fn key_released_event(key_code: KeyCode) {
 	let logo_down = keyboard_state.key_state[KeyCode::KeyLeftLogo as usize]
 		|| keyboard_state.key_state[KeyCode::KeyRightLogo as usize];
 
-	// Construct the KeyUp event
-	let event = KeyEvent {
+	KeyEvent {
 		key_code,
-		event_type: KeyEventType::KeyUp,
+		event_type,
 		shift_down,
 		ctrl_down,
 		alt_down,
 		logo_down,
 		caps_lock_enabled: keyboard_state.caps_lock_enabled,
 		number_lock_enabled: keyboard_state.number_lock_enabled,
-	};
+	}
+}
 
+/// Pushes `event` to the events queue, dropping it if the queue is full
+fn produce_event(event: KeyEvent) {
 	if KEYBOARD_EVENTS_QUEUE.produce(event).is_none() {
 		println!("Warning: dropping keyboard events because buffer ran out of space");
 	}
-}
\ No newline at end of file
+}
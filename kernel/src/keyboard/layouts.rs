@@ -0,0 +1,212 @@
+//! Keyboard layouts, compiled into tables which map a key code and the modifier state to the
+//! ASCII code the key types
+
+use super::KeyCode;
+
+/// Modifier state bit for a shift key being down
+pub const MODIFIER_SHIFT: usize = 1 << 0;
+/// Modifier state bit for caps lock being enabled
+pub const MODIFIER_CAPS_LOCK: usize = 1 << 1;
+/// Modifier state bit for number lock being enabled
+pub const MODIFIER_NUMBER_LOCK: usize = 1 << 2;
+/// The number of modifier states a layout has a table for
+pub const MODIFIER_STATES: usize = 1 << 3;
+
+/// The number of key codes
+const KEY_CODE_COUNT: usize = KeyCode::Count as usize;
+
+/// A key of a layout, and the ASCII codes it types without and with shift
+type LayoutKey = (KeyCode, u8, u8);
+
+/// A keyboard layout
+pub struct KeyboardLayout {
+	pub name: &'static str,
+	/// For each modifier state, the ASCII code every key code types, zero if it doesn't type
+	/// anything
+	ascii: [[u8; KEY_CODE_COUNT]; MODIFIER_STATES],
+}
+
+impl KeyboardLayout {
+	/// Builds the tables of a layout in which the keys in `keys` type text. Keys which type a
+	/// lower-case letter type the upper-case letter if either shift is down or caps lock is
+	/// enabled (but not both), and other keys only respect shift.
+	const fn new(name: &'static str, keys: &[LayoutKey]) -> Self {
+		let mut ascii = [[0u8; KEY_CODE_COUNT]; MODIFIER_STATES];
+
+		let mut state = 0;
+		while state < MODIFIER_STATES {
+			let shift_down = (state & MODIFIER_SHIFT) != 0;
+			let caps_lock_enabled = (state & MODIFIER_CAPS_LOCK) != 0;
+			let number_lock_enabled = (state & MODIFIER_NUMBER_LOCK) != 0;
+
+			let mut key_idx = 0;
+			while key_idx < keys.len() {
+				let (key_code, plain, shifted) = keys[key_idx];
+				let upper_case = if plain.is_ascii_lowercase() {
+					shift_down ^ caps_lock_enabled
+				} else {
+					shift_down
+				};
+				ascii[state][key_code as usize] = if upper_case { shifted } else { plain };
+				key_idx += 1;
+			}
+
+			// If the number lock is not enabled, or if shift is down (even if number lock is
+			// enabled), the numpad keys act as their action-counterpart, and not as text
+			let numpad_numbers = number_lock_enabled && !shift_down;
+			let mut key_idx = 0;
+			while key_idx < NUMPAD_KEYS.len() {
+				let (key_code, number, action) = NUMPAD_KEYS[key_idx];
+				ascii[state][key_code as usize] = if numpad_numbers { number } else { action };
+				key_idx += 1;
+			}
+
+			state += 1;
+		}
+
+		Self { name, ascii }
+	}
+
+	/// Returns the ASCII code `key_code` types in the modifier state `modifiers`, zero if it
+	/// doesn't type anything
+	#[inline]
+	pub fn ascii(&self, key_code: KeyCode, modifiers: usize) -> u8 {
+		self.ascii[modifiers][key_code as usize]
+	}
+}
+
+/// The numpad keys, and the ASCII codes they type with and without the number lock. They are the
+/// same in every layout.
+const NUMPAD_KEYS: [LayoutKey; 16] = [
+	(KeyCode::KeyNumpad0, b'0', 0),
+	(KeyCode::KeyNumpad1, b'1', 0),
+	(KeyCode::KeyNumpad2, b'2', 0),
+	(KeyCode::KeyNumpad3, b'3', 0),
+	(KeyCode::KeyNumpad4, b'4', 0),
+	(KeyCode::KeyNumpad5, b'5', 0),
+	(KeyCode::KeyNumpad6, b'6', 0),
+	(KeyCode::KeyNumpad7, b'7', 0),
+	(KeyCode::KeyNumpad8, b'8', 0),
+	(KeyCode::KeyNumpad9, b'9', 0),
+	(KeyCode::KeyNumpadSlash, b'/', b'/'),
+	(KeyCode::KeyNumpadAsterisk, b'*', b'*'),
+	(KeyCode::KeyNumpadMinus, b'-', b'-'),
+	(KeyCode::KeyNumpadPlus, b'+', b'+'),
+	(KeyCode::KeyNumpadEnter, b'\n', b'\n'),
+	(KeyCode::KeyNumpadPeriod, b'.', b'.'),
+];
+
+/// The US QWERTY layout
+pub static US_QWERTY: KeyboardLayout = KeyboardLayout::new("us", &[
+	(KeyCode::KeyBackTick, b'`', b'~'),
+	(KeyCode::Key1, b'1', b'!'),
+	(KeyCode::Key2, b'2', b'@'),
+	(KeyCode::Key3, b'3', b'#'),
+	(KeyCode::Key4, b'4', b'$'),
+	(KeyCode::Key5, b'5', b'%'),
+	(KeyCode::Key6, b'6', b'^'),
+	(KeyCode::Key7, b'7', b'&'),
+	(KeyCode::Key8, b'8', b'*'),
+	(KeyCode::Key9, b'9', b'('),
+	(KeyCode::Key0, b'0', b')'),
+	(KeyCode::KeyMinus, b'-', b'_'),
+	(KeyCode::KeyEquals, b'=', b'+'),
+	(KeyCode::KeyBackspace, 8, 8), // TODO: Should I really do this?
+	(KeyCode::KeyTab, b'\t', b'\t'),
+	(KeyCode::KeyQ, b'q', b'Q'),
+	(KeyCode::KeyW, b'w', b'W'),
+	(KeyCode::KeyE, b'e', b'E'),
+	(KeyCode::KeyR, b'r', b'R'),
+	(KeyCode::KeyT, b't', b'T'),
+	(KeyCode::KeyY, b'y', b'Y'),
+	(KeyCode::KeyU, b'u', b'U'),
+	(KeyCode::KeyI, b'i', b'I'),
+	(KeyCode::KeyO, b'o', b'O'),
+	(KeyCode::KeyP, b'p', b'P'),
+	(KeyCode::KeyLeftSquareBracket, b'[', b'{'),
+	(KeyCode::KeyRightSquareBracket, b']', b'}'),
+	(KeyCode::KeyEnter, b'\n', b'\n'),
+	(KeyCode::KeyA, b'a', b'A'),
+	(KeyCode::KeyS, b's', b'S'),
+	(KeyCode::KeyD, b'd', b'D'),
+	(KeyCode::KeyF, b'f', b'F'),
+	(KeyCode::KeyG, b'g', b'G'),
+	(KeyCode::KeyH, b'h', b'H'),
+	(KeyCode::KeyJ, b'j', b'J'),
+	(KeyCode::KeyK, b'k', b'K'),
+	(KeyCode::KeyL, b'l', b'L'),
+	(KeyCode::KeySemicolon, b';', b':'),
+	(KeyCode::KeyApostrophe, b'\'', b'"'),
+	(KeyCode::KeyBackSlash, b'\\', b'|'),
+	(KeyCode::KeyExtraBackSlash, b'\\', b'|'),
+	(KeyCode::KeyZ, b'z', b'Z'),
+	(KeyCode::KeyX, b'x', b'X'),
+	(KeyCode::KeyC, b'c', b'C'),
+	(KeyCode::KeyV, b'v', b'V'),
+	(KeyCode::KeyB, b'b', b'B'),
+	(KeyCode::KeyN, b'n', b'N'),
+	(KeyCode::KeyM, b'm', b'M'),
+	(KeyCode::KeyComma, b',', b'<'),
+	(KeyCode::KeyPeriod, b'.', b'>'),
+	(KeyCode::KeySlash, b'/', b'?'),
+	(KeyCode::KeySpace, b' ', b' '),
+]);
+
+/// The US Dvorak layout. The key codes name the keys by their position on a QWERTY keyboard.
+pub static US_DVORAK: KeyboardLayout = KeyboardLayout::new("dvorak", &[
+	(KeyCode::KeyBackTick, b'`', b'~'),
+	(KeyCode::Key1, b'1', b'!'),
+	(KeyCode::Key2, b'2', b'@'),
+	(KeyCode::Key3, b'3', b'#'),
+	(KeyCode::Key4, b'4', b'$'),
+	(KeyCode::Key5, b'5', b'%'),
+	(KeyCode::Key6, b'6', b'^'),
+	(KeyCode::Key7, b'7', b'&'),
+	(KeyCode::Key8, b'8', b'*'),
+	(KeyCode::Key9, b'9', b'('),
+	(KeyCode::Key0, b'0', b')'),
+	(KeyCode::KeyMinus, b'[', b'{'),
+	(KeyCode::KeyEquals, b']', b'}'),
+	(KeyCode::KeyBackspace, 8, 8),
+	(KeyCode::KeyTab, b'\t', b'\t'),
+	(KeyCode::KeyQ, b'\'', b'"'),
+	(KeyCode::KeyW, b',', b'<'),
+	(KeyCode::KeyE, b'.', b'>'),
+	(KeyCode::KeyR, b'p', b'P'),
+	(KeyCode::KeyT, b'y', b'Y'),
+	(KeyCode::KeyY, b'f', b'F'),
+	(KeyCode::KeyU, b'g', b'G'),
+	(KeyCode::KeyI, b'c', b'C'),
+	(KeyCode::KeyO, b'r', b'R'),
+	(KeyCode::KeyP, b'l', b'L'),
+	(KeyCode::KeyLeftSquareBracket, b'/', b'?'),
+	(KeyCode::KeyRightSquareBracket, b'=', b'+'),
+	(KeyCode::KeyEnter, b'\n', b'\n'),
+	(KeyCode::KeyA, b'a', b'A'),
+	(KeyCode::KeyS, b'o', b'O'),
+	(KeyCode::KeyD, b'e', b'E'),
+	(KeyCode::KeyF, b'u', b'U'),
+	(KeyCode::KeyG, b'i', b'I'),
+	(KeyCode::KeyH, b'd', b'D'),
+	(KeyCode::KeyJ, b'h', b'H'),
+	(KeyCode::KeyK, b't', b'T'),
+	(KeyCode::KeyL, b'n', b'N'),
+	(KeyCode::KeySemicolon, b's', b'S'),
+	(KeyCode::KeyApostrophe, b'-', b'_'),
+	(KeyCode::KeyBackSlash, b'\\', b'|'),
+	(KeyCode::KeyExtraBackSlash, b'\\', b'|'),
+	(KeyCode::KeyZ, b';', b':'),
+	(KeyCode::KeyX, b'q', b'Q'),
+	(KeyCode::KeyC, b'j', b'J'),
+	(KeyCode::KeyV, b'k', b'K'),
+	(KeyCode::KeyB, b'x', b'X'),
+	(KeyCode::KeyN, b'b', b'B'),
+	(KeyCode::KeyM, b'm', b'M'),
+	(KeyCode::KeyComma, b'w', b'W'),
+	(KeyCode::KeyPeriod, b'v', b'V'),
+	(KeyCode::KeySlash, b'z', b'Z'),
+	(KeyCode::KeySpace, b' ', b' '),
+]);
+
+/// Every compiled-in layout. The first one is the default.
+pub static LAYOUTS: [&KeyboardLayout; 2] = [&US_QWERTY, &US_DVORAK];
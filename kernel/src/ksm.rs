@@ -0,0 +1,427 @@
+//! Same-page merging. A scanner driven by the timer interrupt walks the user pages of every
+//! address space, a few at a time, and hashes the contents of unshared pages. Pages with identical
+//! contents are merged into a single read-only page frame, which is mapped copy-on-write into
+//! every address space that had a copy, so the first write to a merged page splits it off again
+//! through the page fault handler.
+//!
+//! Frames which pages were merged into are kept in a stable table, indexed by the hash of their
+//! contents. Pages which didn't match any of them are remembered in an unstable table for the
+//! rest of the pass, so a later page with the same contents can be merged with them. Entries of
+//! the unstable table are only hints: the page is checked again before it is merged, because it
+//! might have been written or unmapped since.
+
+use alloc::{boxed::Box, vec, vec::Vec};
+use core::sync::atomic::{AtomicBool, AtomicU32, Ordering};
+
+use exclusive_cell::ExclusiveCell;
+use page_tables::{PageDirectory, PhysAddr, PhysMem, VirtAddr, PAGE_ENTRY_PRESENT, PAGE_ENTRY_USER,
+	PAGE_ENTRY_WRITE, PAGE_ENTRY_DIRTY, PAGE_ENTRY_COW, PAGE_ENTRY_FILE};
+use serial::println;
+use crate::memory_manager::{self, PhysicalMemory};
+use crate::reclaim;
+
+/// The scanner runs every this many timer ticks
+const SCAN_INTERVAL_TICKS: u32 = 10;
+/// The number of pages the scanner hashes every time it runs
+const PAGES_PER_SCAN: usize = 64;
+/// The number of page table entries the scanner looks at every time it runs, which bounds the
+/// time spent in sparse address spaces
+const ENTRIES_PER_SCAN: usize = 4096;
+/// The number of entries in the stable table
+const STABLE_TABLE_SIZE: usize = 512;
+/// The number of entries in the unstable table
+const UNSTABLE_TABLE_SIZE: usize = 1024;
+
+/// A page frame which pages were merged into. The table holds a reference to the frame, so it is
+/// never released while it is in the table.
+#[derive(Clone, Copy)]
+struct StableEntry {
+	/// The merged page frame, None if the entry is unused
+	frame: Option<PhysAddr>,
+	hash: u32,
+}
+
+/// A page which was hashed during the current pass
+#[derive(Clone, Copy)]
+struct UnstableEntry {
+	/// The page directory of the address space of the page, zero if the entry is unused
+	directory: PhysAddr,
+	page_vaddr: VirtAddr,
+	/// The page frame the page was mapped to when it was hashed
+	frame: PhysAddr,
+	hash: u32,
+	/// The pass in which the page was hashed
+	pass: u32,
+}
+
+struct MergeState {
+	/// The position of the scanner: an index into the address space registry and a user page
+	/// number
+	hand: (usize, u32),
+	/// The number of passes the scanner completed
+	pass: u32,
+	stable: Vec<StableEntry>,
+	unstable: Vec<UnstableEntry>,
+	/// Buffer for the contents of a page, because only one page frame can be accessed at a time
+	page_buffer: Box<[u8; 4096]>,
+}
+
+/// The state of the scanner. Only accessed while the physical memory lock is held.
+static STATE: ExclusiveCell<Option<MergeState>> = ExclusiveCell::new(None);
+
+/// Whether the scanner was set up
+static ENABLED: AtomicBool = AtomicBool::new(false);
+/// The number of timer ticks since the scanner last ran
+static TICKS: AtomicU32 = AtomicU32::new(0);
+/// The number of page frames in the stable table
+static STABLE_FRAMES: AtomicU32 = AtomicU32::new(0);
+/// Total number of pages hashed by the scanner
+static PAGES_SCANNED: AtomicU32 = AtomicU32::new(0);
+/// Total number of pages merged into another page frame
+static PAGES_MERGED: AtomicU32 = AtomicU32::new(0);
+/// Total number of passes the scanner completed over all address spaces
+static FULL_SCANS: AtomicU32 = AtomicU32::new(0);
+
+/// Usage and activity counters of same-page merging
+pub struct MergeStats {
+	/// The number of merged page frames which are still mapped
+	pub shared_frames: u32,
+	/// The number of mappings of merged page frames beyond the first one of each, which is the
+	/// number of page frames merging currently saves
+	pub sharing_pages: u32,
+	pub stable_frames: u32,
+	pub pages_scanned: u32,
+	pub pages_merged: u32,
+	pub full_scans: u32,
+}
+
+/// Returns the current usage and activity counters of same-page merging. Must be called with the
+/// physical memory lock held.
+pub fn get_stats(phys_mem: &PhysicalMemory) -> MergeStats {
+	let mut stats = MergeStats {
+		shared_frames: 0,
+		sharing_pages: 0,
+		stable_frames: STABLE_FRAMES.load(Ordering::Relaxed),
+		pages_scanned: PAGES_SCANNED.load(Ordering::Relaxed),
+		pages_merged: PAGES_MERGED.load(Ordering::Relaxed),
+		full_scans: FULL_SCANS.load(Ordering::Relaxed),
+	};
+
+	if let Some(state) = STATE.acquire().as_ref() {
+		for frame in state.stable.iter().filter_map(|entry| entry.frame) {
+			// The reference of the table takes up the first mapping, so the share count is the
+			// number of pages mapping the frame
+			let mappings = phys_mem.frame_share_count(frame) as u32;
+			if mappings > 0 {
+				stats.shared_frames += 1;
+				stats.sharing_pages += mappings - 1;
+			}
+		}
+	}
+
+	stats
+}
+
+/// Prints the usage and activity counters of same-page merging to the serial port
+#[allow(unused)]
+pub fn dump_stats() {
+	let stats = {
+		let pmem = memory_manager::PHYS_MEM.lock();
+		get_stats(&pmem.as_ref().unwrap().0)
+	};
+	println!("Same-page merging: {} frames shared by {} more pages ({} frames in the stable table)",
+		stats.shared_frames, stats.sharing_pages, stats.stable_frames);
+	println!("\t{} pages scanned in {} full scans, {} pages merged", stats.pages_scanned,
+		stats.full_scans, stats.pages_merged);
+}
+
+/// Sets up the scanner, which starts running on the next timer ticks
+pub fn init() {
+	// Everything is allocated before the state is published, because the scanner must not
+	// allocate
+	let state = MergeState {
+		hand: (0, 0),
+		pass: 0,
+		stable: vec![StableEntry { frame: None, hash: 0 }; STABLE_TABLE_SIZE],
+		unstable: vec![UnstableEntry {
+			directory: PhysAddr(0),
+			page_vaddr: VirtAddr(0),
+			frame: PhysAddr(0),
+			hash: 0,
+			pass: 0,
+		}; UNSTABLE_TABLE_SIZE],
+		page_buffer: vec![0; 4096].into_boxed_slice().try_into().unwrap(),
+	};
+
+	let _pmem = memory_manager::PHYS_MEM.lock();
+	*STATE.acquire() = Some(state);
+	ENABLED.store(true, Ordering::Relaxed);
+
+	println!("Enabled same-page merging");
+}
+
+/// Called on every timer tick, runs the scanner once every `SCAN_INTERVAL_TICKS` ticks. Must only
+/// be called from the deferred work of the timer interrupt.
+pub fn handle_timer_tick() {
+	if !ENABLED.load(Ordering::Relaxed) {
+		return;
+	}
+	if TICKS.fetch_add(1, Ordering::Relaxed) + 1 < SCAN_INTERVAL_TICKS {
+		return;
+	}
+	TICKS.store(0, Ordering::Relaxed);
+
+	// Interrupts are masked while the physical memory lock is held, so it can't be held by the
+	// code we interrupted
+	let mut pmem = memory_manager::PHYS_MEM.lock();
+	let (phys_mem, _) = pmem.as_mut().unwrap();
+	let mut state = STATE.acquire();
+	if let Some(state) = state.as_mut() {
+		state.scan(phys_mem, PAGES_PER_SCAN, ENTRIES_PER_SCAN);
+	}
+}
+
+/// Releases the page frames of the stable table which are no longer mapped by any page. Returns
+/// the number of page frames released.
+pub fn release_unused_frames(phys_mem: &mut PhysicalMemory) -> usize {
+	let mut state = STATE.acquire();
+	match state.as_mut() {
+		Some(state) => state.release_unused_frames(phys_mem),
+		None => 0,
+	}
+}
+
+impl MergeState {
+	/// Advances the scanner until `page_budget` pages are hashed or `entry_budget` page table
+	/// entries are looked at
+	fn scan(&mut self, phys_mem: &mut PhysicalMemory, page_budget: usize, entry_budget: usize) {
+		let (mut address_space_idx, mut page) = self.hand;
+
+		let mut hashed = 0;
+		let mut entries = 0;
+		while hashed < page_budget && entries < entry_budget {
+			let directory = reclaim::get_address_space(address_space_idx);
+			if directory.is_none() || page >= reclaim::USER_PAGE_COUNT {
+				// Move on to the next address space
+				address_space_idx = (address_space_idx + 1) % reclaim::MAX_ADDRESS_SPACES;
+				page = 0;
+				if address_space_idx == 0 {
+					self.finish_pass(phys_mem);
+				}
+				continue;
+			}
+			let directory = directory.unwrap();
+
+			entries += 1;
+			let mut page_dir = unsafe { PageDirectory::from_cr3(directory.0) };
+			let page_vaddr = VirtAddr(page << 12);
+
+			// Skip entire page tables which don't exist
+			if page % 1024 == 0 {
+				let raw_pde = page_dir.get_page_directory_entry(phys_mem, page_vaddr).unwrap_or(0);
+				if (raw_pde & PAGE_ENTRY_PRESENT) == 0 {
+					page += 1024;
+					continue;
+				}
+			}
+			page += 1;
+
+			let raw_pte = page_dir.get_page_table_entry(phys_mem, page_vaddr).unwrap_or(0);
+			if !is_candidate(phys_mem, raw_pte) {
+				continue;
+			}
+
+			hashed += 1;
+			self.scan_page(phys_mem, directory, page_vaddr, raw_pte);
+		}
+
+		self.hand = (address_space_idx, page);
+		PAGES_SCANNED.fetch_add(hashed as u32, Ordering::Relaxed);
+	}
+
+	/// Tries to merge the candidate page at `page_vaddr` of the address space with the page
+	/// directory at `directory`, which is mapped by `raw_pte`
+	fn scan_page(&mut self, phys_mem: &mut PhysicalMemory, directory: PhysAddr,
+		page_vaddr: VirtAddr, raw_pte: u32) {
+		let frame = PhysAddr(raw_pte & !0xFFF);
+		let hash = unsafe { hash_page(phys_mem.translate_phys(frame, 4096).unwrap()) };
+
+		// A frame pages were already merged into is the best match, because merging into it
+		// doesn't take another page frame out of the pool of writable pages
+		let stable_idx = hash as usize % STABLE_TABLE_SIZE;
+		let stable = self.stable[stable_idx];
+		if let Some(stable_frame) = stable.frame.filter(|_| stable.hash == hash) {
+			if self.frames_equal(phys_mem, stable_frame, frame) {
+				merge_page(phys_mem, directory, page_vaddr, raw_pte, stable_frame);
+				return;
+			}
+		}
+
+		let unstable_idx = hash as usize % UNSTABLE_TABLE_SIZE;
+		let unstable = self.unstable[unstable_idx];
+		self.unstable[unstable_idx] = UnstableEntry {
+			directory,
+			page_vaddr,
+			frame,
+			hash,
+			pass: self.pass,
+		};
+
+		if unstable.directory.0 == 0 || unstable.pass != self.pass || unstable.hash != hash
+			|| unstable.frame == frame {
+			return;
+		}
+
+		// The page of the unstable entry must still be mapped to the same unshared frame and have
+		// the same contents. The address space is still registered, so its page directory wasn't
+		// released.
+		let registered = (0..reclaim::MAX_ADDRESS_SPACES)
+			.any(|idx| reclaim::get_address_space(idx) == Some(unstable.directory));
+		if !registered {
+			return;
+		}
+		let mut other_page_dir = unsafe { PageDirectory::from_cr3(unstable.directory.0) };
+		let other_raw_pte = other_page_dir.get_page_table_entry(phys_mem, unstable.page_vaddr)
+			.unwrap_or(0);
+		if !is_candidate(phys_mem, other_raw_pte) || (other_raw_pte & !0xFFF) != unstable.frame.0
+			|| !self.frames_equal(phys_mem, unstable.frame, frame) {
+			return;
+		}
+
+		// The frame of this page becomes a merged frame, so it is made read-only before the other
+		// page is merged into it
+		if unsafe { !remap_shared(phys_mem, directory, page_vaddr, raw_pte, frame) } {
+			return;
+		}
+		phys_mem.share_frame(frame);
+		self.insert_stable(phys_mem, stable_idx, frame, hash);
+		merge_page(phys_mem, unstable.directory, unstable.page_vaddr, other_raw_pte, frame);
+
+		// The page is no longer a candidate, and it is found through the stable table from now on
+		self.unstable[unstable_idx].directory = PhysAddr(0);
+	}
+
+	/// Puts `frame`, whose contents hash to `hash`, into the stable table at `stable_idx`. The
+	/// caller must have taken a reference to the frame for the table.
+	fn insert_stable(&mut self, phys_mem: &mut PhysicalMemory, stable_idx: usize, frame: PhysAddr,
+		hash: u32) {
+		// The frame which was in the entry stays shared by the pages merged into it, it just
+		// won't have any more pages merged into it
+		match self.stable[stable_idx].frame {
+			Some(old_frame) => {
+				if phys_mem.drop_frame_reference(old_frame) {
+					phys_mem.release_phys_mem(old_frame, 4096);
+				}
+			},
+			None => {
+				STABLE_FRAMES.fetch_add(1, Ordering::Relaxed);
+			},
+		}
+
+		self.stable[stable_idx] = StableEntry {
+			frame: Some(frame),
+			hash,
+		};
+	}
+
+	/// Called when the scanner completes a pass over all address spaces
+	fn finish_pass(&mut self, phys_mem: &mut PhysicalMemory) {
+		// Entries of the unstable table from the previous pass are stale, which the pass number
+		// marks
+		self.pass = self.pass.wrapping_add(1);
+		self.release_unused_frames(phys_mem);
+		FULL_SCANS.fetch_add(1, Ordering::Relaxed);
+	}
+
+	/// Releases the page frames of the stable table which are no longer mapped by any page.
+	/// Returns the number of page frames released.
+	fn release_unused_frames(&mut self, phys_mem: &mut PhysicalMemory) -> usize {
+		let mut released = 0;
+		for entry in self.stable.iter_mut() {
+			let frame = match entry.frame {
+				Some(frame) if phys_mem.frame_share_count(frame) == 0 => frame,
+				_ => continue,
+			};
+
+			// Only the reference of the table is left
+			entry.frame = None;
+			if phys_mem.drop_frame_reference(frame) {
+				phys_mem.release_phys_mem(frame, 4096);
+				released += 1;
+			}
+		}
+
+		STABLE_FRAMES.fetch_sub(released as u32, Ordering::Relaxed);
+		released
+	}
+
+	/// Returns true if the page frames at `a` and `b` have the same contents
+	fn frames_equal(&mut self, phys_mem: &mut PhysicalMemory, a: PhysAddr, b: PhysAddr) -> bool {
+		unsafe {
+			// Only one page frame can be accessed at a time, so one of them is copied out first
+			let a_ptr = phys_mem.translate_phys(a, 4096).unwrap();
+			core::ptr::copy_nonoverlapping(a_ptr, self.page_buffer.as_mut_ptr(), 4096);
+			let b_ptr = phys_mem.translate_phys(b, 4096).unwrap();
+			core::slice::from_raw_parts(b_ptr, 4096) == &self.page_buffer[..]
+		}
+	}
+}
+
+/// Returns true if the page mapped by `raw_pte` is a user page which is mapped to a page frame
+/// only it maps, so it can be merged
+fn is_candidate(phys_mem: &PhysicalMemory, raw_pte: u32) -> bool {
+	// Pages marked copy-on-write are either shared already or about to be written
+	(raw_pte & (PAGE_ENTRY_PRESENT | PAGE_ENTRY_USER)) == (PAGE_ENTRY_PRESENT | PAGE_ENTRY_USER)
+		&& (raw_pte & PAGE_ENTRY_COW) == 0
+		&& phys_mem.frame_share_count(PhysAddr(raw_pte & !0xFFF)) == 0
+}
+
+/// Maps the candidate page at `page_vaddr`, which is mapped by `raw_pte`, to the merged frame
+/// `stable_frame` and releases the page frame it was mapped to
+fn merge_page(phys_mem: &mut PhysicalMemory, directory: PhysAddr, page_vaddr: VirtAddr,
+	raw_pte: u32, stable_frame: PhysAddr) {
+	if unsafe { !remap_shared(phys_mem, directory, page_vaddr, raw_pte, stable_frame) } {
+		return;
+	}
+	phys_mem.share_frame(stable_frame);
+
+	// The page was a candidate, so it was the only mapping of its frame
+	let frame = PhysAddr(raw_pte & !0xFFF);
+	if phys_mem.drop_frame_reference(frame) {
+		phys_mem.release_phys_mem(frame, 4096);
+	}
+	PAGES_MERGED.fetch_add(1, Ordering::Relaxed);
+}
+
+/// Maps the page at `page_vaddr`, which is currently mapped by `raw_pte`, to `frame`. The page is
+/// made read-only, and copy-on-write if it was writable. Returns false if the page could not be
+/// mapped.
+///
+/// ### Safety
+/// `directory` must be the page directory of a registered address space, and `frame` must have
+/// the same contents as the page
+unsafe fn remap_shared(phys_mem: &mut PhysicalMemory, directory: PhysAddr, page_vaddr: VirtAddr,
+	raw_pte: u32, frame: PhysAddr) -> bool {
+	let mut flags = raw_pte & 0xFFF;
+	if (flags & PAGE_ENTRY_DIRTY) != 0 {
+		// The contents no longer match the file the page was read from, so it can't be dropped
+		// and read in again
+		flags &= !PAGE_ENTRY_FILE;
+	}
+	if (flags & PAGE_ENTRY_WRITE) != 0 {
+		flags = (flags & !PAGE_ENTRY_WRITE) | PAGE_ENTRY_COW;
+	}
+
+	// If the address space is the current one, `map_raw` also flushes the stale translation
+	let mut page_dir = PageDirectory::from_cr3(directory.0);
+	page_dir.map_raw(phys_mem, page_vaddr, frame.0 | flags, true, false).is_some()
+}
+
+/// Hashes the contents of the page at `page_ptr` (FNV-1a over dwords)
+///
+/// ### Safety
+/// `page_ptr` must be valid for reading 4096 bytes
+unsafe fn hash_page(page_ptr: *const u8) -> u32 {
+	let dwords = core::slice::from_raw_parts(page_ptr as *const u32, 1024);
+	dwords.iter().fold(0x811C9DC5u32, |hash, dword| (hash ^ dword).wrapping_mul(0x01000193))
+}
@@ -1,13 +1,13 @@
 //! Kernel entry point
 
-#![feature(asm_sym, asm_const, panic_info_message, default_alloc_error_handler, naked_functions, box_syntax)]
+#![feature(asm_sym, asm_const, panic_info_message, default_alloc_error_handler, naked_functions)]
 #![no_std]
 #![no_main]
 
 extern crate compiler_reqs;
 extern crate alloc;
 
-use alloc::vec;
+use alloc::{sync::Arc, vec};
 use boot_args::BootArgs;
 use page_tables::VirtAddr;
 use serial::println;
@@ -22,13 +22,27 @@ mod gdt;
 mod interrupts;
 mod screen;
 mod keyboard;
+mod input;
 mod mouse;
 mod ps2;
 mod vfs;
+mod procfs;
 mod userspace;
 mod syscall;
 mod process;
+mod signal;
+mod page_fault;
+mod reclaim;
+mod reaper;
+mod swap;
+mod zram;
+mod ksm;
 mod ext2;
+mod ata;
+mod block;
+mod dma;
+mod pci;
+mod virtio_blk;
 mod time;
 
 /// Entry point of the kernel. `boot_args_ptr` is a a physical address below 1MiB which points to a
@@ -51,6 +65,9 @@ pub extern fn entry(boot_args_ptr: *const BootArgs) -> ! {
 
     println!("Initialized memory manager");
 
+    // Create the page tables of the DMA region before any address space copies the kernel's
+    dma::init();
+
     // Initialize the GDT and the TSS
     unsafe { gdt::init(); }
 
@@ -87,7 +104,18 @@ pub extern fn entry(boot_args_ptr: *const BootArgs) -> ! {
     //     println!("Took {} cycles to allocate {} bytes {:?}", elapsed, vec.capacity(), &vec[..3]);
     // }
 
-    ext2::init();
+    // Parse the filesystem image the bootloader loaded
+    ext2::init(&boot_args);
+
+    // Enumerate the PCI bus and set up the devices we have drivers for, e.g. the virtio block
+    // devices, which are preferred for swapping
+    pci::init();
+
+    // Set up the compressed swap store and look for a swap area on the block devices
+    swap::init();
+
+    // Start merging identical user pages in the background
+    ksm::init();
 
     let user_program = {
         let ext2_parser = ext2::EXT2_PARSER.lock();
@@ -102,12 +130,11 @@ pub extern fn entry(boot_args_ptr: *const BootArgs) -> ! {
 
     const KERNEL_INTR_STACK_VADDR: u32 = 0xFFFFB000;
 
+    let user_program = Arc::new(user_program);
     let elf_parser = ElfParser::parse(&user_program).unwrap();
-    let proc = Process::new_from_elf(VirtAddr(KERNEL_INTR_STACK_VADDR), elf_parser);
+    let proc = Process::new_from_elf(VirtAddr(KERNEL_INTR_STACK_VADDR), elf_parser, &user_program)
+        .expect("Failed to create the init process");
 
     SCHEDULER_STATE.lock().processes[0] = Some(proc);
     process::switch_to_current_process();
 }
-
-// TODO: Package this better, currently changes in userland cause the kernel to re-compile
-pub const RAM_EXT2_FS: &[u8] = include_bytes!("../../userland/test_ext2.fs");
\ No newline at end of file
@@ -13,6 +13,7 @@ use range_set::{RangeSet, InclusiveRange};
 use page_tables::{PAGE_ENTRY_PRESENT, PAGE_ENTRY_WRITE, PageDirectory, PhysAddr, PhysMem, VirtAddr};
 use lock_cell::LockCell;
 use boot_args::{BootArgs, LAST_PAGE_TABLE_VADDR, KERNEL_ALLOCATIONS_BASE_VADDR};
+use crate::reclaim;
 
 /// Global to hold the `RangeSet` of available physical memory and the `PageDirectory` which manages
 /// page mappings.
@@ -30,7 +31,102 @@ pub struct PhysicalMemory {
     last_page_table_paddr: PhysAddr,
 
     /// The current physical mapping in the last page (That is used to access physical memory)
-    current_phys_mapping: Option<PhysAddr>
+    current_phys_mapping: Option<PhysAddr>,
+
+    /// Head of the list of free single page frames. Each free frame holds the physical address of
+    /// the next one in its first dword
+    free_frames: Option<PhysAddr>,
+
+    /// Number of frames in the free frame list
+    free_frame_count: u32,
+
+    /// For each physical page frame, the number of mappings of it beyond the first one. Frames
+    /// which are mapped only once (which is every frame that was not explicitly shared) have a
+    /// count of zero, so allocations do not need to touch this array.
+    frame_share_counts: &'static mut [u16],
+}
+
+/// Marks the end of the free frame list
+const NO_FREE_FRAME: u32 = u32::MAX;
+
+impl PhysicalMemory {
+    /// Returns the number of bytes of free physical memory
+    pub fn free_bytes(&self) -> u32 {
+        self.memory_ranges.total_size().unwrap_or(u32::MAX)
+            .saturating_add(self.free_frame_count.saturating_mul(4096))
+    }
+
+    /// Allocates physical memory with the requested `layout`, without trying to reclaim memory.
+    /// Used by the reclaim paths themselves, which must not recurse into reclaim.
+    pub fn allocate_phys_mem_no_reclaim(&mut self, layout: Layout) -> Option<PhysAddr> {
+        if layout.size() == 4096 && layout.align() <= 4096 {
+            if let Some(frame) = self.free_frames {
+                let next = unsafe { *(self.translate_phys(frame, 4)? as *const u32) };
+                self.free_frames = if next == NO_FREE_FRAME { None } else { Some(PhysAddr(next)) };
+                self.free_frame_count -= 1;
+                return Some(frame);
+            }
+        }
+
+        let addr = self.memory_ranges.allocate(layout.size().try_into().ok()?,
+            layout.align().try_into().ok()?);
+        
+        addr.map(PhysAddr)
+    }
+
+    /// Allocates physically contiguous memory with the requested `layout`, whose last byte is at
+    /// most `max_addr`, for devices which can only address part of physical memory. The free
+    /// frame list is not used, so reclaiming memory doesn't help these allocations.
+    pub fn allocate_phys_mem_below(&mut self, layout: Layout, max_addr: u32) -> Option<PhysAddr> {
+        let addr = self.memory_ranges.allocate_below(layout.size().try_into().ok()?,
+            layout.align().try_into().ok()?, max_addr);
+
+        addr.map(PhysAddr)
+    }
+
+    /// Releases the single page frames `frames` at once, by linking them to each other and pushing
+    /// the whole chain to the free frame list
+    pub fn release_frames(&mut self, frames: &[PhysAddr]) {
+        let mut next = self.free_frames.map_or(NO_FREE_FRAME, |frame| frame.0);
+        for frame in frames.iter().rev() {
+            assert!((frame.0 & 0xFFF) == 0);
+            unsafe {
+                let link = self.translate_phys(*frame, 4)
+                    .expect("Failed to translate a released page frame");
+                *(link as *mut u32) = next;
+            }
+            next = frame.0;
+        }
+
+        if let Some(first) = frames.first() {
+            self.free_frames = Some(*first);
+            self.free_frame_count += frames.len() as u32;
+        }
+    }
+
+    /// Records an additional mapping of the page frame at `phys_addr`
+    pub fn share_frame(&mut self, phys_addr: PhysAddr) {
+        let count = self.frame_share_counts.get_mut((phys_addr.0 >> 12) as usize)
+            .expect("Attempt to share an untracked page frame");
+        *count = count.checked_add(1).expect("Page frame share count overflow");
+    }
+
+    /// Returns the number of mappings of the page frame at `phys_addr` beyond the first one
+    pub fn frame_share_count(&self, phys_addr: PhysAddr) -> u16 {
+        self.frame_share_counts.get((phys_addr.0 >> 12) as usize).copied().unwrap_or(0)
+    }
+
+    /// Drops one mapping of the page frame at `phys_addr`. Returns true if that was the last
+    /// mapping of the frame, in which case the caller is responsible for releasing it
+    pub fn drop_frame_reference(&mut self, phys_addr: PhysAddr) -> bool {
+        match self.frame_share_counts.get_mut((phys_addr.0 >> 12) as usize) {
+            Some(count) if *count > 0 => {
+                *count -= 1;
+                false
+            },
+            _ => true
+        }
+    }
 }
 
 impl PhysMem for PhysicalMemory {
@@ -93,11 +189,23 @@ impl PhysMem for PhysicalMemory {
         Some(virt_addr as *mut u8)
     }
 
+    /// Calls `translate_phys` (when reclaiming memory or using the free frame list), so past
+    /// translations are invalidated.
     fn allocate_phys_mem(&mut self, layout: Layout) -> Option<PhysAddr> {
-        let addr = self.memory_ranges.allocate(layout.size().try_into().ok()?,
-            layout.align().try_into().ok()?);
-        
-        addr.map(PhysAddr)
+        // We reclaim page frames when free memory runs low, so allocations don't fail later on
+        let size: u32 = layout.size().try_into().ok()?;
+        if self.free_bytes() < reclaim::LOW_WATERMARK_BYTES.saturating_add(size) {
+            reclaim::reclaim_frames(self, reclaim::RECLAIM_BATCH_FRAMES,
+                reclaim::RECLAIM_SCAN_BUDGET);
+        }
+
+        if let Some(addr) = self.allocate_phys_mem_no_reclaim(layout) {
+            return Some(addr);
+        }
+
+        // The allocation failed, so we reclaim everything we can and try again
+        reclaim::reclaim_frames(self, usize::MAX, usize::MAX);
+        self.allocate_phys_mem_no_reclaim(layout)
     }
 
     fn release_phys_mem(&mut self, phys_addr: PhysAddr, size: usize) {
@@ -105,6 +213,20 @@ impl PhysMem for PhysicalMemory {
             return;
         }
 
+        // Single page frames are pushed to the free frame list, so releasing many scattered frames
+        // does not fragment `memory_ranges`
+        if size == 4096 && (phys_addr.0 & 0xFFF) == 0 {
+            let next = self.free_frames.map_or(NO_FREE_FRAME, |frame| frame.0);
+            unsafe {
+                let link = self.translate_phys(phys_addr, 4)
+                    .expect("Failed to translate a released page frame");
+                *(link as *mut u32) = next;
+            }
+            self.free_frames = Some(phys_addr);
+            self.free_frame_count += 1;
+            return;
+        }
+
         self.memory_ranges.insert(InclusiveRange {
             start: phys_addr.0,
             end: phys_addr.0.saturating_add((size - 1) as u32)
@@ -117,9 +239,66 @@ struct FreePagesEntry {
     next: Option<*mut FreePagesEntry>,
 }
 
+/// The virtual address where the frame share counts array is mapped
+const FRAME_SHARE_COUNTS_VADDR: u32 = 0xC8000000;
+
+/// The size of the virtual region of kernel allocations
+const KERNEL_ALLOCATIONS_SIZE: usize = 0x200000;
+
 static NEXT_AVAILABLE_VADDR: AtomicUsize = AtomicUsize::new(KERNEL_ALLOCATIONS_BASE_VADDR as usize);
 static FREE_PAGES_LIST: LockCell<Option<*mut FreePagesEntry>> = LockCell::new(None);
 
+/// Number of bytes requested by live heap allocations
+static HEAP_BYTES_IN_USE: AtomicUsize = AtomicUsize::new(0);
+/// Number of bytes of heap pages backing live heap allocations
+static HEAP_BYTES_ALLOCATED: AtomicUsize = AtomicUsize::new(0);
+
+/// Usage statistics of the kernel heap
+pub struct HeapStats {
+    /// Bytes of the heap's virtual region which are mapped
+    pub mapped_bytes: usize,
+    /// Bytes requested by live allocations
+    pub bytes_in_use: usize,
+    /// Bytes of pages backing live allocations (allocations are rounded up to whole pages)
+    pub allocated_bytes: usize,
+    /// Bytes in the free list
+    pub free_bytes: usize,
+    /// Number of entries in the free list
+    pub free_list_length: usize,
+    /// Size in bytes of the largest entry in the free list
+    pub largest_free_bytes: usize,
+}
+
+/// Collects the usage statistics of the kernel heap
+pub fn heap_stats() -> HeapStats {
+    let next_available_vaddr = NEXT_AVAILABLE_VADDR.load(Ordering::SeqCst)
+        .min(KERNEL_ALLOCATIONS_BASE_VADDR as usize + KERNEL_ALLOCATIONS_SIZE);
+
+    let mut stats = HeapStats {
+        mapped_bytes: next_available_vaddr - KERNEL_ALLOCATIONS_BASE_VADDR as usize,
+        bytes_in_use: HEAP_BYTES_IN_USE.load(Ordering::SeqCst),
+        allocated_bytes: HEAP_BYTES_ALLOCATED.load(Ordering::SeqCst),
+        free_bytes: 0,
+        free_list_length: 0,
+        largest_free_bytes: 0,
+    };
+
+    let start_of_free_list = FREE_PAGES_LIST.lock();
+    let mut entry = *start_of_free_list;
+    while let Some(entry_ptr) = entry {
+        let free_pages = unsafe { core::ptr::read(entry_ptr) };
+        let entry_bytes = free_pages.page_count * 4096;
+
+        stats.free_bytes += entry_bytes;
+        stats.free_list_length += 1;
+        stats.largest_free_bytes = stats.largest_free_bytes.max(entry_bytes);
+
+        entry = free_pages.next;
+    }
+
+    stats
+}
+
 /// The global allocator for the kernel
 #[global_allocator]
 static GLOBAL_ALLOCATOR: GlobalAllocator = GlobalAllocator;
@@ -235,8 +414,7 @@ impl GlobalAllocator {
 
         // Check we have enough room for the allocation
         if virt_addr.checked_add(aligned_size - 1)? >=
-            KERNEL_ALLOCATIONS_BASE_VADDR as usize + 0x200000 {
-            // TODO: Move the size to a better place
+            KERNEL_ALLOCATIONS_BASE_VADDR as usize + KERNEL_ALLOCATIONS_SIZE {
             return None;
         }
 
@@ -343,11 +521,20 @@ impl GlobalAllocator {
 
 unsafe impl GlobalAlloc for GlobalAllocator {
     unsafe fn alloc(&self, layout: Layout) -> *mut u8 {
-        self.alloc_internal(layout).unwrap_or(core::ptr::null_mut())
+        match self.alloc_internal(layout) {
+            Some(allocation) => {
+                HEAP_BYTES_IN_USE.fetch_add(layout.size(), Ordering::SeqCst);
+                HEAP_BYTES_ALLOCATED.fetch_add((layout.size() + 4095) & !0xFFF, Ordering::SeqCst);
+                allocation
+            },
+            None => core::ptr::null_mut()
+        }
     }
 
     unsafe fn dealloc(&self, ptr: *mut u8, layout: Layout) {
         assert!(self.dealloc_internal(ptr, layout).is_some());
+        HEAP_BYTES_IN_USE.fetch_sub(layout.size(), Ordering::SeqCst);
+        HEAP_BYTES_ALLOCATED.fetch_sub((layout.size() + 4095) & !0xFFF, Ordering::SeqCst);
     }
 }
 
@@ -363,7 +550,10 @@ pub fn init(boot_args: &BootArgs) {
     let mut phys_mem = PhysicalMemory{
         memory_ranges: boot_args.free_memory,
         last_page_table_paddr: boot_args.last_page_table_paddr,
-        current_phys_mapping: None
+        current_phys_mapping: None,
+        free_frames: None,
+        free_frame_count: 0,
+        frame_share_counts: &mut [],
     };
     
     // Setup the page directory
@@ -374,6 +564,20 @@ pub fn init(boot_args: &BootArgs) {
         page_directory.unmap(&mut phys_mem, VirtAddr(paddr), false)
             .expect("Failed to unmap temp identity map");
     }
+
+    // Map the frame share counts array, with an entry for every frame up to the highest usable
+    // physical address
+    let max_phys_addr = boot_args.free_memory.ranges().iter().map(|range| range.end).max()
+        .expect("No usable physical memory");
+    let frame_count = (max_phys_addr as usize >> 12) + 1;
+    let share_counts_size = frame_count * core::mem::size_of::<u16>();
+    page_directory.map(&mut phys_mem, VirtAddr(FRAME_SHARE_COUNTS_VADDR), share_counts_size as u32,
+        true, false).expect("Failed to map the frame share counts");
+    let frame_share_counts = unsafe {
+        core::slice::from_raw_parts_mut(FRAME_SHARE_COUNTS_VADDR as *mut u16, frame_count)
+    };
+    frame_share_counts.fill(0);
+    phys_mem.frame_share_counts = frame_share_counts;
     
     *pmem = Some((phys_mem, page_directory));
 }
\ No newline at end of file
@@ -1,53 +1,149 @@
 //! General mouse definitions and methods
 
-use exclusive_cell::ExclusiveCell;
-
-/// Represents the current state of the mouse
-pub struct MouseState {
-	left_button_down: bool,
-	right_button_down: bool,
-	middle_button_down: bool,
-	fourth_button_down: bool,
-	fifth_button_down: bool,
-	x: f32,
-	y: f32,
+use core::sync::atomic::{AtomicU32, Ordering};
+
+use lock_cell::LockCell;
+use syscall_interface::{SyscallMouseEvent, MOUSE_BUTTON_LEFT, MOUSE_BUTTON_RIGHT,
+	MOUSE_BUTTON_MIDDLE, MOUSE_BUTTON_FOURTH, MOUSE_BUTTON_FIFTH, MOUSE_SAMPLE_RATES};
+
+/// The number of events the mouse events ring can hold
+const MOUSE_EVENTS_CAPACITY: usize = 256;
+
+/// A ring of mouse events waiting to be read. When the reader lags behind, motion is coalesced
+/// into the newest unread event instead of taking up more of the ring.
+struct MouseEventRing {
+	events: [SyscallMouseEvent; MOUSE_EVENTS_CAPACITY],
+	/// Index of the oldest unread event
+	head: usize,
+	/// Number of unread events
+	len: usize,
 }
 
-impl MouseState {
-	/// Constructs a mouse state object that represents the state of the mouse on start-up
-	const fn new() -> Self {
-		Self {
-			left_button_down: false,
-			right_button_down: false,
-			middle_button_down: false,
-			fourth_button_down: false,
-			fifth_button_down: false,
-			x: 0.0,
-			y: 0.0,
+impl MouseEventRing {
+	/// Adds `event` to the ring. If the newest unread event has the same buttons down, the motion
+	/// of `event` is added to it instead. Returns false if the ring is full and the event was
+	/// dropped, and whether the event was coalesced otherwise.
+	fn push(&mut self, event: SyscallMouseEvent) -> Result<bool, ()> {
+		if self.len > 0 {
+			let tail = &mut self.events[(self.head + self.len - 1) % MOUSE_EVENTS_CAPACITY];
+			if tail.buttons == event.buttons {
+				tail.x_delta = tail.x_delta.saturating_add(event.x_delta);
+				tail.y_delta = tail.y_delta.saturating_add(event.y_delta);
+				tail.z_delta = tail.z_delta.saturating_add(event.z_delta);
+				return Ok(true);
+			}
+		}
+
+		if self.len == MOUSE_EVENTS_CAPACITY {
+			return Err(());
 		}
+
+		self.events[(self.head + self.len) % MOUSE_EVENTS_CAPACITY] = event;
+		self.len += 1;
+		Ok(false)
+	}
+
+	/// Removes the oldest unread event from the ring
+	fn pop(&mut self) -> Option<SyscallMouseEvent> {
+		if self.len == 0 {
+			return None;
+		}
+
+		let event = self.events[self.head];
+		self.head = (self.head + 1) % MOUSE_EVENTS_CAPACITY;
+		self.len -= 1;
+		Some(event)
 	}
 }
 
-/// The global mouse state. Access should be exclusive: we do not expect to recieve two mouse
-/// events simultaneously
-static MOUSE_STATE: ExclusiveCell<MouseState> = ExclusiveCell::new(MouseState::new());
+/// The mouse events waiting to be read. The lock masks interrupts, so the mouse interrupt can't
+/// push events while they are read.
+static MOUSE_EVENTS: LockCell<MouseEventRing> = LockCell::new(MouseEventRing {
+	events: [SyscallMouseEvent { x_delta: 0, y_delta: 0, z_delta: 0, buttons: 0, reserved: 0 };
+		MOUSE_EVENTS_CAPACITY],
+	head: 0,
+	len: 0,
+});
+
+/// Total number of mouse packets received
+static MOUSE_PACKETS: AtomicU32 = AtomicU32::new(0);
+/// Number of mouse packets whose motion was coalesced into an unread event
+static COALESCED_PACKETS: AtomicU32 = AtomicU32::new(0);
+/// Number of mouse packets which were dropped because the events ring was full
+static DROPPED_PACKETS: AtomicU32 = AtomicU32::new(0);
+
+/// Returns the total number of mouse packets received, and the number of them which were coalesced
+/// and dropped
+#[allow(unused)]
+pub fn get_stats() -> (u32, u32, u32) {
+	(MOUSE_PACKETS.load(Ordering::Relaxed), COALESCED_PACKETS.load(Ordering::Relaxed),
+		DROPPED_PACKETS.load(Ordering::Relaxed))
+}
+
+/// Clamps a packet delta to the range of an event delta
+fn clamp_delta(delta: i32) -> i16 {
+	delta.clamp(i16::MIN as i32, i16::MAX as i32) as i16
+}
 
 pub fn mouse_event(left_down: bool, right_down: bool, middle_down: bool, fourth_down: bool,
 	fifth_down: bool, x_delta: i32, y_delta: i32, z_delta: i32) {
-	let mut mouse_state = MOUSE_STATE.acquire();
-
-	mouse_state.left_button_down = left_down;
-	mouse_state.right_button_down = right_down;
-	mouse_state.middle_button_down = middle_down;
-	mouse_state.fourth_button_down = fourth_down;
-	mouse_state.fifth_button_down = fifth_down;
-	
-	if left_down { // TODO: DEBUG CODE
-		mouse_state.x += (x_delta as f32)/20.;
+	let mut buttons = 0;
+	for (down, button) in [(left_down, MOUSE_BUTTON_LEFT), (right_down, MOUSE_BUTTON_RIGHT),
+		(middle_down, MOUSE_BUTTON_MIDDLE), (fourth_down, MOUSE_BUTTON_FOURTH),
+		(fifth_down, MOUSE_BUTTON_FIFTH)] {
+		if down {
+			buttons |= button;
+		}
+	}
+
+	let event = SyscallMouseEvent {
+		x_delta: clamp_delta(x_delta),
+		y_delta: clamp_delta(y_delta),
+		z_delta: z_delta.clamp(i8::MIN as i32, i8::MAX as i32) as i8,
+		buttons,
+		reserved: 0,
+	};
+
+	MOUSE_PACKETS.fetch_add(1, Ordering::Relaxed);
+	match MOUSE_EVENTS.lock().push(event) {
+		Ok(true) => { COALESCED_PACKETS.fetch_add(1, Ordering::Relaxed); },
+		Ok(false) => {},
+		Err(()) => { DROPPED_PACKETS.fetch_add(1, Ordering::Relaxed); },
 	}
-	mouse_state.y += (y_delta as f32)/20.;
+}
+
+/// Moves as many unread mouse events as fit to `buf`, oldest first. Only whole events are copied.
+/// Does not wait for events. Returns the number of bytes copied.
+pub fn read_events(buf: &mut [u8]) -> usize {
+	let event_size = core::mem::size_of::<SyscallMouseEvent>();
 
-	// TODO: DEBUG CODE
-	crate::screen::set_cursor_offset(mouse_state.x as usize);
-	// crate::println!("X: {} ({})", mouse_state.x as usize, mouse_state.x);
-}
\ No newline at end of file
+	let mut events = MOUSE_EVENTS.lock();
+	let mut num_read = 0;
+	for raw_event in buf.chunks_exact_mut(event_size) {
+		let event = match events.pop() {
+			Some(event) => event,
+			None => break,
+		};
+
+		raw_event.copy_from_slice(unsafe {
+			core::slice::from_raw_parts(&event as *const SyscallMouseEvent as *const u8, event_size)
+		});
+		num_read += event_size;
+	}
+
+	num_read
+}
+
+/// Handles sample rates written to the mouse device: each byte of `buf` is a sample rate in samples
+/// per second, which must be one of `MOUSE_SAMPLE_RATES`. Stops at the first invalid rate, or if
+/// the mouse can't take a command right now. Returns the number of bytes of `buf` which were
+/// handled.
+pub fn control(buf: &[u8]) -> usize {
+	for (idx, &rate) in buf.iter().enumerate() {
+		if !MOUSE_SAMPLE_RATES.contains(&rate) || !crate::ps2::mouse::set_sample_rate(rate) {
+			return idx;
+		}
+	}
+
+	buf.len()
+}
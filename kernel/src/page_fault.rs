@@ -0,0 +1,477 @@
+//! Page fault handling. Faults on pages of the current process' virtual memory areas are resolved
+//! by mapping the pages in (demand-zero, file-backed and stack growth faults) or by copying shared
+//! pages (copy-on-write faults). Any other fault is delivered to the faulting process.
+//!
+//! The common faults, which only map in a new page, take their page frames from a small cache
+//! which is refilled in the background, and walk the page tables through a window of their own, so
+//! they don't take `PHYS_MEM`. Copy-on-write and swap-in faults go through `PHYS_MEM`.
+
+use core::alloc::Layout;
+use core::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+
+use boot_args::LAST_PAGE_TABLE_VADDR;
+use lock_cell::LockCell;
+use page_tables::{PageDirectory, PhysAddr, PhysMem, VirtAddr, PAGE_ENTRY_PRESENT, PAGE_ENTRY_WRITE,
+	PAGE_ENTRY_USER, PAGE_ENTRY_COW, PAGE_ENTRY_FILE};
+use serial::println;
+use crate::{memory_manager::{self, PhysicalMemory}, reclaim, swap};
+use crate::interrupts::TrapFrame;
+use crate::process::{self, VirtualMemoryArea, VmaBacking};
+
+/// The fault was caused by a page-level protection violation (else by a non-present page)
+const PF_ERROR_PROTECTION: u32 = 1 << 0;
+/// The access causing the fault was a write (else a read)
+const PF_ERROR_WRITE: u32 = 1 << 1;
+/// The access causing the fault was a user-mode access (else a supervisor-mode access)
+const PF_ERROR_USER: u32 = 1 << 2;
+
+/// Accesses this far below the stack pointer are still considered stack accesses (`pushad` writes
+/// 32 bytes below the stack pointer)
+const STACK_ACCESS_SLACK: u32 = 64;
+
+/// The exit code of a process which was terminated because of an invalid memory access (the exit
+/// code a shell reports for SIGSEGV)
+const SEGFAULT_EXIT_CODE: u8 = 128 + 11;
+
+/// The virtual page the page fault handler maps page frames at, so it doesn't use the window of
+/// `PHYS_MEM`. It is in the last page table, which every address space shares.
+const FAULT_WINDOW_VADDR: u32 = 0xFFFF7000;
+/// The number of page frames set aside for resolving faults without taking `PHYS_MEM`
+const FRAME_CACHE_SIZE: usize = 16;
+
+/// The number of buckets in each fault latency histogram
+pub const HISTOGRAM_BUCKETS: usize = 16;
+/// The log2 of the upper bound in cycles of the first histogram bucket. Each bucket after it
+/// covers twice the cycles, and the last bucket also counts everything above it.
+pub const HISTOGRAM_FIRST_BUCKET_SHIFT: u32 = 9;
+
+/// How a page fault was handled
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum FaultType {
+	/// An anonymous page was mapped in and zeroed
+	DemandZero,
+	/// A private copy of a shared page was made (or the page was made writable if it was no longer
+	/// shared)
+	CopyOnWrite,
+	/// A page was mapped in and read from the file backing it
+	FileBacked,
+	/// The stack grew down to cover the faulting page
+	StackGrowth,
+	/// A page was read back from the swap area (or the swap cache)
+	SwapIn,
+	/// A page was decompressed from the compressed store
+	CompressedSwapIn,
+	/// The page was already mapped with the required permissions
+	Spurious,
+	/// The fault could not be resolved
+	Invalid,
+	Count
+}
+
+/// The reason a page fault could not be resolved
+#[derive(Clone, Copy, Debug)]
+enum FaultError {
+	/// The fault address is in kernel memory
+	KernelAddress,
+	/// There is no current process to resolve the fault for
+	NoProcess,
+	/// The fault address is not in any of the process' virtual memory areas
+	NoVma,
+	/// The access is not permitted by the virtual memory area
+	AccessViolation,
+	/// A page frame could not be allocated
+	OutOfMemory,
+	/// A swapped-out page could not be read from the swap area or the compressed store
+	SwapFailure,
+}
+
+/// The page frames set aside for the page fault handler, and the frame its window maps. Frames are
+/// handed out through `PhysMem`, so the page tables can allocate from them too.
+struct FaultFrames {
+	frames: [PhysAddr; FRAME_CACHE_SIZE],
+	len: usize,
+	window_paddr: Option<PhysAddr>,
+}
+
+/// Only taken by the page fault handler and its refill, which never fault while holding it
+static FAULT_FRAMES: LockCell<FaultFrames> = LockCell::new(FaultFrames {
+	frames: [PhysAddr(0); FRAME_CACHE_SIZE],
+	len: 0,
+	window_paddr: None,
+});
+
+impl PhysMem for FaultFrames {
+	unsafe fn translate_phys(&mut self, phys_addr: PhysAddr, size: usize) -> Option<*mut u8> {
+		if size == 0 {
+			return None;
+		}
+
+		// The window is a single page
+		let phys_addr_page = phys_addr.0 & !0xFFF;
+		if (phys_addr.0 - phys_addr_page).checked_add(size as u32 - 1)? > 4095 {
+			return None;
+		}
+
+		if self.window_paddr != Some(PhysAddr(phys_addr_page)) {
+			let raw_pte = PAGE_ENTRY_PRESENT | PAGE_ENTRY_WRITE | phys_addr_page;
+			PageDirectory::map_raw_directly(VirtAddr(FAULT_WINDOW_VADDR), raw_pte, true,
+				VirtAddr(LAST_PAGE_TABLE_VADDR))?;
+			self.window_paddr = Some(PhysAddr(phys_addr_page));
+		}
+
+		Some((FAULT_WINDOW_VADDR + (phys_addr.0 - phys_addr_page)) as *mut u8)
+	}
+
+	fn allocate_phys_mem(&mut self, layout: Layout) -> Option<PhysAddr> {
+		if layout.size() > 4096 || layout.align() > 4096 || self.len == 0 {
+			return None;
+		}
+
+		self.len -= 1;
+		Some(self.frames[self.len])
+	}
+
+	fn release_phys_mem(&mut self, phys_addr: PhysAddr, size: usize) {
+		// Only frames which were taken from the cache are released to it
+		assert!(size == 4096 && self.len < FRAME_CACHE_SIZE);
+		self.frames[self.len] = phys_addr;
+		self.len += 1;
+	}
+}
+
+/// Tops up the page frames set aside for the page fault handler, unless memory is low
+pub fn refill_frame_cache(phys_mem: &mut PhysicalMemory) {
+	let mut fault_frames = FAULT_FRAMES.lock();
+	while fault_frames.len < FRAME_CACHE_SIZE
+		&& phys_mem.free_bytes() > reclaim::LOW_WATERMARK_BYTES {
+		match phys_mem.allocate_phys_mem_no_reclaim(page_layout()) {
+			Some(frame) => fault_frames.release_phys_mem(frame, 4096),
+			None => break,
+		}
+	}
+}
+
+/// Called on every timer tick. Must only be called from the deferred work of the timer interrupt.
+pub fn handle_timer_tick() {
+	if FAULT_FRAMES.lock().len > FRAME_CACHE_SIZE / 2 {
+		return;
+	}
+
+	// Interrupts are masked while the physical memory lock is held, so it can't be held by the
+	// code we interrupted
+	let mut pmem = memory_manager::PHYS_MEM.lock();
+	let (phys_mem, _) = pmem.as_mut().unwrap();
+	refill_frame_cache(phys_mem);
+}
+
+/// Statistics collected for each type of page fault
+struct FaultStats {
+	count: AtomicU32,
+	total_cycles: AtomicU64,
+	histogram: [AtomicU32; HISTOGRAM_BUCKETS],
+}
+
+/// A snapshot of the statistics of a type of page fault
+#[derive(Clone, Copy, Debug)]
+pub struct FaultStatsSnapshot {
+	pub count: u32,
+	pub total_cycles: u64,
+	pub histogram: [u32; HISTOGRAM_BUCKETS],
+}
+
+const ZERO_BUCKET: AtomicU32 = AtomicU32::new(0);
+const NO_FAULTS: FaultStats = FaultStats {
+	count: AtomicU32::new(0),
+	total_cycles: AtomicU64::new(0),
+	histogram: [ZERO_BUCKET; HISTOGRAM_BUCKETS],
+};
+static FAULT_STATS: [FaultStats; FaultType::Count as usize] = [NO_FAULTS; FaultType::Count as usize];
+
+/// Returns a snapshot of the statistics of page faults of type `fault_type`
+pub fn get_stats(fault_type: FaultType) -> FaultStatsSnapshot {
+	let stats = &FAULT_STATS[fault_type as usize];
+	let mut histogram = [0u32; HISTOGRAM_BUCKETS];
+	for (bucket, count) in histogram.iter_mut().zip(stats.histogram.iter()) {
+		*bucket = count.load(Ordering::Relaxed);
+	}
+
+	FaultStatsSnapshot {
+		count: stats.count.load(Ordering::Relaxed),
+		total_cycles: stats.total_cycles.load(Ordering::Relaxed),
+		histogram,
+	}
+}
+
+/// Prints the statistics of every type of page fault to the serial port
+#[allow(unused)]
+pub fn dump_stats() {
+	const FAULT_TYPES: [FaultType; FaultType::Count as usize] = [FaultType::DemandZero,
+		FaultType::CopyOnWrite, FaultType::FileBacked, FaultType::StackGrowth, FaultType::SwapIn,
+		FaultType::CompressedSwapIn, FaultType::Spurious, FaultType::Invalid];
+
+	println!("Page faults:");
+	for fault_type in FAULT_TYPES {
+		let stats = get_stats(fault_type);
+		let average_cycles = stats.total_cycles.checked_div(stats.count as u64).unwrap_or(0);
+		println!("\t{:?}: {} faults, {} cycles on average, histogram {:?}", fault_type,
+			stats.count, average_cycles, stats.histogram);
+	}
+}
+
+/// Adds a fault of type `fault_type` which took `cycles` cycles to handle to the statistics
+fn record_fault(fault_type: FaultType, cycles: u64) {
+	let stats = &FAULT_STATS[fault_type as usize];
+	stats.count.fetch_add(1, Ordering::Relaxed);
+	stats.total_cycles.fetch_add(cycles, Ordering::Relaxed);
+
+	let log2_cycles = 63u32.saturating_sub(cycles.leading_zeros());
+	let bucket = (log2_cycles.saturating_sub(HISTOGRAM_FIRST_BUCKET_SHIFT - 1) as usize)
+		.min(HISTOGRAM_BUCKETS - 1);
+	stats.histogram[bucket].fetch_add(1, Ordering::Relaxed);
+}
+
+/// Page fault handler, registered for vector 14
+pub unsafe fn handle_page_fault(frame: &mut TrapFrame) {
+	let start_cycles = cpu::serializing_rdtsc();
+	let fault_vaddr = VirtAddr(cpu::get_cr2() as u32);
+
+	let mut result = resolve_fault(fault_vaddr, frame);
+	while let Err(FaultError::OutOfMemory) = result {
+		if (frame.error_code & PF_ERROR_USER) == 0 {
+			break;
+		}
+
+		// Nothing is left to reclaim, so we terminate a process to free memory and try again. The
+		// fault happened in user-mode, so no kernel locks are held.
+		if !reclaim::oom_kill() {
+			panic!("Out of memory and there is no process to terminate");
+		}
+		result = resolve_fault(fault_vaddr, frame);
+	}
+
+	let fault_type = *result.as_ref().unwrap_or(&FaultType::Invalid);
+	record_fault(fault_type, cpu::serializing_rdtsc() - start_cycles);
+
+	if let Err(error) = result {
+		if (frame.error_code & PF_ERROR_USER) == 0 {
+			panic!("Page-Fault Exception (#PF) CR2={:#010x} eip={:#010x} code={:#x} ({:?})",
+				fault_vaddr.0, frame.eip, frame.error_code, error);
+		}
+
+		// The fault happened in user-mode, so no kernel locks are held and the process can be
+		// terminated
+		println!("Process segfault at {:#010x} eip={:#010x} code={:#x} ({:?})", fault_vaddr.0,
+			frame.eip, frame.error_code, error);
+		process::exit_current_process(SEGFAULT_EXIT_CODE);
+	}
+}
+
+/// Tries to resolve a fault on `fault_vaddr` in the current process
+fn resolve_fault(fault_vaddr: VirtAddr, frame: &TrapFrame) -> Result<FaultType, FaultError> {
+	// User memory is in the lower 3GiB, any fault above it is a kernel bug or a user-mode access
+	// to kernel memory
+	if fault_vaddr.0 >= 0xC000_0000 {
+		return Err(FaultError::KernelAddress);
+	}
+
+	let is_write = (frame.error_code & PF_ERROR_WRITE) != 0;
+	let page_vaddr = VirtAddr(fault_vaddr.0 & !0xFFF);
+
+	// The page fault gate masks interrupts, so the current process can't change under us
+	let proc = unsafe { process::current_process_unlocked() }.ok_or(FaultError::NoProcess)?;
+
+	let mut grew_stack = false;
+	if proc.find_vma(fault_vaddr).is_none() {
+		// An access right below the stack pointer is the stack growing (kernel accesses to user
+		// memory come from syscalls, which don't know where the user stack pointer is)
+		let is_user = (frame.error_code & PF_ERROR_USER) != 0;
+		if is_user && fault_vaddr.0.wrapping_add(STACK_ACCESS_SLACK) < frame.user_esp {
+			return Err(FaultError::NoVma);
+		}
+		proc.grow_stack(fault_vaddr).ok_or(FaultError::NoVma)?;
+		grew_stack = true;
+	}
+	let vma = proc.find_vma(fault_vaddr).ok_or(FaultError::NoVma)?;
+
+	if is_write && !vma.write {
+		return Err(FaultError::AccessViolation);
+	}
+
+	if let Some(result) = resolve_fault_without_lock(page_vaddr, is_write, vma, grew_stack) {
+		return result;
+	}
+
+	let mut pmem = memory_manager::PHYS_MEM.lock();
+	let (phys_mem, _) = pmem.as_mut().ok_or(FaultError::OutOfMemory)?;
+	refill_frame_cache(phys_mem);
+	// The faulting address space is the one currently loaded
+	let mut page_dir = unsafe { PageDirectory::from_cr3(cpu::get_cr3() as u32) };
+
+	let raw_pte = page_dir.get_page_table_entry(phys_mem, page_vaddr).unwrap_or(0);
+	if (raw_pte & PAGE_ENTRY_PRESENT) != 0 {
+		if !is_write || (raw_pte & PAGE_ENTRY_WRITE) != 0 {
+			// The page was mapped in after the fault was raised
+			return Ok(FaultType::Spurious);
+		}
+
+		if (frame.error_code & PF_ERROR_PROTECTION) == 0 || (raw_pte & PAGE_ENTRY_COW) == 0 {
+			return Err(FaultError::AccessViolation);
+		}
+
+		let frame_paddr = PhysAddr(raw_pte & !0xFFF);
+		let writable_pte = (raw_pte & !PAGE_ENTRY_COW) | PAGE_ENTRY_WRITE;
+		if phys_mem.frame_share_count(frame_paddr) == 0 {
+			// All other mappings of the frame are gone, so we can just take it over
+			unsafe {
+				page_dir.map_raw(phys_mem, page_vaddr, writable_pte, true, false)
+					.ok_or(FaultError::OutOfMemory)?;
+			}
+			return Ok(FaultType::CopyOnWrite);
+		}
+
+		let copy_paddr = allocate_page(phys_mem)?;
+
+		// Allocating might have reclaimed the shared frame, in which case the fault is retried
+		if page_dir.get_page_table_entry(phys_mem, page_vaddr) != Some(raw_pte) {
+			phys_mem.release_phys_mem(copy_paddr, 4096);
+			return Ok(FaultType::Spurious);
+		}
+
+		unsafe {
+			// The shared frame is still mapped (read-only) at the faulting page, so it can be
+			// copied from there
+			let copy_ptr = phys_mem.translate_phys(copy_paddr, 4096).unwrap();
+			core::ptr::copy_nonoverlapping(page_vaddr.0 as *const u8, copy_ptr, 4096);
+			if page_dir.map_raw(phys_mem, page_vaddr, copy_paddr.0 | (writable_pte & 0xFFF), true,
+				false).is_none() {
+				phys_mem.release_phys_mem(copy_paddr, 4096);
+				return Err(FaultError::OutOfMemory);
+			}
+		}
+		if phys_mem.drop_frame_reference(frame_paddr) {
+			phys_mem.release_phys_mem(frame_paddr, 4096);
+		}
+
+		return Ok(FaultType::CopyOnWrite);
+	}
+
+	let mut pte_flags = PAGE_ENTRY_PRESENT | PAGE_ENTRY_USER;
+	if vma.write {
+		pte_flags |= PAGE_ENTRY_WRITE;
+	}
+
+	if let Some(entry) = swap::get_swap_entry(raw_pte) {
+		// The frame is allocated before swapping in, so any reclaiming happens first
+		let page_paddr = allocate_page(phys_mem)?;
+		if page_dir.get_page_table_entry(phys_mem, page_vaddr) != Some(raw_pte) {
+			phys_mem.release_phys_mem(page_paddr, 4096);
+			return Ok(FaultType::Spurious);
+		}
+
+		// Only unshared pages are swapped out, so the page is private to this address space
+		let page_paddr = match swap::swap_in(phys_mem, entry, page_paddr) {
+			Some(swapped_in_paddr) => swapped_in_paddr,
+			None => {
+				phys_mem.release_phys_mem(page_paddr, 4096);
+				return Err(FaultError::SwapFailure);
+			}
+		};
+		unsafe {
+			page_dir.map_raw(phys_mem, page_vaddr, page_paddr.0 | pte_flags, true, false)
+				.ok_or(FaultError::OutOfMemory)?;
+		}
+		return match entry {
+			swap::SwapEntry::Drive(_) => Ok(FaultType::SwapIn),
+			swap::SwapEntry::Compressed(_) => Ok(FaultType::CompressedSwapIn),
+		};
+	}
+
+	// The page is not mapped in yet, so we allocate and initialize it based on the area backing
+	let page_paddr = allocate_page(phys_mem)?;
+	map_new_page(phys_mem, &mut page_dir, page_vaddr, page_paddr, vma, grew_stack, pte_flags)
+}
+
+/// Resolves the faults which only map in a new page, and spurious faults, with the page frames
+/// set aside for the page fault handler. Returns `None` if the fault must be resolved while holding
+/// `PHYS_MEM`: copy-on-write and swapped-out pages, or when the set aside frames run out.
+fn resolve_fault_without_lock(page_vaddr: VirtAddr, is_write: bool, vma: &VirtualMemoryArea,
+	grew_stack: bool) -> Option<Result<FaultType, FaultError>> {
+	let mut fault_frames = FAULT_FRAMES.lock();
+	let mut page_dir = unsafe { PageDirectory::from_cr3(cpu::get_cr3() as u32) };
+
+	let raw_pte = page_dir.get_page_table_entry(&mut *fault_frames, page_vaddr).unwrap_or(0);
+	if (raw_pte & PAGE_ENTRY_PRESENT) != 0 {
+		if !is_write || (raw_pte & PAGE_ENTRY_WRITE) != 0 {
+			return Some(Ok(FaultType::Spurious));
+		}
+		return None;
+	}
+
+	// One frame for the page, and one for its page table if it doesn't exist yet
+	if swap::get_swap_entry(raw_pte).is_some() || fault_frames.len < 2 {
+		return None;
+	}
+
+	let mut pte_flags = PAGE_ENTRY_PRESENT | PAGE_ENTRY_USER;
+	if vma.write {
+		pte_flags |= PAGE_ENTRY_WRITE;
+	}
+
+	let page_paddr = fault_frames.allocate_phys_mem(page_layout())?;
+	Some(map_new_page(&mut *fault_frames, &mut page_dir, page_vaddr, page_paddr, vma, grew_stack,
+		pte_flags))
+}
+
+/// Initializes the page frame at `page_paddr` with the contents of the page at `page_vaddr` in
+/// `vma` and maps it there. The frame is released if it can't be mapped.
+fn map_new_page(phys_mem: &mut impl PhysMem, page_dir: &mut PageDirectory, page_vaddr: VirtAddr,
+	page_paddr: PhysAddr, vma: &VirtualMemoryArea, grew_stack: bool, pte_flags: u32)
+	-> Result<FaultType, FaultError> {
+	let fault_type = unsafe {
+		let page_ptr = phys_mem.translate_phys(page_paddr, 4096).unwrap();
+		match &vma.backing {
+			VmaBacking::Anonymous | VmaBacking::Stack => {
+				core::ptr::write_bytes(page_ptr, 0, 4096);
+				if grew_stack { FaultType::StackGrowth } else { FaultType::DemandZero }
+			},
+			VmaBacking::File { image, file_offset, file_size } => {
+				let page_offset = (page_vaddr.0 - vma.first_page_vaddr.0) as usize;
+				let file_bytes = file_size.saturating_sub(page_offset).min(4096);
+				if file_bytes > 0 {
+					let file_start = file_offset + page_offset;
+					core::ptr::copy_nonoverlapping(image[file_start..].as_ptr(), page_ptr,
+						file_bytes);
+				}
+				core::ptr::write_bytes(page_ptr.add(file_bytes), 0, 4096 - file_bytes);
+				FaultType::FileBacked
+			},
+		}
+	};
+
+	let mut raw_pte = page_paddr.0 | pte_flags;
+	if fault_type == FaultType::FileBacked {
+		// Marks the page as reclaimable as long as it stays clean
+		raw_pte |= PAGE_ENTRY_FILE;
+	}
+	unsafe {
+		if page_dir.map_raw(phys_mem, page_vaddr, raw_pte, false, true).is_none() {
+			phys_mem.release_phys_mem(page_paddr, 4096);
+			return Err(FaultError::OutOfMemory);
+		}
+	}
+
+	Ok(fault_type)
+}
+
+/// The layout of a page frame
+fn page_layout() -> Layout {
+	Layout::from_size_align(4096, 4096).unwrap()
+}
+
+/// Allocates a page frame for a user page, falling back to the frames set aside for the page fault
+/// handler when nothing is left to reclaim
+fn allocate_page(phys_mem: &mut PhysicalMemory) -> Result<PhysAddr, FaultError> {
+	phys_mem.allocate_phys_mem(page_layout())
+		.or_else(|| FAULT_FRAMES.lock().allocate_phys_mem(page_layout()))
+		.ok_or(FaultError::OutOfMemory)
+}
@@ -0,0 +1,397 @@
+//! PCI bus enumeration through the legacy configuration mechanism (the address and data ports at
+//! 0xCF8 and 0xCFC). The buses are walked from the host bridge through the PCI-to-PCI bridges, and
+//! every function found is recorded in a registry along with its IDs, class, BARs and IRQ line.
+//! Each function is then offered to the drivers in `DRIVERS`, and the first driver whose match
+//! table accepts it and whose probe succeeds is bound to it.
+
+use core::fmt::{self, Write};
+
+use alloc::vec::Vec;
+use lock_cell::LockCell;
+use serial::println;
+use crate::virtio_blk;
+
+/// I/O port which selects the configuration space register accessed through the data port
+const PCI_CONFIG_ADDRESS_PORT: u16 = 0xCF8;
+/// I/O port through which the selected configuration space register is accessed
+const PCI_CONFIG_DATA_PORT: u16 = 0xCFC;
+/// Bit of the configuration address which enables the access
+const PCI_CONFIG_ENABLE: u32 = 1 << 31;
+
+/// Configuration space offset of the vendor ID (low word) and device ID (high word)
+const PCI_VENDOR_DEVICE_OFFSET: u8 = 0x00;
+/// Configuration space offset of the command register (low word) and status register (high word)
+const PCI_COMMAND_OFFSET: u8 = 0x04;
+/// Configuration space offset of the revision (bits 0-7), programming interface (bits 8-15),
+/// subclass (bits 16-23) and class (bits 24-31)
+const PCI_CLASS_OFFSET: u8 = 0x08;
+/// Configuration space offset of the header type byte (at bits 16-23)
+const PCI_HEADER_TYPE_OFFSET: u8 = 0x0C;
+/// Configuration space offset of the first base address register
+const PCI_BAR0_OFFSET: u8 = 0x10;
+/// Configuration space offset of the bus numbers of a PCI-to-PCI bridge, where the secondary bus
+/// is at bits 8-15
+const PCI_BRIDGE_BUS_NUMBERS_OFFSET: u8 = 0x18;
+/// Configuration space offset of the interrupt line byte (at bits 0-7) and the interrupt pin byte
+/// (at bits 8-15), where a pin of 0 means the function doesn't use an interrupt pin
+const PCI_INTERRUPT_LINE_OFFSET: u8 = 0x3C;
+
+/// Command register bit which lets the function respond to I/O space accesses
+const PCI_COMMAND_IO_SPACE: u16 = 1 << 0;
+/// Command register bit which lets the function respond to memory space accesses
+const PCI_COMMAND_MEMORY_SPACE: u16 = 1 << 1;
+/// Command register bit which lets the function master the bus, i.e. perform DMA
+const PCI_COMMAND_BUS_MASTER: u16 = 1 << 2;
+/// Header type bit which is set if the device has more than one function
+const PCI_HEADER_MULTI_FUNCTION: u8 = 1 << 7;
+/// The header layout of general devices, which have six BARs
+const PCI_HEADER_TYPE_GENERAL: u8 = 0;
+/// The header layout of PCI-to-PCI bridges, which have two BARs
+const PCI_HEADER_TYPE_BRIDGE: u8 = 1;
+/// Base address register bit which is set for I/O space BARs
+const PCI_BAR_IO_SPACE: u32 = 1 << 0;
+/// The type bits of a memory BAR which mark it as 64-bit, taking up the next BAR too
+const PCI_BAR_MEMORY_64BIT: u32 = 2 << 1;
+/// Memory BAR bit which marks the memory as prefetchable
+const PCI_BAR_MEMORY_PREFETCHABLE: u32 = 1 << 3;
+
+/// The class and subclass of PCI-to-PCI bridges
+const PCI_CLASS_BRIDGE: u8 = 0x06;
+const PCI_SUBCLASS_PCI_BRIDGE: u8 = 0x04;
+
+/// The vendor ID read from a function which doesn't exist
+const PCI_NO_VENDOR: u16 = 0xFFFF;
+
+/// The drivers offered the functions found on the bus, in order of preference
+const DRIVERS: [PciDriver; 1] = [
+	virtio_blk::PCI_DRIVER,
+];
+
+/// The address of a function on the PCI bus
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub struct PciAddress {
+	pub bus: u8,
+	pub device: u8,
+	pub function: u8,
+}
+
+impl PciAddress {
+	/// Reads the configuration space dword at `offset`, which must be dword aligned
+	pub fn read_config(&self, offset: u8) -> u32 {
+		unsafe {
+			cpu::out32(PCI_CONFIG_ADDRESS_PORT, self.config_address(offset));
+			cpu::in32(PCI_CONFIG_DATA_PORT)
+		}
+	}
+
+	/// Writes `value` to the configuration space dword at `offset`, which must be dword aligned
+	pub fn write_config(&self, offset: u8, value: u32) {
+		unsafe {
+			cpu::out32(PCI_CONFIG_ADDRESS_PORT, self.config_address(offset));
+			cpu::out32(PCI_CONFIG_DATA_PORT, value);
+		}
+	}
+
+	/// Returns the value written to the address port to access the register at `offset`
+	fn config_address(&self, offset: u8) -> u32 {
+		assert!((offset & 3) == 0 && self.device < 32 && self.function < 8);
+		PCI_CONFIG_ENABLE | ((self.bus as u32) << 16) | ((self.device as u32) << 11)
+			| ((self.function as u32) << 8) | (offset as u32)
+	}
+
+	/// Returns the (vendor ID, device ID) of the function
+	fn ids(&self) -> (u16, u16) {
+		let ids = self.read_config(PCI_VENDOR_DEVICE_OFFSET);
+		(ids as u16, (ids >> 16) as u16)
+	}
+
+	/// Returns the header type byte of the function
+	fn header_type(&self) -> u8 {
+		(self.read_config(PCI_HEADER_TYPE_OFFSET) >> 16) as u8
+	}
+
+	/// Writes the command register. The status register bits are cleared by writing ones, so they
+	/// are written back as zeros.
+	fn write_command(&self, command: u16) {
+		self.write_config(PCI_COMMAND_OFFSET, command as u32);
+	}
+
+	fn read_command(&self) -> u16 {
+		self.read_config(PCI_COMMAND_OFFSET) as u16
+	}
+
+	/// Lets the function respond to I/O and memory space accesses and perform DMA
+	pub fn enable_decoding_and_bus_mastering(&self) {
+		self.write_command(self.read_command() | PCI_COMMAND_IO_SPACE | PCI_COMMAND_MEMORY_SPACE
+			| PCI_COMMAND_BUS_MASTER);
+	}
+}
+
+impl fmt::Display for PciAddress {
+	fn fmt(&self, f: &mut fmt::Formatter<'_>) -> fmt::Result {
+		write!(f, "{:02x}:{:02x}.{}", self.bus, self.device, self.function)
+	}
+}
+
+/// What a base address register maps
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum Bar {
+	/// The BAR is not implemented, or is the upper half of a 64-bit memory BAR
+	None,
+	/// A range of I/O ports
+	Io { port: u16, size: u16 },
+	/// A range of physical memory. Ranges above 4GiB are recorded but can't be mapped.
+	Memory { addr: u64, size: u64, prefetchable: bool },
+}
+
+/// A function found on the bus
+#[derive(Clone, Debug)]
+pub struct PciDevice {
+	pub address: PciAddress,
+	pub vendor_id: u16,
+	pub device_id: u16,
+	pub class: u8,
+	pub subclass: u8,
+	pub prog_if: u8,
+	pub revision: u8,
+	pub bars: [Bar; 6],
+	/// The PIC IRQ the function's interrupt pin is routed to, as set up by the BIOS. None if the
+	/// function has no interrupt pin.
+	pub interrupt_line: Option<u8>,
+	/// The name of the driver bound to the function
+	pub driver: Option<&'static str>,
+}
+
+impl PciDevice {
+	/// Returns the I/O port base of the BAR `bar`, or `None` if it doesn't map I/O ports
+	pub fn io_bar(&self, bar: usize) -> Option<u16> {
+		match self.bars[bar] {
+			Bar::Io { port, .. } => Some(port),
+			_ => None,
+		}
+	}
+}
+
+/// A `None` field of a match entry matches any value
+#[derive(Clone, Copy)]
+pub struct PciMatch {
+	pub vendor_id: Option<u16>,
+	pub device_id: Option<u16>,
+	/// The class and subclass
+	pub class: Option<(u8, u8)>,
+}
+
+impl PciMatch {
+	/// Matches the function with the given vendor and device IDs
+	pub const fn ids(vendor_id: u16, device_id: u16) -> Self {
+		PciMatch { vendor_id: Some(vendor_id), device_id: Some(device_id), class: None }
+	}
+
+	/// Matches any function of the given class and subclass
+	#[allow(unused)]
+	pub const fn class(class: u8, subclass: u8) -> Self {
+		PciMatch { vendor_id: None, device_id: None, class: Some((class, subclass)) }
+	}
+
+	fn matches(&self, device: &PciDevice) -> bool {
+		self.vendor_id.map_or(true, |vendor_id| vendor_id == device.vendor_id)
+			&& self.device_id.map_or(true, |device_id| device_id == device.device_id)
+			&& self.class.map_or(true, |class| class == (device.class, device.subclass))
+	}
+}
+
+/// A driver of PCI functions
+pub struct PciDriver {
+	pub name: &'static str,
+	/// The functions the driver is offered
+	pub match_table: &'static [PciMatch],
+	/// Sets up a matching function. Returns whether the driver took the function.
+	pub probe: fn(&PciDevice) -> bool,
+}
+
+/// The functions found on the bus
+static DEVICES: LockCell<Vec<PciDevice>> = LockCell::new(Vec::new());
+
+/// Enumerates the functions on the bus and binds drivers to them. Must be called after the memory
+/// manager and the interrupts are initialized, because the drivers use them.
+pub fn init() {
+	let mut devices = Vec::new();
+
+	// If the host bridge is a multi-function device, each of its functions is the host bridge of
+	// the bus with the same number
+	let host_bridge = PciAddress { bus: 0, device: 0, function: 0 };
+	if (host_bridge.header_type() & PCI_HEADER_MULTI_FUNCTION) == 0 {
+		enumerate_bus(0, &mut devices);
+	} else {
+		for function in 0..8 {
+			if (PciAddress { function, ..host_bridge }).ids().0 != PCI_NO_VENDOR {
+				enumerate_bus(function, &mut devices);
+			}
+		}
+	}
+
+	// The drivers are probed before the registry is published, so probes don't run with its
+	// lock held
+	for device in devices.iter_mut() {
+		for driver in DRIVERS.iter() {
+			if driver.match_table.iter().any(|entry| entry.matches(device)) && (driver.probe)(device) {
+				device.driver = Some(driver.name);
+				break;
+			}
+		}
+	}
+
+	println!("Found {} PCI functions", devices.len());
+	*DEVICES.lock() = devices;
+}
+
+/// Records the functions on `bus` in `devices`, and the functions behind the bridges on it
+fn enumerate_bus(bus: u8, devices: &mut Vec<PciDevice>) {
+	for device in 0..32 {
+		let address = PciAddress { bus, device, function: 0 };
+		if address.ids().0 == PCI_NO_VENDOR {
+			continue;
+		}
+
+		let function_count =
+			if (address.header_type() & PCI_HEADER_MULTI_FUNCTION) != 0 { 8 } else { 1 };
+		for function in 0..function_count {
+			enumerate_function(PciAddress { function, ..address }, devices);
+		}
+	}
+}
+
+/// Records the function at `address` in `devices` if it exists, and if it is a bridge enumerates
+/// the bus behind it
+fn enumerate_function(address: PciAddress, devices: &mut Vec<PciDevice>) {
+	let (vendor_id, device_id) = address.ids();
+	if vendor_id == PCI_NO_VENDOR {
+		return;
+	}
+
+	let class_info = address.read_config(PCI_CLASS_OFFSET);
+	let header_type = address.header_type() & !PCI_HEADER_MULTI_FUNCTION;
+	let bar_count = match header_type {
+		PCI_HEADER_TYPE_GENERAL => 6,
+		PCI_HEADER_TYPE_BRIDGE => 2,
+		_ => 0,
+	};
+
+	let interrupt_info = address.read_config(PCI_INTERRUPT_LINE_OFFSET);
+	let interrupt_line = interrupt_info as u8;
+	let interrupt_pin = (interrupt_info >> 8) as u8;
+	let device = PciDevice {
+		address,
+		vendor_id,
+		device_id,
+		class: (class_info >> 24) as u8,
+		subclass: (class_info >> 16) as u8,
+		prog_if: (class_info >> 8) as u8,
+		revision: class_info as u8,
+		bars: read_bars(address, bar_count),
+		interrupt_line: if interrupt_pin != 0 && interrupt_line < 16 {
+			Some(interrupt_line)
+		} else {
+			None
+		},
+		driver: None,
+	};
+
+	let is_pci_bridge = header_type == PCI_HEADER_TYPE_BRIDGE && device.class == PCI_CLASS_BRIDGE
+		&& device.subclass == PCI_SUBCLASS_PCI_BRIDGE;
+	devices.push(device);
+
+	if is_pci_bridge {
+		let secondary_bus = (address.read_config(PCI_BRIDGE_BUS_NUMBERS_OFFSET) >> 8) as u8;
+		// A bridge the firmware didn't configure has a secondary bus of zero, which would loop
+		if secondary_bus > address.bus {
+			enumerate_bus(secondary_bus, devices);
+		}
+	}
+}
+
+/// Reads the first `bar_count` BARs of the function at `address`. The size of each BAR is found by
+/// writing all ones to it and reading back which address bits are fixed to zero, with decoding
+/// disabled meanwhile so the function doesn't respond at the bogus address.
+fn read_bars(address: PciAddress, bar_count: usize) -> [Bar; 6] {
+	let mut bars = [Bar::None; 6];
+
+	let command = address.read_command();
+	address.write_command(command & !(PCI_COMMAND_IO_SPACE | PCI_COMMAND_MEMORY_SPACE));
+
+	// Writes all ones to the BAR at `offset` and returns its original value and the read back value
+	let probe_bar = |offset: u8| {
+		let original = address.read_config(offset);
+		address.write_config(offset, !0);
+		let mask = address.read_config(offset);
+		address.write_config(offset, original);
+		(original, mask)
+	};
+
+	let mut bar = 0;
+	while bar < bar_count {
+		let offset = PCI_BAR0_OFFSET + (bar as u8) * 4;
+		let (value, mask) = probe_bar(offset);
+		if mask == 0 {
+			bar += 1;
+			continue;
+		}
+
+		if (value & PCI_BAR_IO_SPACE) != 0 {
+			// The upper 16 bits of I/O BARs might not be implemented
+			let size = (!(mask & !3) as u16).wrapping_add(1);
+			bars[bar] = Bar::Io { port: (value & !3) as u16, size };
+			bar += 1;
+		} else if (value & 6) == PCI_BAR_MEMORY_64BIT && bar + 1 < bar_count {
+			let (value_high, mask_high) = probe_bar(offset + 4);
+			let addr = ((value_high as u64) << 32) | (value & !0xF) as u64;
+			let mask = ((mask_high as u64) << 32) | (mask & !0xF) as u64;
+			bars[bar] = Bar::Memory {
+				addr,
+				size: (!mask).wrapping_add(1),
+				prefetchable: (value & PCI_BAR_MEMORY_PREFETCHABLE) != 0,
+			};
+			bar += 2;
+		} else {
+			bars[bar] = Bar::Memory {
+				addr: (value & !0xF) as u64,
+				size: (!(mask & !0xF)).wrapping_add(1) as u64,
+				prefetchable: (value & PCI_BAR_MEMORY_PREFETCHABLE) != 0,
+			};
+			bar += 1;
+		}
+	}
+
+	address.write_command(command);
+	bars
+}
+
+/// Writes the functions in the registry, one per line
+pub fn write_devices(out: &mut impl Write) -> fmt::Result {
+	writeln!(out, "address  vendor:device  class     rev  irq  driver")?;
+	for device in DEVICES.lock().iter() {
+		write!(out, "{}  {:04x}:{:04x}      {:02x}.{:02x}.{:02x}  {:02x}  ", device.address,
+			device.vendor_id, device.device_id, device.class, device.subclass, device.prog_if,
+			device.revision)?;
+		match device.interrupt_line {
+			Some(irq) => write!(out, "{:>3}", irq)?,
+			None => write!(out, "  -")?,
+		}
+		writeln!(out, "  {}", device.driver.unwrap_or("-"))?;
+
+		for (idx, bar) in device.bars.iter().enumerate() {
+			match *bar {
+				Bar::None => {},
+				Bar::Io { port, size } => {
+					writeln!(out, "\tBAR{}: I/O ports {:#06x} ({:#x} bytes)", idx, port, size)?
+				},
+				Bar::Memory { addr, size, prefetchable } => {
+					writeln!(out, "\tBAR{}: memory {:#010x} ({:#x} bytes{})", idx, addr, size,
+						if prefetchable { ", prefetchable" } else { "" })?
+				},
+			}
+		}
+	}
+
+	Ok(())
+}
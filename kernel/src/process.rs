@@ -1,21 +1,70 @@
 use core::arch::asm;
+use core::sync::atomic::{AtomicPtr, AtomicU32, Ordering};
 
-use alloc::{string::String, vec};
+use alloc::{string::String, sync::Arc, vec, vec::Vec};
 use elf_parser::ElfParser;
 use lock_cell::LockCell;
-use page_tables::{PageDirectory, VirtAddr, PhysMem};
+use page_tables::{PageDirectory, VirtAddr, PhysAddr, PhysMem, PAGE_ENTRY_PRESENT, PAGE_ENTRY_WRITE,
+	PAGE_ENTRY_COW};
 use cpu::PushADRegisterState;
-use crate::{gdt, memory_manager::{self, PhysicalMemory}, tss};
+use serial::println;
+use syscall_interface::{SyscallError, SyscallProcessMemInfo};
+use crate::{gdt, memory_manager::{self, PhysicalMemory}, reaper, reclaim, swap, tss};
+use crate::signal::SignalState;
+use crate::vfs::FILE_DESCRIPTIONS;
 
 
 const KERNEL_INTR_STACK_SIZE: u32 = 0x1000;
 const USER_STACK_VADDR: VirtAddr = VirtAddr(0x0FFF_F000);
 const USER_STACK_SIZE: u32 = 0x1000;
+/// The maximum size the user stack can grow to
+const USER_STACK_MAX_SIZE: u32 = 0x10_0000;
+/// User memory is below this address
+const USER_MEMORY_END: usize = 0xC000_0000;
 const USER_DEFAULT_EFLAGS: u32 = 0b0000_0000_0000_0000_0000_0010_0000_0010;
 
+/// What backs the pages of a virtual memory area when they are first accessed
+#[derive(Clone)]
+pub enum VmaBacking {
+	/// Zero-filled pages
+	Anonymous,
+	/// Zero-filled pages. The area grows down when the process faults right below it
+	Stack,
+	/// The first `file_size` bytes of the area are read from `image` at `file_offset`, the rest
+	/// of the area is zero-filled
+	File { image: Arc<Vec<u8>>, file_offset: usize, file_size: usize },
+}
+
+/// A page-aligned range of user virtual memory. Pages of the area are only mapped when they are
+/// first accessed (by the page fault handler)
+#[derive(Clone)]
+pub struct VirtualMemoryArea {
+	pub first_page_vaddr: VirtAddr,
+	pub num_pages: u32,
+	pub write: bool,
+	pub exec: bool,
+	pub backing: VmaBacking,
+}
+
+impl VirtualMemoryArea {
+	/// Checks whether or not `vaddr` is inside the area
+	pub fn contains(&self, vaddr: VirtAddr) -> bool {
+		vaddr >= self.first_page_vaddr &&
+			(vaddr.0 - self.first_page_vaddr.0) / 4096 < self.num_pages
+	}
+
+	/// Checks whether or not the area intersects the pages `first_page_vaddr..end_vaddr`
+	fn overlaps(&self, first_page_vaddr: VirtAddr, end_vaddr: u64) -> bool {
+		let self_end = self.first_page_vaddr.0 as u64 + self.num_pages as u64 * 4096;
+		(first_page_vaddr.0 as u64) < self_end && (self.first_page_vaddr.0 as u64) < end_vaddr
+	}
+}
+
+const NO_VMA: Option<VirtualMemoryArea> = None;
+
 pub struct Process {
 	page_directory: PageDirectory,
-	virtual_memory_ranges: [Option<(VirtAddr, u32, bool, bool)>; 16], // First page vaddr, num pages, write, exec
+	virtual_memory_areas: [Option<VirtualMemoryArea>; 16],
 	kernel_intr_stack: VirtAddr,
 
 	file_descriptors: [Option<usize>; 16],
@@ -27,36 +76,54 @@ pub struct Process {
 	in_kernel: bool,
 
 	exit_code: Option<u8>,
+	/// Number of times the process was switched to
+	times_scheduled: u32,
+
+	pub signals: SignalState,
 }
 
 impl Process {
-	pub fn new(kernel_intr_stack: VirtAddr) -> Self {
+	pub fn new(kernel_intr_stack: VirtAddr) -> Option<Self> {
 		let mut pd_buffer = box[0u8; 1024];
 
 		let mut pmem = memory_manager::PHYS_MEM.lock();
 		let (phys_mem, cur_page_dir) = pmem.as_mut().unwrap();
 
+		// Exited processes are torn down first, which also frees the kernel stack an exited process
+		// might have left at `kernel_intr_stack`
+		reaper::reap_pending(phys_mem, cur_page_dir);
+
 		let old_cr3 = cur_page_dir.get_directory_addr();
 		let cur_pd = unsafe {
 			core::slice::from_raw_parts(phys_mem.translate_phys(old_cr3, 4096).unwrap(), 4096)
 		};
 		pd_buffer.copy_from_slice(&cur_pd[3072..]);
 		
-		let mut proc_page_dir = PageDirectory::new(phys_mem).unwrap();
+		let mut proc_page_dir = PageDirectory::new(phys_mem)?;
 		let new_cr3 = proc_page_dir.get_directory_addr();
 		let new_pd = unsafe {
 			core::slice::from_raw_parts_mut(phys_mem.translate_phys(new_cr3, 4096).unwrap(), 4096)
 		};
 		(&mut new_pd[3072..]).copy_from_slice(&pd_buffer[..]);
 			
-		// FIXME: Temp hack because we dont free the kernel stack yet
+		// FIXME: Temp hack which releases the stack the bootloader mapped where the first process
+		// puts its kernel stack
 		let _ = proc_page_dir.unmap(phys_mem, kernel_intr_stack, true);
 		// TODO: How does this get updates in other processes' page directories?
-		proc_page_dir.map(phys_mem, kernel_intr_stack, KERNEL_INTR_STACK_SIZE, true, false).unwrap();
+		if proc_page_dir.map(phys_mem, kernel_intr_stack, KERNEL_INTR_STACK_SIZE, true, false).is_none()
+			|| !reclaim::register_address_space(new_cr3) {
+			// The stack might be partly mapped. Unmapping its pages also releases the page tables
+			// which were created for it, once they are empty.
+			for offset in (0..KERNEL_INTR_STACK_SIZE).step_by(4096) {
+				let _ = proc_page_dir.unmap(phys_mem, VirtAddr(kernel_intr_stack.0 + offset), true);
+			}
+			phys_mem.release_phys_mem(new_cr3, 4096);
+			return None;
+		}
 
-		Self {
+		Some(Self {
 			page_directory: proc_page_dir,
-			virtual_memory_ranges: [None; 16],
+			virtual_memory_areas: [NO_VMA; 16],
 			kernel_intr_stack,
 			file_descriptors: [None; 16],
 			cwd_inode: ext2_parser::ROOT_INODE,
@@ -65,99 +132,302 @@ impl Process {
 			eflags: USER_DEFAULT_EFLAGS,
 			in_kernel: false,
 			exit_code: None,
+			times_scheduled: 0,
+			signals: SignalState::new(),
+		})
+	}
+
+	/// Releases the memory of a process which never ran
+	fn discard(mut self, phys_mem: &mut PhysicalMemory) {
+		self.unmap_user_virtual_memory(phys_mem);
+
+		// Unmapping every user page also released the page tables, so only the directory is left
+		let directory_addr = self.page_directory.get_directory_addr();
+		reclaim::unregister_address_space(directory_addr);
+		phys_mem.release_phys_mem(directory_addr, 4096);
+	}
+
+	/// Adds `vma` to the process' virtual memory areas. Fails if it overlaps an existing area or
+	/// if there is no room for another area
+	fn add_vma(&mut self, vma: VirtualMemoryArea) -> Option<()> {
+		let end_vaddr = vma.first_page_vaddr.0 as u64 + vma.num_pages as u64 * 4096;
+		if self.virtual_memory_areas.iter().flatten()
+			.any(|area| area.overlaps(vma.first_page_vaddr, end_vaddr)) {
+			return None;
 		}
+
+		let free_slot = self.virtual_memory_areas.iter_mut().find(|area| area.is_none())?;
+		*free_slot = Some(vma);
+		Some(())
+	}
+
+	/// Returns the virtual memory area containing `vaddr`
+	pub fn find_vma(&mut self, vaddr: VirtAddr) -> Option<&mut VirtualMemoryArea> {
+		self.virtual_memory_areas.iter_mut().flatten().find(|area| area.contains(vaddr))
 	}
 
-	fn init_elf(&mut self, elf: ElfParser, phys_mem: &mut PhysicalMemory) {
+	/// Grows the stack down so it covers the page containing `vaddr`. Fails if this would grow the
+	/// stack past its maximum size or into another area
+	pub fn grow_stack(&mut self, vaddr: VirtAddr) -> Option<()> {
+		let page_vaddr = VirtAddr(vaddr.0 & !0xFFF);
+		let stack_limit = USER_STACK_VADDR.0 + USER_STACK_SIZE - USER_STACK_MAX_SIZE;
+		if page_vaddr.0 < stack_limit {
+			return None;
+		}
+
+		let stack_idx = self.virtual_memory_areas.iter().position(|area| {
+			matches!(area, Some(VirtualMemoryArea { backing: VmaBacking::Stack, .. }))
+		})?;
+		let stack_first_page_vaddr = self.virtual_memory_areas[stack_idx].as_ref()?
+			.first_page_vaddr;
+		if page_vaddr >= stack_first_page_vaddr {
+			return None;
+		}
+
+		// Make sure the gap between the stack and the new page is not used by any other area
+		if self.virtual_memory_areas.iter().flatten()
+			.any(|area| area.overlaps(page_vaddr, stack_first_page_vaddr.0 as u64)) {
+			return None;
+		}
+
+		let stack = self.virtual_memory_areas[stack_idx].as_mut()?;
+		stack.num_pages += (stack_first_page_vaddr.0 - page_vaddr.0) / 4096;
+		stack.first_page_vaddr = page_vaddr;
+		Some(())
+	}
+
+	/// Returns whether every segment of `elf` can be mapped by `init_elf`: segments must start at a
+	/// page boundary, be inside user memory, and have no more initialized bytes than their size
+	pub fn is_loadable_elf(elf: &ElfParser) -> bool {
+		elf.for_segment(|seg_vaddr, seg_size, init_bytes, _read, _write, _exec| {
+			let seg_end = seg_vaddr.checked_add(seg_size)?;
+			if seg_vaddr & 0xFFF != 0 || seg_end > USER_MEMORY_END || init_bytes.len() > seg_size {
+				return None;
+			}
+			Some(())
+		}).is_some()
+	}
+
+	/// Maps the stack and the segments of `elf`. Fails with `OutOfMemory` if the stack can't be
+	/// mapped, and with `InvalidElfFile` if the segments can't be added (e.g. they overlap)
+	fn init_elf(&mut self, elf: ElfParser, image: &Arc<Vec<u8>>, phys_mem: &mut PhysicalMemory)
+		-> Result<(), SyscallError> {
+		// The top of the stack is mapped in eagerly because the launch arguments are written to it
 		let (stack_first_page_vaddr, stack_num_pages) = self.page_directory.map(phys_mem,
-			USER_STACK_VADDR, USER_STACK_SIZE, true, true).unwrap();
-		self.virtual_memory_ranges[0] = Some((stack_first_page_vaddr, stack_num_pages, true, false));
+			USER_STACK_VADDR, USER_STACK_SIZE, true, true).ok_or(SyscallError::OutOfMemory)?;
+		self.add_vma(VirtualMemoryArea {
+			first_page_vaddr: stack_first_page_vaddr,
+			num_pages: stack_num_pages,
+			write: true,
+			exec: false,
+			backing: VmaBacking::Stack,
+		}).ok_or(SyscallError::OutOfMemory)?;
 		self.registers.esp = USER_STACK_VADDR.0 + USER_STACK_SIZE;
 
-		let mut virt_mem_range_idx = 1;
 		elf.for_segment(|seg_vaddr, seg_size, init_bytes, _read, write, exec| {
-			let (first_page_vaddr, num_pages) = self.page_directory.map_init(
-				phys_mem,
-				VirtAddr(seg_vaddr as u32),
-				seg_size as u32,
-				write,
-				true,
-				|off| { 
-					if off < init_bytes.len() {
-						init_bytes[off]
-					} else {
-						0
-					}
-				}
-			)?;
+			// Segments are mapped in page by page, so they must start at a page boundary
+			if seg_vaddr & 0xFFF != 0 {
+				return None;
+			}
 
-			assert!(virt_mem_range_idx < self.virtual_memory_ranges.len());
-			self.virtual_memory_ranges[virt_mem_range_idx] = Some((first_page_vaddr, num_pages, write, exec));
-			virt_mem_range_idx += 1;
-			Some(())
-		}).unwrap();
+			if seg_size == 0 {
+				return Some(());
+			}
+
+			let num_pages = (seg_size.checked_add(0xFFF)? / 4096) as u32;
+			let backing = if init_bytes.is_empty() {
+				VmaBacking::Anonymous
+			} else {
+				// The segment bytes are borrowed from the image, so their position in it is the
+				// file offset of the segment
+				let file_offset = init_bytes.as_ptr() as usize - image.as_ptr() as usize;
+				VmaBacking::File { image: image.clone(), file_offset, file_size: init_bytes.len() }
+			};
+
+			self.add_vma(VirtualMemoryArea {
+				first_page_vaddr: VirtAddr(seg_vaddr as u32),
+				num_pages,
+				write,
+				exec,
+				backing,
+			})
+		}).ok_or(SyscallError::InvalidElfFile)?;
 
 		self.eip = elf.entry_point as u32;
+		Ok(())
 	}
 
-	pub fn new_from_elf(kernel_intr_stack: VirtAddr, elf: ElfParser) -> Self {
-		let mut proc = Self::new(kernel_intr_stack);
+	pub fn new_from_elf(kernel_intr_stack: VirtAddr, elf: ElfParser, image: &Arc<Vec<u8>>)
+		-> Option<Self> {
+		let mut proc = Self::new(kernel_intr_stack)?;
 
 		let mut pmem = memory_manager::PHYS_MEM.lock();
 		let (phys_mem, _) = pmem.as_mut().unwrap();
-		proc.init_elf(elf, phys_mem);
-		proc
+		if proc.init_elf(elf, image, phys_mem).is_err() {
+			proc.discard(phys_mem);
+			return None;
+		}
+
+		Some(proc)
 	}
 
-	pub fn new_from_fork(kernel_intr_stack: VirtAddr, parent: &Process) -> Self {
-		let mut proc = Self::new(kernel_intr_stack);
+	pub fn new_from_fork(kernel_intr_stack: VirtAddr, parent: &mut Process) -> Option<Self> {
+		let mut proc = Self::new(kernel_intr_stack)?;
 
 		proc.file_descriptors = parent.file_descriptors;
+		{
+			let mut file_descriptions = FILE_DESCRIPTIONS.lock();
+			for &description in proc.file_descriptors.iter().flatten() {
+				file_descriptions.add_reference(description);
+			}
+		}
 		proc.cwd_inode = parent.cwd_inode;
+		proc.signals = parent.signals.forked();
 		proc.registers = parent.registers;
 		proc.registers.eax = 0; // The fork-syscall return value is 0 for the child
 		proc.eip = parent.eip;
 		proc.eflags = parent.eflags;
-
-		// TODO: Copy on write
-		proc.virtual_memory_ranges = parent.virtual_memory_ranges;
-		
-		let mut temp_buf = box[0u8; 4096];
+		proc.virtual_memory_areas = parent.virtual_memory_areas.clone();
 
 		let mut pmem = memory_manager::PHYS_MEM.lock();
 		let (phys_mem, _) = pmem.as_mut().unwrap();
 
-		for mem_range in parent.virtual_memory_ranges {
-			if let Some((first_page_vaddr, num_pages, write, _exec)) = mem_range {
-				for page in 0..num_pages {
-					let page_vaddr = first_page_vaddr.0 + page*4096;
-					let page_slice = unsafe {
-						core::slice::from_raw_parts(page_vaddr as *const u8, 4096)
+		// Instead of copying the parent's memory, the child shares its page frames. Writable pages
+		// are marked copy-on-write in both address spaces, and whichever process writes to such a
+		// page first gets a private copy of it from the page fault handler.
+		for vma in parent.virtual_memory_areas.iter().flatten() {
+			for page in 0..vma.num_pages {
+				let page_vaddr = VirtAddr(vma.first_page_vaddr.0 + page*4096);
+				let raw_pte = match parent.page_directory.get_page_table_entry(phys_mem, page_vaddr) {
+					Some(raw_pte) if raw_pte != 0 => raw_pte,
+					_ => continue, // Pages which were never accessed are faulted-in by each process
+				};
+
+				if let Some(entry) = swap::get_swap_entry(raw_pte) {
+					// Swapped-out pages are shared by referencing their swap entry from both processes
+					swap::duplicate_entry(entry);
+					let mapped = unsafe {
+						proc.page_directory.map_raw(phys_mem, page_vaddr, raw_pte, false, true)
 					};
-					temp_buf.copy_from_slice(page_slice);
-					proc.page_directory.map_init(phys_mem, VirtAddr(page_vaddr), 4096, write, true,
-						|offset| temp_buf[offset]).unwrap(); // TODO: This is slow, use memcpy
+					if mapped.is_none() {
+						swap::free_entry(phys_mem, entry);
+						proc.discard(phys_mem);
+						return None;
+					}
+					continue;
+				}
+
+				let shared_pte = if (raw_pte & PAGE_ENTRY_WRITE) != 0 {
+					(raw_pte & !PAGE_ENTRY_WRITE) | PAGE_ENTRY_COW
+				} else {
+					raw_pte
+				};
+
+				// The frame is shared before it is mapped in the child, because mapping it might
+				// allocate a page table, which might reclaim the parent's mapping of the frame
+				let frame_paddr = PhysAddr(raw_pte & !0xFFF);
+				phys_mem.share_frame(frame_paddr);
+
+				let mapped = unsafe {
+					// The parent is the current process, so `map_raw` also flushes the stale
+					// writable translation from the TLB. The entry was just read from the page
+					// table, so the table exists and overwriting the entry can't fail.
+					if shared_pte != raw_pte {
+						parent.page_directory.map_raw(phys_mem, page_vaddr, shared_pte, true, false)
+							.expect("Failed to mark a parent page copy-on-write");
+					}
+					proc.page_directory.map_raw(phys_mem, page_vaddr, shared_pte, false, true)
+				};
+
+				if mapped.is_none() {
+					if phys_mem.drop_frame_reference(frame_paddr) {
+						phys_mem.release_phys_mem(frame_paddr, 4096);
+					}
+					proc.discard(phys_mem);
+					return None;
 				}
 			}
 		}
 
-		proc
+		Some(proc)
+	}
+
+	/// Computes the memory usage of the process by walking its page tables
+	pub fn memory_usage(&mut self, phys_mem: &mut PhysicalMemory) -> SyscallProcessMemInfo {
+		let mut usage = SyscallProcessMemInfo {
+			is_zombie: self.is_zombie(),
+			..Default::default()
+		};
+
+		// The address space of an exited process is torn down by the reaper
+		if self.is_zombie() {
+			return usage;
+		}
+
+		for vma in self.virtual_memory_areas.iter().flatten() {
+			usage.virtual_pages += vma.num_pages;
+
+			for page in 0..vma.num_pages {
+				let page_vaddr = VirtAddr(vma.first_page_vaddr.0 + page*4096);
+				let raw_pte = self.page_directory.get_page_table_entry(phys_mem, page_vaddr)
+					.unwrap_or(0);
+				if swap::get_swap_entry(raw_pte).is_some() {
+					usage.swapped_pages += 1;
+				}
+				if (raw_pte & PAGE_ENTRY_PRESENT) == 0 {
+					continue;
+				}
+
+				usage.resident_pages += 1;
+				if phys_mem.frame_share_count(PhysAddr(raw_pte & !0xFFF)) > 0 {
+					usage.shared_pages += 1;
+				} else {
+					usage.private_pages += 1;
+				}
+			}
+		}
+
+		// User memory is the lower 3GiB, i.e. the first 768 page directory entries. The page
+		// directory itself is also counted
+		usage.page_table_pages = 1;
+		for directory_index in 0..768 {
+			let raw_pde = self.page_directory.get_page_directory_entry(phys_mem,
+				VirtAddr(directory_index << 22)).unwrap_or(0);
+			if (raw_pde & PAGE_ENTRY_PRESENT) != 0 {
+				usage.page_table_pages += 1;
+			}
+		}
+
+		usage
 	}
 
 	fn unmap_user_virtual_memory(&mut self, phys_mem: &mut PhysicalMemory) {
-		for mem_range in self.virtual_memory_ranges.iter_mut() {
-			if mem_range.is_some() {
-				let (first_page_vaddr, num_pages, _, _) = mem_range.unwrap();
-				for page in 0..num_pages {
-					let page_vaddr = first_page_vaddr.0 + page*4096;
-					self.page_directory.unmap(phys_mem, VirtAddr(page_vaddr), true).unwrap();
+		for vma in self.virtual_memory_areas.iter_mut() {
+			if let Some(area) = vma.take() {
+				for page in 0..area.num_pages {
+					let page_vaddr = VirtAddr(area.first_page_vaddr.0 + page*4096);
+
+					let raw_pte = self.page_directory.get_page_table_entry(phys_mem, page_vaddr)
+						.unwrap_or(0);
+					if (raw_pte & PAGE_ENTRY_PRESENT) != 0 {
+						// Shared frames are only released when their last mapping is dropped
+						let last_mapping = phys_mem.drop_frame_reference(PhysAddr(raw_pte & !0xFFF));
+						self.page_directory.unmap(phys_mem, page_vaddr, last_mapping).unwrap();
+					} else if let Some(entry) = swap::get_swap_entry(raw_pte) {
+						swap::free_entry(phys_mem, entry);
+						self.page_directory.unmap(phys_mem, page_vaddr, false).unwrap();
+					}
+					// Pages which were never accessed (or were dropped by reclaim) have nothing
+					// to release
 				}
-				*mem_range = None;
 			}
 		}
 	}
 
-	pub fn replace_with_elf(&mut self, elf: ElfParser, argv: &[String], envp: &[String]) {
+	/// Replaces the program of the process with `elf`. If this fails, the process is left without
+	/// any user memory
+	pub fn replace_with_elf(&mut self, elf: ElfParser, image: &Arc<Vec<u8>>, argv: &[String],
+		envp: &[String]) -> Result<(), SyscallError> {
 		let mut envp_ptrs = vec![0u32; envp.len() + 1];
 		let mut argv_ptrs = vec![0u32; argv.len() + 1];
 
@@ -165,12 +435,18 @@ impl Process {
 		let (phys_mem, _) = pmem.as_mut().unwrap();
 
 		self.unmap_user_virtual_memory(phys_mem);
+		self.signals.reset_handlers();
 
-		self.init_elf(elf, phys_mem);
+		if let Err(err) = self.init_elf(elf, image, phys_mem) {
+			self.unmap_user_virtual_memory(phys_mem);
+			return Err(err);
+		}
 
+		// The top page of the stack was mapped in eagerly
 		let stack_paddr = self.page_directory.translate_virt(phys_mem, USER_STACK_VADDR).unwrap();
 		let stack_page = unsafe { 
-			core::slice::from_raw_parts_mut(phys_mem.translate_phys(stack_paddr, 4096).unwrap(), 4096)
+			let stack_ptr = phys_mem.translate_phys(stack_paddr, 4096).unwrap();
+			core::slice::from_raw_parts_mut(stack_ptr, 4096)
 		};
 
 		let mut stack_off = 0;
@@ -211,6 +487,7 @@ impl Process {
 		assert!(stack_off < 4096);
 
 		self.registers.esp -= stack_off as u32;
+		Ok(())
 	}
 
 	pub fn alloc_file_descriptor(&mut self, desc: usize) -> Option<usize> {
@@ -230,14 +507,13 @@ impl Process {
 			return false;
 		}
 
-		if self.file_descriptors[fd].is_none() {
-			return false;
+		match self.file_descriptors[fd].take() {
+			Some(description) => {
+				FILE_DESCRIPTIONS.lock().drop_reference(description);
+				true
+			},
+			None => false,
 		}
-
-		// FIXME: Check if we need to close the corresponding description
-
-		self.file_descriptors[fd] = None;
-		true
 	}
 
 	pub fn get_file_descriptor(&mut self, fd: usize) -> Option<usize> {
@@ -252,6 +528,27 @@ impl Process {
 		self.exit_code.is_some()
 	}
 
+	/// Returns the exit code of the process if it exited
+	pub fn exit_code(&self) -> Option<u8> {
+		self.exit_code
+	}
+
+	/// Returns true if the process gave up the CPU in the middle of a syscall, and is waiting to
+	/// continue it
+	pub fn is_in_kernel(&self) -> bool {
+		self.in_kernel
+	}
+
+	/// Returns the number of open file descriptors
+	pub fn open_file_count(&self) -> usize {
+		self.file_descriptors.iter().flatten().count()
+	}
+
+	/// Returns the number of times the process was switched to
+	pub fn times_scheduled(&self) -> u32 {
+		self.times_scheduled
+	}
+
 	pub fn exit(&mut self, exit_code: u8) {
 		assert!(!self.is_zombie());
 
@@ -261,13 +558,18 @@ impl Process {
 			self.close_file_descriptor(fd);
 		}
 		
-		let mut pmem = memory_manager::PHYS_MEM.lock();
-		let (phys_mem, _) = pmem.as_mut().unwrap();
-
-		self.unmap_user_virtual_memory(phys_mem);
-		
-		// FIXME: We can't do this here, because we are currently using this stack! 
-		// self.page_directory.unmap(phys_mem, self.kernel_intr_stack, true).unwrap();
+		// The user pages, the page tables, the directory and the kernel stack are all released by
+		// the reaper, because this might be running on the address space and the kernel stack
+		for vma in self.virtual_memory_areas.iter_mut() {
+			*vma = None;
+		}
+		let directory = self.page_directory.get_directory_addr();
+		reclaim::unregister_address_space(directory);
+		reaper::queue(reaper::DeadAddressSpace {
+			directory,
+			kernel_stack: self.kernel_intr_stack,
+			kernel_stack_size: KERNEL_INTR_STACK_SIZE,
+		});
 	}
 }
 pub struct SchedulerState {
@@ -279,6 +581,13 @@ impl SchedulerState {
 	pub fn get_current_process(&mut self) -> &mut Process {
 		self.processes[self.current_process].as_mut().unwrap()
 	}
+
+	/// Returns the pid of the next process after the current one which can run, if there is one
+	pub fn next_runnable_process(&self) -> Option<usize> {
+		let num_slots = self.processes.len();
+		(1..num_slots).map(|offset| (self.current_process + offset) % num_slots)
+			.find(|&pid| matches!(&self.processes[pid], Some(proc) if !proc.is_zombie()))
+	}
 }
 
 const INIT: Option<Process> = None; // There must be a better way...
@@ -287,6 +596,30 @@ pub static SCHEDULER_STATE: LockCell<SchedulerState> = LockCell::new(SchedulerSt
 	current_process: 0,
 });
 
+/// Number of switches to a process
+static CONTEXT_SWITCHES: AtomicU32 = AtomicU32::new(0);
+/// Number of times a process gave up the CPU in the middle of a syscall
+static YIELDS: AtomicU32 = AtomicU32::new(0);
+
+/// Returns the number of switches to a process, and the number of them which followed a process
+/// giving up the CPU in the middle of a syscall
+pub fn get_scheduler_stats() -> (u32, u32) {
+	(CONTEXT_SWITCHES.load(Ordering::Relaxed), YIELDS.load(Ordering::Relaxed))
+}
+
+/// The currently running process, published on every switch. The page fault handler uses this to
+/// look up the faulting VMA without taking `SCHEDULER_STATE`, which the faulting code might hold.
+static CURRENT_PROCESS: AtomicPtr<Process> = AtomicPtr::new(core::ptr::null_mut());
+
+/// Returns the currently running process without going through `SCHEDULER_STATE`
+///
+/// ### Safety
+/// Must only be called with interrupts masked, and the returned reference must not be kept after
+/// the current process changes. The caller must not create overlapping references to the process.
+pub unsafe fn current_process_unlocked() -> Option<&'static mut Process> {
+	CURRENT_PROCESS.load(Ordering::SeqCst).as_mut()
+}
+
 pub fn yield_execution() {
 	let mut saved_registers = cpu::PushADRegisterState::default();
 	let saved_eflags: u32;
@@ -337,14 +670,21 @@ pub fn yield_execution() {
 	// yielded and were re-scheduled, so we want to just return
 	if first_exec != 0 {
 		let mut sched_state = SCHEDULER_STATE.lock();
+
+		// There might be no other process to run (e.g. it was terminated to free memory)
+		let next_process = match sched_state.next_runnable_process() {
+			Some(pid) => pid,
+			None => return,
+		};
+
 		let cur_proc = sched_state.get_current_process();
 		cur_proc.registers = saved_registers;
 		cur_proc.eip = return_eip;
 		cur_proc.eflags = saved_eflags;
 		cur_proc.in_kernel = true;
+		YIELDS.fetch_add(1, Ordering::Relaxed);
 
-		// FIXME: temp
-		sched_state.current_process = 1;
+		sched_state.current_process = next_process;
 		drop(sched_state);
 		switch_to_current_process();
 	} else {
@@ -357,6 +697,9 @@ pub fn yield_execution() {
 pub fn switch_to_current_process() -> ! {
 	let mut proc_state = SCHEDULER_STATE.lock();
 	let cur_proc = proc_state.get_current_process();
+	CURRENT_PROCESS.store(cur_proc, Ordering::SeqCst);
+	cur_proc.times_scheduled += 1;
+	CONTEXT_SWITCHES.fetch_add(1, Ordering::Relaxed);
 
 	tss::set_kernel_esp(cur_proc.kernel_intr_stack.0 + KERNEL_INTR_STACK_SIZE);
 	let eip = cur_proc.eip;
@@ -385,4 +728,24 @@ pub fn set_current_register_state(eip: u32, eflags: u32, register_state: PushADR
 	cur_proc.eip = eip;
 	cur_proc.eflags = eflags;
 	cur_proc.registers = register_state;
+}
+
+/// Terminates the current process with the exit code `exit_code` and switches to the next process
+pub fn exit_current_process(exit_code: u8) -> ! {
+	let next_process = {
+		let mut sched_state = SCHEDULER_STATE.lock();
+		sched_state.get_current_process().exit(exit_code);
+		let next_process = sched_state.next_runnable_process();
+		if let Some(pid) = next_process {
+			sched_state.current_process = pid;
+		}
+		next_process
+	};
+
+	if next_process.is_none() {
+		println!("The last process exited with {}, nothing is left to run", exit_code);
+		unsafe { cpu::halt(); }
+	}
+
+	switch_to_current_process();
 }
\ No newline at end of file
@@ -0,0 +1,285 @@
+//! The `/proc` file system: files and directories whose contents are generated by the kernel when
+//! they are read, exposing live statistics of the processes, the memory, the scheduler, the
+//! interrupts, the locks and the PCI devices.
+//!
+//! The text of a file is generated when it is read from offset 0, into a buffer which belongs to
+//! the file description and is reused, so a tool which polls a file by seeking back (or reopening
+//! it) doesn't allocate on every poll. Reads at other offsets continue the same snapshot.
+
+use core::fmt::{self, Write};
+
+use alloc::string::String;
+use alloc::vec::Vec;
+use ext2_parser::{DirEntryType, Ext2Parser};
+use lock_cell::LockCell;
+#[cfg(feature = "lock_stats")]
+use lock_cell::LockStats;
+use syscall_interface::SyscallError;
+use crate::{ext2, interrupts, ksm, memory_manager, pci, process, reaper, swap, vfs, zram};
+use crate::process::SchedulerState;
+
+/// The path the file system is mounted at
+pub const MOUNT_PATH: &str = "/proc";
+
+/// The files of the root directory which aren't process directories
+const GLOBAL_FILES: [(&str, ProcEntry); 5] = [
+	("meminfo", ProcEntry::MemInfo),
+	("interrupts", ProcEntry::Interrupts),
+	("sched", ProcEntry::Sched),
+	("locks", ProcEntry::Locks),
+	("pci", ProcEntry::Pci),
+];
+
+/// A file or a directory of the file system
+#[derive(Clone, Copy, Debug)]
+pub enum ProcEntry {
+	/// The root directory, which holds the global files and a directory for each process
+	Root,
+	/// Free physical memory, heap, swap and merging statistics
+	MemInfo,
+	/// Per-vector interrupt counters
+	Interrupts,
+	/// Scheduler counters
+	Sched,
+	/// Usage statistics of the kernel's main locks
+	Locks,
+	/// The functions found on the PCI bus and their drivers
+	Pci,
+	/// The directory of the process with the given PID
+	ProcessDir(usize),
+	/// The status of the process with the given PID
+	ProcessStatus(usize),
+}
+
+impl ProcEntry {
+	pub fn is_dir(&self) -> bool {
+		matches!(self, ProcEntry::Root | ProcEntry::ProcessDir(_))
+	}
+}
+
+/// The generated text of every file description of a `/proc` file, indexed by the index of the
+/// description. The text is freed when the description is released.
+static TEXT_BUFFERS: LockCell<Vec<String>> = LockCell::new(Vec::new());
+
+/// Returns the entry at the absolute path `path`, if it is inside the file system. Processes are
+/// not checked to exist, so the process can exit between the lookup and the read anyway. `self` is
+/// resolved to `current_pid`, the PID of the current process.
+pub fn lookup(path: &str, current_pid: usize) -> Option<ProcEntry> {
+	let path = path.strip_prefix(MOUNT_PATH)?.trim_end_matches('/');
+	if path.is_empty() {
+		return Some(ProcEntry::Root);
+	}
+
+	let mut components = path.strip_prefix('/')?.split('/');
+	let first = components.next()?;
+	if let Some((_, entry)) = GLOBAL_FILES.iter().find(|(name, _)| *name == first) {
+		return if components.next().is_none() { Some(*entry) } else { None };
+	}
+
+	let pid = if first == "self" {
+		current_pid
+	} else {
+		first.parse::<usize>().ok()?
+	};
+
+	match (components.next(), components.next()) {
+		(None, _) => Some(ProcEntry::ProcessDir(pid)),
+		(Some("status"), None) => Some(ProcEntry::ProcessStatus(pid)),
+		_ => None,
+	}
+}
+
+/// Frees the generated text of the file description at `description_idx`, which was released
+pub fn release(description_idx: usize) {
+	let mut text_buffers = TEXT_BUFFERS.lock();
+	if let Some(text) = text_buffers.get_mut(description_idx) {
+		*text = String::new();
+	}
+}
+
+/// Reads `entry` for the file description at `description_idx`, whose offset is `offset`, into
+/// `buf`. The scheduler state is taken from the caller, which already holds it. Directories read a
+/// single `SyscallDirectoryEntry` at a time, and their offset is the index of the next entry.
+/// Returns the number of bytes read, or an error.
+pub fn read(entry: ProcEntry, sched_state: &mut SchedulerState, ext2_parser: &Ext2Parser,
+	description_idx: usize, offset: &mut u32, buf: &mut [u8]) -> i32 {
+	if entry.is_dir() {
+		return read_directory(entry, sched_state, offset, buf);
+	}
+
+	let mut text_buffers = TEXT_BUFFERS.lock();
+	if text_buffers.len() <= description_idx {
+		text_buffers.resize_with(description_idx + 1, String::new);
+	}
+	let text = &mut text_buffers[description_idx];
+
+	if *offset == 0 {
+		text.clear();
+		let result = match entry {
+			ProcEntry::MemInfo => write_meminfo(text),
+			ProcEntry::Interrupts => interrupts::stats::write_stats(text),
+			ProcEntry::Sched => write_sched(text, sched_state),
+			ProcEntry::Locks => write_locks(text),
+			ProcEntry::Pci => pci::write_devices(text),
+			ProcEntry::ProcessStatus(pid) => {
+				if !matches!(sched_state.processes.get(pid), Some(Some(_))) {
+					return SyscallError::NoSuchProcess.to_i32();
+				}
+				write_process_status(text, sched_state, ext2_parser, pid)
+			},
+			ProcEntry::Root | ProcEntry::ProcessDir(_) => unreachable!(),
+		};
+		result.unwrap();
+	}
+
+	let start = (*offset as usize).min(text.len());
+	let num_read = buf.len().min(text.len() - start);
+	buf[..num_read].copy_from_slice(&text.as_bytes()[start..start + num_read]);
+	*offset += num_read as u32;
+	num_read as i32
+}
+
+/// Reads the directory entry at index `offset` of the directory `entry` into `buf`
+fn read_directory(entry: ProcEntry, sched_state: &mut SchedulerState, offset: &mut u32,
+	buf: &mut [u8]) -> i32 {
+	let mut name = String::new();
+	let entry_type = match entry {
+		ProcEntry::Root => {
+			let idx = *offset as usize;
+			if let Some((file_name, _)) = GLOBAL_FILES.get(idx) {
+				name.push_str(file_name);
+				DirEntryType::RegularFile
+			} else {
+				let pid = sched_state.processes.iter().enumerate()
+					.filter(|(_, proc)| proc.is_some())
+					.map(|(pid, _)| pid)
+					.nth(idx - GLOBAL_FILES.len());
+				match pid {
+					Some(pid) => write!(name, "{}", pid).unwrap(),
+					None => return 0,
+				}
+				DirEntryType::Directory
+			}
+		},
+		ProcEntry::ProcessDir(pid) => {
+			if !matches!(sched_state.processes.get(pid), Some(Some(_))) {
+				return SyscallError::NoSuchProcess.to_i32();
+			}
+			if *offset > 0 {
+				return 0;
+			}
+			name.push_str("status");
+			DirEntryType::RegularFile
+		},
+		_ => unreachable!(),
+	};
+
+	match vfs::copy_directory_entry(buf, 0, entry_type, &name) {
+		Some(entry_size) => {
+			*offset += 1;
+			entry_size as i32
+		},
+		None => SyscallError::BufferTooSmall.to_i32(),
+	}
+}
+
+fn write_meminfo(out: &mut String) -> fmt::Result {
+	let (free_memory, merge_stats) = {
+		let pmem = memory_manager::PHYS_MEM.lock();
+		let (phys_mem, _) = pmem.as_ref().unwrap();
+		(phys_mem.free_bytes(), ksm::get_stats(phys_mem))
+	};
+	let heap_stats = memory_manager::heap_stats();
+	let swap_stats = swap::get_stats();
+	let compressed_stats = zram::get_stats();
+	let (reaped_address_spaces, reaped_frames) = reaper::get_stats();
+
+	writeln!(out, "MemFree:        {:>10} kB", free_memory / 1024)?;
+	writeln!(out, "HeapMapped:     {:>10} kB", heap_stats.mapped_bytes / 1024)?;
+	writeln!(out, "HeapInUse:      {:>10} kB", heap_stats.bytes_in_use / 1024)?;
+	writeln!(out, "HeapAllocated:  {:>10} kB", heap_stats.allocated_bytes / 1024)?;
+	writeln!(out, "HeapFree:       {:>10} kB", heap_stats.free_bytes / 1024)?;
+	writeln!(out, "HeapFreeList:   {:>10}", heap_stats.free_list_length)?;
+	writeln!(out, "SwapTotal:      {:>10} kB", swap_stats.total_pages * 4)?;
+	writeln!(out, "SwapFree:       {:>10} kB", swap_stats.free_pages * 4)?;
+	writeln!(out, "Compressed:     {:>10} pages in {} kB", compressed_stats.stored_pages,
+		compressed_stats.compressed_bytes / 1024)?;
+	writeln!(out, "MergedFrames:   {:>10}", merge_stats.shared_frames)?;
+	writeln!(out, "MergedSaved:    {:>10} pages", merge_stats.sharing_pages)?;
+	writeln!(out, "Reaped:         {:>10} pages from {} processes", reaped_frames,
+		reaped_address_spaces)
+}
+
+fn write_sched(out: &mut String, sched_state: &SchedulerState) -> fmt::Result {
+	let (context_switches, yields) = process::get_scheduler_stats();
+	let processes = sched_state.processes.iter().flatten();
+
+	writeln!(out, "processes:        {}", processes.clone().count())?;
+	writeln!(out, "zombies:          {}", processes.filter(|proc| proc.is_zombie()).count())?;
+	writeln!(out, "current:          {}", sched_state.current_process)?;
+	writeln!(out, "context switches: {}", context_switches)?;
+	writeln!(out, "yields:           {}", yields)
+}
+
+#[cfg(not(feature = "lock_stats"))]
+fn write_locks(out: &mut String) -> fmt::Result {
+	writeln!(out, "Lock statistics are disabled in this kernel (the lock_stats feature)")
+}
+
+#[cfg(feature = "lock_stats")]
+fn write_locks(out: &mut String) -> fmt::Result {
+	let locks: [(&str, LockStats); 4] = [
+		("scheduler", process::SCHEDULER_STATE.stats()),
+		("physical memory", memory_manager::PHYS_MEM.stats()),
+		("file descriptions", vfs::FILE_DESCRIPTIONS.stats()),
+		("ext2", ext2::EXT2_PARSER.stats()),
+	];
+
+	writeln!(out, "acquisitions  contentions  avg cycles  max cycles  lock")?;
+	for (name, stats) in locks.iter() {
+		writeln!(out, "{:>12} {:>12} {:>11} {:>11}  {}", stats.acquisitions, stats.contentions,
+			stats.held_cycles.checked_div(stats.acquisitions as u64).unwrap_or(0),
+			stats.max_held_cycles, name)?;
+	}
+
+	Ok(())
+}
+
+/// Writes the status of the process `pid`, which must exist
+fn write_process_status(out: &mut String, sched_state: &mut SchedulerState,
+	ext2_parser: &Ext2Parser, pid: usize) -> fmt::Result {
+	let is_current = pid == sched_state.current_process;
+	let proc = sched_state.processes[pid].as_mut().unwrap();
+
+	let state = if proc.is_zombie() {
+		"zombie"
+	} else if is_current {
+		"running"
+	} else if proc.is_in_kernel() {
+		"waiting in kernel"
+	} else {
+		"ready"
+	};
+
+	// Nothing is allocated while the physical memory is locked
+	let usage = {
+		let mut pmem = memory_manager::PHYS_MEM.lock();
+		let (phys_mem, _) = pmem.as_mut().unwrap();
+		proc.memory_usage(phys_mem)
+	};
+
+	let mut cwd = [0u8; 256];
+	let cwd_length = ext2::get_directory_path(ext2_parser, proc.cwd_inode, &mut cwd).unwrap_or(0);
+	let cwd = core::str::from_utf8(&cwd[..cwd_length]).unwrap_or("?");
+
+	writeln!(out, "Pid:       {}", pid)?;
+	writeln!(out, "State:     {}", state)?;
+	writeln!(out, "VmSize:    {:>8} kB", usage.virtual_pages * 4)?;
+	writeln!(out, "VmRSS:     {:>8} kB", usage.resident_pages * 4)?;
+	writeln!(out, "RssShared: {:>8} kB", usage.shared_pages * 4)?;
+	writeln!(out, "VmSwap:    {:>8} kB", usage.swapped_pages * 4)?;
+	writeln!(out, "VmPTE:     {:>8} kB", usage.page_table_pages * 4)?;
+	writeln!(out, "FDs:       {}", proc.open_file_count())?;
+	writeln!(out, "Cwd:       {}", cwd)?;
+	writeln!(out, "Scheduled: {}", proc.times_scheduled())
+}
@@ -1,9 +1,14 @@
 //! PS/2 command queues
 
+use crate::interrupts::pit_8254;
+use crate::println;
+
 const PS2_MSG_ACK: u8 = 0xFA;
 const PS2_MSG_RESEND: u8 = 0xFE;
 /// Maximum amount of command retries when receiving a RESEND response
 const MAX_COMMAND_RETRIES: usize = 3;
+/// Time in milliseconds after which a command which wasn't acknowledged is sent again
+const COMMAND_TIMEOUT_MS: u32 = 200;
 
 #[derive(Clone, Copy, Debug)]
 pub struct PS2Command {
@@ -23,6 +28,10 @@ pub struct PS2CommandQueue {
 	waiting_for_data_ack: bool,
 	/// Whether the command should be send to the second port of the first port
 	second_port: bool,
+	/// The PIT tick in which the current queued command was sent
+	sent_tick: u32,
+	/// Whether the device stopped responding to commands, in which case commands are dropped
+	failed: bool,
 }
 
 impl PS2CommandQueue {
@@ -32,13 +41,19 @@ impl PS2CommandQueue {
 			queue_length: 0,
 			command_retries: 0,
 			waiting_for_data_ack: false,
-			second_port
+			second_port,
+			sent_tick: 0,
+			failed: false,
 		}
 	}
 
-	/// Queues the specified command and dispatches it immediately if it is the first in the queue
+	/// Queues the specified command and dispatches it immediately if it is the first in the queue.
+	/// The command is dropped if the device failed.
 	pub fn queue(&mut self, command: impl Into<PS2Command>) {
 		let command: PS2Command = command.into();
+		if self.failed {
+			return;
+		}
 
 		// Assert we have enough space left in the queue
 		assert!(self.queue_length < self.queue.len());
@@ -53,6 +68,22 @@ impl PS2CommandQueue {
 		}
 	}
 
+	/// Returns true if no commands are queued
+	pub fn is_empty(&self) -> bool {
+		self.queue_length == 0
+	}
+
+	/// Queues the specified command like `queue`, but returns false instead of panicking if the
+	/// queue is full, or if the device failed
+	pub fn try_queue(&mut self, command: impl Into<PS2Command>) -> bool {
+		if self.failed || self.queue_length == self.queue.len() {
+			return false;
+		}
+
+		self.queue(command);
+		true
+	}
+
 	/// Uses the provided keyboard message to update the command queue. Returns true if the queue is
 	/// empty after the message is handled
 	pub fn handle_message(&mut self, message: u8) -> bool {
@@ -63,12 +94,7 @@ impl PS2CommandQueue {
 
 		if message == PS2_MSG_RESEND {
 			// If this is a RESEND message, we retry the first command in the queue a few times
-			if self.command_retries < MAX_COMMAND_RETRIES {
-				self.command_retries += 1;
-				self.send_command_to_device(self.queue[0]);
-			} else {
-				panic!("[PS2CommandQueue]: Failed to send command {:?} (Too many retries)",	self.queue[0]);
-			}
+			self.retry_command();
 		} else if message == PS2_MSG_ACK {
 			// If this is an acknowledge message, we first check if the command is also expect an
 			// ACK for the its data byte, in which case we need to discard the first ACK
@@ -101,8 +127,35 @@ impl PS2CommandQueue {
 		self.queue_length == 0
 	}
 	
+	/// Resends the command which wasn't acknowledged if the device didn't respond to it in time
+	pub fn handle_timer_tick(&mut self) {
+		let elapsed_ticks = pit_8254::get_ticks().wrapping_sub(self.sent_tick);
+		if self.queue_length > 0 && elapsed_ticks > pit_8254::ms_to_ticks(COMMAND_TIMEOUT_MS) {
+			self.retry_command();
+		}
+	}
+
+	/// Sends the first command in the queue again. If it was already retried too many times the
+	/// device is considered failed, and the queued commands are dropped.
+	fn retry_command(&mut self) {
+		if self.command_retries < MAX_COMMAND_RETRIES {
+			self.command_retries += 1;
+			self.send_command_to_device(self.queue[0]);
+		} else {
+			println!("[PS2CommandQueue] Failed to send command {:?} (Too many retries), the device \
+				on the {} port is marked as failed", self.queue[0],
+				if self.second_port { "second" } else { "first" });
+			self.failed = true;
+			self.queue_length = 0;
+			self.command_retries = 0;
+			self.waiting_for_data_ack = false;
+		}
+	}
+
 	/// Sends the specified command to the keyboard
 	fn send_command_to_device(&mut self, command: PS2Command) {
+		self.sent_tick = pit_8254::get_ticks();
+
 		// We first send the command byte
 		if self.second_port {
 			super::controller::send_data_to_second_port(command.command);
@@ -2,6 +2,10 @@
 
 use core::hint::spin_loop;
 
+use lock_cell::LockCell;
+use crate::interrupts::deferred::{self, WorkItem};
+use crate::interrupts::pit_8254;
+
 /// Data I/O port of the PS/2 controller
 const PS2_CTRL_DATA_PORT: u16 = 0x60;
 /// I/O port for reading the PS/2 controller status register
@@ -33,8 +37,10 @@ const PS2_CTRL_PORT_TEST_PASSED: u8 = 0x0;
 /// The universal reset command that all PS/2 devices support
 const PS2_DEVICE_RESET_CMD: u8 = 0xFF;
 
-/// Timeout for receiving and sending PS/2 controller data
-const PS2_TIMEOUT: usize = 0xB000000;
+/// Timeout in milliseconds for receiving and sending PS/2 controller data during initialization
+const PS2_TIMEOUT_MS: u32 = 500;
+/// The number of bytes which can wait to be sent to the PS/2 devices
+const TRANSMIT_QUEUE_CAPACITY: usize = 16;
 
 /// Possible commands for the PS/2 controller
 #[repr(u8)]
@@ -142,13 +148,19 @@ pub fn init() {
 	serial::println!("Enabled PS/2 Controller [{}, {}]", first_port_avail, second_port_avail);
 }
 
-/// Handles an interrupt from one of the PS/2 devices
+/// Handles an interrupt from one of the PS/2 devices: reads the message, which lets the controller
+/// receive the next one, and queues it to be handled after the interrupt
 pub fn handle_interrupt() {
 	let status = get_status_register();
 	assert!(status & PS2_CTRL_STATUS_OUTPUT_FULL_MASK != 0);
 
 	let message = unsafe { cpu::in8(PS2_CTRL_DATA_PORT) };
+	deferred::queue(WorkItem::PS2Message { status, message });
+}
 
+/// Handles a message read from the PS/2 controller by `handle_interrupt`, which was read with the
+/// status register `status`. Must only be called from the deferred work of the interrupt.
+pub fn handle_message(status: u8, message: u8) {
 	// Even though we get interrupts with different IRQs for each device, if two interrupts happen
 	// simultaneously, the order of the CPU interrupts and the order of bytes read from the PS/2
 	// controller might be different, so we ignore the IRQ and use the controller status byte to
@@ -158,6 +170,82 @@ pub fn handle_interrupt() {
 	} else {
 		super::keyboard::handle_interrupt(message);
 	}
+
+	// The controller consumed a byte if it had one, so we can send the next
+	flush_transmit_queue();
+}
+
+/// Handles a PIT interrupt: sends bytes which the controller wasn't ready for yet, and times out
+/// device commands and responses. Must only be called from the deferred work of the interrupt.
+pub fn handle_timer_tick() {
+	flush_transmit_queue();
+	super::keyboard::handle_timer_tick();
+	super::mouse::handle_timer_tick();
+}
+
+/// A byte waiting to be sent to a PS/2 device
+#[derive(Clone, Copy)]
+struct PendingByte {
+	byte: u8,
+	/// Whether the byte is sent to the device connected to the second port
+	second_port: bool,
+}
+
+/// Bytes waiting for the controller's input buffer to be empty. They are sent in order from the
+/// PS/2 and PIT interrupts, so no one spins on the controller.
+struct TransmitQueue {
+	bytes: [PendingByte; TRANSMIT_QUEUE_CAPACITY],
+	/// Index of the next byte to send
+	head: usize,
+	/// Number of bytes waiting
+	len: usize,
+	/// Whether the `WriteToSecondPort` command for the next byte was already sent
+	second_port_selected: bool,
+}
+
+/// The bytes waiting to be sent. The lock masks interrupts, so the queue is only flushed by one
+/// context at a time.
+static TRANSMIT_QUEUE: LockCell<TransmitQueue> = LockCell::new(TransmitQueue {
+	bytes: [PendingByte { byte: 0, second_port: false }; TRANSMIT_QUEUE_CAPACITY],
+	head: 0,
+	len: 0,
+	second_port_selected: false,
+});
+
+/// Sends as many waiting bytes as the controller is ready for, without waiting for it
+fn flush_transmit_queue() {
+	let mut queue = TRANSMIT_QUEUE.lock();
+	while queue.len > 0 && (get_status_register() & PS2_CTRL_STATUS_INPUT_FULL_MASK) == 0 {
+		let pending = queue.bytes[queue.head];
+
+		// A byte for the second port takes two writes, and the controller must be ready for each
+		if pending.second_port && !queue.second_port_selected {
+			send_command(PS2Command::WriteToSecondPort);
+			queue.second_port_selected = true;
+			continue;
+		}
+
+		unsafe {
+			cpu::out8(PS2_CTRL_DATA_PORT, pending.byte);
+		}
+		queue.second_port_selected = false;
+		queue.head = (queue.head + 1) % TRANSMIT_QUEUE_CAPACITY;
+		queue.len -= 1;
+	}
+}
+
+/// Queues `byte` to be sent to a PS/2 device, and sends it immediately if the controller is ready
+fn queue_byte(byte: u8, second_port: bool) {
+	{
+		let mut queue = TRANSMIT_QUEUE.lock();
+		assert!(queue.len < TRANSMIT_QUEUE_CAPACITY, "PS/2 transmit queue is full");
+
+		let idx = (queue.head + queue.len) % TRANSMIT_QUEUE_CAPACITY;
+		queue.bytes[idx] = PendingByte { byte, second_port };
+		queue.len += 1;
+	}
+
+	flush_transmit_queue();
 }
 
 /// Sends a command the PS/2 controller
@@ -170,29 +258,36 @@ fn send_command(command: PS2Command)  {
 /// Sends a command that takes an extra argument byte to the PS/2 controller
 fn send_command_with_arg(command: PS2Command, arg: u8) {
 	send_command(command);
-	send_data(arg);
+	poll_send_data(arg);
 }
 
 /// Sends a command to the PS/2 controller and waits for a response
 fn send_command_with_response(command: PS2Command) -> u8 {
 	send_command(command);
-	receive_data()
+	poll_receive_data().expect("Timeout in `receive_data()` of PS/2 controller")
 }
 
-/// Waits for and returns the value in the PS/2 controller's output buffer. Panics on timeout
-pub fn receive_data() -> u8 {
-	recieve_data_with_timeout().expect("Timeout in `receive_data()` of PS/2 controller")
-}
-
-/// Waits for and returns the value in the PS/2 controller's output buffer. Returns `None` on timeout
-pub fn recieve_data_with_timeout() -> Option<u8> {
-	let mut timeout = PS2_TIMEOUT;
-	while (get_status_register() & PS2_CTRL_STATUS_OUTPUT_FULL_MASK) == 0 && timeout > 0 {
-		timeout -= 1;
+/// Waits until the status register matches `mask` against `expected`, or until the timeout passes.
+/// Only used during initialization, before the devices interrupt: the PIT must be running, so this
+/// must not be called from interrupt context. Returns false on timeout.
+fn poll_status(mask: u8, expected: u8) -> bool {
+	assert!(cpu::get_if(), "Polling the PS/2 controller with interrupts masked");
+
+	let start_tick = pit_8254::get_ticks();
+	let timeout_ticks = pit_8254::ms_to_ticks(PS2_TIMEOUT_MS);
+	while (get_status_register() & mask) != expected {
+		if pit_8254::get_ticks().wrapping_sub(start_tick) > timeout_ticks {
+			return false;
+		}
 		spin_loop();
 	}
 
-	if timeout == 0 {
+	true
+}
+
+/// Waits for and returns the value in the PS/2 controller's output buffer. Returns `None` on timeout
+fn poll_receive_data() -> Option<u8> {
+	if !poll_status(PS2_CTRL_STATUS_OUTPUT_FULL_MASK, PS2_CTRL_STATUS_OUTPUT_FULL_MASK) {
 		return None;
 	}
 
@@ -201,16 +296,9 @@ pub fn recieve_data_with_timeout() -> Option<u8> {
 	}
 }
 
-/// Waits for and sends a value to the PS/2 controller's input buffer. Unless the PS/2 controller
-/// expects an argument for a command, this is sent to the device connected to the first port
-pub fn send_data(byte: u8) {
-	let mut timeout = PS2_TIMEOUT;
-	while (get_status_register() & PS2_CTRL_STATUS_INPUT_FULL_MASK != 0) && timeout > 0 {
-		timeout -= 1;
-		spin_loop();
-	}
-
-	if timeout == 0 {
+/// Waits for and sends a value to the PS/2 controller's input buffer. Panics on timeout
+fn poll_send_data(byte: u8) {
+	if !poll_status(PS2_CTRL_STATUS_INPUT_FULL_MASK, 0) {
 		panic!("Timeout in `send_data({:#x})` of PS/2 controller", byte);
 	}
 
@@ -219,9 +307,14 @@ pub fn send_data(byte: u8) {
 	}
 }
 
-/// Waits for and sends a value to the device connected to the second port
+/// Sends a value to the device connected to the first port, once the controller is ready for it
+pub fn send_data(byte: u8) {
+	queue_byte(byte, false);
+}
+
+/// Sends a value to the device connected to the second port, once the controller is ready for it
 pub fn send_data_to_second_port(byte: u8) {
-	send_command_with_arg(PS2Command::WriteToSecondPort, byte);
+	queue_byte(byte, true);
 }
 
 /// Reads the PS/2 controller's status register
@@ -229,4 +322,4 @@ fn get_status_register() -> u8 {
 	unsafe {
 		cpu::in8(PS2_CTRL_READ_STATUS_PORT)
 	}
-}
\ No newline at end of file
+}
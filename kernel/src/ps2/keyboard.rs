@@ -2,12 +2,16 @@
 
 use exclusive_cell::ExclusiveCell;
 use crate::keyboard::KeyCode;
+use crate::interrupts::pit_8254;
 use crate::println;
 use super::command_queue::{PS2Command, PS2CommandQueue};
 
 /// Whether or not to print driver debug mesages
 const PRINT_DEBUG_MESSAGES: bool = false;
 
+/// Time in milliseconds to wait for another byte of the keyboard type
+const IDENTIFY_TIMEOUT_MS: u32 = 50;
+
 /// The delay until the key starts repeating when a key is pressed down. Values ranges from 0 to 3
 /// which maps to 250ms to 1000ms respectively
 const TYPEMATIC_REPEAT_DELAY: u8 = 1;
@@ -83,6 +87,12 @@ struct PS2KeyboardDriver {
 	state: PS2KeyboardState,
 	/// Command queue for command sequences
 	command_queue: PS2CommandQueue,
+	/// The bytes of the keyboard type received while identifying
+	keyboard_type: [u8; 2],
+	/// The number of bytes of the keyboard type received
+	type_length: usize,
+	/// The PIT tick in which the last byte of the identification was received
+	identify_tick: u32,
 }
 
 impl PS2KeyboardDriver {
@@ -90,7 +100,49 @@ impl PS2KeyboardDriver {
 	const fn new() -> Self {
 		PS2KeyboardDriver {
 			state: PS2KeyboardState::Uninitialized,
-			command_queue: PS2CommandQueue::new(false)
+			command_queue: PS2CommandQueue::new(false),
+			keyboard_type: [0; 2],
+			type_length: 0,
+			identify_tick: 0,
+		}
+	}
+
+	/// Handles the keyboard type received while identifying, and starts initializing the keyboard
+	fn finish_identification(&mut self) {
+		if PRINT_DEBUG_MESSAGES {
+			println!("[PS2Keyboard({:?})] Type: {:X?}", self.state,
+				&self.keyboard_type[..self.type_length]);
+		}
+
+		// We expect an MF2 keyboard with no translation
+		assert!(self.type_length == 2 && self.keyboard_type == [0xAB, 0x83]);
+
+		// We then initialize the keyboard, by first setting the scan code set to set 2
+		self.command_queue.queue(PS2KeyboardCommand::SetScanCodeSet(2));
+		// We then set the typematic byte to some defaults
+		self.command_queue.queue(PS2KeyboardCommand::SetTypematicByte {
+			delay: TYPEMATIC_REPEAT_DELAY,
+			rate: TYPEMATIC_REPEAT_RATE
+		});
+		// We then set the keyboard LEDs to a known state
+		self.command_queue.queue(PS2KeyboardCommand::SetLEDs {
+			number_lock: true,
+			caps_lock: false,
+			scroll_lock: false,
+		});
+		// And finally we re-enable scanning
+		self.command_queue.queue(PS2KeyboardCommand::EnableScanning);
+		self.state = PS2KeyboardState::Initialized;
+	}
+
+	/// Handles a PIT interrupt: times out commands, and the wait for the keyboard type
+	fn handle_timer_tick(&mut self) {
+		self.command_queue.handle_timer_tick();
+
+		let timeout_ticks = pit_8254::ms_to_ticks(IDENTIFY_TIMEOUT_MS);
+		if matches!(self.state, PS2KeyboardState::Identifying) && self.identify_tick != 0
+			&& pit_8254::get_ticks().wrapping_sub(self.identify_tick) > timeout_ticks {
+			self.finish_identification();
 		}
 	}
 
@@ -128,42 +180,19 @@ impl PS2KeyboardDriver {
 				},
 				PS2KeyboardState::Identifying => {
 					// The keyboard type could be 0 bytes, 1 byte, or 2 bytes, and the only way to
-					// know is by trying to get another byte and timing out.
-					let mut keyboard_type = [0u8; 2];
-					let mut type_length = 0;
-					if let Some(type_a) = super::controller::recieve_data_with_timeout() {
-						keyboard_type[0] = type_a;
-						type_length = 1;
-						if let Some(type_b) = super::controller::recieve_data_with_timeout() {
-							keyboard_type[1] = type_b;
-							type_length = 2;
-						}
+					// know is by waiting for another byte until a timeout, which the timer handles.
+					// We start waiting when the identify command is acknowledged.
+					if keyboard_message == KEYBOARD_MSG_ACK && self.identify_tick == 0 {
+						self.identify_tick = pit_8254::get_ticks().max(1);
+						return;
 					}
 
-					if PRINT_DEBUG_MESSAGES {
-						println!("[PS2Keyboard({:?})] Type: {:X?}", self.state,
-							&keyboard_type[..type_length]);
+					self.keyboard_type[self.type_length] = keyboard_message;
+					self.type_length += 1;
+					self.identify_tick = pit_8254::get_ticks().max(1);
+					if self.type_length == self.keyboard_type.len() {
+						self.finish_identification();
 					}
-					
-					// We expect an MF2 keyboard with no translation
-					assert!(type_length == 2 && keyboard_type == [0xAB, 0x83]);
-
-					// We then initialize the keyboard, by first setting the scan code set to set 2
-					self.command_queue.queue(PS2KeyboardCommand::SetScanCodeSet(2));
-					// We then set the typematic byte to some defaults
-					self.command_queue.queue(PS2KeyboardCommand::SetTypematicByte {
-						delay: TYPEMATIC_REPEAT_DELAY,
-						rate: TYPEMATIC_REPEAT_RATE
-					});
-					// We then set the keyboard LEDs to a known state
-					self.command_queue.queue(PS2KeyboardCommand::SetLEDs {
-						number_lock: true,
-						caps_lock: false,
-						scroll_lock: false,
-					});
-					// And finally we re-enable scanning
-					self.command_queue.queue(PS2KeyboardCommand::EnableScanning);
-					self.state = PS2KeyboardState::Initialized;
 				},
 				PS2KeyboardState::Initialized => {
 					// When we get to this state all the initialization commands have been completed
@@ -291,145 +320,169 @@ impl PS2KeyboardDriver {
 /// is inherent.
 static KEYBOARD_DRIVER: ExclusiveCell<PS2KeyboardDriver> = ExclusiveCell::new(PS2KeyboardDriver::new());
 
-/// Handles an interrupt from the PS/2 keyboard (should only be called when an interrupt happens)
+/// Handles an interrupt from the PS/2 keyboard (should only be called from the
+/// deferred work of an interrupt)
 pub fn handle_interrupt(keyboard_message: u8) {
 	KEYBOARD_DRIVER.acquire().handle_interrupt(keyboard_message);
 }
 
+/// Handles a PIT interrupt for the PS/2 keyboard (should only be called from the
+/// deferred work of an interrupt)
+pub fn handle_timer_tick() {
+	KEYBOARD_DRIVER.acquire().handle_timer_tick();
+}
+
 /// Converts a simple 1-byte set 2 scan code to the corresponding key code
 fn simple_scancode_to_keycode(scan_code: u8) -> KeyCode {
-	match scan_code {
-		0x01 => KeyCode::KeyF9,
-		0x03 => KeyCode::KeyF5,
-		0x04 => KeyCode::KeyF3,
-		0x05 => KeyCode::KeyF1,
-		0x06 => KeyCode::KeyF2,
-		0x07 => KeyCode::KeyF12,
-		0x09 => KeyCode::KeyF10,
-		0x0A => KeyCode::KeyF8,
-		0x0B => KeyCode::KeyF6,
-		0x0C => KeyCode::KeyF4,
-		0x0D => KeyCode::KeyTab,
-		0x0E => KeyCode::KeyBackTick,
-		0x11 => KeyCode::KeyLeftAlt,
-		0x12 => KeyCode::KeyLeftShift,
-		0x14 => KeyCode::KeyLeftControl,
-		0x15 => KeyCode::KeyQ,
-		0x16 => KeyCode::Key1,
-		0x1A => KeyCode::KeyZ,
-		0x1B => KeyCode::KeyS,
-		0x1C => KeyCode::KeyA,
-		0x1D => KeyCode::KeyW,
-		0x1E => KeyCode::Key2,
-		0x21 => KeyCode::KeyC,
-		0x22 => KeyCode::KeyX,
-		0x23 => KeyCode::KeyD,
-		0x24 => KeyCode::KeyE,
-		0x25 => KeyCode::Key4,
-		0x26 => KeyCode::Key3,
-		0x29 => KeyCode::KeySpace,
-		0x2A => KeyCode::KeyV,
-		0x2B => KeyCode::KeyF,
-		0x2C => KeyCode::KeyT,
-		0x2D => KeyCode::KeyR,
-		0x2E => KeyCode::Key5,
-		0x31 => KeyCode::KeyN,
-		0x32 => KeyCode::KeyB,
-		0x33 => KeyCode::KeyH,
-		0x34 => KeyCode::KeyG,
-		0x35 => KeyCode::KeyY,
-		0x36 => KeyCode::Key6,
-		0x3A => KeyCode::KeyM,
-		0x3B => KeyCode::KeyJ,
-		0x3C => KeyCode::KeyU,
-		0x3D => KeyCode::Key7,
-		0x3E => KeyCode::Key8,
-		0x41 => KeyCode::KeyComma,
-		0x42 => KeyCode::KeyK,
-		0x43 => KeyCode::KeyI,
-		0x44 => KeyCode::KeyO,
-		0x45 => KeyCode::Key0,
-		0x46 => KeyCode::Key9,
-		0x49 => KeyCode::KeyPeriod,
-		0x4A => KeyCode::KeySlash,
-		0x4B => KeyCode::KeyL,
-		0x4C => KeyCode::KeySemicolon,
-		0x4D => KeyCode::KeyP,
-		0x4E => KeyCode::KeyMinus,
-		0x52 => KeyCode::KeyApostrophe,
-		0x54 => KeyCode::KeyLeftSquareBracket,
-		0x55 => KeyCode::KeyEquals,
-		0x58 => KeyCode::KeyCapsLock,
-		0x59 => KeyCode::KeyRightShift,
-		0x5A => KeyCode::KeyEnter,
-		0x5B => KeyCode::KeyRightSquareBracket,
-		0x5D => KeyCode::KeyBackSlash,
-		0x61 => KeyCode::KeyExtraBackSlash,
-		0x66 => KeyCode::KeyBackspace,
-		0x69 => KeyCode::KeyNumpad1,
-		0x6B => KeyCode::KeyNumpad4,
-		0x6C => KeyCode::KeyNumpad7,
-		0x70 => KeyCode::KeyNumpad0,
-		0x71 => KeyCode::KeyNumpadPeriod,
-		0x72 => KeyCode::KeyNumpad2,
-		0x73 => KeyCode::KeyNumpad5,
-		0x74 => KeyCode::KeyNumpad6,
-		0x75 => KeyCode::KeyNumpad8,
-		0x76 => KeyCode::KeyEscape,
-		0x77 => KeyCode::KeyNumberLock,
-		0x78 => KeyCode::KeyF11,
-		0x79 => KeyCode::KeyNumpadPlus,
-		0x7A => KeyCode::KeyNumpad3,
-		0x7B => KeyCode::KeyNumpadMinus,
-		0x7C => KeyCode::KeyNumpadAsterisk,
-		0x7D => KeyCode::KeyNumpad9,
-		0x7E => KeyCode::KeyScrollLock,
-		0x83 => KeyCode::KeyF7,
-		_ => KeyCode::Unknown,
-	}	
+	SIMPLE_SCANCODE_TO_KEYCODE[scan_code as usize]
 }
 
+/// The key code of every simple 1-byte set 2 scan code
+static SIMPLE_SCANCODE_TO_KEYCODE: [KeyCode; 256] = scancode_table(&[
+	(0x01, KeyCode::KeyF9),
+	(0x03, KeyCode::KeyF5),
+	(0x04, KeyCode::KeyF3),
+	(0x05, KeyCode::KeyF1),
+	(0x06, KeyCode::KeyF2),
+	(0x07, KeyCode::KeyF12),
+	(0x09, KeyCode::KeyF10),
+	(0x0A, KeyCode::KeyF8),
+	(0x0B, KeyCode::KeyF6),
+	(0x0C, KeyCode::KeyF4),
+	(0x0D, KeyCode::KeyTab),
+	(0x0E, KeyCode::KeyBackTick),
+	(0x11, KeyCode::KeyLeftAlt),
+	(0x12, KeyCode::KeyLeftShift),
+	(0x14, KeyCode::KeyLeftControl),
+	(0x15, KeyCode::KeyQ),
+	(0x16, KeyCode::Key1),
+	(0x1A, KeyCode::KeyZ),
+	(0x1B, KeyCode::KeyS),
+	(0x1C, KeyCode::KeyA),
+	(0x1D, KeyCode::KeyW),
+	(0x1E, KeyCode::Key2),
+	(0x21, KeyCode::KeyC),
+	(0x22, KeyCode::KeyX),
+	(0x23, KeyCode::KeyD),
+	(0x24, KeyCode::KeyE),
+	(0x25, KeyCode::Key4),
+	(0x26, KeyCode::Key3),
+	(0x29, KeyCode::KeySpace),
+	(0x2A, KeyCode::KeyV),
+	(0x2B, KeyCode::KeyF),
+	(0x2C, KeyCode::KeyT),
+	(0x2D, KeyCode::KeyR),
+	(0x2E, KeyCode::Key5),
+	(0x31, KeyCode::KeyN),
+	(0x32, KeyCode::KeyB),
+	(0x33, KeyCode::KeyH),
+	(0x34, KeyCode::KeyG),
+	(0x35, KeyCode::KeyY),
+	(0x36, KeyCode::Key6),
+	(0x3A, KeyCode::KeyM),
+	(0x3B, KeyCode::KeyJ),
+	(0x3C, KeyCode::KeyU),
+	(0x3D, KeyCode::Key7),
+	(0x3E, KeyCode::Key8),
+	(0x41, KeyCode::KeyComma),
+	(0x42, KeyCode::KeyK),
+	(0x43, KeyCode::KeyI),
+	(0x44, KeyCode::KeyO),
+	(0x45, KeyCode::Key0),
+	(0x46, KeyCode::Key9),
+	(0x49, KeyCode::KeyPeriod),
+	(0x4A, KeyCode::KeySlash),
+	(0x4B, KeyCode::KeyL),
+	(0x4C, KeyCode::KeySemicolon),
+	(0x4D, KeyCode::KeyP),
+	(0x4E, KeyCode::KeyMinus),
+	(0x52, KeyCode::KeyApostrophe),
+	(0x54, KeyCode::KeyLeftSquareBracket),
+	(0x55, KeyCode::KeyEquals),
+	(0x58, KeyCode::KeyCapsLock),
+	(0x59, KeyCode::KeyRightShift),
+	(0x5A, KeyCode::KeyEnter),
+	(0x5B, KeyCode::KeyRightSquareBracket),
+	(0x5D, KeyCode::KeyBackSlash),
+	(0x61, KeyCode::KeyExtraBackSlash),
+	(0x66, KeyCode::KeyBackspace),
+	(0x69, KeyCode::KeyNumpad1),
+	(0x6B, KeyCode::KeyNumpad4),
+	(0x6C, KeyCode::KeyNumpad7),
+	(0x70, KeyCode::KeyNumpad0),
+	(0x71, KeyCode::KeyNumpadPeriod),
+	(0x72, KeyCode::KeyNumpad2),
+	(0x73, KeyCode::KeyNumpad5),
+	(0x74, KeyCode::KeyNumpad6),
+	(0x75, KeyCode::KeyNumpad8),
+	(0x76, KeyCode::KeyEscape),
+	(0x77, KeyCode::KeyNumberLock),
+	(0x78, KeyCode::KeyF11),
+	(0x79, KeyCode::KeyNumpadPlus),
+	(0x7A, KeyCode::KeyNumpad3),
+	(0x7B, KeyCode::KeyNumpadMinus),
+	(0x7C, KeyCode::KeyNumpadAsterisk),
+	(0x7D, KeyCode::KeyNumpad9),
+	(0x7E, KeyCode::KeyScrollLock),
+	(0x83, KeyCode::KeyF7),
+]);
+
 /// Converts an extended set 2 scan code to the corresponding key code
 fn extended_scancode_to_keycode(scan_code: u8) -> KeyCode {
-	match scan_code {
-		0x10 => KeyCode::KeyMultimediaSearch,
-		0x11 => KeyCode::KeyRightAlt,
-		0x14 => KeyCode::KeyRightControl,
-		0x15 => KeyCode::KeyMultimediaPreviousTrack,
-		0x18 => KeyCode::KeyMultimediaFavorites,
-		0x1F => KeyCode::KeyLeftLogo,
-		0x20 => KeyCode::KeyMultimediaRefresh,
-		0x21 => KeyCode::KeyMultimediaVolumeDown,
-		0x23 => KeyCode::KeyMultimediaMute,
-		0x27 => KeyCode::KeyRightLogo,
-		0x28 => KeyCode::KeyMultimediaWebStop,
-		0x2B => KeyCode::KeyMultimediaCalculator,
-		0x2F => KeyCode::KeyMenu,
-		0x30 => KeyCode::KeyMultimediaWebForward,
-		0x32 => KeyCode::KeyMultimediaVolumeUp,
-		0x34 => KeyCode::KeyMultimediaPlayPause,
-		0x37 => KeyCode::KeyACPIPower,
-		0x38 => KeyCode::KeyMultimediaWebBack,
-		0x3A => KeyCode::KeyMultimediaWebHome,
-		0x3B => KeyCode::KeyMultimediaStop,
-		0x3F => KeyCode::KeyACPISleep,
-		0x40 => KeyCode::KeyMultimediaMyComputer,
-		0x48 => KeyCode::KeyMultimediaEmail,
-		0x4A => KeyCode::KeyNumpadSlash,
-		0x4D => KeyCode::KeyMultimediaNextTrack,
-		0x50 => KeyCode::KeyMultimediaMediaSelect,
-		0x5A => KeyCode::KeyNumpadEnter,
-		0x5E => KeyCode::KeyACPIWake,
-		0x69 => KeyCode::KeyEnd,
-		0x6B => KeyCode::KeyLeftArrow,
-		0x6C => KeyCode::KeyHome,
-		0x70 => KeyCode::KeyInsert,
-		0x71 => KeyCode::KeyDelete,
-		0x72 => KeyCode::KeyDownArrow,
-		0x74 => KeyCode::KeyRightArrow,
-		0x75 => KeyCode::KeyUpArrow,
-		0x7A => KeyCode::KeyPageDown,
-		0x7D => KeyCode::KeyPageUp,
-		_ => KeyCode::Unknown,
+	EXTENDED_SCANCODE_TO_KEYCODE[scan_code as usize]
+}
+
+/// The key code of every extended set 2 scan code (the byte following the extended key message)
+static EXTENDED_SCANCODE_TO_KEYCODE: [KeyCode; 256] = scancode_table(&[
+	(0x10, KeyCode::KeyMultimediaSearch),
+	(0x11, KeyCode::KeyRightAlt),
+	(0x14, KeyCode::KeyRightControl),
+	(0x15, KeyCode::KeyMultimediaPreviousTrack),
+	(0x18, KeyCode::KeyMultimediaFavorites),
+	(0x1F, KeyCode::KeyLeftLogo),
+	(0x20, KeyCode::KeyMultimediaRefresh),
+	(0x21, KeyCode::KeyMultimediaVolumeDown),
+	(0x23, KeyCode::KeyMultimediaMute),
+	(0x27, KeyCode::KeyRightLogo),
+	(0x28, KeyCode::KeyMultimediaWebStop),
+	(0x2B, KeyCode::KeyMultimediaCalculator),
+	(0x2F, KeyCode::KeyMenu),
+	(0x30, KeyCode::KeyMultimediaWebForward),
+	(0x32, KeyCode::KeyMultimediaVolumeUp),
+	(0x34, KeyCode::KeyMultimediaPlayPause),
+	(0x37, KeyCode::KeyACPIPower),
+	(0x38, KeyCode::KeyMultimediaWebBack),
+	(0x3A, KeyCode::KeyMultimediaWebHome),
+	(0x3B, KeyCode::KeyMultimediaStop),
+	(0x3F, KeyCode::KeyACPISleep),
+	(0x40, KeyCode::KeyMultimediaMyComputer),
+	(0x48, KeyCode::KeyMultimediaEmail),
+	(0x4A, KeyCode::KeyNumpadSlash),
+	(0x4D, KeyCode::KeyMultimediaNextTrack),
+	(0x50, KeyCode::KeyMultimediaMediaSelect),
+	(0x5A, KeyCode::KeyNumpadEnter),
+	(0x5E, KeyCode::KeyACPIWake),
+	(0x69, KeyCode::KeyEnd),
+	(0x6B, KeyCode::KeyLeftArrow),
+	(0x6C, KeyCode::KeyHome),
+	(0x70, KeyCode::KeyInsert),
+	(0x71, KeyCode::KeyDelete),
+	(0x72, KeyCode::KeyDownArrow),
+	(0x74, KeyCode::KeyRightArrow),
+	(0x75, KeyCode::KeyUpArrow),
+	(0x7A, KeyCode::KeyPageDown),
+	(0x7D, KeyCode::KeyPageUp),
+]);
+
+/// Builds a table which maps every scan code to a key code from the `(scan code, key code)` pairs
+/// in `entries`. Scan codes which are not in `entries` map to `KeyCode::Unknown`.
+const fn scancode_table(entries: &[(u8, KeyCode)]) -> [KeyCode; 256] {
+	let mut table = [KeyCode::Unknown; 256];
+	let mut entry_idx = 0;
+	while entry_idx < entries.len() {
+		let (scan_code, key_code) = entries[entry_idx];
+		table[scan_code as usize] = key_code;
+		entry_idx += 1;
 	}
-}
\ No newline at end of file
+	table
+}
@@ -1,10 +1,12 @@
 //! PS/2 mouse driver
 
-use exclusive_cell::ExclusiveCell;
+use lock_cell::LockCell;
 use super::command_queue::{PS2CommandQueue, PS2Command};
 
 /// Command acknowledged response
 const MOUSE_MSG_ACK: u8 = 0xFA;
+/// Resend last command response
+const MOUSE_MSG_RESEND: u8 = 0xFE;
 /// Self-test successful response
 const MOUSE_MSG_SELF_TEST_PASSED: u8 = 0xAA;
 /// Self-test failed response
@@ -21,8 +23,8 @@ const MOUSE_CMD_ENABLE_STREAMING: u8 = 0xF4;
 const MOUSE_CMD_SET_SAMPLE_RATE: u8 = 0xF3;
 /// Command to get the mouse device ID
 const MOUSE_CMD_GET_MOUSE_ID: u8 = 0xF2;
-/// Mouse sample rate
-const MOUSE_SAMPLE_RATE: u8 = 10;
+/// The initial mouse sample rate
+const MOUSE_DEFAULT_SAMPLE_RATE: u8 = 10;
 
 /// Mouse driver state-machine states
 #[derive(Debug)]
@@ -48,6 +50,8 @@ struct PS2MouseDriver {
 	packet_data: [u8; 4],
 	/// Amount of packet bytes accumualted
 	packet_sequence: usize,
+	/// The sample rate the mouse is set to once it is initialized
+	sample_rate: u8,
 }
 
 impl PS2MouseDriver {
@@ -60,11 +64,19 @@ impl PS2MouseDriver {
 			supports_5_buttons: false,
 			packet_data: [0; 4],
 			packet_sequence: 0,
+			sample_rate: MOUSE_DEFAULT_SAMPLE_RATE,
 		}
 	}
 
 	/// Handle a mouse IRQ
 	pub fn handle_interrupt(&mut self, mouse_message: u8) {
+		// Packet bytes which were already on their way when a command was sent to an initialized
+		// mouse are discarded
+		if matches!(self.state, PS2MouseState::Initialized) && !self.command_queue.is_empty()
+			&& mouse_message != MOUSE_MSG_ACK && mouse_message != MOUSE_MSG_RESEND {
+			return;
+		}
+
 		// We first check if this is a response to a command we queued, and handle the response if
 		// it is
 		let queue_empty = self.command_queue.handle_message(mouse_message);
@@ -115,12 +127,17 @@ impl PS2MouseDriver {
 					self.state = PS2MouseState::TryInitScrollWheel;
 				},
 				PS2MouseState::TryInitScrollWheel => {
-					let device_id = super::controller::receive_data();
+					// The device ID follows the acknowledgement of the command which requested it
+					if mouse_message == MOUSE_MSG_ACK {
+						return;
+					}
+
+					let device_id = mouse_message;
 					if device_id == MOUSE_ID_STANDARD {
 						// If the device ID did not change, the mouse does not have a scroll wheel
 						// We set the sample rate and then enable packet streaming
 						self.command_queue.queue(PS2Command {
-							command: MOUSE_CMD_SET_SAMPLE_RATE, data: Some(MOUSE_SAMPLE_RATE)
+							command: MOUSE_CMD_SET_SAMPLE_RATE, data: Some(self.sample_rate)
 						});
 						self.command_queue.queue(PS2Command {
 							command: MOUSE_CMD_ENABLE_STREAMING, data: None
@@ -152,7 +169,12 @@ impl PS2MouseDriver {
 					}
 				},
 				PS2MouseState::TryInit5Buttons => {
-					let device_id = super::controller::receive_data();
+					// The device ID follows the acknowledgement of the command which requested it
+					if mouse_message == MOUSE_MSG_ACK {
+						return;
+					}
+
+					let device_id = mouse_message;
 					if device_id == MOUSE_ID_INTELLIMOUSE_EXPLORER {
 						// The device ID changed, so the buttons are now enabled
 						self.supports_5_buttons = true;
@@ -162,7 +184,7 @@ impl PS2MouseDriver {
 
 					// We set the sample rate and then enable packet streaming
 					self.command_queue.queue(PS2Command {
-						command: MOUSE_CMD_SET_SAMPLE_RATE, data: Some(MOUSE_SAMPLE_RATE)
+						command: MOUSE_CMD_SET_SAMPLE_RATE, data: Some(self.sample_rate)
 					});
 					self.command_queue.queue(PS2Command {
 						command: MOUSE_CMD_ENABLE_STREAMING, data: None
@@ -198,6 +220,25 @@ impl PS2MouseDriver {
 		}
 	}
 
+	/// Sets the sample rate of the mouse to `rate` samples per second. If the mouse is not
+	/// initialized yet, the rate is set when it is. Returns false if the command queue is full.
+	pub fn set_sample_rate(&mut self, rate: u8) -> bool {
+		if !matches!(self.state, PS2MouseState::Initialized) {
+			self.sample_rate = rate;
+			return true;
+		}
+
+		// While the mouse acknowledges the command it does not stream packets, so we restart the
+		// packet sequence
+		let command = PS2Command { command: MOUSE_CMD_SET_SAMPLE_RATE, data: Some(rate) };
+		if !self.command_queue.try_queue(command) {
+			return false;
+		}
+		self.sample_rate = rate;
+		self.packet_sequence = 0;
+		true
+	}
+
 	/// Dispatched a mouse packet based on the packet bytes stored in `self.packet_sequence`
 	fn dispatch_packet(&self) {
 		// A mouse packet is 3 bytes long, or 4 bytes long if the scroll wheel has been enabled.
@@ -249,11 +290,24 @@ impl PS2MouseDriver {
 	}
 }
 
-/// The current mouse state. We should only get one mouse interrupt at a time, so exclusivity
-/// is inherent.
-static MOUSE_DRIVER: ExclusiveCell<PS2MouseDriver> = ExclusiveCell::new(PS2MouseDriver::new());
+/// The current mouse state. The lock masks interrupts, so a mouse interrupt can't arrive while the
+/// sample rate is changed.
+static MOUSE_DRIVER: LockCell<PS2MouseDriver> = LockCell::new(PS2MouseDriver::new());
 
-/// Handles an interrupt from the PS/2 mouse (should only be called when an interrupt happens)
+/// Handles an interrupt from the PS/2 mouse (should only be called from the
+/// deferred work of an interrupt)
 pub fn handle_interrupt(mouse_message: u8) {
-	MOUSE_DRIVER.acquire().handle_interrupt(mouse_message);
+	MOUSE_DRIVER.lock().handle_interrupt(mouse_message);
+}
+
+/// Handles a PIT interrupt for the PS/2 mouse (should only be called from the
+/// deferred work of an interrupt)
+pub fn handle_timer_tick() {
+	MOUSE_DRIVER.lock().command_queue.handle_timer_tick();
+}
+
+/// Sets the sample rate of the mouse to `rate` samples per second, which must be a rate the mouse
+/// supports. Returns false if the mouse can't take the command right now.
+pub fn set_sample_rate(rate: u8) -> bool {
+	MOUSE_DRIVER.lock().set_sample_rate(rate)
 }
\ No newline at end of file
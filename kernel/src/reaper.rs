@@ -0,0 +1,182 @@
+//! Deferred teardown of the address spaces of exited processes. A process can't free its own page
+//! directory or kernel stack while it exits, because it is still running on them, so
+//! `Process::exit` queues the address space and the reaper frees it later, from another context:
+//! the deferred work of the timer interrupt, the creation of a process, or the OOM killer.
+//!
+//! The page tables are walked through the physical memory window, so tearing an address space down
+//! doesn't switch to it, and an address space is only torn down once the CPU switched away from it.
+//! Every user page is released along with the page tables holding it, instead of unmapping the
+//! pages one at a time, and the page frames are returned to the allocator in batches.
+
+use core::sync::atomic::{AtomicU32, Ordering};
+
+use lock_cell::LockCell;
+use page_tables::{PageDirectory, PhysAddr, PhysMem, VirtAddr, PAGE_ENTRY_PRESENT};
+use crate::memory_manager::{self, PhysicalMemory};
+use crate::swap;
+
+/// The maximum number of address spaces waiting to be torn down, one for each process
+const MAX_PENDING: usize = 16;
+/// The number of user page directory entries (user memory is the lower 3GiB)
+const USER_DIRECTORY_ENTRIES: u32 = 768;
+/// The number of page frames collected before they are returned to the allocator
+const RELEASE_BATCH_FRAMES: usize = 32;
+
+/// The address space of an exited process
+#[derive(Clone, Copy)]
+pub struct DeadAddressSpace {
+	/// The page directory of the address space
+	pub directory: PhysAddr,
+	/// The kernel stack of the process, and its size
+	pub kernel_stack: VirtAddr,
+	pub kernel_stack_size: u32,
+}
+
+/// The address spaces waiting to be torn down
+static PENDING: LockCell<[Option<DeadAddressSpace>; MAX_PENDING]> =
+	LockCell::new([None; MAX_PENDING]);
+/// The number of entries in `PENDING`, so the timer tick can check it without the lock
+static PENDING_COUNT: AtomicU32 = AtomicU32::new(0);
+
+/// Number of address spaces torn down
+static ADDRESS_SPACES_REAPED: AtomicU32 = AtomicU32::new(0);
+/// Number of page frames released by the reaper, including page tables and kernel stacks
+static FRAMES_REAPED: AtomicU32 = AtomicU32::new(0);
+
+/// Queues `address_space` to be torn down. The address space must already be removed from the
+/// reclaim sweep, and nothing else may use it after this.
+pub fn queue(address_space: DeadAddressSpace) {
+	let mut pending = PENDING.lock();
+	let slot = pending.iter_mut().find(|slot| slot.is_none())
+		.expect("Too many address spaces waiting to be torn down");
+	*slot = Some(address_space);
+	PENDING_COUNT.fetch_add(1, Ordering::SeqCst);
+}
+
+/// Returns the number of address spaces torn down and the number of page frames they released
+pub fn get_stats() -> (u32, u32) {
+	(ADDRESS_SPACES_REAPED.load(Ordering::Relaxed), FRAMES_REAPED.load(Ordering::Relaxed))
+}
+
+/// Called on every timer tick. Must only be called from the deferred work of the timer interrupt.
+pub fn handle_timer_tick() {
+	if PENDING_COUNT.load(Ordering::SeqCst) == 0 {
+		return;
+	}
+
+	// Interrupts are masked while the physical memory lock is held, so it can't be held by the
+	// code we interrupted
+	let mut pmem = memory_manager::PHYS_MEM.lock();
+	let (phys_mem, page_dir) = pmem.as_mut().unwrap();
+	reap_pending(phys_mem, page_dir);
+}
+
+/// Tears down every queued address space the CPU is not using
+pub fn reap_pending(phys_mem: &mut PhysicalMemory, kernel_page_dir: &mut PageDirectory) {
+	if PENDING_COUNT.load(Ordering::SeqCst) == 0 {
+		return;
+	}
+
+	// An exiting process runs on its address space and its kernel stack until the scheduler
+	// switches away from it, which switches both at once
+	let current_directory = unsafe { cpu::get_cr3() } as u32 & !0xFFF;
+
+	let mut pending = PENDING.lock();
+	for slot in pending.iter_mut() {
+		match slot {
+			Some(address_space) if address_space.directory.0 != current_directory => {
+				let frames = reap(phys_mem, kernel_page_dir, address_space);
+				*slot = None;
+				PENDING_COUNT.fetch_sub(1, Ordering::SeqCst);
+				ADDRESS_SPACES_REAPED.fetch_add(1, Ordering::Relaxed);
+				FRAMES_REAPED.fetch_add(frames, Ordering::Relaxed);
+			},
+			_ => {},
+		}
+	}
+}
+
+/// Frames waiting to be returned to the allocator
+struct ReleaseBatch {
+	frames: [PhysAddr; RELEASE_BATCH_FRAMES],
+	len: usize,
+	/// The total number of frames released through the batch
+	released: u32,
+}
+
+impl ReleaseBatch {
+	fn push(&mut self, phys_mem: &mut PhysicalMemory, frame: PhysAddr) {
+		if self.len == RELEASE_BATCH_FRAMES {
+			self.flush(phys_mem);
+		}
+		self.frames[self.len] = frame;
+		self.len += 1;
+	}
+
+	fn flush(&mut self, phys_mem: &mut PhysicalMemory) {
+		phys_mem.release_frames(&self.frames[..self.len]);
+		self.released += self.len as u32;
+		self.len = 0;
+	}
+}
+
+/// Releases the user pages, the user page tables, the page directory and the kernel stack of
+/// `address_space`. Returns the number of page frames released.
+fn reap(phys_mem: &mut PhysicalMemory, kernel_page_dir: &mut PageDirectory,
+	address_space: &DeadAddressSpace) -> u32 {
+	let mut batch = ReleaseBatch {
+		frames: [PhysAddr(0); RELEASE_BATCH_FRAMES],
+		len: 0,
+		released: 0,
+	};
+
+	// Each entry is read through the physical memory window right before it is used, because
+	// releasing frames moves the window
+	let read_entry = |phys_mem: &mut PhysicalMemory, paddr: u32| unsafe {
+		*(phys_mem.translate_phys(PhysAddr(paddr), 4)
+			.expect("Failed to translate a dead page table") as *const u32)
+	};
+
+	for directory_index in 0..USER_DIRECTORY_ENTRIES {
+		let raw_pde = read_entry(phys_mem, address_space.directory.0 + directory_index * 4);
+		if (raw_pde & PAGE_ENTRY_PRESENT) == 0 {
+			continue;
+		}
+
+		let table_paddr = raw_pde & !0xFFF;
+		for table_index in 0..1024 {
+			let raw_pte = read_entry(phys_mem, table_paddr + table_index * 4);
+			if (raw_pte & PAGE_ENTRY_PRESENT) != 0 {
+				// Shared frames are only released when their last mapping is dropped
+				let frame = PhysAddr(raw_pte & !0xFFF);
+				if phys_mem.drop_frame_reference(frame) {
+					batch.push(phys_mem, frame);
+				}
+			} else if let Some(entry) = swap::get_swap_entry(raw_pte) {
+				swap::free_entry(phys_mem, entry);
+			}
+		}
+
+		batch.push(phys_mem, PhysAddr(table_paddr));
+	}
+
+	batch.push(phys_mem, address_space.directory);
+
+	// The kernel stacks are mapped in page tables shared by every address space. A new process
+	// reaps the pending address spaces before it maps its stack, so the stack at this address is
+	// still the one of the dead process.
+	for offset in (0..address_space.kernel_stack_size).step_by(4096) {
+		let stack_page = VirtAddr(address_space.kernel_stack.0 + offset);
+		let raw_pte = kernel_page_dir.get_page_table_entry(phys_mem, stack_page).unwrap_or(0);
+		if (raw_pte & PAGE_ENTRY_PRESENT) != 0 {
+			unsafe {
+				kernel_page_dir.map_raw(phys_mem, stack_page, 0, true, false)
+					.expect("Failed to unmap a dead kernel stack");
+			}
+			batch.push(phys_mem, PhysAddr(raw_pte & !0xFFF));
+		}
+	}
+
+	batch.flush(phys_mem);
+	batch.released
+}
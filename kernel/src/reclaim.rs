@@ -0,0 +1,228 @@
+//! Reclaiming of page frames under memory pressure. A clock sweeps over the user pages of every
+//! address space, giving recently accessed pages a second chance, dropping clean pages which were
+//! read from a file (they are read in again by the page fault handler when accessed) and swapping
+//! out other unshared pages. When nothing is left to reclaim, a process is terminated to free its
+//! memory.
+
+use core::sync::atomic::{AtomicU32, Ordering};
+
+use exclusive_cell::ExclusiveCell;
+use page_tables::{PageDirectory, PhysAddr, PhysMem, VirtAddr, PAGE_ENTRY_PRESENT, PAGE_ENTRY_USER,
+	PAGE_ENTRY_ACCESSED, PAGE_ENTRY_DIRTY, PAGE_ENTRY_FILE};
+use serial::println;
+use crate::{ksm, reaper};
+use crate::memory_manager::{self, PhysicalMemory};
+use crate::process::{self, SCHEDULER_STATE};
+use crate::swap::{self, SwapCandidate};
+
+/// When free memory drops below this, allocations first try to reclaim page frames
+pub const LOW_WATERMARK_BYTES: u32 = 64 * 4096;
+/// The number of page frames an allocation below the low watermark tries to reclaim
+pub const RECLAIM_BATCH_FRAMES: usize = 32;
+/// The number of pages an allocation below the low watermark scans at most
+pub const RECLAIM_SCAN_BUDGET: usize = 4096;
+
+/// The exit code of a process which was terminated to free memory (the exit code a shell reports
+/// for SIGKILL)
+pub const OOM_KILL_EXIT_CODE: u8 = 128 + 9;
+
+/// The maximum number of address spaces the clock can sweep over
+pub const MAX_ADDRESS_SPACES: usize = 16;
+/// The number of user pages in an address space (user memory is the lower 3GiB)
+pub const USER_PAGE_COUNT: u32 = 768 * 1024;
+
+/// The physical addresses of the page directories of all user address spaces, zero if unused
+static ADDRESS_SPACES: [AtomicU32; MAX_ADDRESS_SPACES] = {
+	const UNUSED: AtomicU32 = AtomicU32::new(0);
+	[UNUSED; MAX_ADDRESS_SPACES]
+};
+
+/// The position of the clock hand: an index into `ADDRESS_SPACES` and a user page number. Only
+/// accessed while the physical memory lock is held.
+static CLOCK_HAND: ExclusiveCell<(usize, u32)> = ExclusiveCell::new((0, 0));
+
+/// Total number of page frames reclaimed
+static FRAMES_RECLAIMED: AtomicU32 = AtomicU32::new(0);
+/// Total number of processes terminated to free memory
+static OOM_KILLS: AtomicU32 = AtomicU32::new(0);
+
+/// Adds the address space with the page directory at `page_directory` to the sweep of the clock.
+/// Returns false if there is no room for another address space.
+pub fn register_address_space(page_directory: PhysAddr) -> bool {
+	ADDRESS_SPACES.iter().any(|address_space| {
+		address_space.compare_exchange(0, page_directory.0, Ordering::SeqCst, Ordering::SeqCst)
+			.is_ok()
+	})
+}
+
+/// Removes the address space with the page directory at `page_directory` from the sweep of the
+/// clock
+pub fn unregister_address_space(page_directory: PhysAddr) {
+	for address_space in ADDRESS_SPACES.iter() {
+		let _ = address_space.compare_exchange(page_directory.0, 0, Ordering::SeqCst,
+			Ordering::SeqCst);
+	}
+}
+
+/// Returns the page directory of the address space in slot `idx` of the sweep, if it is used
+pub fn get_address_space(idx: usize) -> Option<PhysAddr> {
+	match ADDRESS_SPACES[idx].load(Ordering::SeqCst) {
+		0 => None,
+		directory_addr => Some(PhysAddr(directory_addr)),
+	}
+}
+
+/// Returns the total number of page frames reclaimed and the number of processes terminated to
+/// free memory
+#[allow(unused)]
+pub fn get_stats() -> (u32, u32) {
+	(FRAMES_RECLAIMED.load(Ordering::Relaxed), OOM_KILLS.load(Ordering::Relaxed))
+}
+
+/// Advances the clock until `target` page frames are reclaimed, `scan_budget` pages are scanned or
+/// the clock went around twice (by then every page lost its second chance). Returns the number of
+/// page frames reclaimed.
+pub fn reclaim_frames(phys_mem: &mut PhysicalMemory, target: usize, scan_budget: usize) -> usize {
+	// Cached swap pages are copies of pages which are still in the swap area, so they go first
+	let mut reclaimed = swap::shrink_cache(phys_mem, target);
+	// Merged page frames which no page maps anymore only wait for the next pass of the scanner
+	reclaimed += ksm::release_unused_frames(phys_mem);
+
+	let mut hand = CLOCK_HAND.acquire();
+	let (mut address_space_idx, mut page) = *hand;
+
+	// Pages to swap out are collected so they can be written to the swap area together
+	let mut cluster = [SwapCandidate::EMPTY; swap::SWAP_CLUSTER_PAGES];
+	let mut cluster_len = 0;
+	let swap_enabled = swap::is_enabled();
+
+	let mut scanned = 0;
+	let mut revolutions = 0;
+	while reclaimed < target && scanned < scan_budget && revolutions < 2 {
+		let directory_addr = ADDRESS_SPACES[address_space_idx].load(Ordering::SeqCst);
+		if directory_addr == 0 || page >= USER_PAGE_COUNT {
+			// Move on to the next address space
+			address_space_idx = (address_space_idx + 1) % MAX_ADDRESS_SPACES;
+			page = 0;
+			if address_space_idx == 0 {
+				revolutions += 1;
+			}
+			continue;
+		}
+
+		scanned += 1;
+		let mut page_dir = unsafe { PageDirectory::from_cr3(directory_addr) };
+		let page_vaddr = VirtAddr(page << 12);
+
+		// Skip entire page tables which don't exist
+		if page % 1024 == 0 {
+			let raw_pde = page_dir.get_page_directory_entry(phys_mem, page_vaddr).unwrap_or(0);
+			if (raw_pde & PAGE_ENTRY_PRESENT) == 0 {
+				page += 1024;
+				continue;
+			}
+		}
+		page += 1;
+
+		let raw_pte = page_dir.get_page_table_entry(phys_mem, page_vaddr).unwrap_or(0);
+		if (raw_pte & (PAGE_ENTRY_PRESENT | PAGE_ENTRY_USER)) != (PAGE_ENTRY_PRESENT | PAGE_ENTRY_USER) {
+			continue;
+		}
+
+		if (raw_pte & PAGE_ENTRY_ACCESSED) != 0 {
+			// The page was accessed since the clock last passed it, so it gets a second chance
+			unsafe {
+				let _ = page_dir.map_raw(phys_mem, page_vaddr, raw_pte & !PAGE_ENTRY_ACCESSED, true,
+					false);
+			}
+			continue;
+		}
+
+		let frame_paddr = PhysAddr(raw_pte & !0xFFF);
+
+		// Clean pages read from a file can be dropped, because they can be read in again
+		if (raw_pte & PAGE_ENTRY_FILE) != 0 && (raw_pte & PAGE_ENTRY_DIRTY) == 0 {
+			// Unmapping also releases the page table if it is left empty
+			if page_dir.unmap(phys_mem, page_vaddr, false).is_none() {
+				continue;
+			}
+
+			// Frames shared with other address spaces are only released by their last mapping
+			if phys_mem.drop_frame_reference(frame_paddr) {
+				phys_mem.release_phys_mem(frame_paddr, 4096);
+				reclaimed += 1;
+			}
+			continue;
+		}
+
+		// Any other page must be written to the swap area, which is only done for unshared pages
+		if !swap_enabled || phys_mem.frame_share_count(frame_paddr) != 0 {
+			continue;
+		}
+
+		cluster[cluster_len] = SwapCandidate {
+			directory: PhysAddr(directory_addr),
+			page_vaddr,
+			raw_pte,
+		};
+		cluster_len += 1;
+		if cluster_len == cluster.len() {
+			reclaimed += swap::swap_out_cluster(phys_mem, &cluster);
+			cluster_len = 0;
+		}
+	}
+
+	if cluster_len > 0 {
+		reclaimed += swap::swap_out_cluster(phys_mem, &cluster[..cluster_len]);
+	}
+
+	*hand = (address_space_idx, page);
+	FRAMES_RECLAIMED.fetch_add(reclaimed as u32, Ordering::Relaxed);
+	reclaimed
+}
+
+/// Frees memory by terminating the process with the most resident pages. This is the last resort
+/// when there is nothing left to reclaim. The init process is never chosen. Returns false if there
+/// is no process to terminate, and does not return if the current process was terminated.
+/// Must not be called with `SCHEDULER_STATE` or `PHYS_MEM` held.
+pub fn oom_kill() -> bool {
+	let mut sched_state = SCHEDULER_STATE.lock();
+
+	let mut victim = None;
+	{
+		let mut pmem = memory_manager::PHYS_MEM.lock();
+		let (phys_mem, _) = pmem.as_mut().unwrap();
+
+		let mut victim_resident_pages = 0;
+		for (pid, proc) in sched_state.processes.iter_mut().enumerate().skip(1) {
+			if let Some(proc) = proc.as_mut().filter(|proc| !proc.is_zombie()) {
+				let resident_pages = proc.memory_usage(phys_mem).resident_pages;
+				if victim.is_none() || resident_pages > victim_resident_pages {
+					victim = Some(pid);
+					victim_resident_pages = resident_pages;
+				}
+			}
+		}
+	}
+
+	let victim = match victim {
+		Some(victim) => victim,
+		None => return false,
+	};
+
+	OOM_KILLS.fetch_add(1, Ordering::Relaxed);
+	println!("Out of memory: terminating process {}", victim);
+
+	if victim == sched_state.current_process {
+		drop(sched_state);
+		process::exit_current_process(OOM_KILL_EXIT_CODE);
+	}
+
+	sched_state.processes[victim].as_mut().unwrap().exit(OOM_KILL_EXIT_CODE);
+
+	// The victim isn't running, so its memory can be released right away
+	let mut pmem = memory_manager::PHYS_MEM.lock();
+	let (phys_mem, page_dir) = pmem.as_mut().unwrap();
+	reaper::reap_pending(phys_mem, page_dir);
+	true
+}
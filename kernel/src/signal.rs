@@ -0,0 +1,281 @@
+//! POSIX-style signals. A signal sent to a process is marked pending, and is delivered when the
+//! process next returns to user-mode from an interrupt or a syscall: a signal frame holding the
+//! interrupted state is pushed on the user stack, and the process continues at the handler. The
+//! handler returns to the restorer of its action, which calls `SigReturn` to restore the state from
+//! the frame. Signals without a handler terminate the process or are ignored.
+
+use core::sync::atomic::{AtomicUsize, Ordering};
+
+use cpu::PushADRegisterState;
+use page_tables::VirtAddr;
+use syscall_interface::{SyscallError, SyscallSigAction, NUM_SIGNALS, SIGCHLD, SIGINT, SIGKILL,
+	SIGSEGV, SIG_DFL, SIG_IGN};
+use crate::interrupts::TrapFrame;
+use crate::process::{self, SchedulerState, SCHEDULER_STATE};
+use crate::userspace::UserVaddr;
+
+/// The exit code of a process terminated by a signal is this plus the signal number
+const SIGNAL_EXIT_CODE_BASE: u8 = 128;
+/// The EFLAGS bits user-mode can change through `SigReturn`: CF, PF, AF, ZF, SF, TF, DF and OF
+const USER_EFLAGS_MASK: u32 = 0x0DD5;
+/// Value of `FOREGROUND_PROCESS` when no process is in the foreground
+const NO_FOREGROUND: usize = usize::MAX;
+
+/// The process Ctrl+C interrupts: the process the shell is waiting for
+static FOREGROUND_PROCESS: AtomicUsize = AtomicUsize::new(NO_FOREGROUND);
+
+/// The signal state of a process
+#[derive(Clone, Copy)]
+pub struct SignalState {
+	/// Bitmap of the signals which were sent and not delivered yet
+	pending: u32,
+	/// Bitmap of the signals whose delivery is postponed, e.g. while their handler runs
+	mask: u32,
+	actions: [SyscallSigAction; NUM_SIGNALS as usize],
+}
+
+/// What was pushed on the user stack to call a handler. The handler is entered with `esp` pointing
+/// at `return_address`, so it sees `signal` as its argument, and when it returns to the restorer
+/// `esp` points at `signal`.
+#[repr(C)]
+struct SignalFrame {
+	/// The restorer of the action
+	return_address: u32,
+	signal: u32,
+	/// The interrupted registers, `esp` holds the interrupted user stack pointer
+	registers: PushADRegisterState,
+	eip: u32,
+	eflags: u32,
+	/// The signal mask to restore
+	mask: u32,
+}
+
+/// What to do with a signal being delivered
+enum Disposition {
+	Ignore,
+	Terminate,
+	Handle(SyscallSigAction),
+}
+
+impl SignalState {
+	pub const fn new() -> Self {
+		Self {
+			pending: 0,
+			mask: 0,
+			actions: [SyscallSigAction { handler: SIG_DFL, restorer: 0 }; NUM_SIGNALS as usize],
+		}
+	}
+
+	/// Returns the signal state of a child forked from a process with this state: the actions and
+	/// the mask are inherited, but no signal is pending
+	pub fn forked(&self) -> Self {
+		Self { pending: 0, ..*self }
+	}
+
+	/// Resets the handled signals to their default action, as the handlers are gone after an exec.
+	/// Ignored signals stay ignored.
+	pub fn reset_handlers(&mut self) {
+		for action in self.actions.iter_mut() {
+			if action.handler != SIG_IGN {
+				*action = SyscallSigAction { handler: SIG_DFL, restorer: 0 };
+			}
+		}
+	}
+
+	/// Returns true if a signal is pending which isn't masked
+	pub fn has_deliverable(&self) -> bool {
+		(self.pending & !self.mask) != 0
+	}
+
+	/// Removes the lowest deliverable signal from the pending signals, and decides what to do
+	/// with it. `is_init` is whether this is the first process, which like init isn't terminated
+	/// by signals it doesn't handle.
+	fn take_deliverable(&mut self, is_init: bool) -> Option<(u32, Disposition)> {
+		let deliverable = self.pending & !self.mask;
+		if deliverable == 0 {
+			return None;
+		}
+
+		let signal = deliverable.trailing_zeros();
+		self.pending &= !(1 << signal);
+		Some((signal, self.disposition(signal, is_init)))
+	}
+
+	/// Decides what to do with `signal`. `is_init` is as in `take_deliverable`.
+	fn disposition(&self, signal: u32, is_init: bool) -> Disposition {
+		let action = self.actions[signal as usize];
+		match action.handler {
+			_ if signal == SIGKILL && !is_init => Disposition::Terminate,
+			SIG_IGN => Disposition::Ignore,
+			SIG_DFL if signal == SIGCHLD || is_init => Disposition::Ignore,
+			SIG_DFL => Disposition::Terminate,
+			_ => Disposition::Handle(action),
+		}
+	}
+}
+
+/// Sends `signal` to the process `pid`. A signal of 0 only checks that the process exists.
+/// Signals the process would ignore are discarded right away, so they don't interrupt its syscalls.
+pub fn send(sched_state: &mut SchedulerState, pid: usize, signal: u32) -> Result<(), SyscallError> {
+	if signal >= NUM_SIGNALS {
+		return Err(SyscallError::InvalidSignal);
+	}
+
+	let proc = sched_state.processes.get_mut(pid).ok_or(SyscallError::InvalidPID)?
+		.as_mut().filter(|proc| !proc.is_zombie()).ok_or(SyscallError::NoSuchProcess)?;
+	if signal == 0 {
+		return Ok(());
+	}
+
+	if !matches!(proc.signals.disposition(signal, pid == 0), Disposition::Ignore) {
+		proc.signals.pending |= 1 << signal;
+	}
+	Ok(())
+}
+
+/// Sets the action of `signal` in the current process to `new_action` if it is given, and returns
+/// the previous action. The action of `SIGKILL` can't be changed.
+pub fn set_action(sched_state: &mut SchedulerState, signal: u32,
+	new_action: Option<SyscallSigAction>) -> Result<SyscallSigAction, SyscallError> {
+	if signal == 0 || signal >= NUM_SIGNALS || (signal == SIGKILL && new_action.is_some()) {
+		return Err(SyscallError::InvalidSignal);
+	}
+
+	let signals = &mut sched_state.get_current_process().signals;
+	let old_action = signals.actions[signal as usize];
+	if let Some(new_action) = new_action {
+		signals.actions[signal as usize] = new_action;
+		if new_action.handler == SIG_IGN {
+			signals.pending &= !(1 << signal);
+		}
+	}
+	Ok(old_action)
+}
+
+/// Sets the process Ctrl+C interrupts, or clears it if `pid` is `None`
+pub fn set_foreground(pid: Option<usize>) {
+	FOREGROUND_PROCESS.store(pid.unwrap_or(NO_FOREGROUND), Ordering::Relaxed);
+}
+
+/// Sends `SIGINT` to the foreground process, if there is one. Called when Ctrl+C is pressed.
+pub fn interrupt_foreground() {
+	let pid = FOREGROUND_PROCESS.load(Ordering::Relaxed);
+	if pid != NO_FOREGROUND {
+		let _ = send(&mut SCHEDULER_STATE.lock(), pid, SIGINT);
+	}
+}
+
+/// Returns true if the current process has a signal to deliver, so a syscall waiting in the kernel
+/// should return and let it be delivered
+pub fn current_has_deliverable() -> bool {
+	SCHEDULER_STATE.lock().get_current_process().signals.has_deliverable()
+}
+
+/// Delivers the pending signals of the current process before the interrupt with the frame `frame`
+/// returns to it. Must only be called when the interrupt returns to user-mode, as the last thing
+/// the interrupt does. Returns with interrupts masked.
+pub fn deliver_pending(frame: &mut TrapFrame) {
+	// The interrupt return restores the interrupt flag of the process anyway, and with interrupts
+	// masked nothing can send a signal after the check
+	unsafe { cpu::cli(); }
+
+	// Fast path: nothing to deliver. This runs on every return to user-mode, so the current process
+	// is checked without going through `SCHEDULER_STATE`.
+	match unsafe { process::current_process_unlocked() } {
+		Some(proc) if proc.signals.has_deliverable() => {},
+		_ => return,
+	}
+
+	loop {
+		let (signal, action, old_mask) = {
+			let mut sched_state = SCHEDULER_STATE.lock();
+			let is_init = sched_state.current_process == 0;
+			let signals = &mut sched_state.get_current_process().signals;
+			let (signal, disposition) = match signals.take_deliverable(is_init) {
+				Some(delivery) => delivery,
+				None => return,
+			};
+
+			match disposition {
+				Disposition::Ignore => continue,
+				Disposition::Terminate => {
+					drop(sched_state);
+					process::exit_current_process(SIGNAL_EXIT_CODE_BASE + signal as u8);
+				},
+				Disposition::Handle(action) => {
+					// The signal is masked until its handler returns
+					let old_mask = signals.mask;
+					signals.mask |= 1 << signal;
+					(signal, action, old_mask)
+				},
+			}
+		};
+
+		// The frame is written after `SCHEDULER_STATE` is released, because the write might page
+		// fault. It is checked to be in writable memory of the process first, so the fault can
+		// always be resolved.
+		let frame_size = core::mem::size_of::<SignalFrame>() as u32;
+		let frame_addr = (frame.user_esp.wrapping_sub(frame_size) & !0xF).wrapping_sub(4);
+		if frame_addr < 0x1000 || frame_addr > frame.user_esp || frame.user_esp > 0xC000_0000
+			|| !is_frame_accessible(frame_addr, true) {
+			process::exit_current_process(SIGNAL_EXIT_CODE_BASE + SIGSEGV as u8);
+		}
+
+		let mut registers = frame.registers;
+		registers.esp = frame.user_esp;
+		*UserVaddr::<SignalFrame>::new(&frame_addr).as_ref_mut().unwrap() = SignalFrame {
+			return_address: action.restorer,
+			signal,
+			registers,
+			eip: frame.eip,
+			eflags: frame.eflags,
+			mask: old_mask,
+		};
+
+		// Continue at the handler. Another pending signal gets its own frame on top of this one,
+		// so its handler runs first.
+		frame.user_esp = frame_addr;
+		frame.eip = action.handler;
+	}
+}
+
+/// Checks whether the signal frame at `frame_addr`, which is in the lower 3GiB, is inside the
+/// memory areas of the current process (and writable if `write` is set), so the kernel can access
+/// it without an unresolvable page fault. A frame written right below the stack grows the stack.
+fn is_frame_accessible(frame_addr: u32, write: bool) -> bool {
+	let frame_last_page = (frame_addr + (core::mem::size_of::<SignalFrame>() as u32 - 1)) & !0xFFF;
+
+	let mut sched_state = SCHEDULER_STATE.lock();
+	let proc = sched_state.get_current_process();
+	for page_vaddr in ((frame_addr & !0xFFF)..=frame_last_page).step_by(4096) {
+		let page_vaddr = VirtAddr(page_vaddr);
+		if proc.find_vma(page_vaddr).is_none() && (!write || proc.grow_stack(page_vaddr).is_none()) {
+			return false;
+		}
+		if write && !proc.find_vma(page_vaddr).map_or(false, |vma| vma.write) {
+			return false;
+		}
+	}
+
+	true
+}
+
+/// Handles the `SigReturn` syscall: restores the state saved in the signal frame the handler
+/// returned from, and the signal mask from before the handler
+pub fn sigreturn(frame: &mut TrapFrame) {
+	// The restorer is entered after the handler's `ret` popped the return address
+	let frame_addr = frame.user_esp.wrapping_sub(4);
+	if frame_addr < 0x1000 || frame_addr >= 0xC000_0000 - core::mem::size_of::<SignalFrame>() as u32
+		|| !is_frame_accessible(frame_addr, false) {
+		process::exit_current_process(SIGNAL_EXIT_CODE_BASE + SIGSEGV as u8);
+	}
+	let signal_frame = UserVaddr::<SignalFrame>::new(&frame_addr).as_ref().unwrap();
+
+	frame.registers = signal_frame.registers;
+	frame.user_esp = signal_frame.registers.esp;
+	frame.eip = signal_frame.eip;
+	frame.eflags = (frame.eflags & !USER_EFLAGS_MASK) | (signal_frame.eflags & USER_EFLAGS_MASK);
+	let mask = signal_frame.mask & !(1 << SIGKILL);
+
+	SCHEDULER_STATE.lock().get_current_process().signals.mask = mask;
+}
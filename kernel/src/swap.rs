@@ -0,0 +1,524 @@
+//! Swapping of anonymous pages. Pages are first offered to the compressed in-memory store (see
+//! `zram`), and pages it rejects go to a swap area on a block device: the first virtio block device
+//! with a swap area signature, or else the second drive of the primary IDE bus.
+//! Pages are written to the device in clusters of contiguous slots with a single transfer, a
+//! swap-in reads ahead the slots following the faulting one, and pages read from the swap area are
+//! kept in a swap cache until they are faulted in, so repeated faults don't read the device again.
+//!
+//! A swapped-out page is marked in its page table entry with `PAGE_ENTRY_SWAPPED`, and the address
+//! bits hold its slot (or its entry in the compressed store). Slots are reference counted, because
+//! forking copies swap entries.
+
+use alloc::{vec, vec::Vec};
+use core::alloc::Layout;
+use core::sync::atomic::{AtomicU32, Ordering};
+
+use exclusive_cell::ExclusiveCell;
+use page_tables::{PageDirectory, PhysAddr, PhysMem, VirtAddr, PAGE_ENTRY_PRESENT,
+	PAGE_ENTRY_SWAPPED};
+use serial::println;
+use crate::{ata, reclaim, virtio_blk, zram};
+use crate::block::{self, BlockDevice};
+use crate::memory_manager::PhysicalMemory;
+
+/// Signature at the start of the swap area header, which takes up the first page of the device and
+/// is followed by the number of pages in the swap area (including the header) as a little-endian
+/// u32
+const SWAP_SIGNATURE: &[u8; 8] = b"EXOSSWAP";
+/// The ATA drive checked for a swap area if no virtio block device has one
+const SWAP_ATA_DRIVE: ata::Drive = ata::Drive::Slave;
+/// The number of sectors in a page
+const SECTORS_PER_PAGE: u32 = (4096 / block::SECTOR_SIZE) as u32;
+
+/// The maximum number of pages written to the swap area in a single transfer
+pub const SWAP_CLUSTER_PAGES: usize = 16;
+/// The maximum number of slots following the faulting one which are read along with it
+const SWAP_READAHEAD_PAGES: usize = 7;
+/// The maximum number of pages kept in the swap cache
+const SWAP_CACHE_ENTRIES: usize = 64;
+
+/// Marks a swap entry whose page is in the compressed store. The CPU ignores every bit but the
+/// present bit of a not-present entry, so this reuses the position of the write bit.
+const SWAP_ENTRY_COMPRESSED: u32 = 1 << 1;
+
+/// Where a swapped-out page is kept
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+pub enum SwapEntry {
+	/// A slot of the swap area on the drive
+	Drive(usize),
+	/// An entry of the compressed store
+	Compressed(usize),
+}
+
+/// An anonymous page chosen to be swapped out
+#[derive(Clone, Copy)]
+pub struct SwapCandidate {
+	/// The page directory of the address space the page is mapped in
+	pub directory: PhysAddr,
+	pub page_vaddr: VirtAddr,
+	/// The page table entry mapping the page
+	pub raw_pte: u32,
+}
+
+impl SwapCandidate {
+	pub const EMPTY: SwapCandidate = SwapCandidate {
+		directory: PhysAddr(0),
+		page_vaddr: VirtAddr(0),
+		raw_pte: 0,
+	};
+}
+
+struct SwapArea {
+	/// The block device holding the swap area
+	device: BlockDevice,
+	/// The number of page table entries referring to each slot, zero if the slot is free
+	slot_refs: Vec<u16>,
+	/// The slot where the search for free slots starts, so clusters are laid out sequentially
+	next_slot: usize,
+	/// Pages read from the swap area which were not faulted in yet, as (slot, page frame)
+	cache: [Option<(usize, PhysAddr)>; SWAP_CACHE_ENTRIES],
+	/// The next swap cache entry to be replaced when the cache is full
+	cache_hand: usize,
+	/// Buffer for transfers of whole clusters
+	transfer_buffer: Vec<u8>,
+}
+
+/// The swap area, if a block device with a swap area signature was found. Only accessed while the
+/// physical memory lock is held.
+static SWAP_AREA: ExclusiveCell<Option<SwapArea>> = ExclusiveCell::new(None);
+
+/// The number of slots in the swap area
+static TOTAL_SLOTS: AtomicU32 = AtomicU32::new(0);
+/// The number of free slots in the swap area
+static FREE_SLOTS: AtomicU32 = AtomicU32::new(0);
+/// Total number of pages written to the swap area
+static PAGES_OUT: AtomicU32 = AtomicU32::new(0);
+/// Total number of pages faulted in from the swap area
+static PAGES_IN: AtomicU32 = AtomicU32::new(0);
+/// Total number of clusters written to the swap area
+static CLUSTERS_WRITTEN: AtomicU32 = AtomicU32::new(0);
+/// Total number of pages read from the swap area (including read ahead pages)
+static PAGES_READ: AtomicU32 = AtomicU32::new(0);
+/// Total number of swap-ins served from the swap cache
+static CACHE_HITS: AtomicU32 = AtomicU32::new(0);
+
+/// Swap usage and activity counters
+pub struct SwapStats {
+	pub total_pages: u32,
+	pub free_pages: u32,
+	pub pages_out: u32,
+	pub pages_in: u32,
+	pub clusters_written: u32,
+	pub pages_read: u32,
+	pub cache_hits: u32,
+}
+
+/// Returns the current swap usage and activity counters
+pub fn get_stats() -> SwapStats {
+	SwapStats {
+		total_pages: TOTAL_SLOTS.load(Ordering::Relaxed),
+		free_pages: FREE_SLOTS.load(Ordering::Relaxed),
+		pages_out: PAGES_OUT.load(Ordering::Relaxed),
+		pages_in: PAGES_IN.load(Ordering::Relaxed),
+		clusters_written: CLUSTERS_WRITTEN.load(Ordering::Relaxed),
+		pages_read: PAGES_READ.load(Ordering::Relaxed),
+		cache_hits: CACHE_HITS.load(Ordering::Relaxed),
+	}
+}
+
+/// Prints the swap usage and activity counters to the serial port
+#[allow(unused)]
+pub fn dump_stats() {
+	let stats = get_stats();
+	println!("Swap: {} of {} pages free", stats.free_pages, stats.total_pages);
+	println!("\t{} pages out in {} clusters, {} pages in ({} from the swap cache, {} read)",
+		stats.pages_out, stats.clusters_written, stats.pages_in, stats.cache_hits,
+		stats.pages_read);
+}
+
+/// Sets up the compressed store, and looks for a swap area on the block devices
+pub fn init() {
+	zram::init();
+
+	// The virtio block devices are preferred, because they transfer a cluster with several requests
+	// in flight instead of polling a sector at a time
+	let mut header = vec![0u8; 4096];
+	let candidates = (0..virtio_blk::device_count()).map(BlockDevice::VirtioBlk)
+		.chain(core::iter::once(BlockDevice::Ata(SWAP_ATA_DRIVE)));
+	let mut found = None;
+	for device in candidates {
+		if let Some(sector_count) = device.sector_count() {
+			if device.read_sectors(0, &mut header).is_some() && &header[..8] == SWAP_SIGNATURE {
+				found = Some((device, sector_count));
+				break;
+			}
+		}
+	}
+
+	let (device, sector_count) = match found {
+		Some(found) => found,
+		None => {
+			println!("No block device has a swap area signature, swapping is disabled");
+			return;
+		}
+	};
+	println!("Swapping to {:?}", device);
+
+	// The header page is not a slot, and swap entries have 20 bits for the slot
+	let page_count = u32::from_le_bytes(header[8..12].try_into().unwrap())
+		.min(sector_count / SECTORS_PER_PAGE);
+	let slot_count = page_count.saturating_sub(1).min(1 << 20);
+	if slot_count == 0 {
+		return;
+	}
+
+	// Everything is allocated before the swap area is published, because allocating might
+	// reclaim memory
+	let area = SwapArea {
+		device,
+		slot_refs: vec![0; slot_count as usize],
+		next_slot: 0,
+		cache: [None; SWAP_CACHE_ENTRIES],
+		cache_hand: 0,
+		transfer_buffer: vec![0u8; SWAP_CLUSTER_PAGES * 4096],
+	};
+
+	let _pmem = crate::memory_manager::PHYS_MEM.lock();
+	*SWAP_AREA.acquire() = Some(area);
+	FREE_SLOTS.store(slot_count, Ordering::Relaxed);
+	TOTAL_SLOTS.store(slot_count, Ordering::Relaxed);
+
+	println!("Enabled swapping to a swap area of {} KiB", slot_count * 4);
+}
+
+/// Returns true if anonymous pages can be swapped out
+pub fn is_enabled() -> bool {
+	zram::is_enabled() || TOTAL_SLOTS.load(Ordering::Relaxed) != 0
+}
+
+/// Returns the swap entry held by `raw_pte`, if it is the page table entry of a swapped-out page
+pub fn get_swap_entry(raw_pte: u32) -> Option<SwapEntry> {
+	if (raw_pte & (PAGE_ENTRY_PRESENT | PAGE_ENTRY_SWAPPED)) != PAGE_ENTRY_SWAPPED {
+		return None;
+	}
+
+	let idx = (raw_pte >> 12) as usize;
+	if (raw_pte & SWAP_ENTRY_COMPRESSED) != 0 {
+		Some(SwapEntry::Compressed(idx))
+	} else {
+		Some(SwapEntry::Drive(idx))
+	}
+}
+
+/// Returns the page table entry of a page swapped out to `entry`
+fn raw_swap_entry(entry: SwapEntry) -> u32 {
+	match entry {
+		SwapEntry::Drive(slot) => ((slot as u32) << 12) | PAGE_ENTRY_SWAPPED,
+		SwapEntry::Compressed(idx) => ((idx as u32) << 12) | SWAP_ENTRY_COMPRESSED
+			| PAGE_ENTRY_SWAPPED,
+	}
+}
+
+/// Returns the first sector of `slot` on the swap device
+fn slot_lba(slot: usize) -> u32 {
+	(slot as u32 + 1) * SECTORS_PER_PAGE
+}
+
+impl SwapArea {
+	/// Allocates a run of up to `max_count` contiguous free slots, each with a single reference.
+	/// Returns the first slot of the run and its length.
+	fn allocate_slots(&mut self, max_count: usize) -> Option<(usize, usize)> {
+		let slot_count = self.slot_refs.len();
+		let first_slot = (0..slot_count).map(|idx| (self.next_slot + idx) % slot_count)
+			.find(|&slot| self.slot_refs[slot] == 0)?;
+
+		let mut count = 0;
+		while count < max_count && first_slot + count < slot_count
+			&& self.slot_refs[first_slot + count] == 0 {
+			self.slot_refs[first_slot + count] = 1;
+			count += 1;
+		}
+
+		self.next_slot = (first_slot + count) % slot_count;
+		FREE_SLOTS.fetch_sub(count as u32, Ordering::Relaxed);
+		Some((first_slot, count))
+	}
+
+	/// Drops a reference to `slot`, freeing it (and its swap cache entry) if it was the last one
+	fn release_slot(&mut self, phys_mem: &mut PhysicalMemory, slot: usize) {
+		assert!(self.slot_refs[slot] > 0, "Released a free swap slot");
+		self.slot_refs[slot] -= 1;
+		if self.slot_refs[slot] != 0 {
+			return;
+		}
+
+		FREE_SLOTS.fetch_add(1, Ordering::Relaxed);
+		if let Some(idx) = self.find_cached(slot) {
+			let (_, frame) = self.cache[idx].take().unwrap();
+			phys_mem.release_phys_mem(frame, 4096);
+		}
+	}
+
+	/// Returns the index of the swap cache entry of `slot`
+	fn find_cached(&self, slot: usize) -> Option<usize> {
+		self.cache.iter().position(|entry| matches!(entry, Some((cached, _)) if *cached == slot))
+	}
+
+	/// Adds the page frame `frame` holding the contents of `slot` to the swap cache, replacing an
+	/// older entry if the cache is full
+	fn insert_cached(&mut self, phys_mem: &mut PhysicalMemory, slot: usize, frame: PhysAddr) {
+		let idx = match self.cache.iter().position(|entry| entry.is_none()) {
+			Some(idx) => idx,
+			None => {
+				let idx = self.cache_hand;
+				self.cache_hand = (self.cache_hand + 1) % SWAP_CACHE_ENTRIES;
+				let (_, old_frame) = self.cache[idx].take().unwrap();
+				phys_mem.release_phys_mem(old_frame, 4096);
+				idx
+			}
+		};
+
+		self.cache[idx] = Some((slot, frame));
+	}
+
+	/// Copies the page at `page_idx` of the transfer buffer into the page frame `frame`
+	fn copy_out_of_buffer(&self, phys_mem: &mut PhysicalMemory, page_idx: usize, frame: PhysAddr) {
+		unsafe {
+			let frame_ptr = phys_mem.translate_phys(frame, 4096)
+				.expect("Failed to translate a swap page frame");
+			core::ptr::copy_nonoverlapping(self.transfer_buffer[page_idx * 4096..].as_ptr(),
+				frame_ptr, 4096);
+		}
+	}
+
+	/// Copies the contents of the page frame `frame` into the page at `page_idx` of the transfer
+	/// buffer
+	fn copy_into_buffer(&mut self, phys_mem: &mut PhysicalMemory, page_idx: usize, frame: PhysAddr) {
+		unsafe {
+			let frame_ptr = phys_mem.translate_phys(frame, 4096)
+				.expect("Failed to translate a swap page frame");
+			core::ptr::copy_nonoverlapping(frame_ptr,
+				self.transfer_buffer[page_idx * 4096..].as_mut_ptr(), 4096);
+		}
+	}
+}
+
+/// Swaps out the pages of `candidates`: pages are stored compressed when possible, and the rest
+/// are written to the swap area in clusters of contiguous slots. The page table entries are
+/// replaced with swap entries and the page frames are released. The page frames must not be
+/// shared. Returns the number of page frames released.
+pub fn swap_out_cluster(phys_mem: &mut PhysicalMemory, candidates: &[SwapCandidate]) -> usize {
+	let mut swapped_out = 0;
+
+	// Pages which the compressed store rejects are collected for the drive
+	let mut rejected = [SwapCandidate::EMPTY; SWAP_CLUSTER_PAGES];
+	let mut rejected_len = 0;
+	for candidate in candidates {
+		let frame = PhysAddr(candidate.raw_pte & !0xFFF);
+		let entry_idx = match zram::store(phys_mem, frame) {
+			Some(entry_idx) => entry_idx,
+			None => {
+				if rejected_len < rejected.len() {
+					rejected[rejected_len] = *candidate;
+					rejected_len += 1;
+				}
+				continue;
+			}
+		};
+
+		if replace_with_swap_entry(phys_mem, candidate, SwapEntry::Compressed(entry_idx)) {
+			swapped_out += 1;
+		} else {
+			zram::release(phys_mem, entry_idx);
+		}
+	}
+
+	let mut area = SWAP_AREA.acquire();
+	if let Some(area) = area.as_mut() {
+		swapped_out += write_to_drive(area, phys_mem, &rejected[..rejected_len]);
+	}
+
+	PAGES_OUT.fetch_add(swapped_out as u32, Ordering::Relaxed);
+	swapped_out
+}
+
+/// Writes the pages of `candidates` to the swap area in clusters of contiguous slots. Returns the
+/// number of page frames released.
+fn write_to_drive(area: &mut SwapArea, phys_mem: &mut PhysicalMemory, candidates: &[SwapCandidate])
+	-> usize {
+	let mut swapped_out = 0;
+	let mut remaining = candidates;
+	while !remaining.is_empty() {
+		// When free slots are fragmented a cluster is split into several transfers
+		let (first_slot, count) = match area.allocate_slots(remaining.len()) {
+			Some(run) => run,
+			None => break, // The swap area is full
+		};
+		let (cluster, rest) = remaining.split_at(count);
+		remaining = rest;
+
+		for (idx, candidate) in cluster.iter().enumerate() {
+			area.copy_into_buffer(phys_mem, idx, PhysAddr(candidate.raw_pte & !0xFFF));
+		}
+
+		if area.device.write_sectors(slot_lba(first_slot),
+			&area.transfer_buffer[..count * 4096]).is_none() {
+			println!("Failed to write {} pages to the swap area", count);
+			for slot in first_slot..first_slot + count {
+				area.release_slot(phys_mem, slot);
+			}
+			break;
+		}
+		CLUSTERS_WRITTEN.fetch_add(1, Ordering::Relaxed);
+
+		for (idx, candidate) in cluster.iter().enumerate() {
+			if replace_with_swap_entry(phys_mem, candidate, SwapEntry::Drive(first_slot + idx)) {
+				swapped_out += 1;
+			} else {
+				area.release_slot(phys_mem, first_slot + idx);
+			}
+		}
+	}
+
+	swapped_out
+}
+
+/// Replaces the page table entry of `candidate` with `entry` and releases its page frame. Returns
+/// false if the page table entry could not be replaced.
+fn replace_with_swap_entry(phys_mem: &mut PhysicalMemory, candidate: &SwapCandidate,
+	entry: SwapEntry) -> bool {
+	let mut page_dir = unsafe { PageDirectory::from_cr3(candidate.directory.0) };
+	let replaced = unsafe {
+		page_dir.map_raw(phys_mem, candidate.page_vaddr, raw_swap_entry(entry), true, false)
+	};
+	if replaced.is_none() {
+		return false;
+	}
+
+	phys_mem.release_phys_mem(PhysAddr(candidate.raw_pte & !0xFFF), 4096);
+	true
+}
+
+/// Swaps in the page of `entry` for a single page table entry, and drops that page table entry's
+/// reference to it. `frame` is a newly allocated page frame, allocated before the call so that any
+/// memory reclaiming happens first. Returns the page frame to map in place of the swap entry,
+/// which is either `frame` or a page frame from the swap cache (in which case `frame` is
+/// released).
+pub fn swap_in(phys_mem: &mut PhysicalMemory, entry: SwapEntry, frame: PhysAddr)
+	-> Option<PhysAddr> {
+	let slot = match entry {
+		SwapEntry::Drive(slot) => slot,
+		SwapEntry::Compressed(entry_idx) => {
+			zram::load(phys_mem, entry_idx, frame)?;
+			zram::release(phys_mem, entry_idx);
+			PAGES_IN.fetch_add(1, Ordering::Relaxed);
+			return Some(frame);
+		}
+	};
+
+	let mut area = SWAP_AREA.acquire();
+	let area = area.as_mut()?;
+	if slot >= area.slot_refs.len() || area.slot_refs[slot] == 0 {
+		return None;
+	}
+
+	PAGES_IN.fetch_add(1, Ordering::Relaxed);
+
+	if let Some(idx) = area.find_cached(slot) {
+		CACHE_HITS.fetch_add(1, Ordering::Relaxed);
+
+		let (_, cached_frame) = area.cache[idx].unwrap();
+		if area.slot_refs[slot] == 1 {
+			// This is the last reference to the slot, so the cached page frame is handed over
+			area.cache[idx] = None;
+			area.release_slot(phys_mem, slot);
+			phys_mem.release_phys_mem(frame, 4096);
+			return Some(cached_frame);
+		}
+
+		// Other entries still refer to the slot, so they keep the cached page frame
+		area.copy_into_buffer(phys_mem, 0, cached_frame);
+		area.copy_out_of_buffer(phys_mem, 0, frame);
+		area.release_slot(phys_mem, slot);
+		return Some(frame);
+	}
+
+	// The faulting slot is read together with the slots in use following it, in a single transfer
+	let mut count = 1;
+	while count <= SWAP_READAHEAD_PAGES && slot + count < area.slot_refs.len()
+		&& area.slot_refs[slot + count] != 0 && area.find_cached(slot + count).is_none() {
+		count += 1;
+	}
+
+	area.device.read_sectors(slot_lba(slot), &mut area.transfer_buffer[..count * 4096])?;
+	PAGES_READ.fetch_add(count as u32, Ordering::Relaxed);
+	area.copy_out_of_buffer(phys_mem, 0, frame);
+
+	// The faulting page is also cached if other entries still refer to its slot
+	let first_cached = if area.slot_refs[slot] > 1 { 0 } else { 1 };
+	let page_layout = Layout::from_size_align(4096, 4096).unwrap();
+	for idx in first_cached..count {
+		// Cached pages are only kept while memory is not low, so caching never causes reclaim
+		if phys_mem.free_bytes() < reclaim::LOW_WATERMARK_BYTES {
+			break;
+		}
+		let cache_frame = match phys_mem.allocate_phys_mem_no_reclaim(page_layout) {
+			Some(cache_frame) => cache_frame,
+			None => break,
+		};
+
+		area.copy_out_of_buffer(phys_mem, idx, cache_frame);
+		area.insert_cached(phys_mem, slot + idx, cache_frame);
+	}
+
+	area.release_slot(phys_mem, slot);
+	Some(frame)
+}
+
+/// Adds a reference to the page of `entry`, for a copy of a swap entry. Must be called with the
+/// physical memory lock held.
+pub fn duplicate_entry(entry: SwapEntry) {
+	match entry {
+		SwapEntry::Drive(slot) => {
+			let mut area = SWAP_AREA.acquire();
+			let area = area.as_mut().expect("Duplicated a swap entry while swapping is disabled");
+			area.slot_refs[slot] += 1;
+		},
+		SwapEntry::Compressed(entry_idx) => zram::duplicate(entry_idx),
+	}
+}
+
+/// Drops a reference to the page of `entry`, for a swap entry which is unmapped
+pub fn free_entry(phys_mem: &mut PhysicalMemory, entry: SwapEntry) {
+	match entry {
+		SwapEntry::Drive(slot) => {
+			let mut area = SWAP_AREA.acquire();
+			let area = area.as_mut().expect("Freed a swap entry while swapping is disabled");
+			area.release_slot(phys_mem, slot);
+		},
+		SwapEntry::Compressed(entry_idx) => zram::release(phys_mem, entry_idx),
+	}
+}
+
+/// Releases up to `target` page frames of the swap cache (their contents are still in the swap
+/// area). Returns the number of page frames released.
+pub fn shrink_cache(phys_mem: &mut PhysicalMemory, target: usize) -> usize {
+	let mut area = SWAP_AREA.acquire();
+	let area = match area.as_mut() {
+		Some(area) => area,
+		None => return 0,
+	};
+
+	let mut released = 0;
+	for entry in area.cache.iter_mut() {
+		if released >= target {
+			break;
+		}
+		if let Some((_, frame)) = entry.take() {
+			phys_mem.release_phys_mem(frame, 4096);
+			released += 1;
+		}
+	}
+
+	released
+}
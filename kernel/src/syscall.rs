@@ -1,15 +1,23 @@
+use core::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+
 use alloc::string::String;
+use alloc::sync::Arc;
 use alloc::vec::Vec;
 use elf_parser::ElfParser;
-use ext2_parser::{DirEntryType, IterationDecision};
+use ext2_parser::DirEntryType;
 use page_tables::VirtAddr;
-use syscall_interface::{SyscallString, SyscallFileStat, SyscallArray, SyscallDirectoryEntry};
+use syscall_interface::{SyscallString, SyscallCounters, SyscallFileStat, SyscallMemInfo,
+	SyscallProcessMemInfo, SyscallSigAction, MAX_SYSCALL_ARGS};
 pub use syscall_interface::{Syscall, SyscallError};
-use crate::ext2;
-use crate::keyboard::{KEYBOARD_EVENTS_QUEUE, KeyEventType};
+use crate::{ext2, input, ksm, memory_manager, mouse, procfs, reclaim, signal, swap, vfs, zram};
+use crate::keyboard::{self, KEYBOARD_EVENTS_QUEUE, KeyEventType};
 use crate::process::{Process, SCHEDULER_STATE};
-use crate::vfs::{FILE_DESCRIPTIONS, FileDescription, FileType};
-use crate::userspace::{UserVaddr};
+use crate::vfs::{Device, FILE_DESCRIPTIONS, FileDescription, FileType};
+use crate::userspace::{SyscallArg, UserVaddr};
+
+/// The exit code of a process whose program `Execve` failed to load after dropping the old one, for
+/// any reason but running out of memory (the exit code a shell reports for SIGSEGV)
+const EXEC_FAILURE_EXIT_CODE: u8 = 128 + 11;
 
 macro_rules! unwrap_or_return {
 	( $x:expr, $err:expr ) => {
@@ -21,21 +29,62 @@ macro_rules! unwrap_or_return {
 	};
 }
 
-pub fn handle_syscall(syscall: Syscall, arg0: u32, arg1: u32, arg2: u32) -> i32 {
-	match syscall {
-		Syscall::Read => syscall_read(arg0, UserVaddr::new(&arg1), arg2),
-		Syscall::Write => syscall_write(arg0, UserVaddr::new(&arg1), arg2),
-		Syscall::Open => syscall_open(UserVaddr::new(&arg0), arg1),
-		Syscall::Close => syscall_close(arg0),
-		Syscall::Execve => syscall_execve(UserVaddr::new(&arg0), UserVaddr::new(&arg1), UserVaddr::new(&arg2)),
-		Syscall::Fork => syscall_fork(),
-		Syscall::Exit => syscall_exit(arg0),
-		Syscall::WaitPID => syscall_waitpid(arg0, UserVaddr::new(&arg1), arg2),
-		Syscall::Stat => syscall_stat(UserVaddr::new(&arg0), UserVaddr::new(&arg1)),
-		Syscall::GetCWD => syscall_getcwd(UserVaddr::new(&arg0), arg1),
-		Syscall::ChangeCWD => syscall_changecwd(UserVaddr::new(&arg0)),
-		Syscall::Count => SyscallError::UnknownSyscall.to_i32(),
+/// Whether the dispatch counts the calls of each syscall and the cycles they took. Reading the
+/// time stamp counter serializes the CPU, so this adds to the latency of every syscall, and it is
+/// off unless the syscalls are being profiled.
+const RECORD_SYSCALL_STATS: bool = false;
+
+/// A handler, called with the values of the argument registers
+type SyscallHandler = fn([u32; MAX_SYSCALL_ARGS]) -> i32;
+
+macro_rules! define_handler_table {
+	($($variant:ident => $handler:ident($($arg:ident),*),)*) => {
+		/// The handlers, indexed by syscall number, which is their order in the table. Each converts
+		/// the arguments it takes to the types of its handler's parameters.
+		static SYSCALL_HANDLERS: [SyscallHandler; Syscall::Count as usize] = [
+			$(|args: [u32; MAX_SYSCALL_ARGS]| {
+				let [$($arg,)* ..] = args;
+				$handler($(SyscallArg::from_register($arg)),*)
+			},)*
+		];
+	};
+}
+syscall_interface::syscall_table!(define_handler_table);
+
+/// The counters of a single syscall
+struct SyscallStats {
+	/// Number of times the syscall was issued
+	count: AtomicU32,
+	/// Total cycles its handler took, for the calls which returned
+	total_cycles: AtomicU64,
+}
+
+static STATS: [SyscallStats; Syscall::Count as usize] = {
+	const NO_STATS: SyscallStats = SyscallStats {
+		count: AtomicU32::new(0),
+		total_cycles: AtomicU64::new(0),
+	};
+	[NO_STATS; Syscall::Count as usize]
+};
+
+/// Calls the handler of the syscall `number` with the values of the argument registers `args`
+pub fn handle_syscall(number: u32, args: [u32; MAX_SYSCALL_ARGS]) -> i32 {
+	let handler = unwrap_or_return!(
+		SYSCALL_HANDLERS.get(number as usize),
+		SyscallError::UnknownSyscall
+	);
+
+	if !RECORD_SYSCALL_STATS {
+		return handler(args);
 	}
+
+	// The call is counted before the handler runs, as some handlers (e.g. of `Exit`) never return
+	let stats = &STATS[number as usize];
+	stats.count.fetch_add(1, Ordering::Relaxed);
+	let start_cycles = cpu::serializing_rdtsc();
+	let return_value = handler(args);
+	stats.total_cycles.fetch_add(cpu::serializing_rdtsc() - start_cycles, Ordering::Relaxed);
+	return_value
 }
 
 fn syscall_read(fd: u32, buf: UserVaddr<u8>, num_bytes: u32) -> i32 {
@@ -47,9 +96,29 @@ fn syscall_read(fd: u32, buf: UserVaddr<u8>, num_bytes: u32) -> i32 {
 
 	let buf = buf.as_slice_mut(num_bytes as usize).unwrap();
 	if fd == 0 {
-		for byte in buf.iter_mut().take(num_bytes as usize) {
+		for (idx, byte) in buf.iter_mut().enumerate() {
 			'try_get_ascii: loop {
-				let event = KEYBOARD_EVENTS_QUEUE.consume_blocking();
+				let event = match KEYBOARD_EVENTS_QUEUE.consume() {
+					Some(event) => event,
+					None => {
+						// Syscalls are taken with interrupts unmasked, so we sleep until the next
+						// interrupt. Interrupts are masked between the check and the halt, so an
+						// event queued in between can't be missed
+						unsafe { cpu::cli(); }
+						if KEYBOARD_EVENTS_QUEUE.len() > 0 {
+							unsafe { cpu::sti(); }
+							continue;
+						}
+						unsafe { cpu::enable_interrupts_and_halt(); }
+
+						// Stop waiting so a signal (e.g. from Ctrl+C) can be delivered. This takes
+						// the scheduler lock, so it is only checked after sleeping
+						if signal::current_has_deliverable() {
+							return if idx == 0 { SyscallError::Interrupted.to_i32() } else { idx as i32 };
+						}
+						continue;
+					},
+				};
 				if event.event_type == KeyEventType::KeyDown {
 					if let Some(ascii) = event.as_ascii() {
 						*byte = ascii;
@@ -73,6 +142,21 @@ fn syscall_read(fd: u32, buf: UserVaddr<u8>, num_bytes: u32) -> i32 {
 		let ext2_parser = ext2_parser.as_ref().unwrap();
 
 		match description.file_type {
+			FileType::Device(Device::InputRecord) => {
+				let num_read = input::read_recording(buf, description.offset as usize);
+				description.offset += num_read as u32;
+				num_read as i32
+			},
+			FileType::Device(Device::InputInject) => 0,
+			FileType::Device(Device::Mouse) => mouse::read_events(buf) as i32,
+			FileType::Device(Device::KeyboardLayout) => {
+				let num_read = keyboard::read_layout(buf, description.offset as usize);
+				description.offset += num_read as u32;
+				num_read as i32
+			},
+			FileType::Device(Device::Proc(entry)) => {
+				procfs::read(entry, &mut proc_state, ext2_parser, descriptor, &mut description.offset, buf)
+			},
 			FileType::File => {
 				let num_read = ext2_parser.get_contents_with_offset(description.inode, buf, description.offset as usize);
 				description.offset += num_read as u32;
@@ -85,32 +169,15 @@ fn syscall_read(fd: u32, buf: UserVaddr<u8>, num_bytes: u32) -> i32 {
 					return 0;
 				}
 
-				if (num_bytes as usize) < core::mem::size_of::<SyscallDirectoryEntry>() {
-					return SyscallError::BufferTooSmall.to_i32();
-				}
-
 				let (next_opaque_offset, entry_inode, entry_name, entry_type) = entry.unwrap();
+				let entry_size = unwrap_or_return!(
+					vfs::copy_directory_entry(buf, entry_inode, entry_type, entry_name),
+					SyscallError::BufferTooSmall
+				);
 				description.offset = next_opaque_offset;
 
-				let name_len = entry_name.as_bytes().len();
-				assert!(name_len < u8::MAX as usize);
-				let mut syscall_struct = SyscallDirectoryEntry {
-					inode: entry_inode,
-					entry_type: entry_type as u8,
-					name_length: name_len as u8,
-					name: [0u8; 256]
-				};
-				syscall_struct.name[..name_len].copy_from_slice(entry_name.as_bytes());
-
-				buf[..core::mem::size_of::<SyscallDirectoryEntry>()].copy_from_slice(unsafe {
-					core::slice::from_raw_parts(
-						&syscall_struct as *const SyscallDirectoryEntry as *const u8,
-						core::mem::size_of::<SyscallDirectoryEntry>()
-					)
-				});
-
-				assert!(core::mem::size_of::<SyscallDirectoryEntry>() < i32::MAX as usize);
-				core::mem::size_of::<SyscallDirectoryEntry>() as i32
+				assert!(entry_size < i32::MAX as usize);
+				entry_size as i32
 			},
 		}
 	}
@@ -127,17 +194,53 @@ fn syscall_write(fd: u32, buf: UserVaddr<u8>, num_bytes: u32) -> i32 {
 	if fd == 1 {
 		let buf_str = core::str::from_utf8(buf).unwrap();
 		crate::screen::print(buf_str);
+		return num_bytes as i32;
 	}
 
-	num_bytes as i32
+	let mut proc_state = SCHEDULER_STATE.lock();
+	// Writes to file descriptors which are not open are discarded, like writes to files
+	let descriptor = match proc_state.get_current_process().get_file_descriptor(fd as usize) {
+		Some(descriptor) => descriptor,
+		None => return num_bytes as i32,
+	};
+	let mut file_descriptions = FILE_DESCRIPTIONS.lock();
+	let description = file_descriptions.get_description(descriptor).unwrap();
+
+	match description.file_type {
+		FileType::Device(Device::InputInject) => input::inject(buf) as i32,
+		FileType::Device(Device::InputRecord) => input::control_recording(buf) as i32,
+		FileType::Device(Device::Mouse) => mouse::control(buf) as i32,
+		FileType::Device(Device::KeyboardLayout) => keyboard::control_layout(buf) as i32,
+		FileType::Device(Device::Proc(_)) => 0,
+		// TODO: Writing to files
+		_ => num_bytes as i32,
+	}
 }
 
-fn syscall_open(path: UserVaddr<SyscallString>, flags: u32) -> i32 {
-	let path = unwrap_or_return!(path.as_str(), SyscallError::InvalidAddress);
+fn syscall_open(path: UserVaddr<u8>, path_len: u32, flags: u32) -> i32 {
+	let path = unwrap_or_return!(path.as_str(path_len), SyscallError::InvalidAddress);
 
 	let mut sched_state = SCHEDULER_STATE.lock();
+	let current_pid = sched_state.current_process;
 	let cur_proc = sched_state.get_current_process();
 
+	// Device files are not in the file system
+	if let Some(device) = vfs::find_device(path, current_pid) {
+		let desc_idx = unwrap_or_return!(FILE_DESCRIPTIONS.lock().add_description(FileDescription {
+			inode: 0,
+			offset: 0,
+			status: flags,
+			file_type: FileType::Device(device),
+			references: 1,
+		}), SyscallError::OpenFileLimitReached);
+
+		let fd = unwrap_or_return!(
+			cur_proc.alloc_file_descriptor(desc_idx),
+			SyscallError::OpenFileLimitReached
+		);
+		return fd as i32;
+	}
+
 	let (inode, entry_type) = unwrap_or_return!(
 		ext2::EXT2_PARSER.lock().as_ref().unwrap().resolve_path_to_inode(path, cur_proc.cwd_inode),
 		SyscallError::InvalidPath
@@ -151,6 +254,7 @@ fn syscall_open(path: UserVaddr<SyscallString>, flags: u32) -> i32 {
 			ext2_parser::DirEntryType::Directory => FileType::Directory,
 			_ => FileType::File,
 		},
+		references: 1,
 	}), SyscallError::OpenFileLimitReached);
 
 	let fd = unwrap_or_return!(
@@ -169,17 +273,18 @@ fn syscall_close(fd: u32) -> i32 {
 	}
 }
 
-fn syscall_execve(path: UserVaddr<SyscallString>, argv: UserVaddr<SyscallArray<SyscallString>>, envp: UserVaddr<SyscallArray<SyscallString>>) -> i32 {
-	{
-		let path = unwrap_or_return!(path.as_str(), SyscallError::InvalidAddress);
+fn syscall_execve(path: UserVaddr<u8>, path_len: u32, argv: UserVaddr<SyscallString>, argv_len: u32,
+	envp: UserVaddr<SyscallString>, envp_len: u32) -> i32 {
+	let replaced = {
+		let path = unwrap_or_return!(path.as_str(path_len), SyscallError::InvalidAddress);
 
 		let resolved_argv: Vec<String> = unwrap_or_return!(
-			argv.as_string_vec(),
+			argv.as_string_vec(argv_len),
 			SyscallError::InvalidAddress
 		);
 
 		let resolved_envp: Vec<String> = unwrap_or_return!(
-			envp.as_string_vec(),
+			envp.as_string_vec(envp_len),
 			SyscallError::InvalidAddress
 		);
 
@@ -201,11 +306,25 @@ fn syscall_execve(path: UserVaddr<SyscallString>, argv: UserVaddr<SyscallArray<S
 			let user_program_size = user_program_metadata.size_low as usize;
 			let mut user_program = crate::vec![0u8; user_program_size];
 			assert!(ext2_parser.get_contents(inode, &mut user_program) == user_program_size);
-			user_program
+			Arc::new(user_program)
 		};
 
 		let elf_parser = unwrap_or_return!(ElfParser::parse(&user_program), SyscallError::InvalidElfFile);
-		sched_state.get_current_process().replace_with_elf(elf_parser, &resolved_argv, &resolved_envp);
+		// A program which can't be loaded is rejected while the old program can still be returned to
+		if !Process::is_loadable_elf(&elf_parser) {
+			return SyscallError::InvalidElfFile.to_i32();
+		}
+		sched_state.get_current_process().replace_with_elf(elf_parser, &user_program, &resolved_argv,
+			&resolved_envp)
+	};
+
+	// The old program is already gone, so there is nothing to return to
+	match replaced {
+		Ok(()) => {},
+		Err(SyscallError::OutOfMemory) => {
+			crate::process::exit_current_process(reclaim::OOM_KILL_EXIT_CODE);
+		},
+		Err(_) => crate::process::exit_current_process(EXEC_FAILURE_EXIT_CODE),
 	}
 	crate::process::switch_to_current_process();
 }
@@ -214,7 +333,10 @@ fn syscall_fork() -> i32 {
 	let mut sched_state = SCHEDULER_STATE.lock();
 
 	const KERNEL_INTR_STACK_VADDR: VirtAddr = VirtAddr(0xFFFF9000); // FIXME: temp
-	let child = Process::new_from_fork(KERNEL_INTR_STACK_VADDR, sched_state.get_current_process());
+	let child = unwrap_or_return!(
+		Process::new_from_fork(KERNEL_INTR_STACK_VADDR, sched_state.get_current_process()),
+		SyscallError::OutOfMemory
+	);
 
 	sched_state.processes[1] = Some(child); // FIXME: temp
 
@@ -222,39 +344,96 @@ fn syscall_fork() -> i32 {
 }
 
 fn syscall_exit(exit_code: u32) -> i32 {
-	{
-		let mut sched_state = SCHEDULER_STATE.lock();
-		assert!(sched_state.current_process == 1);
-		sched_state.processes[1].as_mut().unwrap().exit((exit_code & 0xFF) as u8);
-		sched_state.current_process = 0;
-	}
-
-	crate::process::switch_to_current_process();
+	crate::process::exit_current_process((exit_code & 0xFF) as u8);
 }
 
 fn syscall_waitpid(pid: u32, wstatus: UserVaddr<u32>, options: u32) -> i32 {
-	if !wstatus.is_null() {
-		// TODO: wstatus
-	}
-
 	if options != 0 {
 		todo!("options@waitpid");
 	}
 
 	// FIXME: Check if the target process exited
+	// Ctrl+C interrupts the process we wait for
+	signal::set_foreground(Some(pid as usize));
 	crate::process::yield_execution();
+	signal::set_foreground(None);
+
+	if !wstatus.is_null() {
+		let exit_code = {
+			let mut sched_state = SCHEDULER_STATE.lock();
+			sched_state.processes.get_mut(pid as usize)
+				.and_then(|proc| proc.as_ref())
+				.and_then(|proc| proc.exit_code())
+		};
+		if let Some(exit_code) = exit_code {
+			*unwrap_or_return!(wstatus.as_ref_mut(), SyscallError::InvalidAddress) = exit_code as u32;
+		}
+	}
 
 	assert!(pid < (i32::MAX as u32));
 	pid as i32
 }
 
-fn syscall_stat(path: UserVaddr<SyscallString>, stat_buf: UserVaddr<SyscallFileStat>) -> i32 {
-	let path = unwrap_or_return!(path.as_str(), SyscallError::InvalidAddress);
+fn syscall_kill(pid: u32, signal: u32) -> i32 {
+	match signal::send(&mut SCHEDULER_STATE.lock(), pid as usize, signal) {
+		Ok(()) => 0,
+		Err(err) => err.to_i32(),
+	}
+}
+
+fn syscall_sigaction(signal: u32, new_action: UserVaddr<SyscallSigAction>,
+	old_action: UserVaddr<SyscallSigAction>) -> i32 {
+	let new_action = if new_action.is_null() {
+		None
+	} else {
+		Some(*unwrap_or_return!(new_action.as_ref(), SyscallError::InvalidAddress))
+	};
+
+	let previous_action = {
+		let mut sched_state = SCHEDULER_STATE.lock();
+		match signal::set_action(&mut sched_state, signal, new_action) {
+			Ok(action) => action,
+			Err(err) => return err.to_i32(),
+		}
+	};
+
+	if !old_action.is_null() {
+		*unwrap_or_return!(old_action.as_ref_mut(), SyscallError::InvalidAddress) = previous_action;
+	}
+
+	0
+}
+
+fn syscall_sigreturn() -> i32 {
+	// `SigReturn` replaces the trap frame, so the interrupt handler handles it
+	SyscallError::UnknownSyscall.to_i32()
+}
+
+fn syscall_stat(path: UserVaddr<u8>, path_len: u32, stat_buf: UserVaddr<SyscallFileStat>) -> i32 {
+	let path = unwrap_or_return!(path.as_str(path_len), SyscallError::InvalidAddress);
 	let stat_buf = unwrap_or_return!(stat_buf.as_ref_mut(), SyscallError::InvalidAddress);
 
 	let mut sched_state = SCHEDULER_STATE.lock();
+	let current_pid = sched_state.current_process;
 	let cur_proc = sched_state.get_current_process();
 
+	// Device files are not in the file system
+	if let Some(device) = vfs::find_device(path, current_pid) {
+		*stat_buf = SyscallFileStat {
+			containing_device_id: 0,
+			inode: 0,
+			mode_and_type: device.mode_and_type(),
+			num_hard_links: 1,
+			owner_user_id: 0,
+			owner_group_id: 0,
+			total_size: 0,
+			last_access_time: 0,
+			last_modification_time: 0,
+			last_status_change_time: 0,
+		};
+		return 0;
+	}
+
 	let ext2_parser = ext2::EXT2_PARSER.lock();
 	let ext2_parser = ext2_parser.as_ref().unwrap();
 
@@ -290,74 +469,18 @@ fn syscall_getcwd(buf: UserVaddr<u8>, size: u32) -> i32 {
 	let mut sched_state = SCHEDULER_STATE.lock();
 	let cur_proc = sched_state.get_current_process();
 
-	if cur_proc.cwd_inode == ext2_parser::ROOT_INODE {
-		if size < 1 {
-			return SyscallError::BufferTooSmall.to_i32();
-		} else {
-			buf[0] = b'/';
-			return 1;
-		}
-	}
-
 	let ext2_parser = ext2::EXT2_PARSER.lock();
 	let ext2_parser = ext2_parser.as_ref().unwrap();
 
-	let mut inode_walk = [0u32; 128];
-	let mut walk_index = 0;
-
-	inode_walk[0] = cur_proc.cwd_inode;
-	while inode_walk[walk_index] != ext2_parser::ROOT_INODE {
-		assert!(walk_index + 1 < inode_walk.len());
-
-		ext2_parser.for_each_directory_entry(inode_walk[walk_index],
-			|entry_inode, entry_name, _| {
-				if entry_name == ".." {
-					inode_walk[walk_index + 1] = entry_inode;
-					IterationDecision::Break
-				} else {
-					IterationDecision::Continue
-				}
-			}
-		);
-
-		walk_index += 1;
-	}
-
-	// TODO: Calling for_each_directory_entry twice is bad, optimize this
-
-	let mut write_index = 0;
-	let mut success = true;
-	for i in (1..=walk_index).rev() {
-		ext2_parser.for_each_directory_entry(inode_walk[i],
-			|entry_inode, entry_name, _| {
-				if entry_inode == inode_walk[i-1] {
-					if write_index + entry_name.len() + 1 > size {
-						success = false;
-						return IterationDecision::Break;
-					}
-					
-					buf[write_index] = b'/';
-					write_index += 1;
-					buf[write_index..write_index + entry_name.len()].copy_from_slice(entry_name.as_bytes());
-					write_index += entry_name.len();
-
-					IterationDecision::Break
-				} else {
-					IterationDecision::Continue
-				}
-			}
-		);
-
-		if !success {
-			return SyscallError::BufferTooSmall.to_i32();
-		}
-	}
-
-	write_index as i32
+	let path_length = unwrap_or_return!(
+		ext2::get_directory_path(ext2_parser, cur_proc.cwd_inode, buf),
+		SyscallError::BufferTooSmall
+	);
+	path_length as i32
 }
 
-fn syscall_changecwd(path: UserVaddr<SyscallString>) -> i32 {
-	let path = unwrap_or_return!(path.as_str(), SyscallError::InvalidAddress);
+fn syscall_changecwd(path: UserVaddr<u8>, path_len: u32) -> i32 {
+	let path = unwrap_or_return!(path.as_str(path_len), SyscallError::InvalidAddress);
 	
 	let mut sched_state = SCHEDULER_STATE.lock();
 	let cur_proc = sched_state.get_current_process();
@@ -374,4 +497,86 @@ fn syscall_changecwd(path: UserVaddr<SyscallString>) -> i32 {
 	cur_proc.cwd_inode = inode;
 
 	0
-}
\ No newline at end of file
+}
+
+fn syscall_meminfo(info_buf: UserVaddr<SyscallMemInfo>) -> i32 {
+	let info_buf = unwrap_or_return!(info_buf.as_ref_mut(), SyscallError::InvalidAddress);
+
+	let (free_memory, merge_stats) = {
+		let pmem = memory_manager::PHYS_MEM.lock();
+		let (phys_mem, _) = pmem.as_ref().unwrap();
+		(phys_mem.free_bytes(), ksm::get_stats(phys_mem))
+	};
+	let heap_stats = memory_manager::heap_stats();
+	let swap_stats = swap::get_stats();
+	let compressed_stats = zram::get_stats();
+
+	// The info is only written to the user buffer after the locks are released, because the write
+	// might page fault
+	*info_buf = SyscallMemInfo {
+		free_memory,
+		heap_mapped: heap_stats.mapped_bytes as u32,
+		heap_in_use: heap_stats.bytes_in_use as u32,
+		heap_allocated: heap_stats.allocated_bytes as u32,
+		heap_free: heap_stats.free_bytes as u32,
+		heap_free_list_length: heap_stats.free_list_length as u32,
+		heap_largest_free: heap_stats.largest_free_bytes as u32,
+		swap_total: swap_stats.total_pages.saturating_mul(4096),
+		swap_free: swap_stats.free_pages.saturating_mul(4096),
+		compressed_pages: compressed_stats.stored_pages,
+		compressed_bytes: compressed_stats.compressed_bytes,
+		compressed_pool_bytes: compressed_stats.pool_pages.saturating_mul(4096),
+		compressed_load_cycles: compressed_stats.load_cycles
+			.checked_div(compressed_stats.loads as u64).unwrap_or(0) as u32,
+		merged_frames: merge_stats.shared_frames,
+		merged_saved_pages: merge_stats.sharing_pages,
+	};
+
+	0
+}
+
+fn syscall_getrusage(pid: u32, usage_buf: UserVaddr<SyscallProcessMemInfo>) -> i32 {
+	let usage_buf = unwrap_or_return!(usage_buf.as_ref_mut(), SyscallError::InvalidAddress);
+
+	let usage = {
+		let mut sched_state = SCHEDULER_STATE.lock();
+		let proc_slot = unwrap_or_return!(
+			sched_state.processes.get_mut(pid as usize),
+			SyscallError::InvalidPID
+		);
+		let proc = unwrap_or_return!(proc_slot.as_mut(), SyscallError::NoSuchProcess);
+
+		let mut pmem = memory_manager::PHYS_MEM.lock();
+		let (phys_mem, _) = pmem.as_mut().unwrap();
+		proc.memory_usage(phys_mem)
+	};
+
+	*usage_buf = usage;
+
+	0
+}
+
+fn syscall_syscallstats(stats_buf: UserVaddr<SyscallCounters>, stats_len: u32, reset: u32) -> i32 {
+	if !RECORD_SYSCALL_STATS {
+		return SyscallError::NotSupported.to_i32();
+	}
+
+	let num_stats = (stats_len as usize).min(STATS.len());
+	let stats_buf = unwrap_or_return!(stats_buf.as_slice_mut(num_stats), SyscallError::InvalidAddress);
+
+	for (counters, stats) in stats_buf.iter_mut().zip(STATS.iter()) {
+		*counters = if reset != 0 {
+			SyscallCounters {
+				count: stats.count.swap(0, Ordering::Relaxed),
+				total_cycles: stats.total_cycles.swap(0, Ordering::Relaxed),
+			}
+		} else {
+			SyscallCounters {
+				count: stats.count.load(Ordering::Relaxed),
+				total_cycles: stats.total_cycles.load(Ordering::Relaxed),
+			}
+		};
+	}
+
+	num_stats as i32
+}
@@ -1,10 +1,27 @@
 use core::marker::PhantomData;
 
 use alloc::{string::String, vec::Vec, borrow::ToOwned};
-use syscall_interface::{SyscallString, SyscallArray};
+use syscall_interface::SyscallString;
 
 pub struct UserVaddr<'a, T>(u32, PhantomData<&'a T>);
 
+/// A syscall argument, converted by the syscall dispatch from the value of its register
+pub trait SyscallArg {
+	fn from_register(value: u32) -> Self;
+}
+
+impl SyscallArg for u32 {
+	fn from_register(value: u32) -> Self {
+		value
+	}
+}
+
+impl<'a, T> SyscallArg for UserVaddr<'a, T> {
+	fn from_register(value: u32) -> Self {
+		Self(value, PhantomData::<&'a T>)
+	}
+}
+
 impl<'a, T> UserVaddr<'a, T> {
     pub const fn new(vaddr: &'a u32) -> Self {
 		Self(*vaddr, PhantomData::<&'a T>)
@@ -47,18 +64,17 @@ impl<'a, T> UserVaddr<'a, T> {
 	}
 }
 
-impl<'a> UserVaddr<'a, SyscallString<'a>> {
-	pub fn as_str(&'a self) -> Option<&'a str> {
-		let syscall_str = self.as_ref()?;
-		let buf: &'a [u8] = UserVaddr::new(&syscall_str.ptr).as_slice(syscall_str.length as usize)?;
-		core::str::from_utf8(buf).ok()
+impl<'a> UserVaddr<'a, u8> {
+	/// Returns the string of `length` bytes at this address
+	pub fn as_str(&self, length: u32) -> Option<&'a str> {
+		core::str::from_utf8(self.as_slice(length as usize)?).ok()
 	}
 }
 
-impl<'a> UserVaddr<'a, SyscallArray<'a, SyscallString<'a>>> {
-	pub fn as_string_vec(&self) -> Option<Vec<String>> {
-		let syscall_arr = self.as_ref()?;
-		let str_arr: &[SyscallString] = UserVaddr::new(&syscall_arr.ptr).as_slice(syscall_arr.length as usize)?;
+impl<'a> UserVaddr<'a, SyscallString<'a>> {
+	/// Returns a copy of the `count` strings in the array at this address
+	pub fn as_string_vec(&self, count: u32) -> Option<Vec<String>> {
+		let str_arr: &[SyscallString] = self.as_slice(count as usize)?;
 		let mut vec = Vec::with_capacity(str_arr.len());
 		for (i, s) in str_arr.iter().enumerate() {
 			let buf: &[u8] = UserVaddr::new(&s.ptr).as_slice(s.length as usize)?;
@@ -1,9 +1,90 @@
+use ext2_parser::DirEntryType;
 use lock_cell::LockCell;
+use crate::procfs::{self, ProcEntry};
+use syscall_interface::{SyscallDirectoryEntry, INPUT_INJECT_DEVICE_PATH, INPUT_RECORD_DEVICE_PATH,
+	KEYBOARD_LAYOUT_DEVICE_PATH, MOUSE_DEVICE_PATH};
 
 #[derive(Clone, Copy, Debug)]
 pub enum FileType {
 	File,
 	Directory,
+	Device(Device),
+}
+
+/// A device file, which is handled by the kernel instead of the file system
+#[derive(Clone, Copy, Debug)]
+pub enum Device {
+	/// Injects the input events written to it
+	InputInject,
+	/// Reads the recorded input events, and controls the recording
+	InputRecord,
+	/// Reads mouse events, and sets the sample rate of the mouse
+	Mouse,
+	/// Reads the name of the active keyboard layout, and switches the layout
+	KeyboardLayout,
+	/// A file or a directory of the `/proc` file system
+	Proc(ProcEntry),
+}
+
+impl Device {
+	/// Returns the file type and permissions `stat` reports for the device, in the format of an
+	/// ext2 inode
+	pub fn mode_and_type(&self) -> u16 {
+		match self {
+			// Character devices, readable and writable by everyone
+			Device::InputInject | Device::InputRecord | Device::Mouse | Device::KeyboardLayout => {
+				0x2000 | 0o666
+			},
+			// Directories and regular files, readable by everyone
+			Device::Proc(entry) if entry.is_dir() => 0x4000 | 0o555,
+			Device::Proc(_) => 0x8000 | 0o444,
+		}
+	}
+}
+
+/// The paths of the device files, which are looked up before the file system
+const DEVICE_FILES: [(&str, Device); 4] = [
+	(INPUT_INJECT_DEVICE_PATH, Device::InputInject),
+	(INPUT_RECORD_DEVICE_PATH, Device::InputRecord),
+	(MOUSE_DEVICE_PATH, Device::Mouse),
+	(KEYBOARD_LAYOUT_DEVICE_PATH, Device::KeyboardLayout),
+];
+
+/// Returns the device at the absolute path `path`, if there is one. The `/proc` file system is
+/// mounted at `procfs::MOUNT_PATH`, and its `self` directory is of the process `current_pid`.
+pub fn find_device(path: &str, current_pid: usize) -> Option<Device> {
+	if let Some(entry) = procfs::lookup(path, current_pid) {
+		return Some(Device::Proc(entry));
+	}
+
+	DEVICE_FILES.iter().find(|(device_path, _)| *device_path == path).map(|(_, device)| *device)
+}
+
+/// Copies a directory entry to `buf` as a `SyscallDirectoryEntry`. Returns the number of bytes
+/// copied, or `None` if `buf` is too small.
+pub fn copy_directory_entry(buf: &mut [u8], inode: u32, entry_type: DirEntryType, name: &str)
+	-> Option<usize> {
+	let entry_size = core::mem::size_of::<SyscallDirectoryEntry>();
+	if buf.len() < entry_size {
+		return None;
+	}
+
+	let name_len = name.as_bytes().len();
+	assert!(name_len < u8::MAX as usize);
+	let mut syscall_struct = SyscallDirectoryEntry {
+		inode,
+		entry_type: entry_type as u8,
+		name_length: name_len as u8,
+		name: [0u8; 256]
+	};
+	syscall_struct.name[..name_len].copy_from_slice(name.as_bytes());
+
+	buf[..entry_size].copy_from_slice(unsafe {
+		core::slice::from_raw_parts(&syscall_struct as *const SyscallDirectoryEntry as *const u8,
+			entry_size)
+	});
+
+	Some(entry_size)
 }
 
 #[derive(Clone, Copy, Debug)]
@@ -12,6 +93,8 @@ pub struct FileDescription {
 	pub offset: u32,
 	pub status: u32,
 	pub file_type: FileType,
+	/// Number of file descriptors referring to the description
+	pub references: u32,
 }
 
 pub struct FileDescriptionTable {
@@ -37,6 +120,24 @@ impl FileDescriptionTable {
 			None
 		}
 	}
+
+	/// Adds a reference to the description at `idx`, for a file descriptor which was copied
+	pub fn add_reference(&mut self, idx: usize) {
+		self.descriptions[idx].as_mut().unwrap().references += 1;
+	}
+
+	/// Drops a reference to the description at `idx`, for a file descriptor which was closed. The
+	/// description is freed when the last reference is dropped.
+	pub fn drop_reference(&mut self, idx: usize) {
+		let description = self.descriptions[idx].as_mut().unwrap();
+		description.references -= 1;
+		if description.references == 0 {
+			if let FileType::Device(Device::Proc(_)) = description.file_type {
+				procfs::release(idx);
+			}
+			self.descriptions[idx] = None;
+		}
+	}
 }
 
 pub static FILE_DESCRIPTIONS: LockCell<FileDescriptionTable> = LockCell::new(FileDescriptionTable {
@@ -0,0 +1,521 @@
+//! Driver for virtio block devices (e.g. QEMU's `-drive if=virtio`), through the legacy virtio PCI
+//! interface. Each device has a single split virtqueue, whose descriptors are pre-built into a
+//! fixed chain per request slot: the request header, a data buffer and the status byte. A transfer
+//! is split into requests which are all made available to the device before it is notified once,
+//! so many requests are in flight together.
+//!
+//! Transfers go through DMA buffers owned by the driver, allocated once when the device is set up,
+//! so issuing a transfer never needs the physical memory lock (swapping issues transfers while
+//! holding it).
+//! Transfers poll the used ring for their completions instead of sleeping until the device
+//! interrupt, because swapping, the only user, issues them with interrupts masked. The interrupt is
+//! still acknowledged, and its bottom half reaps the completions of any transfer it interrupted.
+
+use core::sync::atomic::{fence, Ordering};
+
+use lock_cell::LockCell;
+use serial::println;
+use crate::{block::SECTOR_SIZE, interrupts, pci};
+use crate::interrupts::TrapFrame;
+use crate::dma::{self, DmaBlock, DmaBuffer};
+
+/// The vendor ID of virtio devices
+const VIRTIO_VENDOR_ID: u16 = 0x1AF4;
+/// The device ID of transitional virtio block devices, which have the legacy interface
+const VIRTIO_BLK_LEGACY_DEVICE_ID: u16 = 0x1001;
+
+/// Offsets of the registers of the legacy interface in the I/O BAR
+const VIRTIO_DEVICE_FEATURES_REG: u16 = 0x00;
+const VIRTIO_DRIVER_FEATURES_REG: u16 = 0x04;
+const VIRTIO_QUEUE_PFN_REG: u16 = 0x08;
+const VIRTIO_QUEUE_SIZE_REG: u16 = 0x0C;
+const VIRTIO_QUEUE_SELECT_REG: u16 = 0x0E;
+const VIRTIO_QUEUE_NOTIFY_REG: u16 = 0x10;
+const VIRTIO_DEVICE_STATUS_REG: u16 = 0x12;
+const VIRTIO_ISR_STATUS_REG: u16 = 0x13;
+/// Offset of the capacity (in sectors, as a u64) in the block device configuration, which follows
+/// the common registers when MSI-X is disabled
+const VIRTIO_BLK_CAPACITY_REG: u16 = 0x14;
+
+/// Device status bits
+const VIRTIO_STATUS_ACKNOWLEDGE: u8 = 1;
+const VIRTIO_STATUS_DRIVER: u8 = 2;
+const VIRTIO_STATUS_DRIVER_OK: u8 = 4;
+const VIRTIO_STATUS_FAILED: u8 = 0x80;
+
+/// Descriptor flag which marks that the `next` field is valid
+const VIRTQ_DESC_F_NEXT: u16 = 1;
+/// Descriptor flag which marks the buffer as written by the device
+const VIRTQ_DESC_F_WRITE: u16 = 2;
+
+/// Request types
+const VIRTIO_BLK_T_IN: u32 = 0;
+const VIRTIO_BLK_T_OUT: u32 = 1;
+/// The status the device writes for a successful request
+const VIRTIO_BLK_S_OK: u8 = 0;
+
+/// The legacy interface aligns the used ring of a virtqueue to pages
+const VIRTQ_ALIGN: usize = 4096;
+/// The largest queue size we support, which bounds the DMA memory of a device
+const MAX_QUEUE_SIZE: usize = 1024;
+
+/// The maximum number of requests in flight on a device
+const MAX_REQUESTS: usize = 16;
+/// The number of descriptors in the chain of a request
+const DESCRIPTORS_PER_REQUEST: usize = 3;
+/// Size of the data buffer of a request, which is the largest transfer a single request makes
+const REQUEST_BUFFER_SIZE: usize = 16 * 1024;
+
+/// The maximum number of virtio block devices
+const MAX_DEVICES: usize = 4;
+
+/// The header of a request, read by the device
+#[repr(C)]
+struct RequestHeader {
+	request_type: u32,
+	_reserved: u32,
+	sector: u64,
+}
+
+/// The size of the small DMA block of a request, which holds its header followed by the status
+/// byte the device writes
+const REQUEST_BLOCK_SIZE: usize = core::mem::size_of::<RequestHeader>() + 1;
+
+/// A descriptor of the descriptor table
+#[repr(C)]
+struct VirtqDescriptor {
+	addr: u64,
+	len: u32,
+	flags: u16,
+	next: u16,
+}
+
+/// An element of the used ring
+#[repr(C)]
+struct VirtqUsedElement {
+	/// The index of the head descriptor of the completed chain
+	id: u32,
+	/// The number of bytes the device wrote
+	len: u32,
+}
+
+/// The state of a request slot
+#[derive(Clone, Copy, PartialEq, Eq, Debug)]
+enum RequestState {
+	Free,
+	InFlight,
+	/// The device completed the request, with the given success
+	Done(bool),
+}
+
+/// A virtio block device and its virtqueue
+struct VirtioBlk {
+	/// The I/O port base of the legacy registers
+	io_base: u16,
+	/// The number of sectors of the device
+	sector_count: u32,
+	/// The number of descriptors (and ring entries) of the virtqueue
+	queue_size: usize,
+	/// The number of request slots
+	request_count: usize,
+	/// The memory of the virtqueue: the descriptor table, the available ring and the used ring
+	queue: DmaBuffer,
+	/// Offsets of the rings in the virtqueue memory
+	avail_offset: usize,
+	used_offset: usize,
+	/// The data buffers of the request slots, one after the other
+	buffers: DmaBuffer,
+	/// The header and status block of each request slot
+	request_blocks: [Option<DmaBlock>; MAX_REQUESTS],
+	/// The index of the next entry we make available, which the device sees once we publish it
+	next_avail: u16,
+	/// The index of the next used entry we haven't reaped yet
+	next_used: u16,
+	requests: [RequestState; MAX_REQUESTS],
+}
+
+/// The virtio block devices found by `init`
+static DEVICES: LockCell<[Option<VirtioBlk>; MAX_DEVICES]> = {
+	const NO_DEVICE: Option<VirtioBlk> = None;
+	LockCell::new([NO_DEVICE; MAX_DEVICES])
+};
+
+/// The direction and buffer of a transfer
+enum Transfer<'a> {
+	Read(&'a mut [u8]),
+	Write(&'a [u8]),
+}
+
+impl VirtioBlk {
+	fn descriptor(&self, idx: usize) -> *mut VirtqDescriptor {
+		self.queue.ptr_at(idx * core::mem::size_of::<VirtqDescriptor>())
+	}
+
+	/// Returns a pointer to the `u16` at `idx` of the available ring, where index 0 is the flags,
+	/// 1 is the index and the ring entries start at 2
+	fn avail_field(&self, idx: usize) -> *mut u16 {
+		self.queue.ptr_at(self.avail_offset + idx * 2)
+	}
+
+	/// Returns a pointer to the index of the used ring
+	fn used_idx(&self) -> *mut u16 {
+		self.queue.ptr_at(self.used_offset + 2)
+	}
+
+	fn used_element(&self, idx: usize) -> *mut VirtqUsedElement {
+		self.queue.ptr_at(self.used_offset + 4 + idx * core::mem::size_of::<VirtqUsedElement>())
+	}
+
+	fn header(&self, slot: usize) -> *mut RequestHeader {
+		self.request_blocks[slot].unwrap().vaddr.0 as *mut RequestHeader
+	}
+
+	fn status(&self, slot: usize) -> *mut u8 {
+		(self.request_blocks[slot].unwrap().vaddr.0 as usize + core::mem::size_of::<RequestHeader>())
+			as *mut u8
+	}
+
+	fn buffer(&self, slot: usize) -> *mut u8 {
+		self.buffers.ptr_at(slot * REQUEST_BUFFER_SIZE)
+	}
+
+	/// Makes the request in `slot` for `sector_count` sectors starting at `lba` available to the
+	/// device. The device doesn't see it until `publish` is called. For writes, the data must
+	/// already be in the buffer of the slot.
+	fn submit(&mut self, slot: usize, lba: u32, sector_count: usize, write: bool) {
+		assert!(self.requests[slot] == RequestState::Free);
+		let head = slot * DESCRIPTORS_PER_REQUEST;
+		unsafe {
+			self.header(slot).write_volatile(RequestHeader {
+				request_type: if write { VIRTIO_BLK_T_OUT } else { VIRTIO_BLK_T_IN },
+				_reserved: 0,
+				sector: lba as u64,
+			});
+			self.status(slot).write_volatile(0xFF);
+
+			let data = &mut *self.descriptor(head + 1);
+			core::ptr::addr_of_mut!(data.len).write_volatile((sector_count * SECTOR_SIZE) as u32);
+			core::ptr::addr_of_mut!(data.flags).write_volatile(if write {
+				VIRTQ_DESC_F_NEXT
+			} else {
+				VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE
+			});
+
+			let ring_idx = self.next_avail as usize % self.queue_size;
+			self.avail_field(2 + ring_idx).write_volatile(head as u16);
+		}
+
+		self.next_avail = self.next_avail.wrapping_add(1);
+		self.requests[slot] = RequestState::InFlight;
+	}
+
+	/// Publishes the requests submitted since the last call and notifies the device
+	fn publish(&mut self) {
+		// The ring entries must be visible before the index, and the index before the notification
+		fence(Ordering::SeqCst);
+		unsafe {
+			self.avail_field(1).write_volatile(self.next_avail);
+			fence(Ordering::SeqCst);
+			cpu::out16(self.io_base + VIRTIO_QUEUE_NOTIFY_REG, 0);
+		}
+	}
+
+	/// Marks the requests the device completed since the last call as done
+	fn reap_completions(&mut self) {
+		loop {
+			let used_idx = unsafe { self.used_idx().read_volatile() };
+			if used_idx == self.next_used {
+				break;
+			}
+			// The element must be read after the index which covers it
+			fence(Ordering::SeqCst);
+
+			let ring_idx = self.next_used as usize % self.queue_size;
+			let head = unsafe { core::ptr::addr_of!((*self.used_element(ring_idx)).id).read_volatile() };
+			let slot = head as usize / DESCRIPTORS_PER_REQUEST;
+			assert!(slot < self.request_count && self.requests[slot] == RequestState::InFlight,
+				"virtio-blk completed an unknown request");
+
+			let status = unsafe { self.status(slot).read_volatile() };
+			self.requests[slot] = RequestState::Done(status == VIRTIO_BLK_S_OK);
+			self.next_used = self.next_used.wrapping_add(1);
+		}
+	}
+}
+
+impl Drop for VirtioBlk {
+	fn drop(&mut self) {
+		for block in self.request_blocks.iter().flatten() {
+			dma::release_block(*block, REQUEST_BLOCK_SIZE);
+		}
+	}
+}
+
+/// The driver of virtio block devices, offered the matching PCI functions during enumeration
+pub const PCI_DRIVER: pci::PciDriver = pci::PciDriver {
+	name: "virtio-blk",
+	match_table: &[pci::PciMatch::ids(VIRTIO_VENDOR_ID, VIRTIO_BLK_LEGACY_DEVICE_ID)],
+	probe,
+};
+
+/// Sets up the virtio block device `pci_device` in the first free device slot. Returns whether the
+/// device was set up.
+fn probe(pci_device: &pci::PciDevice) -> bool {
+	let idx = match DEVICES.lock().iter().position(|device| device.is_none()) {
+		Some(idx) => idx,
+		None => return false,
+	};
+
+	match init_device(pci_device) {
+		Some(device) => {
+			println!("virtio-blk {}: {} sectors, queue size {}, {} requests in flight",
+				idx, device.sector_count, device.queue_size, device.request_count);
+			DEVICES.lock()[idx] = Some(device);
+			true
+		},
+		None => {
+			println!("Failed to initialize the virtio-blk device at {}", pci_device.address);
+			false
+		},
+	}
+}
+
+/// Resets the device `pci_device` and sets up its virtqueue
+fn init_device(pci_device: &pci::PciDevice) -> Option<VirtioBlk> {
+	let io_base = pci_device.io_bar(0)?;
+	pci_device.address.enable_decoding_and_bus_mastering();
+
+	let status_port = io_base + VIRTIO_DEVICE_STATUS_REG;
+	unsafe {
+		// Reset the device and tell it we found it and know how to drive it
+		cpu::out8(status_port, 0);
+		cpu::out8(status_port, VIRTIO_STATUS_ACKNOWLEDGE);
+		cpu::out8(status_port, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+		// We don't need any of the optional features
+		cpu::in32(io_base + VIRTIO_DEVICE_FEATURES_REG);
+		cpu::out32(io_base + VIRTIO_DRIVER_FEATURES_REG, 0);
+
+		cpu::out16(io_base + VIRTIO_QUEUE_SELECT_REG, 0);
+	}
+
+	let queue_size = unsafe { cpu::in16(io_base + VIRTIO_QUEUE_SIZE_REG) } as usize;
+	let request_count = MAX_REQUESTS.min(queue_size / DESCRIPTORS_PER_REQUEST);
+	if queue_size > MAX_QUEUE_SIZE || request_count == 0 {
+		unsafe { cpu::out8(status_port, VIRTIO_STATUS_FAILED); }
+		return None;
+	}
+
+	// The layout of a legacy virtqueue is fixed by its size
+	let align_up = |offset: usize, align: usize| (offset + align - 1) & !(align - 1);
+	let avail_offset = queue_size * core::mem::size_of::<VirtqDescriptor>();
+	let used_offset = align_up(avail_offset + 6 + 2 * queue_size, VIRTQ_ALIGN);
+	let queue_bytes = used_offset + 6 + 8 * queue_size;
+
+	let mut device = VirtioBlk {
+		io_base,
+		sector_count: 0,
+		queue_size,
+		request_count,
+		queue: DmaBuffer::allocate(queue_bytes, VIRTQ_ALIGN, false)?,
+		avail_offset,
+		used_offset,
+		buffers: DmaBuffer::allocate(request_count * REQUEST_BUFFER_SIZE, 4096, false)?,
+		request_blocks: [None; MAX_REQUESTS],
+		next_avail: 0,
+		next_used: 0,
+		requests: [RequestState::Free; MAX_REQUESTS],
+	};
+	for slot in 0..request_count {
+		device.request_blocks[slot] = Some(dma::allocate_block(REQUEST_BLOCK_SIZE)?);
+	}
+
+	unsafe {
+		// Chain the descriptors of every request slot: the header, the data buffer (whose length
+		// and direction are set per request) and the status byte
+		for slot in 0..request_count {
+			let head = slot * DESCRIPTORS_PER_REQUEST;
+			let block_paddr = device.request_blocks[slot].unwrap().paddr.0;
+			device.descriptor(head).write_volatile(VirtqDescriptor {
+				addr: block_paddr as u64,
+				len: core::mem::size_of::<RequestHeader>() as u32,
+				flags: VIRTQ_DESC_F_NEXT,
+				next: (head + 1) as u16,
+			});
+			device.descriptor(head + 1).write_volatile(VirtqDescriptor {
+				addr: device.buffers.paddr_at(slot * REQUEST_BUFFER_SIZE).0 as u64,
+				len: 0,
+				flags: VIRTQ_DESC_F_NEXT,
+				next: (head + 2) as u16,
+			});
+			device.descriptor(head + 2).write_volatile(VirtqDescriptor {
+				addr: (block_paddr as usize + core::mem::size_of::<RequestHeader>()) as u64,
+				len: 1,
+				flags: VIRTQ_DESC_F_WRITE,
+				next: 0,
+			});
+		}
+
+		cpu::out32(io_base + VIRTIO_QUEUE_PFN_REG, device.queue.paddr().0 >> 12);
+
+		// Sector counts beyond 32 bits are not addressable by the block layer
+		let capacity = (cpu::in32(io_base + VIRTIO_BLK_CAPACITY_REG) as u64)
+			| ((cpu::in32(io_base + VIRTIO_BLK_CAPACITY_REG + 4) as u64) << 32);
+		device.sector_count = capacity.min(u32::MAX as u64) as u32;
+
+		// Transfers poll for their completions, so a device without an IRQ still works
+		match pci_device.interrupt_line {
+			Some(irq) => {
+				if !interrupts::register_irq_handler(irq, handle_interrupt) {
+					println!("virtio-blk {}: IRQ {} is used by another device",
+						pci_device.address, irq);
+				}
+			},
+			None => println!("virtio-blk {}: The device has no interrupt pin", pci_device.address),
+		}
+
+		cpu::out8(status_port,
+			VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_DRIVER_OK);
+	}
+
+	Some(device)
+}
+
+/// Handles the interrupt of the virtio block devices. Reading the ISR status acknowledges the
+/// interrupt of a device, and the completions are reaped in the bottom half. All the devices
+/// register this handler, so devices which share an IRQ are all checked.
+fn handle_interrupt(_frame: &mut TrapFrame) {
+	let devices = DEVICES.lock();
+	let mut raised = false;
+	for device in devices.iter().flatten() {
+		raised |= unsafe { cpu::in8(device.io_base + VIRTIO_ISR_STATUS_REG) } != 0;
+	}
+
+	if raised {
+		interrupts::deferred::queue(interrupts::deferred::WorkItem::BlockCompletion);
+	}
+}
+
+/// Reaps the completed requests of every device, which the interrupted transfers pick up
+pub fn handle_completions() {
+	let mut devices = DEVICES.lock();
+	for device in devices.iter_mut().flatten() {
+		device.reap_completions();
+	}
+}
+
+/// Returns the number of virtio block devices
+pub fn device_count() -> usize {
+	DEVICES.lock().iter().flatten().count()
+}
+
+/// Returns the number of sectors of the device `device`
+pub fn sector_count(device: usize) -> Option<u32> {
+	DEVICES.lock().get(device)?.as_ref().map(|device| device.sector_count)
+}
+
+/// Reads `buffer.len() / SECTOR_SIZE` sectors starting at sector `lba` of `device` into `buffer`.
+/// The length of `buffer` must be a multiple of the sector size.
+#[must_use]
+pub fn read_sectors(device: usize, lba: u32, buffer: &mut [u8]) -> Option<()> {
+	transfer(device, lba, Transfer::Read(buffer))
+}
+
+/// Writes `buffer` to the sectors starting at sector `lba` of `device`. The length of `buffer` must
+/// be a multiple of the sector size.
+#[must_use]
+pub fn write_sectors(device: usize, lba: u32, buffer: &[u8]) -> Option<()> {
+	transfer(device, lba, Transfer::Write(buffer))
+}
+
+/// Transfers the sectors starting at `lba` of `device`, splitting the transfer into as many
+/// requests in flight as the free request slots allow
+fn transfer(device_idx: usize, lba: u32, mut transfer: Transfer) -> Option<()> {
+	let length = match &transfer {
+		Transfer::Read(buffer) => buffer.len(),
+		Transfer::Write(buffer) => buffer.len(),
+	};
+	assert!(length % SECTOR_SIZE == 0);
+
+	{
+		let devices = DEVICES.lock();
+		let device = devices.get(device_idx)?.as_ref()?;
+		let end_lba = lba.checked_add((length / SECTOR_SIZE) as u32)?;
+		if end_lba > device.sector_count {
+			return None;
+		}
+	}
+
+	let mut offset = 0;
+	let mut success = true;
+	while offset < length {
+		// The request slots of this batch, with the offset and length of their part of the buffer
+		let mut batch = [(0usize, 0usize, 0usize); MAX_REQUESTS];
+		let mut batch_len = 0;
+
+		{
+			let mut devices = DEVICES.lock();
+			let device = devices[device_idx].as_mut().unwrap();
+			for slot in 0..device.request_count {
+				if offset == length {
+					break;
+				}
+				if device.requests[slot] != RequestState::Free {
+					continue;
+				}
+
+				let chunk_len = REQUEST_BUFFER_SIZE.min(length - offset);
+				if let Transfer::Write(buffer) = &transfer {
+					unsafe {
+						core::ptr::copy_nonoverlapping(buffer[offset..].as_ptr(), device.buffer(slot),
+							chunk_len);
+					}
+				}
+
+				let write = matches!(transfer, Transfer::Write(_));
+				device.submit(slot, lba + (offset / SECTOR_SIZE) as u32, chunk_len / SECTOR_SIZE,
+					write);
+				batch[batch_len] = (slot, offset, chunk_len);
+				batch_len += 1;
+				offset += chunk_len;
+			}
+
+			if batch_len > 0 {
+				device.publish();
+			}
+		}
+
+		// Every slot is used by another transfer, which will free its slots when it completes
+		if batch_len == 0 {
+			core::hint::spin_loop();
+			continue;
+		}
+
+		loop {
+			{
+				let mut devices = DEVICES.lock();
+				let device = devices[device_idx].as_mut().unwrap();
+				device.reap_completions();
+
+				let all_done = batch[..batch_len].iter()
+					.all(|(slot, _, _)| matches!(device.requests[*slot], RequestState::Done(_)));
+				if all_done {
+					for (slot, chunk_offset, chunk_len) in batch[..batch_len].iter().copied() {
+						success &= device.requests[slot] == RequestState::Done(true);
+						if let Transfer::Read(buffer) = &mut transfer {
+							unsafe {
+								core::ptr::copy_nonoverlapping(device.buffer(slot),
+									buffer[chunk_offset..].as_mut_ptr(), chunk_len);
+							}
+						}
+						device.requests[slot] = RequestState::Free;
+					}
+					break;
+				}
+			}
+			core::hint::spin_loop();
+		}
+	}
+
+	if success { Some(()) } else { None }
+}
@@ -0,0 +1,387 @@
+//! Compressed in-memory store for swapped-out pages. Pages are LZ-compressed into a pool of page
+//! frames which are split into objects of a few size classes (in the style of zsmalloc), so a cold
+//! anonymous page takes a fraction of a page frame. Pages filled with a single byte value (usually
+//! zero) take no pool space at all. The swap layer tries this store before the swap drive.
+
+use alloc::{boxed::Box, vec, vec::Vec};
+use core::alloc::Layout;
+use core::sync::atomic::{AtomicBool, AtomicU32, AtomicU64, Ordering};
+
+use exclusive_cell::ExclusiveCell;
+use lz_compression::HASH_TABLE_SIZE;
+use page_tables::{PhysAddr, PhysMem};
+use serial::println;
+use crate::memory_manager::{self, PhysicalMemory};
+
+/// The size classes of pool objects are multiples of this
+const SIZE_CLASS_GRANULARITY: usize = 64;
+/// Pages which don't compress to this size or less are left for the swap drive
+const MAX_COMPRESSED_SIZE: usize = 3072;
+/// The number of size classes of pool objects
+const NUM_SIZE_CLASSES: usize = MAX_COMPRESSED_SIZE / SIZE_CLASS_GRANULARITY;
+/// The pool may grow to this fraction of the free memory at boot
+const POOL_MEMORY_DIVISOR: u32 = 4;
+/// The maximum number of page frames in the pool, which bounds the heap used for metadata
+const MAX_POOL_PAGES: u32 = 4096;
+/// The number of entries per pool page, which is the compression ratio the entry table is sized
+/// for (pages filled with a single value don't take pool space, so this is usually exceeded)
+const ENTRIES_PER_POOL_PAGE: usize = 4;
+
+/// Marks the end of a list of pool pages
+const NO_POOL_PAGE: u16 = u16::MAX;
+
+/// A page frame of the pool, split into objects of a single size class
+#[derive(Clone, Copy)]
+struct PoolPage {
+	/// The page frame, None if this pool page is unused
+	frame: Option<PhysAddr>,
+	/// The size class of the objects in the page
+	class: usize,
+	/// A bit for every object in the page which is free
+	free_objects: u64,
+	/// The next pool page of the same size class which has free objects
+	next_partial: u16,
+}
+
+/// How the contents of a stored page are kept
+#[derive(Clone, Copy)]
+enum StoredPage {
+	/// Every byte of the page has this value
+	SameFilled(u8),
+	/// The page is compressed into an object of a pool page
+	Compressed {
+		pool_page: u16,
+		object: u8,
+		size: u16,
+	},
+}
+
+/// A page in the store
+#[derive(Clone, Copy)]
+struct Entry {
+	/// The number of swap entries referring to this entry, zero if it is free
+	refs: u16,
+	page: StoredPage,
+}
+
+struct CompressedStore {
+	entries: Vec<Entry>,
+	/// Indices of the free entries. The capacity fits every entry, so this never reallocates.
+	free_entries: Vec<u32>,
+	pool_pages: Vec<PoolPage>,
+	/// Indices of the unused pool pages. The capacity fits every pool page, so this never
+	/// reallocates.
+	unused_pool_pages: Vec<u16>,
+	/// For each size class, the first pool page of the class which has free objects
+	partial_pool_pages: [u16; NUM_SIZE_CLASSES],
+	/// Buffer for the uncompressed contents of a page
+	page_buffer: Box<[u8; 4096]>,
+	/// Buffer for the compressed contents of a page
+	compressed_buffer: Box<[u8; MAX_COMPRESSED_SIZE]>,
+	/// Scratch space for the compressor
+	hash_table: Box<[u16; HASH_TABLE_SIZE]>,
+}
+
+/// The compressed store. Only accessed while the physical memory lock is held.
+static STORE: ExclusiveCell<Option<CompressedStore>> = ExclusiveCell::new(None);
+
+/// Whether the store was set up
+static ENABLED: AtomicBool = AtomicBool::new(false);
+/// The number of pages in the store
+static STORED_PAGES: AtomicU32 = AtomicU32::new(0);
+/// The number of pages in the store which are filled with a single byte value
+static SAME_FILLED_PAGES: AtomicU32 = AtomicU32::new(0);
+/// The total size of the compressed pages in the store
+static COMPRESSED_BYTES: AtomicU32 = AtomicU32::new(0);
+/// The number of page frames in the pool
+static POOL_PAGES: AtomicU32 = AtomicU32::new(0);
+/// Total number of pages which were not stored because they did not compress well enough
+static REJECTED_PAGES: AtomicU32 = AtomicU32::new(0);
+/// Total number of pages loaded from the store, and the cycles it took
+static LOADS: AtomicU32 = AtomicU32::new(0);
+static LOAD_CYCLES: AtomicU64 = AtomicU64::new(0);
+
+/// Usage and activity counters of the compressed store
+pub struct CompressedStoreStats {
+	pub stored_pages: u32,
+	pub same_filled_pages: u32,
+	pub compressed_bytes: u32,
+	pub pool_pages: u32,
+	pub rejected_pages: u32,
+	pub loads: u32,
+	pub load_cycles: u64,
+}
+
+/// Returns the current usage and activity counters of the compressed store
+pub fn get_stats() -> CompressedStoreStats {
+	CompressedStoreStats {
+		stored_pages: STORED_PAGES.load(Ordering::Relaxed),
+		same_filled_pages: SAME_FILLED_PAGES.load(Ordering::Relaxed),
+		compressed_bytes: COMPRESSED_BYTES.load(Ordering::Relaxed),
+		pool_pages: POOL_PAGES.load(Ordering::Relaxed),
+		rejected_pages: REJECTED_PAGES.load(Ordering::Relaxed),
+		loads: LOADS.load(Ordering::Relaxed),
+		load_cycles: LOAD_CYCLES.load(Ordering::Relaxed),
+	}
+}
+
+/// Prints the usage and activity counters of the compressed store to the serial port
+#[allow(unused)]
+pub fn dump_stats() {
+	let stats = get_stats();
+	println!("Compressed store: {} pages ({} same-filled) in {} pool pages, {} bytes compressed",
+		stats.stored_pages, stats.same_filled_pages, stats.pool_pages, stats.compressed_bytes);
+	println!("\t{} pages rejected, {} loads, {} cycles per load on average", stats.rejected_pages,
+		stats.loads, stats.load_cycles.checked_div(stats.loads as u64).unwrap_or(0));
+}
+
+/// Sets up the compressed store, sized by the currently free memory
+pub fn init() {
+	let free_pages = memory_manager::PHYS_MEM.lock().as_ref().unwrap().0.free_bytes() / 4096;
+	let max_pool_pages = (free_pages / POOL_MEMORY_DIVISOR).min(MAX_POOL_PAGES) as usize;
+	if max_pool_pages == 0 {
+		return;
+	}
+	let max_entries = max_pool_pages * ENTRIES_PER_POOL_PAGE;
+
+	// Everything is allocated before the store is published, because allocating might reclaim
+	// memory
+	let store = CompressedStore {
+		entries: vec![Entry { refs: 0, page: StoredPage::SameFilled(0) }; max_entries],
+		free_entries: (0..max_entries as u32).rev().collect(),
+		pool_pages: vec![PoolPage {
+			frame: None,
+			class: 0,
+			free_objects: 0,
+			next_partial: NO_POOL_PAGE,
+		}; max_pool_pages],
+		unused_pool_pages: (0..max_pool_pages as u16).rev().collect(),
+		partial_pool_pages: [NO_POOL_PAGE; NUM_SIZE_CLASSES],
+		page_buffer: vec![0; 4096].into_boxed_slice().try_into().unwrap(),
+		compressed_buffer: vec![0; MAX_COMPRESSED_SIZE].into_boxed_slice().try_into().unwrap(),
+		hash_table: vec![0; HASH_TABLE_SIZE].into_boxed_slice().try_into().unwrap(),
+	};
+
+	let _pmem = memory_manager::PHYS_MEM.lock();
+	*STORE.acquire() = Some(store);
+	ENABLED.store(true, Ordering::Relaxed);
+
+	println!("Enabled compressed swap with a pool of up to {} KiB", max_pool_pages * 4);
+}
+
+/// Returns true if pages can be stored
+pub fn is_enabled() -> bool {
+	ENABLED.load(Ordering::Relaxed)
+}
+
+/// Returns the size of the objects of `class`
+fn class_object_size(class: usize) -> usize {
+	(class + 1) * SIZE_CLASS_GRANULARITY
+}
+
+/// Returns the number of objects in a pool page of `class`
+fn class_objects_per_page(class: usize) -> usize {
+	(4096 / class_object_size(class)).min(64)
+}
+
+impl CompressedStore {
+	/// Allocates an object of `class`. Returns the pool page and the index of the object in it.
+	fn allocate_object(&mut self, phys_mem: &mut PhysicalMemory, class: usize)
+		-> Option<(u16, usize)> {
+		if self.partial_pool_pages[class] == NO_POOL_PAGE {
+			// There is no room in the pool pages of this class, so the pool grows. The caller is
+			// reclaiming memory, so this must not reclaim.
+			let pool_page_idx = *self.unused_pool_pages.last()?;
+			let page_layout = Layout::from_size_align(4096, 4096).unwrap();
+			let frame = phys_mem.allocate_phys_mem_no_reclaim(page_layout)?;
+			self.unused_pool_pages.pop();
+
+			let objects = class_objects_per_page(class);
+			self.pool_pages[pool_page_idx as usize] = PoolPage {
+				frame: Some(frame),
+				class,
+				free_objects: if objects == 64 { u64::MAX } else { (1 << objects) - 1 },
+				next_partial: NO_POOL_PAGE,
+			};
+			self.partial_pool_pages[class] = pool_page_idx;
+			POOL_PAGES.fetch_add(1, Ordering::Relaxed);
+		}
+
+		let pool_page_idx = self.partial_pool_pages[class];
+		let pool_page = &mut self.pool_pages[pool_page_idx as usize];
+		let object = pool_page.free_objects.trailing_zeros() as usize;
+		pool_page.free_objects &= !(1 << object);
+		if pool_page.free_objects == 0 {
+			// The page is full, so it leaves the list of pages with free objects
+			self.partial_pool_pages[class] = pool_page.next_partial;
+			pool_page.next_partial = NO_POOL_PAGE;
+		}
+
+		Some((pool_page_idx, object))
+	}
+
+	/// Frees the object `object` of the pool page `pool_page_idx`, and releases the pool page if
+	/// it becomes empty
+	fn free_object(&mut self, phys_mem: &mut PhysicalMemory, pool_page_idx: u16, object: usize) {
+		let pool_page = &mut self.pool_pages[pool_page_idx as usize];
+		let class = pool_page.class;
+		let was_full = pool_page.free_objects == 0;
+		pool_page.free_objects |= 1 << object;
+
+		if was_full {
+			// The page has a free object again, so it rejoins the list of pages with free objects
+			pool_page.next_partial = self.partial_pool_pages[class];
+			self.partial_pool_pages[class] = pool_page_idx;
+		}
+
+		let objects = class_objects_per_page(class);
+		if pool_page.free_objects.count_ones() as usize != objects {
+			return;
+		}
+
+		// The page is empty, so it is unlinked from the list of its class and released
+		let next_partial = pool_page.next_partial;
+		let mut link = self.partial_pool_pages[class];
+		if link == pool_page_idx {
+			self.partial_pool_pages[class] = next_partial;
+		} else {
+			while self.pool_pages[link as usize].next_partial != pool_page_idx {
+				link = self.pool_pages[link as usize].next_partial;
+			}
+			self.pool_pages[link as usize].next_partial = next_partial;
+		}
+
+		let pool_page = &mut self.pool_pages[pool_page_idx as usize];
+		phys_mem.release_phys_mem(pool_page.frame.take().unwrap(), 4096);
+		self.unused_pool_pages.push(pool_page_idx);
+		POOL_PAGES.fetch_sub(1, Ordering::Relaxed);
+	}
+
+	/// Returns a pointer to the object `object` of the pool page `pool_page_idx`. The pointer is
+	/// only valid until the next `translate_phys`.
+	unsafe fn translate_object(&self, phys_mem: &mut PhysicalMemory, pool_page_idx: u16,
+		object: usize) -> *mut u8 {
+		let pool_page = &self.pool_pages[pool_page_idx as usize];
+		let object_size = class_object_size(pool_page.class);
+		let frame = pool_page.frame.expect("Accessed an object of an unused pool page");
+		let page_ptr = phys_mem.translate_phys(frame, 4096)
+			.expect("Failed to translate a pool page frame");
+		page_ptr.add(object * object_size)
+	}
+}
+
+/// Stores the contents of the page frame `frame`. Returns the index of the new entry (with a
+/// single reference), or None if the page does not compress well enough or the store is full.
+pub fn store(phys_mem: &mut PhysicalMemory, frame: PhysAddr) -> Option<usize> {
+	let mut store = STORE.acquire();
+	let store = store.as_mut()?;
+	let entry_idx = *store.free_entries.last()? as usize;
+
+	unsafe {
+		let frame_ptr = phys_mem.translate_phys(frame, 4096)?;
+		core::ptr::copy_nonoverlapping(frame_ptr, store.page_buffer.as_mut_ptr(), 4096);
+	}
+
+	let fill = store.page_buffer[0];
+	let page = if store.page_buffer.iter().all(|&byte| byte == fill) {
+		SAME_FILLED_PAGES.fetch_add(1, Ordering::Relaxed);
+		StoredPage::SameFilled(fill)
+	} else {
+		let size = match lz_compression::compress(&store.page_buffer[..],
+			&mut store.compressed_buffer[..], &mut store.hash_table) {
+			Some(size) => size,
+			None => {
+				REJECTED_PAGES.fetch_add(1, Ordering::Relaxed);
+				return None;
+			}
+		};
+
+		let class = (size - 1) / SIZE_CLASS_GRANULARITY;
+		let (pool_page, object) = store.allocate_object(phys_mem, class)?;
+		unsafe {
+			let object_ptr = store.translate_object(phys_mem, pool_page, object);
+			core::ptr::copy_nonoverlapping(store.compressed_buffer.as_ptr(), object_ptr, size);
+		}
+
+		COMPRESSED_BYTES.fetch_add(size as u32, Ordering::Relaxed);
+		StoredPage::Compressed { pool_page, object: object as u8, size: size as u16 }
+	};
+
+	store.free_entries.pop();
+	store.entries[entry_idx] = Entry { refs: 1, page };
+	STORED_PAGES.fetch_add(1, Ordering::Relaxed);
+	Some(entry_idx)
+}
+
+/// Decompresses the page of the entry `entry_idx` into the page frame `frame`
+#[must_use]
+pub fn load(phys_mem: &mut PhysicalMemory, entry_idx: usize, frame: PhysAddr) -> Option<()> {
+	let start_cycles = cpu::serializing_rdtsc();
+
+	let mut store = STORE.acquire();
+	let store = store.as_mut()?;
+	let entry = *store.entries.get(entry_idx).filter(|entry| entry.refs > 0)?;
+
+	match entry.page {
+		StoredPage::SameFilled(fill) => unsafe {
+			let frame_ptr = phys_mem.translate_phys(frame, 4096)?;
+			core::ptr::write_bytes(frame_ptr, fill, 4096);
+		},
+		StoredPage::Compressed { pool_page, object, size } => {
+			let size = size as usize;
+			unsafe {
+				let object_ptr = store.translate_object(phys_mem, pool_page, object as usize);
+				core::ptr::copy_nonoverlapping(object_ptr, store.compressed_buffer.as_mut_ptr(),
+					size);
+			}
+
+			let decompressed_size = lz_compression::decompress(&store.compressed_buffer[..size],
+				&mut store.page_buffer[..]);
+			if decompressed_size != Some(4096) {
+				return None;
+			}
+
+			unsafe {
+				let frame_ptr = phys_mem.translate_phys(frame, 4096)?;
+				core::ptr::copy_nonoverlapping(store.page_buffer.as_ptr(), frame_ptr, 4096);
+			}
+		},
+	}
+
+	LOADS.fetch_add(1, Ordering::Relaxed);
+	LOAD_CYCLES.fetch_add(cpu::serializing_rdtsc() - start_cycles, Ordering::Relaxed);
+	Some(())
+}
+
+/// Adds a reference to the entry `entry_idx`
+pub fn duplicate(entry_idx: usize) {
+	let mut store = STORE.acquire();
+	let store = store.as_mut().expect("Duplicated a compressed page while the store is disabled");
+	store.entries[entry_idx].refs += 1;
+}
+
+/// Drops a reference to the entry `entry_idx`, freeing it if it was the last one
+pub fn release(phys_mem: &mut PhysicalMemory, entry_idx: usize) {
+	let mut store = STORE.acquire();
+	let store = store.as_mut().expect("Released a compressed page while the store is disabled");
+
+	let entry = &mut store.entries[entry_idx];
+	assert!(entry.refs > 0, "Released a free compressed page");
+	entry.refs -= 1;
+	if entry.refs != 0 {
+		return;
+	}
+
+	match entry.page {
+		StoredPage::SameFilled(_) => {
+			SAME_FILLED_PAGES.fetch_sub(1, Ordering::Relaxed);
+		},
+		StoredPage::Compressed { pool_page, object, size } => {
+			COMPRESSED_BYTES.fetch_sub(size as u32, Ordering::Relaxed);
+			store.free_object(phys_mem, pool_page, object as usize);
+		},
+	}
+
+	store.free_entries.push(entry_idx as u32);
+	STORED_PAGES.fetch_sub(1, Ordering::Relaxed);
+}
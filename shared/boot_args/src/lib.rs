@@ -18,6 +18,23 @@ pub const KERNEL_ALLOCATIONS_BASE_VADDR: u32 = 0xC4000000;
 /// The virtual address where the page table containing the last page is mapped
 pub const LAST_PAGE_TABLE_VADDR: u32 = 0xFFFFE000;
 
+/// The signature at the start of the module table
+pub const MODULE_TABLE_SIGNATURE: [u8; 8] = *b"EXOSMODS";
+
+/// Describes the modules the build script appends to the disk image after the bootloader. The table
+/// takes the sector right after the bootloader, and is followed by the kernel ELF and then the
+/// filesystem image, each starting on a sector boundary.
+#[derive(Clone, Copy)]
+#[repr(C)]
+pub struct ModuleTable {
+    /// Must be `MODULE_TABLE_SIGNATURE`
+    pub signature: [u8; 8],
+    /// The size in bytes of the kernel ELF
+    pub kernel_size: u32,
+    /// The size in bytes of the filesystem image
+    pub fs_image_size: u32,
+}
+
 /// A structure to hold data the bootloader wants to pass to the kernel
 #[derive(Clone, Copy)]
 #[repr(C)]
@@ -29,4 +46,9 @@ pub struct BootArgs {
     /// The physical address of the page table containing the last page. The kernel needs this
     /// information to access physical memory
     pub last_page_table_paddr: PhysAddr,
+    /// The physical address of the filesystem image the bootloader loaded. The image is page
+    /// aligned, and its memory is not part of `free_memory`
+    pub fs_image_paddr: PhysAddr,
+    /// The size in bytes of the filesystem image
+    pub fs_image_size: u32,
 }
\ No newline at end of file
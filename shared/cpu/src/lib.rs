@@ -39,6 +39,17 @@ pub unsafe fn in16(addr: u16) -> u16 {
     result
 }
 
+/// Reads a dword from the specified IO port `addr`
+///
+/// ### Safety
+/// If the CPL is greater than the IOPL this will cause a GPF
+#[inline]
+pub unsafe fn in32(addr: u16) -> u32 {
+    let result: u32;
+    asm!("in eax, dx", out("eax") result, in("dx") addr, options(nomem, preserves_flags, nostack));
+    result
+}
+
 /// Writes `data` to the specified IO port `addr`
 ///
 /// ### Safety
@@ -57,6 +68,15 @@ pub unsafe fn out16(addr: u16, data: u16) {
     asm!("out dx, ax", in("ax") data, in("dx") addr, options(nomem, preserves_flags, nostack));
 }
 
+/// Writes `data` to the specified IO port `addr`
+///
+/// ### Safety
+/// If the CPL is greater than the IOPL this will cause a GPF
+#[inline]
+pub unsafe fn out32(addr: u16, data: u32) {
+    asm!("out dx, eax", in("eax") data, in("dx") addr, options(nomem, preserves_flags, nostack));
+}
+
 /// Invalidates TLB entries for the page of the address `addr`
 ///
 /// ### Safety
@@ -139,6 +159,20 @@ pub unsafe fn halt_and_service_interrupts() -> ! {
     }
 }
 
+/// Unmasks interrupts and halts the cpu until the next interrupt is serviced. Because of the
+/// interrupt shadow of `sti`, no interrupt can be serviced between the two instructions, so an
+/// interrupt which a caller with masked interrupts is waiting for can't be missed.
+///
+/// ### Safety
+/// If the CPL is not zero this will cause a GPF. An IDT must already be loaded
+#[inline]
+pub unsafe fn enable_interrupts_and_halt() {
+    asm!("
+        sti
+        hlt
+    ", options(nomem, nostack));
+}
+
 /// Disables interrupts and halts the cpu
 ///
 /// ### Safety
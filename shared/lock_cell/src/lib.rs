@@ -4,6 +4,8 @@
 
 use core::cell::UnsafeCell;
 use core::sync::atomic::{AtomicUsize, Ordering};
+#[cfg(feature = "lock_stats")]
+use core::sync::atomic::{AtomicU32, AtomicU64};
 use core::ops::{Drop, Deref, DerefMut};
 
 /// Spin lock for interior mutability
@@ -16,6 +18,46 @@ pub struct LockCell<T> {
     owner_ticket: AtomicUsize,
     /// Whether or not the lock should mask interrupts when held
     interruptable: bool,
+    /// The usage statistics of the lock. Recording them reads the timestamp counter twice and
+    /// updates 64-bit counters on every acquire and release, so they only exist with the
+    /// `lock_stats` feature, for profiling the locks.
+    #[cfg(feature = "lock_stats")]
+    stats: LockStatCounters,
+}
+
+/// The counters behind `LockStats`, updated while the lock is held
+#[cfg(feature = "lock_stats")]
+struct LockStatCounters {
+    acquisitions: AtomicU32,
+    contentions: AtomicU32,
+    held_cycles: AtomicU64,
+    max_held_cycles: AtomicU64,
+}
+
+#[cfg(feature = "lock_stats")]
+impl LockStatCounters {
+    const fn new() -> Self {
+        LockStatCounters {
+            acquisitions: AtomicU32::new(0),
+            contentions: AtomicU32::new(0),
+            held_cycles: AtomicU64::new(0),
+            max_held_cycles: AtomicU64::new(0),
+        }
+    }
+}
+
+/// Usage statistics of a lock
+#[cfg(feature = "lock_stats")]
+#[derive(Clone, Copy, Debug, Default)]
+pub struct LockStats {
+    /// Number of times the lock was acquired
+    pub acquisitions: u32,
+    /// Number of times the lock was already held when someone tried to acquire it
+    pub contentions: u32,
+    /// Total number of cycles the lock was held for
+    pub held_cycles: u64,
+    /// Largest number of cycles the lock was held for at once
+    pub max_held_cycles: u64,
 }
 
 // We make sure access from multiple threads is safe
@@ -29,7 +71,9 @@ impl<T> LockCell<T>  {
             cell: UnsafeCell::new(val),
             available_ticket: AtomicUsize::new(0),
             owner_ticket: AtomicUsize::new(0),
-            interruptable: true
+            interruptable: true,
+            #[cfg(feature = "lock_stats")]
+            stats: LockStatCounters::new(),
         }
     }
 
@@ -40,7 +84,9 @@ impl<T> LockCell<T>  {
             cell: UnsafeCell::new(val),
             available_ticket: AtomicUsize::new(0),
             owner_ticket: AtomicUsize::new(0),
-            interruptable: false
+            interruptable: false,
+            #[cfg(feature = "lock_stats")]
+            stats: LockStatCounters::new(),
         }
     }
 
@@ -60,13 +106,32 @@ impl<T> LockCell<T>  {
         let ticket = self.available_ticket.fetch_add(1, Ordering::SeqCst);
 
         // Wait until it is our turn, i.e. we are the owner
-        while ticket != self.owner_ticket.load(Ordering::SeqCst) {
-            core::hint::spin_loop();
+        if ticket != self.owner_ticket.load(Ordering::SeqCst) {
+            #[cfg(feature = "lock_stats")]
+            self.stats.contentions.fetch_add(1, Ordering::Relaxed);
+            while ticket != self.owner_ticket.load(Ordering::SeqCst) {
+                core::hint::spin_loop();
+            }
         }
+        #[cfg(feature = "lock_stats")]
+        self.stats.acquisitions.fetch_add(1, Ordering::Relaxed);
 
         LockCellGuard {
             lock: self,
-            unmask_interrupts
+            unmask_interrupts,
+            #[cfg(feature = "lock_stats")]
+            acquired_cycles: cpu::serializing_rdtsc(),
+        }
+    }
+
+    /// Returns the usage statistics of the lock
+    #[cfg(feature = "lock_stats")]
+    pub fn stats(&self) -> LockStats {
+        LockStats {
+            acquisitions: self.stats.acquisitions.load(Ordering::Relaxed),
+            contentions: self.stats.contentions.load(Ordering::Relaxed),
+            held_cycles: self.stats.held_cycles.load(Ordering::Relaxed),
+            max_held_cycles: self.stats.max_held_cycles.load(Ordering::Relaxed),
         }
     }
 }
@@ -76,10 +141,21 @@ pub struct LockCellGuard<'a, T> {
     /// Whether or not the interrupts were enabled when the lock was taken, used to re-enable
     /// interrupts when the lock is released
     unmask_interrupts: bool,
+    /// The timestamp counter when the lock was acquired
+    #[cfg(feature = "lock_stats")]
+    acquired_cycles: u64,
 }
 
 impl<'a, T> Drop for LockCellGuard<'a, T> {
     fn drop(&mut self) {
+        // The statistics are updated while the lock is still held
+        #[cfg(feature = "lock_stats")]
+        {
+            let held_cycles = cpu::serializing_rdtsc().wrapping_sub(self.acquired_cycles);
+            self.lock.stats.held_cycles.fetch_add(held_cycles, Ordering::Relaxed);
+            self.lock.stats.max_held_cycles.fetch_max(held_cycles, Ordering::Relaxed);
+        }
+
         // Advance the queue so the next ticket becomes the owner
         self.lock.owner_ticket.fetch_add(1, Ordering::SeqCst);
 
@@ -125,6 +201,20 @@ mod tests {
         assert!(*lock_cell.lock() == 4);
     }
 
+    #[test]
+    #[cfg(feature = "lock_stats")]
+    fn stats() {
+        let lock_cell = LockCell::new_non_interruptable(0);
+        for _ in 0..3 {
+            *lock_cell.lock() += 1;
+        }
+
+        let stats = lock_cell.stats();
+        assert_eq!(stats.acquisitions, 3);
+        assert_eq!(stats.contentions, 0);
+        assert!(stats.max_held_cycles <= stats.held_cycles);
+    }
+
     #[test]
     #[should_panic]
     fn inner_dropped() {
@@ -9,6 +9,12 @@ pub const PAGE_ENTRY_WRITE: u32     = 1<<1;
 pub const PAGE_ENTRY_USER: u32      = 1<<2;
 pub const PAGE_ENTRY_PWT: u32       = 1<<3; // Page-level write-through
 pub const PAGE_ENTRY_PCD: u32       = 1<<4; // Page-level cache disable
+pub const PAGE_ENTRY_ACCESSED: u32  = 1<<5;
+pub const PAGE_ENTRY_DIRTY: u32     = 1<<6;
+pub const PAGE_ENTRY_COW: u32       = 1<<9; // Available for software use: copy-on-write page
+pub const PAGE_ENTRY_FILE: u32      = 1<<10; // Available for software use: page read from a file
+pub const PAGE_ENTRY_SWAPPED: u32   = 1<<11; // Available for software use: not-present page whose
+                                             // swap slot is held in the address bits
 
 /// Strongly typed physical address to diffreniate addresses
 #[derive(Clone, Copy, PartialEq, Eq, PartialOrd, Ord)]
@@ -361,8 +367,8 @@ impl PageDirectory {
     }
 
     /// Unmaps the page at `virt_addr`. If the page table containing this page becomes empty as a
-    /// result of this, it will be freed. If `free_page` is true, the physical page will also be
-    /// freed.
+    /// result of this (i.e. all of its entries are zero), it will be freed. If `free_page` is true,
+    /// the physical page will also be freed.
     #[must_use]
     pub fn unmap(&mut self, phys_mem: &mut impl PhysMem, virt_addr: VirtAddr, free_page: bool)
         -> Option<()> {
@@ -408,14 +414,14 @@ impl PageDirectory {
             // Get the entry in the table
             let table_entry = unsafe { *(table_entry_vaddr as *const u32) };
 
-            if (table_entry & PAGE_ENTRY_PRESENT) != 0 {
-                // The PTE is present, i.e. the page is mapped so this page table is not empty
-                // and there is nothing left to do
+            if table_entry != 0 {
+                // The PTE is either present or holds software state (e.g. a swap slot), so this
+                // page table is not empty and there is nothing left to do
                 return Some(());
             }
         }
 
-        // If we exited the loop every page table entry is not present, so this table can be freed
+        // If we exited the loop every page table entry is zero, so this table can be freed
         phys_mem.release_phys_mem(PhysAddr(table_paddr), 4096);
         
         // We also need to mark the PDE as not present
@@ -429,10 +435,26 @@ impl PageDirectory {
         Some(())
     }
 
-    /// Translates the virtual address `virt_addr` into the corresponding physical address based on
-    /// the page tables.
-    pub fn translate_virt(&mut self, phys_mem: &mut impl PhysMem, virt_addr: VirtAddr)
-        -> Option<PhysAddr> {
+    /// Returns the raw page directory entry responsible for the page containing `virt_addr`
+    pub fn get_page_directory_entry(&mut self, phys_mem: &mut impl PhysMem, virt_addr: VirtAddr)
+        -> Option<u32> {
+        // Index of the entry in the page directory
+        let directory_index = virt_addr.0 >> 22;
+
+        // Compute the physical address of the PDE
+        let directory_entry_paddr = PhysAddr(self.directory.0 + directory_index * 4);
+        // Get the entry in the directory by translating the physical address to a virtual one
+        let directory_entry = unsafe {
+            *(phys_mem.translate_phys(directory_entry_paddr, 4)? as *const u32)
+        };
+
+        Some(directory_entry)
+    }
+
+    /// Returns the raw page table entry of the page containing `virt_addr`. Returns `None` if the
+    /// page table responsible for the page does not exist.
+    pub fn get_page_table_entry(&mut self, phys_mem: &mut impl PhysMem, virt_addr: VirtAddr)
+        -> Option<u32> {
         // Index of the entry in the page directory
         let directory_index = virt_addr.0 >> 22;
         // Index of the entry in the page table
@@ -461,6 +483,16 @@ impl PageDirectory {
             *(table_entry_vaddr as *const u32)
         };
 
+        Some(table_entry)
+    }
+
+    /// Translates the virtual address `virt_addr` into the corresponding physical address based on
+    /// the page tables.
+    pub fn translate_virt(&mut self, phys_mem: &mut impl PhysMem, virt_addr: VirtAddr)
+        -> Option<PhysAddr> {
+        // Get the entry in the table
+        let table_entry = self.get_page_table_entry(phys_mem, virt_addr)?;
+
         // Check if the PTE is present (i.e. the page is already mapped)
         if (table_entry & PAGE_ENTRY_PRESENT) != 0 {
             // Calculate the physical address by adding the page address from the PTE and the page
@@ -171,6 +171,15 @@ impl RangeSet {
     /// 
     /// The alignment must be a power of two.
     pub fn allocate(&mut self, size: u32, align: u32) -> Option<u32> {
+        self.allocate_below(size, align, u32::MAX)
+    }
+
+    /// Allocates `size` bytes from the RangeSet under the `align` alignment requirement, such that
+    /// the last byte of the allocation is at most `max_addr` (e.g. for devices which can only
+    /// address part of physical memory).
+    /// 
+    /// The alignment must be a power of two.
+    pub fn allocate_below(&mut self, size: u32, align: u32, max_addr: u32) -> Option<u32> {
         // We can't allocate a unique address for zero bytes
         if size == 0 {
             return None;
@@ -187,15 +196,20 @@ impl RangeSet {
         for i in 0..self.num_ranges as usize {
             // We round up the start of the range to the alignment, so we can calculate if the
             // aligned allocation will fit in this range.
-            let next_aligned_start = round_up_to_pow_of_2(self.ranges[i].start, align);
-
-            if next_aligned_start > self.ranges[i].end {
+            let next_aligned_start = match checked_round_up_to_pow_of_2(self.ranges[i].start, align) {
+                Some(start) => start,
+                None => continue,
+            };
+            // Only the part of the range up to `max_addr` can be used
+            let range_end = self.ranges[i].end.min(max_addr);
+
+            if next_aligned_start > range_end {
                 // If the aligned start address doesn't fit inside the range, then this is not a
                 // valid allocation point
                 continue;
             }
 
-            if size <= (self.ranges[i].end - next_aligned_start).saturating_add(1) {
+            if size <= (range_end - next_aligned_start).saturating_add(1) {
                 // If it does fit, we calculate the padding needed
                 let padding_needed = next_aligned_start - self.ranges[i].start;
 
@@ -256,17 +270,47 @@ fn does_range_contain(a: InclusiveRange, b: InclusiveRange) -> bool {
     (a.start <= b.start) && (b.end <= a.end)
 }
 
-/// Rounds up `val` to the next multiple of `power` which must be a power of 2
-fn round_up_to_pow_of_2(val: u32, power: u32) -> u32 {
+/// Rounds up `val` to the next multiple of `power` which must be a power of 2. Returns `None` if
+/// the result doesn't fit in a u32.
+fn checked_round_up_to_pow_of_2(val: u32, power: u32) -> Option<u32> {
     // Get a mask
     let mask = power - 1;
 
     // If we are already at a multiple, nothing to do
     if val & mask == 0 {
-        return val;
+        return Some(val);
     }
 
     // By and-ing with the inverted mask we essentially round down, and then add the power to get
     // the correct result
-    (val & !mask) + power
+    (val & !mask).checked_add(power)
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    #[test]
+    fn allocate_below_respects_limit() {
+        let mut set = RangeSet::new();
+        set.insert(InclusiveRange { start: 0x100000, end: 0x1FFFFFF });
+
+        // The whole allocation must end at or below the limit
+        let addr = set.allocate_below(0x4000, 0x1000, 0xFFFFFF).unwrap();
+        assert!(addr + 0x3FFF <= 0xFFFFFF);
+        assert!(set.allocate_below(0x1000000, 0x1000, 0xFFFFFF).is_none());
+
+        // An unbounded allocation can use the rest
+        assert!(set.allocate(0x1000000, 0x1000).is_some());
+    }
+
+    #[test]
+    fn allocate_near_end_of_address_space() {
+        let mut set = RangeSet::new();
+        set.insert(InclusiveRange { start: 0xFFFFF001, end: 0xFFFFFFFF });
+
+        // Aligning the start of the range up overflows, so nothing can be allocated
+        assert!(set.allocate(0x10, 0x1000).is_none());
+        assert_eq!(set.allocate(0x10, 1), Some(0xFFFFF001));
+    }
 }
\ No newline at end of file
@@ -4,24 +4,52 @@
 
 use core::marker::PhantomData;
 
-#[derive(Debug)]
-#[repr(u32)]
-pub enum Syscall {
-    Read = 0,
-    Write,
-	Open,
-	Close,
-	Execve,
-	Fork,
-	Exit,
-	WaitPID,
-	Stat,
-	GetCWD,
-	ChangeCWD,
-
-    Count, // This must be kept last
+/// The table of syscalls, which the `Syscall` enum, the kernel's dispatch and the userland stubs
+/// are all generated from, by passing the name of a macro which is invoked with the table. Each
+/// entry is the variant, the name of the handler in the kernel (and of the stub in userland), and
+/// the arguments, which are passed in ebx, ecx, edx, esi, edi and ebp, in that order. Strings and
+/// buffers are passed directly as a pointer and a length, in two arguments.
+#[macro_export]
+macro_rules! syscall_table {
+	($callback:ident) => {
+		$callback! {
+			Read => syscall_read(fd, buf_ptr, buf_len),
+			Write => syscall_write(fd, buf_ptr, buf_len),
+			Open => syscall_open(path_ptr, path_len, flags),
+			Close => syscall_close(fd),
+			Execve => syscall_execve(path_ptr, path_len, argv_ptr, argv_len, envp_ptr, envp_len),
+			Fork => syscall_fork(),
+			Exit => syscall_exit(exit_code),
+			WaitPID => syscall_waitpid(pid, wstatus_ptr, options),
+			Stat => syscall_stat(path_ptr, path_len, stat_ptr),
+			GetCWD => syscall_getcwd(buf_ptr, buf_len),
+			ChangeCWD => syscall_changecwd(path_ptr, path_len),
+			MemInfo => syscall_meminfo(info_ptr),
+			GetRUsage => syscall_getrusage(pid, usage_ptr),
+			Kill => syscall_kill(pid, signal),
+			SigAction => syscall_sigaction(signal, new_action_ptr, old_action_ptr),
+			SigReturn => syscall_sigreturn(),
+			SyscallStats => syscall_syscallstats(stats_ptr, stats_len, reset),
+		}
+	};
 }
 
+/// The maximum number of arguments of a syscall
+pub const MAX_SYSCALL_ARGS: usize = 6;
+
+macro_rules! define_syscall_enum {
+	($($variant:ident => $handler:ident($($arg:ident),*),)*) => {
+		#[derive(Debug)]
+		#[repr(u32)]
+		pub enum Syscall {
+			$($variant,)*
+
+			Count, // This must be kept last
+		}
+	};
+}
+syscall_table!(define_syscall_enum);
+
 #[derive(Debug)]
 #[derive(Clone, Copy)]
 #[repr(u16)]
@@ -35,6 +63,12 @@ pub enum SyscallError {
 	PathIsNotDirectory,
 	BufferTooSmall,
 	InvalidElfFile,
+	InvalidPID,
+	NoSuchProcess,
+	OutOfMemory,
+	InvalidSignal,
+	Interrupted,
+	NotSupported,
 
     UnknownSyscallError, // This must be kept last, because `from_i32` uses it to determine if the
                          // error number is recognized
@@ -68,6 +102,8 @@ impl Syscall {
 	}
 }
 
+/// An array in user memory, used where an array holds arrays (e.g. the arguments of `Execve`),
+/// because a syscall argument can only pass one array as a pointer and a length
 #[repr(C)]
 pub struct SyscallArray<'a, T> {
 	pub ptr: u32,
@@ -147,4 +183,160 @@ impl SyscallDirectoryEntry {
 	pub fn get_name(&self) -> &str {
 		core::str::from_utf8(&self.name[..self.name_length as usize]).unwrap()
 	}
-}
\ No newline at end of file
+}
+/// System-wide memory usage, returned by the `MemInfo` syscall
+#[derive(Default)]
+#[repr(C)]
+pub struct SyscallMemInfo {
+	/// Free physical memory in bytes
+	pub free_memory: u32,
+	/// Bytes of the kernel heap's virtual region which are mapped
+	pub heap_mapped: u32,
+	/// Bytes requested by live kernel heap allocations
+	pub heap_in_use: u32,
+	/// Bytes of kernel heap pages backing live allocations. The difference from `heap_in_use` is
+	/// lost to rounding allocations up to whole pages
+	pub heap_allocated: u32,
+	/// Bytes in the kernel heap free list
+	pub heap_free: u32,
+	/// Number of entries in the kernel heap free list
+	pub heap_free_list_length: u32,
+	/// Size in bytes of the largest entry in the kernel heap free list
+	pub heap_largest_free: u32,
+	/// Size of the swap area in bytes, zero if swapping is disabled
+	pub swap_total: u32,
+	/// Free bytes in the swap area
+	pub swap_free: u32,
+	/// Number of swapped-out pages kept in the compressed store
+	pub compressed_pages: u32,
+	/// Total size in bytes of the compressed pages (pages filled with a single value take none)
+	pub compressed_bytes: u32,
+	/// Bytes of physical memory used by the pool holding the compressed pages
+	pub compressed_pool_bytes: u32,
+	/// Average number of cycles it took to decompress a page
+	pub compressed_load_cycles: u32,
+	/// Number of page frames which identical pages were merged into and are still mapped
+	pub merged_frames: u32,
+	/// Number of page frames merging identical pages currently saves
+	pub merged_saved_pages: u32,
+}
+
+/// The counters of a single syscall, returned by the `SyscallStats` syscall
+#[derive(Clone, Copy, Default)]
+#[repr(C)]
+pub struct SyscallCounters {
+	/// Number of times the syscall was issued
+	pub count: u32,
+	/// Total cycles its handler took, for the calls which returned (e.g. not `Exit`)
+	pub total_cycles: u64,
+}
+
+/// Memory usage of a process, returned by the `GetRUsage` syscall
+#[derive(Default)]
+#[repr(C)]
+pub struct SyscallProcessMemInfo {
+	/// Number of pages in the virtual memory areas of the process
+	pub virtual_pages: u32,
+	/// Number of pages which are mapped to physical memory
+	pub resident_pages: u32,
+	/// Number of resident pages whose page frame is shared with other mappings
+	pub shared_pages: u32,
+	/// Number of resident pages which are private to the process
+	pub private_pages: u32,
+	/// Number of pages which are swapped out
+	pub swapped_pages: u32,
+	/// Number of page tables mapping the user part of the address space, plus the page directory
+	pub page_table_pages: u32,
+	/// Whether the process has exited and is waiting to be reaped
+	pub is_zombie: bool,
+}
+
+/// A key event, as written to the input injection device or read from the input recording device
+#[derive(Clone, Copy, Default, Debug)]
+#[repr(C)]
+pub struct SyscallInputEvent {
+	/// The kernel's key code of the key
+	pub key_code: u8,
+	/// `INPUT_EVENT_*` flags
+	pub flags: u8,
+	/// The ASCII code the key typed when it was recorded, zero if none. Ignored when injecting.
+	pub ascii: u8,
+	pub reserved: u8,
+}
+
+/// The input event is the release of the key (else it is a key press)
+pub const INPUT_EVENT_KEY_UP: u8 = 1 << 0;
+
+/// The path of the device which injects the input events written to it
+pub const INPUT_INJECT_DEVICE_PATH: &str = "/dev/input/inject";
+/// The path of the device which reads the recorded input events, and which starts and stops
+/// recording when `INPUT_RECORD_START` or `INPUT_RECORD_STOP` is written to it
+pub const INPUT_RECORD_DEVICE_PATH: &str = "/dev/input/record";
+/// Discards the recorded input events and starts recording
+pub const INPUT_RECORD_START: u8 = 1;
+/// Stops recording input events
+pub const INPUT_RECORD_STOP: u8 = 0;
+/// The path of the device which reads the name of the active keyboard layout, and which switches
+/// to the layout whose name is written to it
+pub const KEYBOARD_LAYOUT_DEVICE_PATH: &str = "/dev/input/layout";
+
+/// A mouse event, as read from the mouse device. When the reader lags behind, consecutive motion
+/// with the same buttons down is coalesced into one event.
+#[derive(Clone, Copy, Default, Debug)]
+#[repr(C)]
+pub struct SyscallMouseEvent {
+	/// Horizontal motion, positive to the right
+	pub x_delta: i16,
+	/// Vertical motion, positive upwards
+	pub y_delta: i16,
+	/// Scroll wheel motion
+	pub z_delta: i8,
+	/// The `MOUSE_BUTTON_*` buttons which are down
+	pub buttons: u8,
+	pub reserved: u16,
+}
+
+pub const MOUSE_BUTTON_LEFT: u8 = 1 << 0;
+pub const MOUSE_BUTTON_RIGHT: u8 = 1 << 1;
+pub const MOUSE_BUTTON_MIDDLE: u8 = 1 << 2;
+pub const MOUSE_BUTTON_FOURTH: u8 = 1 << 3;
+pub const MOUSE_BUTTON_FIFTH: u8 = 1 << 4;
+
+/// The path of the device which reads mouse events, and which sets the sample rate of the mouse to
+/// a sample rate written to it
+pub const MOUSE_DEVICE_PATH: &str = "/dev/input/mouse";
+/// The sample rates, in samples per second, a PS/2 mouse supports
+pub const MOUSE_SAMPLE_RATES: [u8; 7] = [10, 20, 40, 60, 80, 100, 200];
+
+/// Interrupt from the keyboard (Ctrl+C)
+pub const SIGINT: u32 = 2;
+/// Terminates the process, can't be caught or ignored
+pub const SIGKILL: u32 = 9;
+/// User-defined signal
+pub const SIGUSR1: u32 = 10;
+/// Invalid memory access
+pub const SIGSEGV: u32 = 11;
+/// User-defined signal
+pub const SIGUSR2: u32 = 12;
+/// Termination request
+pub const SIGTERM: u32 = 15;
+/// A child process terminated, ignored by default
+pub const SIGCHLD: u32 = 17;
+/// Signal numbers are below this
+pub const NUM_SIGNALS: u32 = 32;
+
+/// Handler of an action which takes the default action of the signal
+pub const SIG_DFL: u32 = 0;
+/// Handler of an action which ignores the signal
+pub const SIG_IGN: u32 = 1;
+
+/// The action taken when a signal is delivered, set by the `SigAction` syscall
+#[derive(Clone, Copy, Default, Debug)]
+#[repr(C)]
+pub struct SyscallSigAction {
+	/// `SIG_DFL`, `SIG_IGN`, or the address of an `extern "cdecl" fn(signal: u32)`
+	pub handler: u32,
+	/// Where the handler returns to. The restorer must issue the `SigReturn` syscall without
+	/// touching the stack.
+	pub restorer: u32,
+}
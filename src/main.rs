@@ -11,6 +11,24 @@ const RUST_BOOTLOADER_BASE: usize = 0x7e00;
 /// Maximum size the bootloader can be before it will overwrite BIOS data
 const MAX_BOOTLOADER_SIZE: u64 = 0x9fc00 - RUST_BOOTLOADER_BASE as u64;
 
+/// Physical address a Multiboot loader places the Multiboot image at
+const MULTIBOOT_LOAD_ADDR: usize = 0x100000;
+
+/// Signature the kernel looks for at the start of the swap drive
+const SWAP_SIGNATURE: &[u8; 8] = b"EXOSSWAP";
+/// Size of the swap drive image in 4KiB pages (the first page is the swap area header)
+const SWAP_IMAGE_PAGES: u32 = 0x2000;
+
+/// Signature the bootloader looks for at the start of the module table (see `boot_args::ModuleTable`)
+const MODULE_TABLE_SIGNATURE: &[u8; 8] = b"EXOSMODS";
+
+/// Pads `image` with zeros so it ends on a sector boundary
+fn pad_to_sector(image: &mut Vec<u8>) {
+    if image.len() % 512 != 0 {
+        image.resize(image.len() + (512 - (image.len()%512)), 0);
+    }
+}
+
 /// Creates a flattened image of the elf file at `file_path`. On success returns a tuple containing
 /// (entry point vaddr, image base, image bytes)
 fn flatten_elf<P: AsRef<Path>>(file_path: P) -> Option<(usize, usize, Vec<u8>)> {
@@ -176,6 +194,19 @@ fn main() -> Result<(), Box<dyn Error>>{
         return Err("Failed to assemble stage0".into());
     }
 
+    // Assemble the Multiboot image, which starts the same bootloader without going through stage0
+    let multiboot_file = Path::new("build").canonicalize()?.join("explore_os.multiboot");
+    if !Command::new("nasm").current_dir(&bootloader_src_dir.join("stage0")).args(&[
+            "-f", "bin",
+            "-o", multiboot_file.to_str().unwrap(),
+            &format!("-DBOOTLOADER_ENTRY_POINT={}", entry_point),
+            &format!("-DBOOTLOADER_BASE_ADDR={}", RUST_BOOTLOADER_BASE),
+            &format!("-DMULTIBOOT_LOAD_ADDR={}", MULTIBOOT_LOAD_ADDR),
+            "multiboot.asm"
+        ]).status()?.success() {
+        return Err("Failed to assemble the Multiboot image".into());
+    }
+
     // The bootloader must be small enough so that we don't want overwrite BIOS data which starts at
     // address 0x9fc00.
     let final_bootloader_size = bootfile.metadata()?.len();
@@ -185,12 +216,6 @@ fn main() -> Result<(), Box<dyn Error>>{
         return Err("Final bootloader size is too large".into());
     }
 
-    // Build the userland filesystem. Currently the filesystem is included in the kernel elf,
-    // so it has to be built before the kernel
-    if !Command::new("./build_fs.sh").current_dir("userland").status()?.success() {
-        return Err("Failed to build userland filesystem".into());
-    }
-
     // Build the kernel
     let kernel_build_dir = Path::new("build").join("kernel").canonicalize()?;
     if kernel_debug {
@@ -214,18 +239,42 @@ fn main() -> Result<(), Box<dyn Error>>{
     };
     println!("Total kernel size is {:#x}", kernel_elf.metadata()?.len());
 
-    // Build the final os image, the bootloader comes first
-    let mut os_image = std::fs::read(bootfile)?;
-    // If the bootloader doesn't end on a sector boundary, pad it with zeros
-    if os_image.len() % 512 != 0 {
-        os_image.resize(os_image.len() + (512 - (os_image.len()%512)), 0);
+    // Build the userland filesystem. It is a separate module of the os image, so changes in userland
+    // don't cause the kernel to re-compile
+    if !Command::new("./build_fs.sh").current_dir("userland").status()?.success() {
+        return Err("Failed to build userland filesystem".into());
     }
+    let fs_image = std::fs::read(Path::new("userland").join("test_ext2.fs"))?;
+
     // Read the kernel image
     let kernel_image = std::fs::read(kernel_elf)?;
-    // Append the kernel image to the os image
+
+    // The Multiboot image takes the kernel and the filesystem image as modules
+    std::fs::write(Path::new("build").join("kernel.elf"), &kernel_image)?;
+    std::fs::write(Path::new("build").join("fs.img"), &fs_image)?;
+
+    // Build the final os image, the bootloader comes first
+    let mut os_image = std::fs::read(bootfile)?;
+    pad_to_sector(&mut os_image);
+    // The module table follows the bootloader in its own sector, and describes the modules after it
+    os_image.extend(MODULE_TABLE_SIGNATURE);
+    os_image.extend((kernel_image.len() as u32).to_le_bytes());
+    os_image.extend((fs_image.len() as u32).to_le_bytes());
+    pad_to_sector(&mut os_image);
+    // Append the kernel image and then the filesystem image, each starting on a sector boundary
     os_image.extend(kernel_image);
+    pad_to_sector(&mut os_image);
+    os_image.extend(fs_image);
+    pad_to_sector(&mut os_image);
     // Write out the os image
     std::fs::write(Path::new("build").join("explore_os.img"), os_image)?;
+
+    // Build the swap drive image, which is attached as the second drive. The swap area header
+    // holds a signature followed by the number of pages in the swap area
+    let mut swap_image = vec![0u8; SWAP_IMAGE_PAGES as usize * 4096];
+    swap_image[..8].copy_from_slice(SWAP_SIGNATURE);
+    swap_image[8..12].copy_from_slice(&SWAP_IMAGE_PAGES.to_le_bytes());
+    std::fs::write(Path::new("build").join("swap.img"), swap_image)?;
     
     Ok(())
 }
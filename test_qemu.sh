@@ -1,4 +1,4 @@
 #!/bin/sh
 
-qemu-system-i386 -serial stdio -drive format=raw,file=build/explore_os.img -m 1G
-
+qemu-system-i386 -serial stdio -drive format=raw,file=build/explore_os.img,index=0 \
+	-drive format=raw,file=build/swap.img,index=1 -m 1G
@@ -0,0 +1,6 @@
+#!/bin/sh
+
+# Boots through the Multiboot image, skipping the boot sector and the BIOS disk reads. The swap
+# area is attached as a virtio block device.
+qemu-system-i386 -serial stdio -kernel build/explore_os.multiboot \
+	-initrd build/kernel.elf,build/fs.img -drive format=raw,file=build/swap.img,if=virtio -m 1G
@@ -8,6 +8,10 @@ cargo build --release || exit $?
 cp target/i586-unknown-linux-gnu/release/cat fs/bin || exit $?
 cp target/i586-unknown-linux-gnu/release/ls fs/bin || exit $?
 cp target/i586-unknown-linux-gnu/release/shell fs/bin || exit $?
+cp target/i586-unknown-linux-gnu/release/free fs/bin || exit $?
+cp target/i586-unknown-linux-gnu/release/ps fs/bin || exit $?
+cp target/i586-unknown-linux-gnu/release/input fs/bin || exit $?
+cp target/i586-unknown-linux-gnu/release/syscount fs/bin || exit $?
 
 if test ! -f "test_ext2.fs"; then
 	echo "Creating new ext2 filesystem"
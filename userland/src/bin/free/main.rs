@@ -0,0 +1,45 @@
+#![no_std]
+#![no_main]
+#![feature(asm_sym, naked_functions)]
+include!("../../prelude.rs");
+
+use userland::syscalls::{exit, mem_info};
+
+fn main(args: LaunchArgs, _envp: LaunchArgs) {
+	if args.len() != 1 {
+		println!("Usage: free");
+		exit(1);
+	}
+
+	let info = mem_info().expect("free: Failed to get memory info");
+
+	println!("Free physical memory: {} KiB", info.free_memory / 1024);
+	if info.swap_total != 0 {
+		println!("Swap: {} KiB free of {} KiB", info.swap_free / 1024, info.swap_total / 1024);
+	} else {
+		println!("Swap: disabled");
+	}
+	if info.compressed_pages != 0 {
+		// The ratio is of the memory the pages would take uncompressed to the memory they take
+		let ratio_percent = (info.compressed_pages as u64 * 4096 * 100)
+			.checked_div(info.compressed_pool_bytes as u64);
+		println!("Compressed swap: {} pages ({} KiB compressed) in {} KiB of pool",
+			info.compressed_pages, info.compressed_bytes / 1024, info.compressed_pool_bytes / 1024);
+		match ratio_percent {
+			Some(ratio_percent) => println!("  ratio {}.{:02}, {} cycles per decompression",
+				ratio_percent / 100, ratio_percent % 100, info.compressed_load_cycles),
+			None => println!("  all pages are filled with a single value, {} cycles per load",
+				info.compressed_load_cycles),
+		}
+	}
+	if info.merged_frames != 0 {
+		println!("Merged pages: {} frames shared by identical pages, saving {} KiB",
+			info.merged_frames, info.merged_saved_pages * 4);
+	}
+	println!("Kernel heap:");
+	println!("  mapped:        {} KiB", info.heap_mapped / 1024);
+	println!("  in use:        {} bytes in {} KiB of pages", info.heap_in_use,
+		info.heap_allocated / 1024);
+	println!("  free list:     {} KiB in {} entries (largest {} KiB)", info.heap_free / 1024,
+		info.heap_free_list_length, info.heap_largest_free / 1024);
+}
@@ -0,0 +1,147 @@
+#![no_std]
+#![no_main]
+#![feature(asm_sym, naked_functions)]
+include!("../../prelude.rs");
+
+use syscall_interface::{SyscallInputEvent, INPUT_EVENT_KEY_UP, INPUT_INJECT_DEVICE_PATH,
+	INPUT_RECORD_DEVICE_PATH, INPUT_RECORD_START, INPUT_RECORD_STOP, KEYBOARD_LAYOUT_DEVICE_PATH};
+use userland::syscalls::{close, exit, open, read, write};
+use userland::{STDIN_FD, STDOUT_FD};
+
+/// The maximum number of recorded events which are replayed
+const MAX_EVENTS: usize = 4096;
+
+fn main(mut args: LaunchArgs, _envp: LaunchArgs) {
+	match (args.nth(1), args.next(), args.next()) {
+		(Some("record"), None, None) => record(),
+		(Some("replay"), count, None) => {
+			let count = match count.map(|count| count.parse::<u32>()) {
+				None => 1,
+				Some(Ok(count)) => count,
+				Some(Err(_)) => usage(),
+			};
+			replay(count);
+		},
+		(Some("layout"), name, None) => layout(name),
+		_ => usage(),
+	}
+}
+
+/// Returns the value of the time-stamp counter
+fn rdtsc() -> u64 {
+	let low: u32;
+	let high: u32;
+	unsafe {
+		core::arch::asm!("rdtsc", out("eax") low, out("edx") high, options(nomem, nostack));
+	}
+	((high as u64) << 32) | (low as u64)
+}
+
+fn usage() -> ! {
+	println!("Usage: input record | input replay [count] | input layout [name]");
+	println!("  record: records the lines typed until an empty line");
+	println!("  replay: injects the recorded keys `count` times");
+	println!("  layout: shows the keyboard layout, or switches to the layout `name`");
+	exit(1);
+}
+
+/// Records the key events of the lines typed until an empty line
+fn record() {
+	let record_fd = open(INPUT_RECORD_DEVICE_PATH, 0).expect("input: Failed to open the recorder");
+	write(record_fd, &[INPUT_RECORD_START]).expect("input: Failed to start recording");
+	println!("Recording, finish with an empty line");
+
+	let mut line_length = 0;
+	let mut ch = [0u8];
+	loop {
+		assert!(read(STDIN_FD, &mut ch).unwrap() == 1);
+		let _ = write(STDOUT_FD, &ch);
+		if ch[0] == b'\n' {
+			if line_length == 0 {
+				break;
+			}
+			line_length = 0;
+		} else {
+			line_length += 1;
+		}
+	}
+
+	write(record_fd, &[INPUT_RECORD_STOP]).expect("input: Failed to stop recording");
+	let _ = close(record_fd);
+}
+
+/// Switches the keyboard layout to `name`, or shows the active layout if there is no name
+fn layout(name: Option<&str>) {
+	let layout_fd = open(KEYBOARD_LAYOUT_DEVICE_PATH, 0)
+		.expect("input: Failed to open the layout device");
+	match name {
+		Some(name) => {
+			if !matches!(write(layout_fd, name.as_bytes()), Ok(num_bytes) if num_bytes > 0) {
+				println!("input: No keyboard layout called `{}`", name);
+				exit(1);
+			}
+		},
+		None => {
+			let mut name = [0u8; 32];
+			let num_bytes = read(layout_fd, &mut name).expect("input: Failed to read the layout");
+			let _ = write(STDOUT_FD, &name[..num_bytes as usize]);
+		},
+	}
+	let _ = close(layout_fd);
+}
+
+/// Injects the recorded key events `count` times
+fn replay(count: u32) {
+	let mut events = [SyscallInputEvent::default(); MAX_EVENTS];
+	let events_bytes = unsafe {
+		core::slice::from_raw_parts_mut(events.as_mut_ptr() as *mut u8,
+			core::mem::size_of_val(&events))
+	};
+
+	let record_fd = open(INPUT_RECORD_DEVICE_PATH, 0).expect("input: Failed to open the recorder");
+	let mut bytes_read = 0;
+	loop {
+		let num_bytes = read(record_fd, &mut events_bytes[bytes_read..])
+			.expect("input: Failed to read the recording") as usize;
+		if num_bytes == 0 {
+			break;
+		}
+		bytes_read += num_bytes;
+	}
+	let _ = close(record_fd);
+
+	// The recording ends with the key press of the empty line which finished it
+	let mut events = &events[..bytes_read / core::mem::size_of::<SyscallInputEvent>()];
+	let last_newline = events.iter().rposition(|event| {
+		event.ascii == b'\n' && (event.flags & INPUT_EVENT_KEY_UP) == 0
+	});
+	if let Some(last_newline) = last_newline {
+		events = &events[..last_newline];
+	}
+	if events.is_empty() {
+		println!("input: Nothing to replay, use `input record` first");
+		exit(1);
+	}
+
+	let events_bytes = unsafe {
+		core::slice::from_raw_parts(events.as_ptr() as *const u8, core::mem::size_of_val(events))
+	};
+
+	let inject_fd = open(INPUT_INJECT_DEVICE_PATH, 0).expect("input: Failed to open the injector");
+	let start_cycles = rdtsc();
+	let mut injected_bytes = 0;
+	for _ in 0..count {
+		let num_bytes = write(inject_fd, events_bytes).expect("input: Failed to inject") as usize;
+		injected_bytes += num_bytes;
+		if num_bytes < events_bytes.len() {
+			println!("input: The input queue is full");
+			break;
+		}
+	}
+	let cycles = rdtsc() - start_cycles;
+	let _ = close(inject_fd);
+
+	let injected = injected_bytes / core::mem::size_of::<SyscallInputEvent>();
+	println!("Injected {} events in {} cycles ({} cycles per event)", injected, cycles,
+		cycles.checked_div(injected as u64).unwrap_or(0));
+}
@@ -0,0 +1,28 @@
+#![no_std]
+#![no_main]
+#![feature(asm_sym, naked_functions)]
+include!("../../prelude.rs");
+
+use syscall_interface::SyscallError;
+use userland::syscalls::{exit, get_rusage};
+
+fn main(args: LaunchArgs, _envp: LaunchArgs) {
+	if args.len() != 1 {
+		println!("Usage: ps");
+		exit(1);
+	}
+
+	println!("PID STATE  VIRT(KiB) RSS(KiB) SHARED PRIVATE SWAP PT");
+	for pid in 0.. {
+		let usage = match get_rusage(pid) {
+			Ok(usage) => usage,
+			Err(SyscallError::NoSuchProcess) => continue,
+			Err(_) => break, // We went past the last process
+		};
+
+		println!("{:<3} {:<6} {:<9} {:<8} {:<6} {:<7} {:<4} {}", pid,
+			if usage.is_zombie { "zombie" } else { "alive" }, usage.virtual_pages * 4,
+			usage.resident_pages * 4, usage.shared_pages, usage.private_pages,
+			usage.swapped_pages, usage.page_table_pages);
+	}
+}
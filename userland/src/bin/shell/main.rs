@@ -4,6 +4,7 @@
 extern crate userland; // Required for panic handler
 
 pub use userland::{print, println};
+use syscall_interface::SIGINT;
 
 // TODO: Allocate a buffer when we have allocations
 pub fn get_line(buffer: &mut [u8]) -> usize {
@@ -76,7 +77,10 @@ pub extern fn entry() -> ! {
 					Ok(()) => unreachable!(),
 				};
 			} else {
-				userland::syscalls::wait_pid(child_pid, 0).unwrap();
+				let result = userland::syscalls::wait_pid(child_pid, 0).unwrap();
+				if result.wstatus == 128 + SIGINT {
+					println!("^C");
+				}
 			}
 		}
 	}
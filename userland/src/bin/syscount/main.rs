@@ -0,0 +1,62 @@
+#![no_std]
+#![no_main]
+#![feature(asm_sym, naked_functions)]
+include!("../../prelude.rs");
+
+use syscall_interface::{Syscall, SyscallCounters, SyscallError};
+use userland::syscalls::{exit, syscall_stats};
+
+const NUM_SYSCALLS: usize = Syscall::Count as usize;
+
+fn main(args: LaunchArgs, _envp: LaunchArgs) {
+	let mut args = args.skip(1);
+	let reset = match (args.next(), args.next()) {
+		(None, _) => false,
+		(Some("-r"), None) => true,
+		_ => {
+			println!("Usage: syscount [-r]");
+			println!("Shows the syscalls issued since boot, or since the counters were reset by -r");
+			exit(1);
+		},
+	};
+
+	let mut stats = [SyscallCounters::default(); NUM_SYSCALLS];
+	let num_stats = match syscall_stats(&mut stats, reset) {
+		Ok(num_stats) => num_stats,
+		Err(SyscallError::NotSupported) => {
+			println!("syscount: The kernel doesn't record syscall counters (RECORD_SYSCALL_STATS)");
+			exit(1);
+		},
+		Err(err) => {
+			println!("syscount: Failed to get the counters: {:?}", err);
+			exit(1);
+		},
+	};
+	let stats = &stats[..num_stats];
+
+	// The syscalls which took the most cycles come first
+	let mut order = [0usize; NUM_SYSCALLS];
+	for (idx, entry) in order.iter_mut().enumerate() {
+		*entry = idx;
+	}
+	let order = &mut order[..num_stats];
+	order.sort_unstable_by(|&a, &b| stats[b].total_cycles.cmp(&stats[a].total_cycles));
+
+	let all_cycles: u64 = stats.iter().map(|counters| counters.total_cycles).sum();
+
+	println!("     calls    avg cycles  %cycles  syscall");
+	for &idx in order.iter() {
+		let counters = &stats[idx];
+		if counters.count == 0 {
+			continue;
+		}
+
+		print!("{:>10} {:>13} {:>7}%  ", counters.count,
+			counters.total_cycles / counters.count as u64,
+			(counters.total_cycles * 100).checked_div(all_cycles).unwrap_or(0));
+		match Syscall::from_u32(idx as u32) {
+			Some(syscall) => println!("{:?}", syscall),
+			None => println!("#{}", idx),
+		}
+	}
+}
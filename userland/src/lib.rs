@@ -1,5 +1,5 @@
 #![no_std]
-#![feature(maybe_uninit_uninit_array, maybe_uninit_slice, panic_info_message)]
+#![feature(maybe_uninit_uninit_array, maybe_uninit_slice, panic_info_message, naked_functions, asm_const)]
 
 extern crate compiler_reqs;
 
@@ -1,5 +1,6 @@
 use core::{arch::asm, mem::MaybeUninit};
-use syscall_interface::{Syscall, SyscallError, SyscallString, SyscallFileStat, SyscallArray};
+use syscall_interface::{Syscall, SyscallError, SyscallString, SyscallCounters, SyscallFileStat,
+	SyscallMemInfo, SyscallProcessMemInfo, SyscallSigAction, MAX_SYSCALL_ARGS};
 
 type SyscallResult<T> = Result<T, SyscallError>;
 
@@ -51,24 +52,72 @@ fn syscall3(syscall: Syscall, arg1: u32, arg2: u32, arg3: u32) -> SyscallResult<
 	SyscallError::from_i32(return_value)
 }
 
+/// Rust can't pass operands in esi or ebp on x86, so the last three arguments are loaded from
+/// memory around the interrupt
+fn syscall6(syscall: Syscall, args: [u32; MAX_SYSCALL_ARGS]) -> SyscallResult<u32> {
+	let return_value: i32;
+	unsafe {
+		asm!("
+			push esi
+			push ebp
+			mov esi, [edi]
+			mov ebp, [edi + 8]
+			mov edi, [edi + 4]
+			int 0x67
+			pop ebp
+			pop esi
+		",
+			in("eax") syscall as u32, in("ebx") args[0], in("ecx") args[1], in("edx") args[2],
+			inout("edi") args[3..].as_ptr() => _,
+			lateout("eax") return_value, options(preserves_flags)
+		);
+	}
+
+	SyscallError::from_i32(return_value)
+}
+
+/// Issues `syscall` with the register arguments `args`, through the stub of the same arity
+macro_rules! syscall {
+	($syscall:expr) => { syscall0($syscall) };
+	($syscall:expr, $a:expr) => { syscall1($syscall, $a) };
+	($syscall:expr, $a:expr, $b:expr) => { syscall2($syscall, $a, $b) };
+	($syscall:expr, $a:expr, $b:expr, $c:expr) => { syscall3($syscall, $a, $b, $c) };
+	($syscall:expr, $($arg:expr),+) => {{
+		let args = [$($arg),+];
+		let mut regs = [0u32; MAX_SYSCALL_ARGS];
+		regs[..args.len()].copy_from_slice(&args);
+		syscall6($syscall, regs)
+	}};
+}
+
+macro_rules! define_stubs {
+	($($variant:ident => $name:ident($($arg:ident),*),)*) => {
+		$(
+			#[allow(dead_code)]
+			fn $name($($arg: u32),*) -> SyscallResult<u32> {
+				syscall!(Syscall::$variant $(, $arg)*)
+			}
+		)*
+	};
+}
+syscall_interface::syscall_table!(define_stubs);
+
 pub fn read(fd: u32, buf: &mut [u8]) -> SyscallResult<u32> {
-	syscall3(Syscall::Read, fd, buf.as_mut_ptr() as u32, buf.len() as u32)
+	syscall_read(fd, buf.as_mut_ptr() as u32, buf.len() as u32)
 }
 
 pub fn write(fd: u32, buf: &[u8]) -> SyscallResult<u32> {
-	syscall3(Syscall::Write, fd, buf.as_ptr() as u32, buf.len() as u32)
+	syscall_write(fd, buf.as_ptr() as u32, buf.len() as u32)
 }
 
 // FIXME: Flags type safety
 pub fn open(path: &str, flags: u32) -> SyscallResult<u32> {
 	assert!(path.is_ascii());
-	let path_arg = SyscallString::new(path.as_bytes());
-
-	syscall2(Syscall::Open, &path_arg as *const SyscallString as u32, flags)
+	syscall_open(path.as_ptr() as u32, path.len() as u32, flags)
 }
 
 pub fn close(fd: u32) -> SyscallResult<()> {
-	syscall1(Syscall::Close, fd)?;
+	syscall_close(fd)?;
 	Ok(())
 }
 
@@ -78,7 +127,6 @@ where
 	V: IntoIterator::<Item = &'b str>,
 {
 	assert!(path.is_ascii());
-	let path_arg = SyscallString::new(path.as_bytes());
 
 	// FIXME: HACK because we don't have alloc yet
 	let mut argv_arg: [MaybeUninit<SyscallString>; 10] = MaybeUninit::uninit_array();
@@ -96,25 +144,21 @@ where
 		envp_len += 1;
 	}
 
-	let argv_arg = SyscallArray::new(unsafe {
-		MaybeUninit::slice_assume_init_ref(&argv_arg[..argv_len])
-	});
-	let envp_arg = SyscallArray::new(unsafe {
-		MaybeUninit::slice_assume_init_ref(&envp_arg[..envp_len])
-	});
+	let argv_arg = unsafe { MaybeUninit::slice_assume_init_ref(&argv_arg[..argv_len]) };
+	let envp_arg = unsafe { MaybeUninit::slice_assume_init_ref(&envp_arg[..envp_len]) };
 
-	syscall3(Syscall::Execve, &path_arg as *const SyscallString as u32,
-		&argv_arg as *const SyscallArray<_> as u32, &envp_arg as *const SyscallArray<_> as u32)?;
+	syscall_execve(path.as_ptr() as u32, path.len() as u32, argv_arg.as_ptr() as u32,
+		argv_arg.len() as u32, envp_arg.as_ptr() as u32, envp_arg.len() as u32)?;
 
 	Ok(())
 }
 
 pub fn fork() -> SyscallResult<u32> {
-	syscall0(Syscall::Fork)
+	syscall_fork()
 }
 
 pub fn exit(exit_code: u32) -> ! {
-	panic!("Exit syscall returned with {:?}", syscall1(Syscall::Exit, exit_code));
+	panic!("Exit syscall returned with {:?}", syscall_exit(exit_code));
 }
 
 pub struct WaitPIDResult {
@@ -123,29 +167,73 @@ pub struct WaitPIDResult {
 }
 pub fn wait_pid(pid: u32, options: u32) -> SyscallResult<WaitPIDResult> {
 	let mut wstatus = 0u32;
-	syscall3(Syscall::WaitPID, pid, &mut wstatus as *mut u32 as u32, options)
+	syscall_waitpid(pid, &mut wstatus as *mut u32 as u32, options)
 		.map(|child_pid| WaitPIDResult {child_pid, wstatus})
 }
 
 pub fn stat(path: &str) -> SyscallResult<SyscallFileStat> {
 	assert!(path.is_ascii());
-	let path_arg = SyscallString::new(path.as_bytes());
 
 	let mut file_stat = SyscallFileStat::default();
-	syscall2(Syscall::Stat, &path_arg as *const SyscallString as u32,
+	syscall_stat(path.as_ptr() as u32, path.len() as u32,
 		&mut file_stat as *const SyscallFileStat as u32)?;
 
 	Ok(file_stat)
 }
 
 pub fn get_cwd(buffer: &mut [u8]) -> SyscallResult<usize> {
-	syscall2(Syscall::GetCWD, buffer.as_mut_ptr() as u32, buffer.len() as u32).map(|x| x as usize)
+	syscall_getcwd(buffer.as_mut_ptr() as u32, buffer.len() as u32).map(|x| x as usize)
 }
 
 pub fn change_cwd(path: &str) -> SyscallResult<()> {
 	assert!(path.is_ascii());
-	let path_arg = SyscallString::new(path.as_bytes());
+	syscall_changecwd(path.as_ptr() as u32, path.len() as u32)?;
+	Ok(())
+}
 
-	syscall1(Syscall::ChangeCWD, &path_arg as *const SyscallString as u32)?;
+pub fn mem_info() -> SyscallResult<SyscallMemInfo> {
+	let mut info = SyscallMemInfo::default();
+	syscall_meminfo(&mut info as *mut SyscallMemInfo as u32)?;
+
+	Ok(info)
+}
+
+pub fn get_rusage(pid: u32) -> SyscallResult<SyscallProcessMemInfo> {
+	let mut usage = SyscallProcessMemInfo::default();
+	syscall_getrusage(pid, &mut usage as *mut SyscallProcessMemInfo as u32)?;
+
+	Ok(usage)
+}
+
+pub fn kill(pid: u32, signal: u32) -> SyscallResult<()> {
+	syscall_kill(pid, signal)?;
 	Ok(())
-}
\ No newline at end of file
+}
+
+/// Sets the handler of `signal` to `handler`, which is `SIG_DFL`, `SIG_IGN` or the address of an
+/// `extern "cdecl" fn(signal: u32)`. Returns the previous handler.
+pub fn sig_action(signal: u32, handler: u32) -> SyscallResult<u32> {
+	let new_action = SyscallSigAction { handler, restorer: signal_restorer as u32 };
+	let mut old_action = SyscallSigAction::default();
+	syscall_sigaction(signal, &new_action as *const SyscallSigAction as u32,
+		&mut old_action as *mut SyscallSigAction as u32)?;
+
+	Ok(old_action.handler)
+}
+
+/// Fills `stats` with the counters of the syscalls, indexed by syscall number, and zeroes them if
+/// `reset` is set. Returns the number of syscalls whose counters were written, or `NotSupported` if
+/// the kernel doesn't record the counters.
+pub fn syscall_stats(stats: &mut [SyscallCounters], reset: bool) -> SyscallResult<usize> {
+	syscall_syscallstats(stats.as_mut_ptr() as u32, stats.len() as u32, reset as u32)
+		.map(|x| x as usize)
+}
+
+/// The handlers return here, with the stack pointer at the signal frame the kernel pushed
+#[naked]
+unsafe extern "C" fn signal_restorer() -> ! {
+	asm!("
+		mov eax, {}
+		int 0x67
+	", const Syscall::SigReturn as u32, options(noreturn))
+}